@@ -13,6 +13,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include <libfive/tree/archive.hpp>
 #include <libfive/render/discrete/heightmap.hpp>
 
+#include "allocator.hpp"
 #include "context.hpp"
 #include "tape.hpp"
 
@@ -24,7 +25,8 @@ int main(int, char**)
     auto t = sqrt((X + 1)*(X + 1) + (Y + 1)*(Y + 1)) - 1.8;
 
     const auto size = 128;
-    auto ctx = mpr::Context(128);
+    // Use managed memory, so that we can read tiles back on the host
+    auto ctx = mpr::Context(128, std::make_shared<mpr::ManagedAllocator>());
     auto tape = mpr::Tape(t);
     ctx.render2D(tape, Eigen::Matrix3f::Identity());
 
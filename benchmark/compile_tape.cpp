@@ -0,0 +1,46 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+
+// Builds a tape from a .frep file and saves it with Tape::save, so that
+// render processes can start with Tape::load instead of rebuilding it
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s input.frep output.tape\n", argv[0]);
+        exit(1);
+    }
+
+    std::ifstream ifs;
+    ifs.open(argv[1]);
+    if (!ifs.is_open()) {
+        fprintf(stderr, "Could not open file %s\n", argv[1]);
+        exit(1);
+    }
+    auto a = libfive::Archive::deserialize(ifs);
+    const auto tape = mpr::Tape(a.shapes.front().tree);
+
+    // The source filename is kept as metadata
+    if (!tape.save(argv[2], argv[1])) {
+        exit(1);
+    }
+    printf("Saved %d clauses (%d slots) to %s\n",
+           tape.length, tape.num_slots, argv[2]);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "context.hpp"
+#include "jit.hpp"
+#include "tape.hpp"
+
+static double time_renders(mpr::Context& ctx, const mpr::Tape& tape,
+                           const Eigen::Matrix4f& mat, int32_t count)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i=0; i < count; ++i) {
+        ctx.render3D(tape, mat);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() /
+           count;
+}
+
+// Compares 3D renders with the tape interpreter against renders which use
+// a JitTape for tiles on the root tape, and checks that they agree.
+int main(int argc, char **argv)
+{
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+
+    const int32_t size = 1024;
+    const int32_t count = 20;
+    auto ctx = mpr::Context(size);
+    const Eigen::Matrix4f mat = Eigen::Matrix4f::Identity();
+
+    auto start_build = std::chrono::steady_clock::now();
+    auto jit = mpr::JitTape::build(tape);
+    auto end_build = std::chrono::steady_clock::now();
+    if (!jit) {
+        return 1;
+    }
+    std::cout << "Building the JitTape took " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_build - start_build).count() <<
+        " ms (including the disk cache)\n";
+
+    // Warm-up, which also allocates all of the buffers
+    ctx.render3D(tape, mat);
+    const double interpreted = time_renders(ctx, tape, mat, count);
+    std::vector<int32_t> depth(size * size);
+    std::vector<uint32_t> normals(size * size);
+    CUDA_CHECK(cudaMemcpy(depth.data(), ctx.stages[3].filled.get(),
+                          sizeof(int32_t) * depth.size(),
+                          cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaMemcpy(normals.data(), ctx.normals.get(),
+                          sizeof(uint32_t) * normals.size(),
+                          cudaMemcpyDeviceToHost));
+
+    ctx.jit = jit;
+    ctx.render3D(tape, mat);
+    const double compiled = time_renders(ctx, tape, mat, count);
+    std::cout << "render3D took " << interpreted << " ms interpreted, " <<
+        compiled << " ms with the JitTape\n";
+
+    size_t depth_mismatched = 0;
+    size_t normal_mismatched = 0;
+    for (size_t i=0; i < depth.size(); ++i) {
+        depth_mismatched += ctx.stages[3].filled[i] != depth[i];
+        normal_mismatched += ctx.normals[i] != normals[i];
+    }
+    std::cout << depth_mismatched << " depth pixels and " <<
+        normal_mismatched << " normals differ\n";
+
+    return depth_mismatched != 0;
+}
@@ -0,0 +1,94 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+
+#include "context.hpp"
+#include "tape.hpp"
+
+// Times Context::query on random points, with and without gradients,
+// against the same query with a single tile (i.e. on the root tape), and
+// checks that they agree.
+int main(int argc, char **argv)
+{
+    const int32_t count = (argc == 2) ? atoi(argv[1]) : (1 << 22);
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [point count]\n", argv[0]);
+        exit(1);
+    }
+
+    // A union of 8^3 spheres, so that pruning has plenty to remove
+    auto X = libfive::Tree::X();
+    auto Y = libfive::Tree::Y();
+    auto Z = libfive::Tree::Z();
+    const int32_t n = 8;
+    libfive::Tree shape = X;
+    for (int32_t i=0; i < n * n * n; ++i) {
+        const float x = ((i % n) + 0.5f) / n * 2.0f - 1.0f;
+        const float y = ((i / n) % n + 0.5f) / n * 2.0f - 1.0f;
+        const float z = ((i / n) / n + 0.5f) / n * 2.0f - 1.0f;
+        auto s = sqrt(square(X - x) + square(Y - y) + square(Z - z)) -
+                 0.5f / n;
+        shape = i ? min(shape, s) : s;
+    }
+    auto tape = mpr::Tape(shape);
+    std::cout << "Tape has " << tape.length << " clauses\n";
+
+    mpr::Ptr<float3[]> points(CUDA_MALLOC(float3, count));
+    mpr::Ptr<float[]> values(CUDA_MALLOC(float, count));
+    mpr::Ptr<float[]> expected(CUDA_MALLOC(float, count));
+    mpr::Ptr<float3[]> grads(CUDA_MALLOC(float3, count));
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (int32_t i=0; i < count; ++i) {
+        points[i] = make_float3(dist(rng), dist(rng), dist(rng));
+    }
+
+    auto ctx = mpr::Context(256);
+    const int32_t reps = 10;
+    auto run = [&](int32_t tiles, float3* g) {
+        ctx.query_tiles_per_side = tiles;
+        ctx.query(tape, points.get(), count, values.get(), g);
+        auto start = std::chrono::steady_clock::now();
+        for (int32_t i=0; i < reps; ++i) {
+            ctx.query(tape, points.get(), count, values.get(), g);
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count()
+               / reps;
+    };
+
+    const double root_ms = run(1, nullptr);
+    std::copy(values.get(), values.get() + count, expected.get());
+    const double root_grad_ms = run(1, grads.get());
+    const double tiled_ms = run(QUERY_TILES_PER_SIDE, nullptr);
+
+    float max_err = 0.0f;
+    for (int32_t i=0; i < count; ++i) {
+        max_err = std::max(max_err, std::abs(values[i] - expected[i]));
+    }
+    const double tiled_grad_ms = run(QUERY_TILES_PER_SIDE, grads.get());
+
+    std::cout << "Querying " << count << " points took " <<
+        root_ms << " ms on the root tape, " << tiled_ms << " ms with " <<
+        QUERY_TILES_PER_SIDE << "^3 tiles\n";
+    std::cout << "With gradients, they took " << root_grad_ms << " ms and " <<
+        tiled_grad_ms << " ms\n";
+    std::cout << "Largest difference in values: " << max_err << "\n";
+    return max_err > 1e-5f;
+}
@@ -56,15 +56,20 @@ int main(int argc, char **argv)
         std::cout << size << " ";
         auto mean = get_stats([&](){ c.render3D(tape, T); });
 
+        // Convert (and if needed, transpose) the images on the GPU, so that
+        // they can be copied straight into the heightmap
         libfive::Heightmap out(size, size);
-        uint32_t i = 0;
-        for (int x=0; x < size; ++x) {
-            for (int y=0; y < size; ++y) {
-                out.depth(x, y) = c.stages[3].filled[i];
-                out.norm(x, y) = c.normals[i];
-                ++i;
-            }
-        }
+        mpr::ReadbackFormat format;
+        format.depth = mpr::ReadbackFormat::FLOAT;
+        format.transpose = !decltype(out.depth)::IsRowMajor;
+
+        const size_t pixels = size * size;
+        mpr::HostPtr<float[]> depth(CUDA_MALLOC_HOST(float, pixels));
+        mpr::HostPtr<uint32_t[]> norm(CUDA_MALLOC_HOST(uint32_t, pixels));
+        CUDA_CHECK(cudaEventSynchronize(c.readback(
+                depth.get(), norm.get(), c.stream.get(), format)));
+        std::copy(depth.get(), depth.get() + pixels, out.depth.data());
+        std::copy(norm.get(), norm.get() + pixels, out.norm.data());
         out.savePNG("out_gpu_depth_ctx_" + std::to_string(size) + ".png");
         out.saveNormalPNG("out_gpu_norm_ctx_" + std::to_string(size) + ".png");
 
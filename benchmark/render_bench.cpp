@@ -0,0 +1,316 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+#include "stats.hpp"
+
+/*  Benchmark driver, which times every render with CUDA events (around the
+ *  whole frame, plus Context::stage_timing for the per-stage breakdown) and
+ *  reports percentiles rather than a mean.
+ *
+ *  Usage: render_bench [options] model.frep [model.frep ...]
+ *      --2d, --3d          Render mode (default is 3D)
+ *      --sizes A,B,...     Image sizes (default is 256,512,1024)
+ *      --warmup N          Untimed renders before each measurement (20)
+ *      --count N           Timed renders per measurement (100)
+ *      --json FILE         Writes results as JSON
+ *      --compare FILE      Compares against a baseline written by --json,
+ *                          exiting with status 1 if any frame's p50 time
+ *                          regressed by more than the threshold
+ *      --threshold F       Allowed regression, as a fraction (0.1)
+ *      --persist-tape      Sets Context::persist_tape
+ *      --early-exit        Sets Context::early_exit
+ */
+
+struct Result {
+    std::string model;
+    int size;
+    Percentiles total;
+    std::vector<std::pair<std::string, Percentiles>> stages;
+};
+
+static int parse_int(const char* s) {
+    errno = 0;
+    char* end;
+    const long i = strtol(s, &end, 10);
+    if (errno || end == s || i <= 0) {
+        fprintf(stderr, "Could not parse '%s'\n", s);
+        exit(1);
+    }
+    return i;
+}
+
+static std::string model_name(const std::string& path) {
+    const auto slash = path.find_last_of('/');
+    std::string out = (slash == std::string::npos) ? path
+                                                   : path.substr(slash + 1);
+    const auto dot = out.find_last_of('.');
+    return (dot == std::string::npos) ? out : out.substr(0, dot);
+}
+
+static Result run(const std::string& model, const mpr::Tape& tape,
+                  int size, bool is_2d, bool persist_tape, bool early_exit,
+                  int warmup, int count)
+{
+    auto ctx = mpr::Context(size);
+    ctx.stage_timing = true;
+    ctx.persist_tape = persist_tape;
+    ctx.early_exit = early_exit;
+
+    cudaStream_t stream;
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+    cudaEvent_t start, end;
+    CUDA_CHECK(cudaEventCreate(&start));
+    CUDA_CHECK(cudaEventCreate(&end));
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+
+    std::vector<double> total;
+    std::vector<double> stages[5];
+    for (int i=0; i < warmup + count; ++i) {
+        CUDA_CHECK(cudaEventRecord(start, stream));
+        if (is_2d) {
+            ctx.render2D(tape, Eigen::Matrix3f::Identity(), 0.0f, stream);
+        } else {
+            ctx.render3D(tape, T, stream);
+        }
+        CUDA_CHECK(cudaEventRecord(end, stream));
+        CUDA_CHECK(cudaEventSynchronize(end));
+        const auto stats = ctx.readStats();
+        if (i < warmup) {
+            continue;
+        }
+
+        float ms;
+        CUDA_CHECK(cudaEventElapsedTime(&ms, start, end));
+        total.push_back(ms);
+        for (unsigned j=0; j < 4; ++j) {
+            stages[j].push_back(stats.stages[j].time_ms);
+        }
+        stages[4].push_back(stats.normals_ms);
+    }
+    CUDA_CHECK(cudaEventDestroy(start));
+    CUDA_CHECK(cudaEventDestroy(end));
+    CUDA_CHECK(cudaStreamDestroy(stream));
+
+    Result out;
+    out.model = model;
+    out.size = size;
+    out.total = get_percentiles(total);
+    if (is_2d) {
+        out.stages.push_back({"tiles_64", get_percentiles(stages[0])});
+        out.stages.push_back({"tiles_8", get_percentiles(stages[2])});
+        out.stages.push_back({"pixels", get_percentiles(stages[3])});
+    } else {
+        out.stages.push_back({"tiles_64", get_percentiles(stages[0])});
+        out.stages.push_back({"subtiles", get_percentiles(stages[1])});
+        out.stages.push_back({"tiles_4", get_percentiles(stages[2])});
+        out.stages.push_back({"voxels", get_percentiles(stages[3])});
+        out.stages.push_back({"normals", get_percentiles(stages[4])});
+    }
+    return out;
+}
+
+static void write_percentiles(FILE* f, const Percentiles& p) {
+    fprintf(f, "{\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f}",
+            p.mean, p.p50, p.p95, p.p99);
+}
+
+/*  Writes one result per line, which keeps the files diffable and lets
+ *  read_baseline get away with a line-by-line scan. */
+static void write_json(const char* filename, bool is_2d, int warmup,
+                       int count, const std::vector<Result>& results)
+{
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Could not open %s for writing\n", filename);
+        exit(1);
+    }
+    fprintf(f, "{\n  \"mode\": \"%s\",\n  \"warmup\": %i,\n  \"count\": %i,\n"
+               "  \"results\": [\n", is_2d ? "2d" : "3d", warmup, count);
+    for (unsigned i=0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        fprintf(f, "    {\"model\": \"%s\", \"size\": %i, \"total\": ",
+                r.model.c_str(), r.size);
+        write_percentiles(f, r.total);
+        fprintf(f, ", \"stages\": {");
+        for (unsigned j=0; j < r.stages.size(); ++j) {
+            fprintf(f, "%s\"%s\": ", j ? ", " : "",
+                    r.stages[j].first.c_str());
+            write_percentiles(f, r.stages[j].second);
+        }
+        fprintf(f, "}}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+/*  Reads the p50 frame times from a file written by write_json, keyed by
+ *  model name and image size. */
+static std::map<std::pair<std::string, int>, double> read_baseline(
+        const char* filename)
+{
+    std::ifstream ifs(filename);
+    if (!ifs.is_open()) {
+        fprintf(stderr, "Could not open baseline %s\n", filename);
+        exit(1);
+    }
+    std::map<std::pair<std::string, int>, double> out;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        const auto m = line.find("\"model\": \"");
+        const auto s = line.find("\"size\": ");
+        const auto t = line.find("\"total\": ");
+        if (m == std::string::npos || s == std::string::npos ||
+            t == std::string::npos)
+        {
+            continue;
+        }
+        const auto m_start = m + strlen("\"model\": \"");
+        const auto model = line.substr(m_start, line.find('"', m_start)
+                                                - m_start);
+        const int size = atoi(line.c_str() + s + strlen("\"size\": "));
+        const auto p = line.find("\"p50\": ", t);
+        if (p == std::string::npos) {
+            continue;
+        }
+        out[{model, size}] = atof(line.c_str() + p + strlen("\"p50\": "));
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    bool is_2d = false;
+    bool persist_tape = false;
+    bool early_exit = false;
+    std::vector<int> sizes = {256, 512, 1024};
+    int warmup = 20;
+    int count = 100;
+    const char* json = nullptr;
+    const char* compare = nullptr;
+    double threshold = 0.1;
+    std::vector<std::string> files;
+
+    for (int i=1; i < argc; ++i) {
+        const bool has_arg = i + 1 < argc;
+        if (!strcmp(argv[i], "--2d")) {
+            is_2d = true;
+        } else if (!strcmp(argv[i], "--3d")) {
+            is_2d = false;
+        } else if (!strcmp(argv[i], "--persist-tape")) {
+            persist_tape = true;
+        } else if (!strcmp(argv[i], "--early-exit")) {
+            early_exit = true;
+        } else if (!strcmp(argv[i], "--sizes") && has_arg) {
+            sizes.clear();
+            std::string s = argv[++i];
+            size_t pos = 0;
+            while (pos != std::string::npos) {
+                const auto next = s.find(',', pos);
+                sizes.push_back(parse_int(s.substr(pos, next - pos).c_str()));
+                pos = (next == std::string::npos) ? next : next + 1;
+            }
+        } else if (!strcmp(argv[i], "--warmup") && has_arg) {
+            warmup = parse_int(argv[++i]);
+        } else if (!strcmp(argv[i], "--count") && has_arg) {
+            count = parse_int(argv[++i]);
+        } else if (!strcmp(argv[i], "--json") && has_arg) {
+            json = argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && has_arg) {
+            compare = argv[++i];
+        } else if (!strcmp(argv[i], "--threshold") && has_arg) {
+            threshold = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            exit(1);
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        fprintf(stderr, "Usage: %s [options] model.frep [model.frep ...]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    std::vector<Result> results;
+    for (auto& filename : files) {
+        std::ifstream ifs;
+        ifs.open(filename);
+        if (!ifs.is_open()) {
+            fprintf(stderr, "Could not open file %s\n", filename.c_str());
+            exit(1);
+        }
+        const auto a = libfive::Archive::deserialize(ifs);
+        const auto tape = mpr::Tape(a.shapes.front().tree);
+        const auto model = model_name(filename);
+
+        for (auto size : sizes) {
+            const auto r = run(model, tape, size, is_2d, persist_tape,
+                               early_exit, warmup, count);
+            printf("%s %i: p50 %.3f  p95 %.3f  p99 %.3f ms  (",
+                   model.c_str(), size, r.total.p50, r.total.p95,
+                   r.total.p99);
+            for (unsigned j=0; j < r.stages.size(); ++j) {
+                printf("%s%s %.3f", j ? ", " : "", r.stages[j].first.c_str(),
+                       r.stages[j].second.p50);
+            }
+            printf(")\n");
+            results.push_back(r);
+        }
+    }
+
+    if (json) {
+        write_json(json, is_2d, warmup, count, results);
+    }
+
+    if (compare) {
+        const auto baseline = read_baseline(compare);
+        int regressions = 0;
+        for (auto& r : results) {
+            const auto itr = baseline.find({r.model, r.size});
+            if (itr == baseline.end()) {
+                printf("%s %i: no baseline\n", r.model.c_str(), r.size);
+                continue;
+            }
+            const double ratio = r.total.p50 / itr->second;
+            const bool failed = ratio > 1.0 + threshold;
+            printf("%s %i: %.3f ms vs %.3f ms baseline (%+.1f%%)%s\n",
+                   r.model.c_str(), r.size, r.total.p50, itr->second,
+                   (ratio - 1.0) * 100.0, failed ? "  REGRESSION" : "");
+            regressions += failed;
+        }
+        if (regressions) {
+            fprintf(stderr, "%i benchmark(s) regressed by more than %.1f%%\n",
+                    regressions, threshold * 100.0);
+            return 1;
+        }
+    }
+    return 0;
+}
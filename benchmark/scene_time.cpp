@@ -0,0 +1,107 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+
+#include "context.hpp"
+#include "scene.hpp"
+#include "tape.hpp"
+
+// Compares rendering a grid of small parts as one union tape against
+// rendering them as an instanced Scene, and checks that they agree.
+int main(int argc, char **argv)
+{
+    const int32_t n = (argc == 2) ? atoi(argv[1]) : 8;
+    if (n <= 0) {
+        fprintf(stderr, "Usage: %s [parts per side]\n", argv[0]);
+        exit(1);
+    }
+
+    // The part is a sphere with a hole through it, of radius 1
+    auto X = libfive::Tree::X();
+    auto Y = libfive::Tree::Y();
+    auto Z = libfive::Tree::Z();
+    const libfive::Tree part = max(sqrt(X*X + Y*Y + Z*Z) - 1.0f,
+                                   0.4f - sqrt(X*X + Y*Y));
+    const Eigen::Vector3f lower = Eigen::Vector3f::Constant(-1.0f);
+    const Eigen::Vector3f upper = Eigen::Vector3f::Constant(1.0f);
+
+    // Place n^3 copies in the [-1, 1] volume, then build the same scene as
+    // one big union
+    mpr::Scene scene;
+    const float scale = 0.8f / n;
+    std::vector<int32_t> all;
+    for (int32_t i=0; i < n * n * n; ++i) {
+        Eigen::Matrix4f m = Eigen::Matrix4f::Identity();
+        m.topLeftCorner<3, 3>() *= scale;
+        m(0, 3) = ((i % n) + 0.5f) / n * 2.0f - 1.0f;
+        m(1, 3) = ((i / n) % n + 0.5f) / n * 2.0f - 1.0f;
+        m(2, 3) = ((i / n) / n + 0.5f) / n * 2.0f - 1.0f;
+        all.push_back(scene.addInstance(part, m, lower, upper));
+    }
+    auto start_build = std::chrono::steady_clock::now();
+    auto tape = mpr::Tape(scene.tree(all));
+    auto end_build = std::chrono::steady_clock::now();
+    std::cout << "Building the union tape (" << tape.length <<
+        " clauses) took " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_build - start_build).count() <<
+        " ms\n";
+
+    const int32_t size = 1024;
+    const int32_t count = 20;
+    auto ctx = mpr::Context(size);
+    Eigen::Matrix4f mat = Eigen::Matrix4f::Identity();
+
+    ctx.render3D(tape, mat);
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i=0; i < count; ++i) {
+        ctx.render3D(tape, mat);
+    }
+    auto end = std::chrono::steady_clock::now();
+    const double union_ms =
+        std::chrono::duration<double, std::milli>(end - start).count() / count;
+    std::vector<int32_t> depth(size * size);
+    CUDA_CHECK(cudaMemcpy(depth.data(), ctx.stages[3].filled.get(),
+                          sizeof(int32_t) * depth.size(),
+                          cudaMemcpyDeviceToHost));
+
+    // The first scene render builds every tape, so it's timed on its own
+    start = std::chrono::steady_clock::now();
+    ctx.renderScene3D(scene, mat);
+    end = std::chrono::steady_clock::now();
+    std::cout << "First scene render (building " << scene.misses <<
+        " tapes) took " <<
+        std::chrono::duration<double, std::milli>(end - start).count() <<
+        " ms\n";
+
+    start = std::chrono::steady_clock::now();
+    for (int32_t i=0; i < count; ++i) {
+        ctx.renderScene3D(scene, mat);
+    }
+    end = std::chrono::steady_clock::now();
+    const double scene_ms =
+        std::chrono::duration<double, std::milli>(end - start).count() / count;
+    std::cout << "Rendering " << n * n * n << " parts took " << union_ms <<
+        " ms as a union, " << scene_ms << " ms as a scene\n";
+
+    size_t mismatched = 0;
+    for (size_t i=0; i < depth.size(); ++i) {
+        mismatched += ctx.stages[3].filled[i] != depth[i];
+    }
+    std::cout << mismatched << " depth pixels differ\n";
+    return mismatched != 0;
+}
@@ -0,0 +1,86 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "context.hpp"
+#include "tape.hpp"
+
+// Compares slicing a model with one render2D call per slice against a
+// single call to renderSlices, and checks that they agree.
+int main(int argc, char **argv)
+{
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+
+    const int32_t size = 1024;
+    const int32_t count = 256;
+    const size_t words = size * size / 64;
+    auto ctx = mpr::Context(size);
+    ctx.packed_2d = true;
+    const Eigen::Matrix3f mat = Eigen::Matrix3f::Identity();
+
+    // Warm-up, which also allocates all of the buffers
+    auto stack = ctx.renderSlices(tape, mat, -1.0f, 1.0f, count);
+
+    std::vector<uint64_t> single(words * count);
+    auto start_single = std::chrono::steady_clock::now();
+    for (int32_t i=0; i < count; ++i) {
+        ctx.render2D(tape, mat, stack.z[i]);
+        CUDA_CHECK(cudaMemcpy(&single[i * words], ctx.filled_2d.get(),
+                              sizeof(uint64_t) * words,
+                              cudaMemcpyDeviceToHost));
+    }
+    auto end_single = std::chrono::steady_clock::now();
+    std::cout << "Rendering " << count << " slices with render2D took " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_single - start_single).count() <<
+        " ms\n";
+
+    auto start_stack = std::chrono::steady_clock::now();
+    stack = ctx.renderSlices(tape, mat, -1.0f, 1.0f, count);
+    auto end_stack = std::chrono::steady_clock::now();
+    std::cout << "Rendering " << count << " slices with renderSlices took " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_stack - start_stack).count() <<
+        " ms\n";
+
+    size_t mismatched = 0;
+    for (size_t i=0; i < single.size(); ++i) {
+        mismatched += __builtin_popcountll(single[i] ^ stack.bits[i]);
+    }
+    std::cout << mismatched << " pixels differ\n";
+
+    return mismatched != 0;
+}
@@ -9,6 +9,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
 #include <chrono>
 #include <vector>
 #include <cmath>
@@ -45,3 +46,24 @@ double get_stats(std::function<void()> f, int warmup, int count) {
     std::cout << mean << " " << stdev << "\n";
     return mean;
 }
+
+Percentiles get_percentiles(std::vector<double> times_ms) {
+    Percentiles out = {0, 0, 0, 0};
+    if (times_ms.empty()) {
+        return out;
+    }
+    std::sort(times_ms.begin(), times_ms.end());
+    for (auto& b : times_ms) {
+        out.mean += b;
+    }
+    out.mean /= times_ms.size();
+
+    const auto rank = [&](double p) {
+        const size_t i = std::ceil(p * times_ms.size());
+        return times_ms[std::min(std::max(i, (size_t)1), times_ms.size()) - 1];
+    };
+    out.p50 = rank(0.50);
+    out.p95 = rank(0.95);
+    out.p99 = rank(0.99);
+    return out;
+}
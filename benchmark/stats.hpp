@@ -10,5 +10,15 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 Copyright (C) 2019-2020  Matt Keeter
 */
 #include <functional>
+#include <vector>
 
 double get_stats(std::function<void()> f, int warmup=20, int count=100);
+
+/*  Summary of a set of timings, with percentiles by nearest rank */
+struct Percentiles {
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+};
+Percentiles get_percentiles(std::vector<double> times_ms);
@@ -13,6 +13,8 @@ Copyright (C) 2019-2020  Matt Keeter
 #include <chrono>
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <vector>
 
 // libfive
 #include <libfive/tree/tree.hpp>
@@ -21,6 +23,36 @@ Copyright (C) 2019-2020  Matt Keeter
 
 #include "tape.hpp"
 
+// Builds a balanced min-tree of n randomly placed spheres, which gives
+// large tapes without needing a model file.
+libfive::Tree spheres(unsigned n) {
+    auto X = libfive::Tree::X();
+    auto Y = libfive::Tree::Y();
+    auto Z = libfive::Tree::Z();
+
+    std::mt19937 rng(n);
+    std::uniform_real_distribution<float> pos(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> radius(0.01f, 0.1f);
+
+    std::vector<libfive::Tree> shapes;
+    for (unsigned i=0; i < n; ++i) {
+        const float x = pos(rng), y = pos(rng), z = pos(rng);
+        shapes.push_back(sqrt((X - x)*(X - x) + (Y - y)*(Y - y) +
+                              (Z - z)*(Z - z)) - radius(rng));
+    }
+    while (shapes.size() > 1) {
+        std::vector<libfive::Tree> next;
+        for (unsigned i=0; i + 1 < shapes.size(); i += 2) {
+            next.push_back(min(shapes[i], shapes[i + 1]));
+        }
+        if (shapes.size() & 1) {
+            next.push_back(shapes.back());
+        }
+        shapes.swap(next);
+    }
+    return shapes.front();
+}
+
 int main(int argc, char **argv)
 {
     libfive::Tree t = libfive::Tree::X();
@@ -54,5 +86,38 @@ int main(int argc, char **argv)
         std::chrono::duration_cast<std::chrono::milliseconds>(end_gpu - start_gpu).count() / 100 <<
         " ms\n";
 
+    // Compare against loading a saved copy of the same tape
+    const std::string path = "tape_building_time.tape";
+    if (!mpr::Tape(t).save(path)) {
+        exit(1);
+    }
+    auto start_load = std::chrono::steady_clock::now();
+    for (unsigned i=0; i < 100; ++i) {
+        auto r = mpr::Tape::load(path);
+    }
+    auto end_load = std::chrono::steady_clock::now();
+    std::cout << "Loading saved tape took " <<
+        std::chrono::duration_cast<std::chrono::microseconds>(end_load - start_load).count() / 100 <<
+        " us\n";
+    remove(path.c_str());
+
+    // Large synthetic trees, which exercise the parallel parts of tape
+    // construction (these are slow enough that a few runs are plenty)
+    for (unsigned n : {1000, 10000, 100000}) {
+        auto s = spheres(n);
+        const unsigned iterations = 5;
+        unsigned clauses = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i=0; i < iterations; ++i) {
+            auto r = mpr::Tape(s);
+            clauses = r.length;
+        }
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "Building tape for " << n << " spheres (" << clauses <<
+            " clauses) took " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / iterations <<
+            " ms\n";
+    }
+
     return 0;
 }
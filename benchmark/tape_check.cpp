@@ -0,0 +1,130 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+
+#include "context.hpp"
+#include "tape.hpp"
+#include "tape_cache.hpp"
+
+// Regression checks for tape building and caching, which evaluate tapes with
+// Context::query and compare against the same expressions on the CPU.
+// Exits with status 1 if any check fails.
+
+static const int32_t COUNT = 4096;
+
+// Evaluates the tape at random points, returning the number of points
+// which disagree with `expected`
+static int check(mpr::Context& ctx, const char* name, const mpr::Tape& tape,
+                 std::function<float(float, float, float)> expected)
+{
+    mpr::Ptr<float3[]> points(CUDA_MALLOC(float3, COUNT));
+    mpr::Ptr<float[]> values(CUDA_MALLOC(float, COUNT));
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(0.5f, 2.0f);
+    for (int32_t i=0; i < COUNT; ++i) {
+        points[i] = make_float3(dist(rng), dist(rng), dist(rng));
+    }
+    ctx.query(tape, points.get(), COUNT, values.get());
+
+    int failed = 0;
+    for (int32_t i=0; i < COUNT; ++i) {
+        const float3 p = points[i];
+        const float e = expected(p.x, p.y, p.z);
+        if (std::abs(values[i] - e) > 1e-4f * std::max(1.0f, std::abs(e))) {
+            if (!failed) {
+                fprintf(stderr, "%s: got %f at (%f %f %f), expected %f\n",
+                        name, values[i], p.x, p.y, p.z, e);
+            }
+            failed++;
+        }
+    }
+    printf("%s: %s\n", name, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(int, char**)
+{
+    auto X = libfive::Tree::X();
+    auto Y = libfive::Tree::Y();
+    auto Z = libfive::Tree::Z();
+    auto ctx = mpr::Context(256);
+    int failed = 0;
+
+    // Clauses which use the same argument twice, at that argument's last
+    // use, while other values are still live
+    failed += check(ctx, "(x+x)*y", mpr::Tape((X + X) * Y),
+        [](float x, float y, float) { return (x + x) * y; });
+    failed += check(ctx, "(x+x)*y + (y*z)*(y-z)",
+        mpr::Tape((X + X) * Y + (Y * Z) * (Y - Z)),
+        [](float x, float y, float z) {
+            return (x + x) * y + (y * z) * (y - z); });
+    failed += check(ctx, "(x-x) + (y*z)*(z+y)",
+        mpr::Tape((X - X) + (Y * Z) * (Z + Y)),
+        [](float, float y, float z) { return (y * z) * (z + y); });
+    failed += check(ctx, "(x/x)*y + (z*y)*z",
+        mpr::Tape((X / X) * Y + (Z * Y) * Z),
+        [](float, float y, float z) { return y + (z * y) * z; });
+    failed += check(ctx, "(x*x+x)*y + y*z",
+        mpr::Tape((X * X + X) * Y + Y * Z),
+        [](float x, float y, float z) { return (x * x + x) * y + y * z; });
+
+    // Fractional exponents, inside min / max so that a bad interval result
+    // prunes the wrong branch (points are in [0.5, 2], where pow is real)
+    failed += check(ctx, "min(pow(x, 0.5), y)",
+        mpr::Tape(min(pow(X, 0.5f), Y)),
+        [](float x, float y, float) { return fminf(powf(x, 0.5f), y); });
+    failed += check(ctx, "max(pow(x, -1.5), y)",
+        mpr::Tape(max(pow(X, -1.5f), Y)),
+        [](float x, float y, float) { return fmaxf(powf(x, -1.5f), y); });
+
+    // Trees which only differ in their free variables must get their own
+    // tapes from a TapeCache, with their own variable indices
+    {
+        mpr::TapeCache cache;
+        auto a = libfive::Tree::var();
+        auto b = libfive::Tree::var();
+        const auto ab = cache.get(a - b);
+        const auto ba = cache.get(b - a);
+        const auto aa = cache.get(a - a);
+        if (ab == ba || ab == aa || ba == aa) {
+            fprintf(stderr, "TapeCache returned a shared tape\n");
+            failed++;
+        }
+        auto with_vars = [&](const mpr::Tape& t, float va, float vb) {
+            ctx.vars.assign(t.num_vars, 0.0f);
+            if (t.varIndex(a) >= 0) {
+                ctx.vars[t.varIndex(a)] = va;
+            }
+            if (t.varIndex(b) >= 0) {
+                ctx.vars[t.varIndex(b)] = vb;
+            }
+        };
+        with_vars(*ab, 1.0f, 3.0f);
+        failed += check(ctx, "cached a-b", *ab,
+            [](float, float, float) { return -2.0f; });
+        with_vars(*ba, 1.0f, 3.0f);
+        failed += check(ctx, "cached b-a", *ba,
+            [](float, float, float) { return 2.0f; });
+        with_vars(*aa, 1.0f, 3.0f);
+        failed += check(ctx, "cached a-a", *aa,
+            [](float, float, float) { return 0.0f; });
+        ctx.vars.clear();
+    }
+
+    return failed != 0;
+}
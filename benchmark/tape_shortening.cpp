@@ -17,6 +17,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include <libfive/tree/archive.hpp>
 #include <libfive/render/discrete/heightmap.hpp>
 
+#include "allocator.hpp"
 #include "context.hpp"
 #include "tape.hpp"
 #include "gpu_opcode.hpp"
@@ -38,7 +39,8 @@ int main(int, char**)
     }
 
     const auto size = 1024;
-    auto ctx = mpr::Context(size);
+    // Use managed memory, so that we can read tiles back on the host
+    auto ctx = mpr::Context(size, std::make_shared<mpr::ManagedAllocator>());
     auto tape = mpr::Tape(t);
     ctx.render2D(tape, Eigen::Matrix3f::Identity());
 
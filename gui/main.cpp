@@ -24,6 +24,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include "context.hpp"
 #include "effects.hpp"
 #include "tape.hpp"
+#include "tape_cache.hpp"
 
 #include "interpreter.hpp"
 #include "tex.hpp"
@@ -36,7 +37,7 @@ static void glfw_error_callback(int error, const char* description)
 }
 
 struct Shape {
-    mpr::Tape tape;
+    std::shared_ptr<const mpr::Tape> tape;
     libfive::Tree tree;
 };
 
@@ -138,6 +139,10 @@ int main(int argc, char** argv)
 
     std::map<libfive::Tree::Id, Shape> shapes;
 
+    // Tapes are cached by tree structure, so re-evaluating the script only
+    // rebuilds the shapes that changed
+    mpr::TapeCache tape_cache;
+
     // Generate a texture which we'll draw into
     GLuint gl_tex;
     glGenTextures(1, &gl_tex);
@@ -159,6 +164,25 @@ int main(int argc, char** argv)
     int render_size = 256;
     int render_dimension = 3;
     int render_mode = RENDER_MODE_NORMALS;
+    bool direct_output = true;
+
+    // Progressive rendering spreads each 3D frame over several loop
+    // iterations, which keep running (without waiting for events) until
+    // the image is complete.  It's only used with a single shape, since
+    // every shape shares one Context.
+    bool progressive = false;
+    float progressive_budget_ms = 12.0f;
+    bool refining = false;
+
+    // Temporal reuse is also limited to a single shape, since each shape
+    // would replace the Context's saved keyframe
+    bool temporal_reuse = false;
+    bool half_precision = false;
+    bool affine_tiles = false;
+    bool packed_2d = false;
+    int antialias = 1;
+    bool sphere_trace = false;
+    int z_slabs = 1;
 
     mpr::Context ctx(render_size);
     mpr::Effects effects;
@@ -170,7 +194,11 @@ int main(int argc, char** argv)
         // - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application.
         // - When io.WantCaptureKeyboard is true, do not dispatch keyboard input data to your main application.
         // Generally you may always pass all inputs to dear imgui, and hide them from your application based on those two flags.
-        glfwWaitEventsTimeout(0.1f);
+        if (refining) {
+            glfwPollEvents();
+        } else {
+            glfwWaitEventsTimeout(0.1f);
+        }
 
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -276,7 +304,7 @@ int main(int argc, char** argv)
                 // Create new shapes from the script
                 for (auto& t : interpreter.shapes) {
                     if (shapes.find(t.first) == shapes.end()) {
-                        Shape s = { mpr::Tape(t.second), t.second };
+                        Shape s = { tape_cache.get(t.second), t.second };
                         shapes.emplace(t.first, std::move(s));
                     }
                 }
@@ -320,6 +348,8 @@ int main(int argc, char** argv)
             ImGui::RadioButton("2D", &render_dimension, 2);
             ImGui::SameLine();
             ImGui::RadioButton("3D", &render_dimension, 3);
+            ImGui::Checkbox("Half-precision voxels", &half_precision);
+            ImGui::Checkbox("Affine tile pruning", &affine_tiles);
 
             if (render_dimension == 3) {
                 ImGui::Text("Render mode:");
@@ -330,8 +360,29 @@ int main(int argc, char** argv)
                 ImGui::RadioButton("SSAO", &render_mode, RENDER_MODE_SSAO);
                 ImGui::SameLine();
                 ImGui::RadioButton("Shaded", &render_mode, RENDER_MODE_SHADED);
+                if (render_mode == RENDER_MODE_SSAO ||
+                    render_mode == RENDER_MODE_SHADED)
+                {
+                    ImGui::Checkbox("Half-resolution SSAO",
+                                    &effects.half_res_ssao);
+                }
+                if (render_size == TEXTURE_SIZE && !progressive) {
+                    ImGui::Checkbox("Render directly to texture",
+                                    &direct_output);
+                }
+                ImGui::Checkbox("Reuse tiles between frames", &temporal_reuse);
+                ImGui::Checkbox("Sphere trace (distance fields only)",
+                                &sphere_trace);
+                ImGui::SliderInt("Z slabs", &z_slabs, 1, 16);
+                ImGui::Checkbox("Progressive", &progressive);
+                if (progressive) {
+                    ImGui::SliderFloat("Budget (ms)", &progressive_budget_ms,
+                                       1.0f, 100.0f);
+                }
             } else {
                 render_mode = RENDER_MODE_2D;
+                ImGui::Checkbox("1-bit output", &packed_2d);
+                ImGui::SliderInt("Antialiasing", &antialias, 1, 4);
             }
         ImGui::End();
 
@@ -340,6 +391,16 @@ int main(int argc, char** argv)
 
         ImGui::Begin("Shapes");
             bool append = false;
+            refining = false;
+            ctx.temporal_reuse = temporal_reuse && shapes.size() == 1;
+            ctx.half_precision = half_precision;
+            ctx.affine_tiles = affine_tiles;
+            ctx.packed_2d = packed_2d;
+            ctx.antialias = antialias;
+            ctx.sphere_trace = sphere_trace;
+            ctx.z_slabs = z_slabs;
+            ImGui::Text("Tape cache: %zu hits, %zu misses",
+                        tape_cache.hits, tape_cache.misses);
 
             for (auto& s : shapes) {
                 ImGui::Text("Shape at %p", (void*)s.first);
@@ -353,6 +414,15 @@ int main(int argc, char** argv)
 
                 {   // Timed rendering pass
                     using namespace std::chrono;
+
+                    // When the render matches the texture, the final pass
+                    // writes straight into it (skipping copy_to_texture)
+                    const bool use_progressive = progressive &&
+                        render_dimension == 3 && shapes.size() == 1;
+                    const bool direct = direct_output && !use_progressive &&
+                        render_dimension == 3 &&
+                        ctx.image_size_px == TEXTURE_SIZE;
+                    cudaSurfaceObject_t surf = 0;
                     auto start = high_resolution_clock::now();
                     if (render_dimension == 2) {
                         Eigen::Matrix4f mat = model.matrix();
@@ -361,9 +431,25 @@ int main(int argc, char** argv)
                         mat2d.block<2, 1>(0, 2) = mat.block<2, 1>(0, 3);
                         mat2d.block<1, 2>(2, 0) = mat.block<1, 2>(3, 0);
                         mat2d.block<1, 1>(2, 2) = mat.block<1, 1>(3, 3);
-                        ctx.render2D(s.second.tape, mat2d);
+                        ctx.render2D(*s.second.tape, mat2d);
+                    } else if (use_progressive) {
+                        refining = !ctx.renderProgressive(
+                                *s.second.tape, model.matrix(),
+                                progressive_budget_ms);
+                    } else if (direct) {
+                        surf = map_surface(cuda_tex);
+                        mpr::SurfaceOutput::Mode m = mpr::SurfaceOutput::NONE;
+                        if (render_mode == RENDER_MODE_DEPTH) {
+                            m = mpr::SurfaceOutput::DEPTH;
+                        } else if (render_mode == RENDER_MODE_NORMALS) {
+                            m = mpr::SurfaceOutput::NORMALS;
+                        }
+                        ctx.surface_output = {surf, m, append};
+                        ctx.render3D(*s.second.tape, model.matrix());
+                        ctx.surface_output = {0, mpr::SurfaceOutput::NONE,
+                                              false};
                     } else {
-                        ctx.render3D(s.second.tape, model.matrix());
+                        ctx.render3D(*s.second.tape, model.matrix());
                     }
                     auto end = high_resolution_clock::now();
                     auto dt = duration_cast<microseconds>(end - start);
@@ -371,24 +457,29 @@ int main(int argc, char** argv)
 
                     if (render_mode == RENDER_MODE_SSAO) {
                         start = high_resolution_clock::now();
-                        effects.drawSSAO(ctx);
+                        effects.drawSSAO(ctx, surf, append);
                         end = high_resolution_clock::now();
                         auto dt = duration_cast<microseconds>(end - start);
                         ImGui::Text("SSAO time: %f s", dt.count() / 1e6);
                     } else if (render_mode == RENDER_MODE_SHADED) {
                         start = high_resolution_clock::now();
-                        effects.drawShaded(ctx);
+                        effects.drawShaded(ctx, surf, append);
                         end = high_resolution_clock::now();
                         auto dt = duration_cast<microseconds>(end - start);
                         ImGui::Text("SSAO + shading time: %f s", dt.count() / 1e6);
                     }
 
-                    start = high_resolution_clock::now();
-                    copy_to_texture(ctx, effects, cuda_tex, TEXTURE_SIZE,
-                                    append, (Mode)render_mode);
-                    end = high_resolution_clock::now();
-                    dt = duration_cast<microseconds>(end - start);
-                    ImGui::Text("Texture load time: %f s", dt.count() / 1e6);
+                    if (direct) {
+                        unmap_surface(cuda_tex, surf);
+                    } else {
+                        start = high_resolution_clock::now();
+                        copy_to_texture(ctx, effects, cuda_tex, TEXTURE_SIZE,
+                                        append, (Mode)render_mode);
+                        end = high_resolution_clock::now();
+                        dt = duration_cast<microseconds>(end - start);
+                        ImGui::Text("Texture load time: %f s",
+                                    dt.count() / 1e6);
+                    }
                 }
 
                 if (ImGui::Button("Save shape.frep")) {
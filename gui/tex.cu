@@ -30,10 +30,37 @@ cudaGraphicsResource* register_texture(GLuint t)
     return gl_tex;
 }
 
+cudaSurfaceObject_t map_surface(cudaGraphicsResource* gl_tex)
+{
+    cudaArray* array;
+    CUDA_CHECK(cudaGraphicsMapResources(1, &gl_tex));
+    CUDA_CHECK(cudaGraphicsSubResourceGetMappedArray(&array, gl_tex, 0, 0));
+
+    // Specify texture
+    struct cudaResourceDesc res_desc;
+    memset(&res_desc, 0, sizeof(res_desc));
+    res_desc.resType = cudaResourceTypeArray;
+    res_desc.res.array.array = array;
+
+    cudaSurfaceObject_t surf = 0;
+    CUDA_CHECK(cudaCreateSurfaceObject(&surf, &res_desc));
+    CUDA_CHECK(cudaDeviceSynchronize());
+    return surf;
+}
+
+void unmap_surface(cudaGraphicsResource* gl_tex, cudaSurfaceObject_t surf)
+{
+    CUDA_CHECK(cudaDeviceSynchronize());
+    CUDA_CHECK(cudaDestroySurfaceObject(surf));
+    CUDA_CHECK(cudaGraphicsUnmapResources(1, &gl_tex));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 __global__
 void copy_2d_to_surface(int32_t* const __restrict__ image,
+                        const uint64_t* const __restrict__ bits,
+                        const float* const __restrict__ coverage,
                         int image_size_px,
                         cudaSurfaceObject_t surf,
                         int texture_size_px, bool append)
@@ -44,8 +71,15 @@ void copy_2d_to_surface(int32_t* const __restrict__ image,
     if (x < texture_size_px && y < texture_size_px) {
         const uint32_t px = x * image_size_px / texture_size_px;
         const uint32_t py = y * image_size_px / texture_size_px;
-        const auto h = image[px + py * image_size_px];
-        if (h) {
+        const uint32_t i = px + py * image_size_px;
+        const bool h = bits ? ((bits[i / 64] >> (i % 64)) & 1) : image[i];
+        if (coverage) {
+            // Antialiased edges are drawn as partially transparent white
+            const uint32_t a = coverage[i] * 255.0f;
+            if (a || !append) {
+                surf2Dwrite(0x00FFFFFF | (a << 24), surf, x*4, y);
+            }
+        } else if (h) {
             surf2Dwrite(0xFFFFFFFF, surf, x*4, y);
         } else if (!append) {
             surf2Dwrite(0, surf, x*4, y);
@@ -155,26 +189,15 @@ void copy_to_texture(const mpr::Context& ctx,
                      bool append,
                      Mode mode)
 {
-    cudaArray* array;
-    CUDA_CHECK(cudaGraphicsMapResources(1, &gl_tex));
-    CUDA_CHECK(cudaGraphicsSubResourceGetMappedArray(&array, gl_tex, 0, 0));
-
-    // Specify texture
-    struct cudaResourceDesc res_desc;
-    memset(&res_desc, 0, sizeof(res_desc));
-    res_desc.resType = cudaResourceTypeArray;
-    res_desc.res.array.array = array;
-
-    // Surface object??!
-    cudaSurfaceObject_t surf = 0;
-    CUDA_CHECK(cudaCreateSurfaceObject(&surf, &res_desc));
-    CUDA_CHECK(cudaDeviceSynchronize());
+    cudaSurfaceObject_t surf = map_surface(gl_tex);
 
     const unsigned u = (texture_size_px + 15) / 16;
     switch (mode) {
         case RENDER_MODE_2D:
             copy_2d_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
                     ctx.stages[3].filled.get(),
+                    ctx.packed_2d ? ctx.filled_2d.get() : nullptr,
+                    (ctx.antialias > 1) ? ctx.coverage.get() : nullptr,
                     ctx.image_size_px,
                     surf, texture_size_px, append);
             break;
@@ -209,7 +232,5 @@ void copy_to_texture(const mpr::Context& ctx,
     }
     CUDA_CHECK(cudaGetLastError());
 
-    CUDA_CHECK(cudaDeviceSynchronize());
-    CUDA_CHECK(cudaDestroySurfaceObject(surf));
-    CUDA_CHECK(cudaGraphicsUnmapResources(1, &gl_tex));
+    unmap_surface(gl_tex, surf);
 }
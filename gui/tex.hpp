@@ -36,6 +36,11 @@ enum Mode {
     RENDER_MODE_SHADED,
 };
 
+// Maps the texture and wraps it in a surface object, so that kernels can
+// write to it directly; it must be released with unmap_surface
+cudaSurfaceObject_t map_surface(cudaGraphicsResource* gl_tex);
+void unmap_surface(cudaGraphicsResource* gl_tex, cudaSurfaceObject_t surf);
+
 void copy_to_texture(const mpr::Context& ctx,
                      const mpr::Effects& effects,
                      cudaGraphicsResource* gl_tex,
@@ -0,0 +1,46 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include "util.hpp"
+
+namespace mpr {
+
+/*  Allocates managed memory, which can be read by the host.  cudaFree
+ *  synchronizes the device, so this allocator doesn't need fences. */
+struct ManagedAllocator : public Allocator {
+    void* allocate(size_t bytes, cudaStream_t stream) override;
+    void deallocate(void* ptr) override;
+};
+
+/*  Allocates device-only memory from a stream-ordered pool (cudaMallocAsync).
+ *  Freed memory stays in the pool rather than going back to the driver, so
+ *  growing a buffer mid-frame doesn't synchronize the device. */
+struct PoolAllocator : public Allocator {
+    PoolAllocator();
+    ~PoolAllocator() override;
+
+    void* allocate(size_t bytes, cudaStream_t stream) override;
+    void deallocate(void* ptr) override;
+    void fence(cudaStream_t stream) override;
+
+    /*  Checks whether the current device supports memory pools */
+    static bool supported();
+
+protected:
+    cudaMemPool_t pool;
+
+    // Deallocations are queued on this stream, which waits on fences
+    Stream stream;
+    Event event;
+};
+
+}   // namespace mpr
@@ -21,3 +21,8 @@ Copyright (C) 2019-2020  Matt Keeter
 #define I_RHS(d) (((uint8_t*)(d))[3])
 #define IMM(d) (((float*)(d))[1])
 #define JUMP_TARGET(d) (((int32_t*)(d))[1])
+
+// The first clause of a tape is a header, with the X, Y, Z slots in the
+// I_OUT, I_LHS, and I_RHS bytes, followed by the number of free variables
+// (see Tape::num_vars)
+#define TAPE_VARS(d) (((int32_t*)(d))[1])
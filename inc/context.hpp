@@ -11,19 +11,25 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
 #include <cstdint>
+#include <memory>
+#include <vector>
 #include <Eigen/Eigen>
 
+#include "parameters.hpp"
 #include "util.hpp"
 
 namespace mpr {
 
-// Forward declaration
+// Forward declarations
 struct Tape;
+struct JitTape;
+struct Scene;
 
 struct TileNode {
     int32_t position;
     int32_t tape;
     int32_t next;
+    int32_t batch;  // Index into a batch render's layers (0 otherwise)
 };
 
 struct Tiles {
@@ -35,11 +41,423 @@ struct Tiles {
     size_t tile_array_size=0;
 };
 
+/*  Destination for writing colors straight from the final pass of a 3D
+ *  render into a caller's surface (e.g. a mapped OpenGL texture), rather
+ *  than copying them out of the depth and normal images afterwards.  The
+ *  surface holds 32-bit RGBA pixels and must be image_size_px on each side.
+ *  DEPTH writes white with the height in the alpha channel, and NORMALS
+ *  writes packed normals.  Unless `append` is set, empty pixels are cleared
+ *  to zero (so that several shapes can be drawn into one surface). */
+struct SurfaceOutput {
+    enum Mode { NONE, DEPTH, NORMALS };
+    cudaSurfaceObject_t surface;
+    Mode mode;
+    bool append;
+};
+
+/*  Layout of the host images written by Context::readback.  Depth is
+ *  written as INT32 (as in stages[3].filled), UINT16 (clamped, which is
+ *  exact for images up to 65535 pixels on a side), or FLOAT (as in
+ *  libfive::Heightmap).  When `transpose` is set, pixel (x, y) is written
+ *  to index y + x * image_size_px rather than x + y * image_size_px, so
+ *  that images can be copied straight into a column-major array. */
+struct ReadbackFormat {
+    enum Depth { INT32, UINT16, FLOAT };
+    Depth depth=INT32;
+    bool transpose=false;
+};
+
+/*  Sparse occupancy of a 3D volume, as found by the tile hierarchy.  Each
+ *  list stores tile positions, packed as x + y * n + z * n * n (where n is
+ *  the number of tiles per side at that level). */
+struct SparseVolume {
+    int32_t image_size_px=0;
+
+    /*  Tiles which are entirely inside the shape, at each of the first three
+     *  levels of the hierarchy, whose sizes (in voxels) are in tile_sizes */
+    int32_t tile_sizes[3];
+    std::vector<int32_t> filled[3];
+
+    /*  4^3 bricks which contain the surface, along with a bitmask of their
+     *  filled voxels (with voxel (x, y, z) at bit x + y * 4 + z * 16) */
+    std::vector<int32_t> bricks;
+    std::vector<uint64_t> occupancy;
+};
+
+/*  Statistics from the most recent render.  Tape pool usage is always
+ *  available, and stage times are filled in if Context::stage_timing is set;
+ *  everything else is only recorded if the library is built with
+ *  MPR_RENDER_STATS defined (the RENDER_STATS CMake option), and is zero
+ *  otherwise.  Recording happens in the production kernels, so it measures
+ *  exactly what a regular render does (but is slower, because of the extra
+ *  atomics and tape walks). */
+struct RenderStats {
+    struct Stage {
+        // Number of tiles evaluated at this stage.  In the final stage, the
+        // remaining counts are of voxels (or pixels), rather than tiles.
+        int32_t tiles;
+        int32_t filled;
+        int32_t empty;
+        int32_t masked;     // hidden behind filled tiles (3D only)
+        int32_t ambiguous;  // passed on to the next stage
+        uint64_t clauses;   // clauses evaluated, summed over every tile
+
+        // Histogram of pushed tape lengths, where bin i counts tapes with
+        // [2^i, 2^(i+1)) clauses (and the last bin includes longer tapes)
+        int32_t tape_lengths[RENDER_STATS_TAPE_BINS];
+
+        float time_ms;      // GPU time, measured with CUDA events
+    };
+    Stage stages[4];        // 2D renders don't use stages[1]
+    float normals_ms;       // GPU time spent on normals (3D only)
+
+    // Size of the tape pool and its peak usage, in clauses, and the number
+    // of tiles which couldn't push a tape because the pool was full
+    int32_t tape_capacity;
+    int32_t tape_high_water;
+    int32_t tape_overflows;
+};
+
+/*  Device-side destination for RenderStats, which is passed to the
+ *  evaluation kernels.  It's only used when built with MPR_RENDER_STATS. */
+struct StatsSink {
+    RenderStats::Stage* stage;
+    float* heatmap;             // Per-pixel work, if not null
+    int32_t heatmap_size_px;
+};
+
+/*  Stack of 2D slices, as rendered by Context::renderSlices.  Each slice is
+ *  a 1-bit-per-pixel image (packed as in Context::filled_2d, with
+ *  image_size_px^2 / 64 words per slice), and slices are stored back to
+ *  back, in the same order as their Z values in `z`. */
+struct SliceStack {
+    int32_t image_size_px=0;
+    std::vector<float> z;
+    std::vector<uint64_t> bits;
+};
+
+/*  Indexed triangle mesh, as built by Context::renderMesh */
+struct Mesh {
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<Eigen::Vector3f> normals;   // One per vertex, normalized
+    std::vector<Eigen::Vector3i> triangles; // Counter-clockwise from outside
+};
+
+/*  Block sizes for the evaluation kernels.  tile_threads is the number of
+ *  threads per block (one per tile) for interval evaluation at each tile
+ *  stage (2D renders use stages 0 and 2), and voxel_tiles is the number of
+ *  tiles per block (each evaluated by one warp) in the final stage.  Values
+ *  must come from LAUNCH_TILE_THREADS and LAUNCH_VOXEL_TILES. */
+struct LaunchConfig {
+    int32_t tile_threads[3];
+    int32_t voxel_tiles;
+};
+
 struct Context {
-    Context(int32_t image_size_px);
-    void render3D(const Tape& tape, const Eigen::Matrix4f& mat);
-    void render2D(const Tape& tape, const Eigen::Matrix3f& mat,
-                  const float z=0.0f);
+    /*  Builds a context which renders square images.  Buffers that are only
+     *  used on the GPU come from `allocator`; if it isn't provided, then we
+     *  use a stream-ordered pool (falling back to managed memory on devices
+     *  which don't support memory pools).
+     *
+     *  `num_subtapes` sets the initial size of the pool of pushed tapes,
+     *  in chunks of SUBTAPE_CHUNK_SIZE clauses. */
+    Context(int32_t image_size_px,
+            std::shared_ptr<Allocator> allocator=nullptr,
+            int32_t num_subtapes=NUM_SUBTAPES);
+
+    /*  Blocking renders, which return statistics (see RenderStats) */
+    RenderStats render3D(const Tape& tape, const Eigen::Matrix4f& mat);
+    RenderStats render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                         const float z=0.0f);
+
+    /*  Stream-aware versions of render3D and render2D.  All work is queued
+     *  on the given stream, so other streams (and other Contexts) can use
+     *  the device at the same time.  The host still waits on `stream` for
+     *  the active tile count between stages, but the final stage is left
+     *  running when this function returns.
+     *
+     *  Returns an event that is recorded when the render is complete.  The
+     *  event is owned by the Context and is re-recorded by every render, so
+     *  callers should wait on it (or enqueue it with cudaStreamWaitEvent)
+     *  before starting another render with this Context. */
+    cudaEvent_t render3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                         cudaStream_t stream);
+    cudaEvent_t render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                         const float z, cudaStream_t stream);
+
+    /*  Reads back statistics from the most recent render, after waiting for
+     *  it to finish. */
+    RenderStats readStats();
+
+    /*  Queues a copy of the depth and normal images from the most recent
+     *  render (or from one layer of a batch render) into host memory, and
+     *  returns an event that is recorded when the copy is done.  Either
+     *  output may be null to skip it; each gets image_size_px^2 pixels, in
+     *  the layout given by `format`.
+     *
+     *  Images are packed into a staging buffer on `stream`, after the
+     *  render, then copied to the host on a Context-owned stream, so that
+     *  the copy overlaps with whatever is queued on `stream` next (e.g. the
+     *  next frame's render).  Outputs should be pinned (e.g. allocated with
+     *  cudaMallocHost), otherwise the copy isn't asynchronous.  They must
+     *  not be read until the event has completed. */
+    cudaEvent_t readback(void* depth_out, uint32_t* normals_out,
+                         cudaStream_t stream,
+                         const ReadbackFormat& format=ReadbackFormat(),
+                         int32_t layer=0);
+
+    /*  When set, render2D and render3D capture the whole pipeline into a
+     *  CUDA graph and replay it, rather than launching each kernel from the
+     *  host.  Tile counts are computed on the GPU and kernels are sized to
+     *  the current tile array capacity, so the host only waits once per
+     *  frame (to check whether any stage overflowed its tile array, in which
+     *  case the frame is re-rendered with the regular path, which grows the
+     *  arrays).  Streams passed to the render functions must not be the
+     *  legacy default stream, which can't be captured. */
+    bool graph_mode=false;
+
+    /*  When set, CUDA events are recorded between stages, so that readStats
+     *  can report per-stage GPU times (see RenderStats).  This works in any
+     *  build, but isn't done for graph_mode replays, where the stages aren't
+     *  launched individually. */
+    bool stage_timing=false;
+
+    /*  When set, 3D renders outside of graph_mode carry the first
+     *  TEMPORAL_STAGES stages of tile classification and tape pruning over
+     *  from a keyframe, while the view only moves slightly.  Keyframes
+     *  evaluate those stages over tiles dilated by temporal_margin_px
+     *  voxels, so their results hold for any affine matrix which moves
+     *  every point of the volume by less than the margin.  Once the view
+     *  moves further (or the tape changes), the next render is a new
+     *  keyframe; perspective matrices are always rendered from scratch.
+     *  Larger margins allow more motion between keyframes, but leave more
+     *  tiles ambiguous for the later stages. */
+    bool temporal_reuse=false;
+    float temporal_margin_px=TEMPORAL_MARGIN_PX;
+
+    /*  When set, the per-voxel stage of 2D and 3D renders evaluates pairs of
+     *  voxels as packed half-precision values, re-evaluating in fp32 any
+     *  pair where a result is within half_tolerance of the surface.  This
+     *  is faster on GPUs with fast fp16 math, but tapes with large
+     *  intermediate values (beyond fp16's range of about 65504) or fields
+     *  that don't grow roughly like distance near the surface can flip
+     *  voxels; render2D_brute always uses fp32. */
+    bool half_precision=false;
+    float half_tolerance=HALF_TOLERANCE;
+
+    /*  When set, tiles which interval arithmetic leaves ambiguous are
+     *  checked again with reduced affine arithmetic (see gpu_affine.hpp),
+     *  which keeps track of correlated terms and can prove many more of
+     *  them filled or empty.  This costs one extra pass over the ambiguous
+     *  tiles at each tile stage, but sends fewer tiles (and voxels) on to
+     *  later stages. */
+    bool affine_tiles=false;
+
+    /*  When set, non-batched 3D renders find the depth of each pixel by
+     *  sphere tracing front-to-back through its column of 4^3 tiles, rather
+     *  than evaluating every voxel of every tile, so tiles behind the
+     *  front-most surface are skipped.  This is only correct for shapes
+     *  whose field changes by at most `lipschitz` per unit of distance
+     *  (lipschitz = 1 for an exact distance field); larger values take
+     *  shorter steps.  Sparse volumes always evaluate every voxel. */
+    bool sphere_trace=false;
+    float lipschitz=1.0f;
+
+    /*  Number of z slabs that each 3D tile stage is split into.  Slabs are
+     *  evaluated from front to back, with occlusion culling in between, so
+     *  tiles hidden by a surface in an earlier slab are never evaluated.
+     *  Each slab is a separate launch over the whole tile list (where tiles
+     *  outside of the slab return immediately), so a few slabs is usually
+     *  best; 1 evaluates each stage in a single pass. */
+    int32_t z_slabs=1;
+
+    /*  When set, render2D and render2D_brute write their output into
+     *  filled_2d, as a bitmask with one bit per pixel, rather than into
+     *  stages[3].filled (which is left untouched).  This writes 32x less
+     *  memory for the final image, which dominates 2D renders at large
+     *  image sizes. */
+    bool packed_2d=false;
+
+    /*  When greater than 1, render2D also writes an antialiased image into
+     *  `coverage`, holding the fraction of each pixel that is inside the
+     *  shape.  The tile hierarchy runs at the output resolution as usual,
+     *  then each pixel of the ambiguous 8^2 tiles is evaluated on an
+     *  antialias x antialias grid of subsamples (up to 8x8), using the
+     *  tile's pruned tape; every other pixel is either fully covered or
+     *  empty.  Coverage is allocated on first use. */
+    int32_t antialias=0;
+
+    /*  If set to a JitTape (see jit.hpp) that was compiled from the tape
+     *  being rendered, then non-batched 2D and 3D renders use its kernels
+     *  instead of the interpreter for tiles (in the voxel stage) and pixels
+     *  (when computing normals) which are still on the root tape.  Pushed
+     *  tapes are always interpreted, and renders of any other tape ignore
+     *  it. */
+    std::shared_ptr<const JitTape> jit;
+
+    /*  Values of the free variables of the tape being rendered, by index
+     *  (see Tape::varIndex).  Every render copies them into the tape's
+     *  variable clauses as it loads the tape, so changing a variable only
+     *  costs a re-render, rather than a new tape.  Variables without a
+     *  value (and any past TAPE_MAX_VARS) are zero, and batch renders give
+     *  every tape the same values. */
+    std::vector<float> vars;
+
+    /*  When set, the stream-aware (and blocking) render2D, render3D,
+     *  renderBatch3D and renderScene3D mark the root tapes at the start of
+     *  tape_data as persisting in L2, with an access policy window on their
+     *  stream.  Every tile starts on the root tape, and its clauses are read
+     *  in lockstep, so they're reused far more than anything else.  Room for
+     *  the tapes is reserved in the device's persisting L2 (which is shared
+     *  by every Context on the device); tapes that don't fit are given a
+     *  proportional hit ratio.  The window is cleared once the render is
+     *  queued, so the caller's stream is left unchanged.  This does nothing
+     *  on devices without a persisting L2 (before sm_80) or on the legacy
+     *  default stream. */
+    bool persist_tape=false;
+
+    /*  Number of tiles per side in the grid that query bins points into.
+     *  Finer grids prune more of the tape, at the cost of more interval
+     *  evaluation; 1 evaluates every point on the root tape. */
+    int32_t query_tiles_per_side=QUERY_TILES_PER_SIDE;
+
+    /*  When set, 3D tiles whose pushed tapes are short (at most
+     *  EARLY_EXIT_TAPE_LENGTH clauses) and have stopped shrinking (keeping
+     *  at least EARLY_EXIT_SHRINK_PERCENT of their parent's clauses) skip
+     *  the rest of the tile hierarchy.  They're unpacked straight into 4^3
+     *  tiles for the voxel stage, which saves subdividing and evaluating
+     *  intervals for tiles where pruning has stopped paying off.  Only tiles
+     *  up to EARLY_EXIT_MAX_VOXEL_TILES voxel tiles in size are sent down
+     *  early, since larger ones would lose too much empty-space culling.
+     *  This is ignored when replaying a graph or building a temporal_reuse
+     *  keyframe. */
+    bool early_exit=false;
+
+    /*  If `surface_output.mode` isn't NONE, then non-batched 3D renders also
+     *  write their colors into `surface_output.surface` (see SurfaceOutput).
+     *  The surface must stay valid until the render is done. */
+    SurfaceOutput surface_output={0, SurfaceOutput::NONE, false};
+
+    /*  Block sizes for the evaluation kernels, which default to NUM_THREADS
+     *  and NUM_TILES.  These can be set by hand, or picked by autotune. */
+    LaunchConfig launch_config={{NUM_THREADS, NUM_THREADS, NUM_THREADS},
+                                NUM_TILES};
+
+    /*  When set, the first render of each tape (at this image size, on the
+     *  current device) tunes launch_config.  Block sizes which the occupancy
+     *  API rates at less than half of the best candidate's occupancy are
+     *  skipped, and the rest are probed with timed renders, keeping the
+     *  fastest for each stage.  Results are cached for the whole process,
+     *  so other Contexts (and later renders) reuse them. */
+    bool autotune=false;
+
+    /*  When set, interval evaluation shares clause loads between the threads
+     *  of a warp whenever they're all evaluating the same tape (which is the
+     *  common case, since sibling tiles are stored contiguously and share
+     *  their parent's tape).  Each thread loads one clause of a window, and
+     *  the clauses are broadcast with warp shuffles. */
+    bool warp_cooperative=false;
+
+    /*  When set, tiles which would push identical tapes (because they have
+     *  the same parent tape and make the same min/max choices) share one
+     *  copy, found through a small hash table that is cleared by every
+     *  render.  This reduces tape pool usage in exchange for hashing every
+     *  tile's choices.  Sharing between tiles in the same warp (which is the
+     *  common case) requires compute capability 7.0 or later. */
+    bool dedup_tapes=false;
+
+    /*  When set, each pushed tape is written into a single contiguous run
+     *  of clauses, rather than a linked list of SUBTAPE_CHUNK_SIZE chunks.
+     *  This takes two passes over the parent tape (one to count the active
+     *  clauses, then one to write them), but later stages can stream
+     *  through the tape without jumps, and no space is wasted at the end of
+     *  partially-filled chunks. */
+    bool contiguous_tapes=false;
+
+    /*  Size (in voxels) of the tiles in the middle of the 3D hierarchy,
+     *  which subdivides 64^3 tiles into subtile_size_px^3 tiles, then into
+     *  4^3 tiles, then into voxels.  This must be 8, 16 (the default), or
+     *  32; other values are treated as 16.  Smaller values spend more time
+     *  at the top level and are a good fit for simple shapes, while larger
+     *  values refine more gradually, which suits thin features.  2D renders
+     *  always go from 64^2 to 8^2 tiles, then to pixels. */
+    int32_t subtile_size_px=16;
+
+    /*  Range of rows of 64^3 tiles (along Y) which 3D renders evaluate.
+     *  Tiles outside of the range are skipped, leaving their pixels empty,
+     *  which lets MultiContext split a frame between devices.  By default,
+     *  every row is rendered. */
+    int32_t tile_row_begin=0;
+    int32_t tile_row_end=INT32_MAX;
+
+    /*  Renders the given view once with each valid subtile_size_px (after a
+     *  warm-up render, so that allocation isn't counted), then keeps the
+     *  fastest one.  Returns the chosen size. */
+    int32_t tuneHierarchy(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    /*  Renders a batch of 3D views in a single pass, one per (tape, matrix)
+     *  pair.  Every tile is tagged with its index in the batch, so each
+     *  stage evaluates the whole batch with one set of kernel launches.
+     *
+     *  Results are written to consecutive layers of stages[3].filled and
+     *  normals, each of which is image_size_px^2 pixels.  The tapes are
+     *  copied back-to-back into tape_data, so their combined length reduces
+     *  the space left over for tape pushing.
+     *
+     *  The stream-aware version follows the same rules as render3D. */
+    using MatrixList = std::vector<Eigen::Matrix4f,
+                                   Eigen::aligned_allocator<Eigen::Matrix4f>>;
+    void renderBatch3D(const std::vector<const Tape*>& tapes,
+                       const MatrixList& mats);
+    cudaEvent_t renderBatch3D(const std::vector<const Tape*>& tapes,
+                              const MatrixList& mats, cudaStream_t stream);
+
+    /*  Renders a scene of instanced shapes (see Scene) into the same images
+     *  as render3D.  Each 64^3 tile starts on a tape holding only the
+     *  instances whose bounds overlap it, and tiles which don't overlap any
+     *  instance are skipped, so no tile evaluates the whole scene.  The
+     *  scene's tapes are copied back-to-back into tape_data, as in
+     *  renderBatch3D.  Scene renders don't use graph_mode, temporal_reuse,
+     *  autotune or jit.
+     *
+     *  The stream-aware version follows the same rules as render3D. */
+    RenderStats renderScene3D(Scene& scene, const Eigen::Matrix4f& mat);
+    cudaEvent_t renderScene3D(Scene& scene, const Eigen::Matrix4f& mat,
+                              cudaStream_t stream);
+
+    /*  Renders a 3D view a piece at a time, stopping once `budget_ms` has
+     *  passed, and returns true once the image is complete.  This is meant
+     *  to be called once per frame by interactive tools, so that heavy
+     *  models don't stall the UI.
+     *
+     *  Calling this again with the same tape, matrix, subtile_size_px, and
+     *  tile row range resumes from the saved tile lists in `stages`; anything
+     *  else (or any other render with this Context) starts over.  Each call
+     *  does at least one step of work: one of the tile stages, a chunk of
+     *  the voxel stage (sized from the measured rate to fit the remaining
+     *  budget), or normals.  Tile stages aren't split, so a call can overrun
+     *  its budget by up to one stage.
+     *
+     *  Until the render is complete, stages[3].filled and normals hold a
+     *  preview: finished tiles and voxels, plus the tops of tiles which are
+     *  still ambiguous, with normals estimated from the depth image.
+     *
+     *  This is a blocking call on the Context's own stream.  The tape must
+     *  outlive the render, and graph_mode and autotune aren't used. */
+    bool renderProgressive(const Tape& tape, const Eigen::Matrix4f& mat,
+                           const float budget_ms);
+
+    /*  Renders `count` 2D slices, evenly spaced from z_begin to z_end
+     *  (inclusive), as a stack of 1-bit-per-pixel images.  Slices are
+     *  rendered in slabs of up to SLICE_SLAB_LAYERS: the 64^2 tiles of a
+     *  slab are evaluated once, over the slab's whole range of Z values,
+     *  and each of their pushed tapes is shared by every slice in the slab,
+     *  which then go through the later stages together.  This is much
+     *  faster than calling render2D once per slice.  affine_tiles isn't
+     *  used, and this is a blocking call on the Context's own stream. */
+    SliceStack renderSlices(const Tape& tape, const Eigen::Matrix3f& mat,
+                            const float z_begin, const float z_end,
+                            const int32_t count);
 
     /*  Renders a 2D image using a brute-force approach, without subdivision
      *  or tape pruning.  This is only useful for benchmarking, and is not
@@ -48,28 +466,383 @@ struct Context {
                         const Eigen::Matrix3f& mat,
                         const float z=0.0f);
 
+    /*  Renders a `width` x `height` x `depth` voxel region, which may be
+     *  larger than (and needn't be a multiple of) image_size_px.  The region
+     *  is rendered as image_size_px^3 sub-volumes, which all reuse this
+     *  Context's buffers, so GPU memory use doesn't grow with the region.
+     *
+     *  The region's largest dimension is mapped to [-1, 1] (so voxels stay
+     *  cubic), then transformed by `mat`.  Each column of sub-volumes is
+     *  rendered from the top down, and pixels which are filled by a higher
+     *  sub-volume mask out tiles in the lower ones.
+     *
+     *  Results are written to host arrays of width * height pixels:
+     *  `depth_out` gets Z heights (0 is empty), and `normals_out` (if not
+     *  null) gets normals, packed as in `normals`. */
+    void renderTiled3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                       const int32_t width, const int32_t height,
+                       const int32_t depth, int32_t* const depth_out,
+                       uint32_t* const normals_out=nullptr);
+
+    /*  Renders the full image_size_px^3 volume as sparse occupancy, rather
+     *  than a depth image.  Occlusion culling is disabled, so every filled
+     *  tile and surface brick is returned, not just the ones visible from
+     *  above.  This is a blocking call on the Context's own stream. */
+    SparseVolume renderVolume(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    /*  Builds a triangle mesh of the image_size_px^3 volume, using marching
+     *  tetrahedra on the voxel corners of every ambiguous 4^3 tile (with
+     *  that tile's pruned tape).  Vertex positions are transformed by `mat`,
+     *  so they're in the same coordinates as the tape's X, Y, Z inputs.
+     *  Like renderVolume, this is a blocking call. */
+    Mesh renderMesh(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    /*  Evaluates the tape at `count` arbitrary points, writing values to
+     *  `values_out` and (if it isn't null) gradients to `grads_out`.  Every
+     *  array must be accessible from the GPU.  Points are binned into a
+     *  grid of query_tiles_per_side^3 tiles over their bounding box, each
+     *  tile's tape is pruned with interval arithmetic, and points are
+     *  evaluated in tile order on the pruned tapes.  This uses the same
+     *  tile and tape buffers as rendering, and is a blocking call on the
+     *  Context's own stream. */
+    void query(const Tape& tape, const float3* points, int32_t count,
+               float* values_out, float3* grads_out=nullptr);
+
     /*  Renders a 2D image, accumulating amortized work per pixel in a heatmap.
      *  This is used to generate a figure in the research paper, and is not
-     *  recommended for regular use. */
+     *  recommended for regular use.  Work is recorded by the regular
+     *  kernels, so this requires a build with MPR_RENDER_STATS; otherwise,
+     *  the heatmap is left empty. */
     Ptr<float[]> render2D_heatmap(const Tape& tape,
                                   const Eigen::Matrix3f& mat,
                                   const float z=0.0f);
     Ptr<float[]> render3D_heatmap(const Tape& tape,
                                   const Eigen::Matrix4f& mat);
 
+    /*  Pre-allocates room for `tile_count` tiles in the given stage (along
+     *  with matching scratch space), so that renders up to that complexity
+     *  don't need to allocate any memory. */
+    void reserve(const unsigned stage, const size_t tile_count);
+
     int32_t image_size_px;
 
+    // Must be declared before (and so outlive) any buffers that it allocates
+    std::shared_ptr<Allocator> allocator;
+
     Ptr<uint64_t[]> tape_data;    // original tape is copied to index 0
     Ptr<int32_t> tape_index;    // single value
+    int32_t tape_capacity;      // size of tape_data, in clauses
+
+    // GPU-allocated count of tiles which couldn't push a tape because
+    // tape_data was full, reset at the beginning of every render
+    Ptr<int32_t[]> tape_overflow;
 
-    Tiles stages[4];        // 64^3, 16^3, 4^3, voxels
+    // GPU-allocated hash table for dedup_tapes, mapping hashed choices
+    // to the start of a pushed tape (or -1 if it hasn't been pushed yet)
+    Ptr<uint64_t[]> tape_dedup_keys;
+    Ptr<int32_t[]> tape_dedup_values;
 
-    Ptr<int32_t> num_active_tiles;  // GPU-allocated count of active tiles
+    /*  If the tape pool overflows during a (non-graph) render, then grow
+     *  it and re-run the tiles which failed to push their tapes.  Checking
+     *  for overflow adds a host round-trip to every stage. */
+    bool tape_retry=false;
+
+    struct TapeStats {
+        // Largest value of tape_index at the end of any stage.  This can
+        // be larger than tape_capacity if pushing overflowed.
+        int32_t high_water=0;
+
+        // Number of tiles which failed to push a tape in the most recent
+        // render, and fell back to their parent's (longer) tape.
+        int32_t overflows=0;
+
+        // Number of times that the pool has been grown by tape_retry
+        int32_t retries=0;
+    };
+    TapeStats tape_stats;
+
+    Tiles stages[4];        // 64^3, subtile_size_px^3, 4^3, voxels
+
+    Ptr<int32_t[]> num_active_tiles;  // GPU-allocated count of active tiles
+
+    // GPU-allocated number of tiles in each stage, clamped to the stage's
+    // tile_array_size, and the unclamped number that the stage wanted
+    Ptr<int32_t[]> tile_count;
+    Ptr<int32_t[]> tile_count_wanted;
 
     Ptr<void> values; // Used to pass data around
     size_t values_size=0;
 
     Ptr<uint32_t[]> normals;
+
+    // Output of 2D renders with packed_2d set, at one bit per pixel:
+    // pixel (x, y) is bit x % 64 of word (x + y * image_size_px) / 64
+    Ptr<uint64_t[]> filled_2d;
+
+    // Per-pixel coverage from 2D renders with antialias set, in [0, 1]
+    Ptr<float[]> coverage;
+
+    // Occlusion mask carried between sub-volumes by renderTiled3D,
+    // allocated on first use
+    Ptr<int32_t[]> tiled_mask;
+
+    // Images for one slab of renderSlices, with room for slice_layers
+    // slices: the shared 64^2 image, then one 8^2 image per slice in
+    // slice_filled, and one packed image per slice in slice_bits
+    Ptr<int32_t[]> slice_filled;
+    Ptr<uint64_t[]> slice_bits;
+    int32_t slice_layers=0;
+
+    // Number of layers allocated in each stage's filled array and normals,
+    // which only grows above 1 after a batch render
+    int32_t num_layers=1;
+
+    // Per-item matrices and root tape offsets for batch renders
+    Ptr<Eigen::Matrix4f[]> batch_mats;
+    Ptr<int32_t[]> batch_tape_starts;
+    int32_t batch_capacity=0;
+
+    // Start of each 64^3 tile's tape (or -1) for scene renders, allocated
+    // on first use
+    Ptr<int32_t[]> scene_tile_tapes;
+
+    // Voxel tiles unpacked from tiles that left the hierarchy early (see
+    // early_exit), which are appended to the voxel stage's tile list.
+    Ptr<TileNode[]> leaf_bricks;
+    size_t leaf_bricks_size=0;
+    int32_t leaf_brick_count=0;
+
+    Stream stream;  // Context-owned stream, used by the blocking renders
+    Event done;     // Recorded at the end of every stream-aware render
+
+    // Staging buffers for readback, the stream which copies them to the
+    // host, and events recorded after packing and after copying.  These
+    // are all created on first use.  The next readback waits on
+    // readback_done before it overwrites the staging buffers.
+    Ptr<uint32_t[]> readback_depth;
+    Ptr<uint32_t[]> readback_normals;
+    Stream readback_stream;
+    Event readback_packed;
+    Event readback_done;
+
+    // Pinned host memory, used to read back active and wanted tile counts
+    HostPtr<int32_t[]> tile_count_host;
+
+    // Pinned host memory, used to read back tape_index and tape_overflow
+    HostPtr<int32_t[]> tape_stats_host;
+
+    // Instantiated graphs for graph_mode, updated in place every frame
+    GraphExec graph_2d;
+    GraphExec graph_3d;
+
+    // Per-stage statistics on the GPU, which are only allocated when built
+    // with MPR_RENDER_STATS
+    Ptr<RenderStats::Stage[]> stats_data;
+
+    // Timing events, recorded at the start of each stage, before normals,
+    // and at the end of the render.  stats_timed is true if they were
+    // recorded by the most recent render.
+    Event stats_events[6];
+    bool stats_timed=false;
+
+    // Number of tiles at the start of each of the first three 3D stages,
+    // which the normals pass uses to index into their tile lists
+    int32_t stage_counts[3];
+
+    /*  Saved state of an unfinished renderProgressive.  `step` is the next
+     *  piece of work: 0-2 are tile stages, 3 is the voxel stage (of which
+     *  `voxels_done` tiles are finished), 4 is normals, DONE means that the
+     *  image is complete, and -1 means that there's nothing to resume. */
+    struct Progress {
+        enum { DONE = 5 };
+        const Tape* tape=nullptr;
+        uint64_t tape_hash=0;
+        std::vector<float> vars;
+        Eigen::Matrix<float, 4, 4, Eigen::DontAlign> mat;
+        int32_t subtile_size_px=0;
+        int32_t tile_row_begin=0;
+        int32_t tile_row_end=0;
+        int32_t step=-1;
+        unsigned count=0;           // tiles in the current stage
+        unsigned voxels_done=0;
+        float ms_per_voxel_tile=0;  // measured rate, for sizing chunks
+    };
+    Progress progress;
+
+    // Working copy of stages[3].filled, saved while a preview is drawn
+    Ptr<int32_t[]> progress_filled;
+
+    /*  Saved keyframe for temporal_reuse.  `margin` is the dilation of the
+     *  keyframe's tiles, in the tape's coordinates, and `tiles`, `filled`,
+     *  and `tape_index` are copies of the inputs to the first stage that
+     *  isn't reused (which has `count` tiles). */
+    struct Temporal {
+        bool valid=false;
+        const Tape* tape=nullptr;
+        uint64_t tape_hash=0;
+        std::vector<float> vars;
+        Eigen::Matrix<float, 4, 4, Eigen::DontAlign> mat;
+        Eigen::Vector3f margin;
+        int32_t subtile_size_px=0;
+        int32_t tile_row_begin=0;
+        int32_t tile_row_end=0;
+        int32_t stage_counts[TEMPORAL_STAGES];
+        unsigned count=0;
+        Ptr<TileNode[]> tiles;
+        size_t tiles_size=0;
+        Ptr<int32_t[]> filled;
+        Ptr<int32_t[]> tape_index;
+    };
+    Temporal temporal;
+
+    // Context::jit if it matches the tape of the current render (or null),
+    // which is picked when the render loads its root tape
+    const JitTape* jit_tape=nullptr;
+
+protected:
+    /*  Queues up a full render on the given stream.  If `sized` is true,
+     *  kernels are launched with enough threads for each stage's complete
+     *  tile array and nothing is read back to the host, which makes the
+     *  sequence suitable for stream capture.
+     *
+     *  In 3D, `mask` is an optional image_size_px^2 image; every pixel
+     *  where it's non-zero is treated as already occluded.  If `volume` is
+     *  not null, then results are written to it instead of the images
+     *  (see renderVolume), which requires `sized` to be false. */
+    void enqueue3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                   cudaStream_t stream, bool sized,
+                   const int32_t* mask=nullptr,
+                   SparseVolume* volume=nullptr);
+    void enqueue2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                   const float z, cudaStream_t stream, bool sized);
+
+    /*  Queues up a 2D render of `layers` slices, where slice i is at
+     *  z + i * z_step (enqueue2D renders a single slice).  `images` holds
+     *  the 64^2 image (shared by every slice), then the 8^2 and per-pixel
+     *  images (with one layer per slice).  If `bits` isn't null, then the
+     *  per-pixel images are written there instead, at one bit per pixel. */
+    void enqueueLayers2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                         const float z, const float z_step,
+                         const int32_t layers,
+                         int32_t* const images[3], uint64_t* const bits,
+                         cudaStream_t stream, bool sized);
+
+    /*  Queues up the per-stage work of a 3D render, once the first stage's
+     *  `count` tiles have been preloaded.  If `batch_size` is non-zero, then
+     *  per-tile matrices are read from `batch_mats` and `mat` is ignored. */
+    void enqueueStages3D(unsigned count, const Eigen::Matrix4f& mat,
+                         const int32_t batch_size, const int32_t num_slots,
+                         cudaStream_t stream, bool sized,
+                         SparseVolume* volume=nullptr,
+                         unsigned first_stage=0);
+
+    /*  Copies a root tape into tape_data at `offset`, then fills in its
+     *  variables from `vars` */
+    void loadTape(const Tape& tape, int32_t offset, cudaStream_t stream);
+
+    /*  When persist_tape is set, sets an L2 access policy window on
+     *  `stream` over the first `length` clauses of tape_data, or clears
+     *  the window if `length` is 0.  The length is kept in `tape_window`,
+     *  so that growTapes can move the window onto the new pool. */
+    void setTapeWindow(int32_t length, cudaStream_t stream);
+    int32_t tape_window=0;
+
+    /*  Queues up a scene render (see renderScene3D), where 64^3 tile i
+     *  starts on tapes[tile_tapes[i]] (or is skipped, if that's -1).  This
+     *  is split out so that only context.cpp needs the Scene (and so
+     *  libfive) headers. */
+    void enqueueScene3D(const std::vector<std::shared_ptr<const Tape>>& tapes,
+                        const std::vector<int32_t>& tile_tapes,
+                        const Eigen::Matrix4f& mat, cudaStream_t stream);
+
+    /*  Queues up a 3D render for temporal_reuse, which either restores the
+     *  saved keyframe and starts at stage TEMPORAL_STAGES, or renders (and
+     *  saves) a new keyframe */
+    void enqueueTemporal3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                           cudaStream_t stream);
+
+    /*  Pieces of a 3D render, which renderProgressive runs one at a time.
+     *  preloadTiles3D resets the images and loads the first stage's tiles,
+     *  returning their count.  enqueueTiles3D evaluates the `count` tiles
+     *  of stage `i` (0-2) and builds the next stage's list, returning its
+     *  size (evaluating tiles dilated by `margin`, if it's provided).
+     *  enqueueVoxels3D evaluates `count` tiles of the final stage,
+     *  starting at `offset`, reading their count from `num_tiles` on the
+     *  GPU.  enqueueNormals3D then fills in normals. */
+    unsigned preloadTiles3D(const Tape& tape, cudaStream_t stream,
+                            const int32_t* mask);
+    unsigned enqueueTiles3D(unsigned i, unsigned count,
+                            const Eigen::Matrix4f& mat,
+                            const int32_t batch_size, const int32_t num_slots,
+                            cudaStream_t stream, bool sized,
+                            SparseVolume* volume=nullptr,
+                            const Eigen::Vector3f* margin=nullptr);
+    void enqueueVoxels3D(unsigned offset, unsigned count,
+                         const int32_t* num_tiles, const Eigen::Matrix4f& mat,
+                         const int32_t batch_size, const int32_t num_slots,
+                         cudaStream_t stream, uint64_t* occupancy);
+    void enqueueNormals3D(const Eigen::Matrix4f& mat,
+                          const int32_t batch_size, const int32_t num_slots,
+                          cudaStream_t stream, bool sized);
+
+    /*  Replaces enqueueVoxels3D when sphere_trace is set, bucketing the
+     *  final stage's tiles by column then tracing each pixel through them */
+    void traceVoxels3D(unsigned count, const Eigen::Matrix4f& mat,
+                       const int32_t num_slots, cudaStream_t stream);
+
+    /*  Saves the working image of an unfinished progressive render into
+     *  progress_filled, then draws a preview into stages[3].filled and
+     *  normals (see renderProgressive) */
+    void drawPreview3D(const Eigen::Matrix4f& mat, cudaStream_t stream);
+
+    /*  Makes sure that `values` is large enough for a sized render, which
+     *  can't allocate memory while it's being captured. */
+    void reserveValues(cudaStream_t stream);
+
+    /*  Grows a stage's tile array (or the `values` array) to fit at least
+     *  `count` items, queueing the allocation on `stream`. */
+    void growTiles(const unsigned stage, const size_t count,
+                   cudaStream_t stream);
+    void growValues(const size_t count, cudaStream_t stream);
+    void growLeafBricks(const size_t count, cudaStream_t stream);
+
+    /*  Clears the per-render counters (and the dedup_tapes table) */
+    void resetCounters(cudaStream_t stream);
+
+    /*  Queues reads of tape_index and tape_overflow into tape_stats_host,
+     *  then (after the stream is synchronized) updates tape_stats. */
+    void queueTapeStats(cudaStream_t stream);
+    void updateTapeStats();
+
+    /*  Reads back tape statistics.  If the tape pool overflowed, then grows
+     *  it (preserving its contents) and returns true. */
+    bool growTapes(cudaStream_t stream);
+
+    /*  If autotune is set, loads launch_config from the cache, or runs the
+     *  probe (using blocking renders of the given tape and matrix) if this
+     *  tape hasn't been tuned yet. */
+    void autotune2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                    const float z);
+    void autotune3D(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    /*  Returns the tile size (in voxels) of the given 3D stage, from 64 at
+     *  stage 0 down to 1 (voxels) at stage 3. */
+    int32_t tileSize3D(unsigned stage) const;
+
+    /*  Helpers for RenderStats.  beginStats clears the statistics and marks
+     *  the start of the render, and recordStats marks the start of the given
+     *  stage (where 4 is normals and 5 is the end of the render). */
+    void beginStats(cudaStream_t stream);
+    void recordStats(unsigned stage, cudaStream_t stream);
+    StatsSink statsSink(unsigned stage) const;
+
+    // Target for render2D_heatmap and render3D_heatmap
+    float* stats_heatmap=nullptr;
+
+    /*  Updates (or re-instantiates) `exec` from the captured `graph`,
+     *  destroys `graph`, and launches `exec` on the given stream. */
+    void launchGraph(GraphExec& exec, cudaGraph_t graph,
+                     cudaStream_t stream);
 };
 
 } // mpr
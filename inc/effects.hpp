@@ -24,12 +24,31 @@ struct Effects {
     Ptr<int32_t[]> tmp;
     Ptr<int32_t[]> image;
 
-    void drawSSAO(const Context& ctx);
-    void drawShaded(const Context& ctx);
+    /*  Draws ambient occlusion (as 0-255 values) or a shaded image into
+     *  `image`, based on the most recent 3D render in `ctx`.
+     *
+     *  If `surface` is provided, then RGBA colors are written directly
+     *  into it instead (and `image` is left alone).  It must be
+     *  ctx.image_size_px on each side; empty pixels are cleared unless
+     *  `append` is set, as in SurfaceOutput. */
+    void drawSSAO(const Context& ctx, cudaSurfaceObject_t surface=0,
+                  bool append=false);
+    void drawShaded(const Context& ctx, cudaSurfaceObject_t surface=0,
+                    bool append=false);
+
+    /*  When set, ambient occlusion is calculated at half resolution, then
+     *  upsampled with a depth-aware (bilateral) filter, which is about four
+     *  times cheaper and slightly blurrier. */
+    bool half_res_ssao=false;
 
 protected:
     void resizeTo(const Context& ctx);
 
+    /*  Runs the SSAO pass into `tmp`, then blurs it and writes either the
+     *  occlusion or a shaded image into `image` (or `surface`) */
+    void draw(const Context& ctx, bool shade,
+              cudaSurfaceObject_t surface, bool append);
+
     int32_t image_size_px;
 
     Eigen::Matrix<float, 64, 3> ssao_kernel;
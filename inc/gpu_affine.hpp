@@ -0,0 +1,295 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cfloat>
+
+#include "gpu_interval.hpp"
+
+namespace mpr {
+
+/*  Reduced affine form, which tracks a value as linear in the three noise
+ *  symbols of a tile (its screen-space X, Y, Z, each within [-1, 1]), plus
+ *  one independent error term that accumulates every approximation.  This
+ *  keeps correlations between terms that intervals throw away, so bounds
+ *  stay much tighter through smooth blends and other deep expressions. */
+struct Affine {
+    __device__ inline Affine() { /* YOLO */ }
+    __device__ inline explicit Affine(float f)
+        : v(f), dx(0.0f), dy(0.0f), dz(0.0f), err(0.0f) {}
+    __device__ inline Affine(float v, float dx, float dy, float dz, float err)
+        : v(v), dx(dx), dy(dy), dz(dz), err(err) {}
+
+    // Total deviation from the central value
+    __device__ inline float rad() const {
+        return fabsf(dx) + fabsf(dy) + fabsf(dz) + err;
+    }
+    __device__ inline float lower() const { return v - rad(); }
+    __device__ inline float upper() const { return v + rad(); }
+
+    float v;            // central value
+    float dx, dy, dz;   // partials with respect to the noise symbols
+    float err;          // accumulated error, which is always >= 0
+};
+
+#ifdef __CUDACC__
+
+/*  Pads the error term to cover float rounding in the operation that built
+ *  `a`, which isn't tracked exactly (unlike the directed rounding used by
+ *  Interval).  The relative padding is a few ulps of the form's magnitude. */
+__device__ inline Affine rounded(Affine a) {
+    a.err += (fabsf(a.v) + a.rad()) * 4.0f * FLT_EPSILON;
+    return a;
+}
+
+__device__ inline Affine affine(const Interval& i) {
+    return rounded(Affine(i.lower() / 2.0f + i.upper() / 2.0f, 0.0f, 0.0f,
+                          0.0f, i.upper() / 2.0f - i.lower() / 2.0f));
+}
+
+__device__ inline Interval interval(const Affine& a) {
+    const float r = a.rad();
+    return Interval(__fsub_rd(a.v, r), __fadd_ru(a.v, r));
+}
+
+/*  Min-range approximation of a function that is monotonic and convex or
+ *  concave over a's range [lo, hi], where `alpha` is the function's slope at
+ *  whichever end it is shallowest.  Subtracting alpha * x then leaves a
+ *  monotonic residue, whose range sets the new center and error. */
+__device__ inline Affine min_range(const Affine& a, float lo, float hi,
+                                   float f_lo, float f_hi, float alpha)
+{
+    const float r_lo = f_lo - alpha * lo;
+    const float r_hi = f_hi - alpha * hi;
+    return rounded(Affine(alpha * a.v + (r_lo + r_hi) / 2.0f,
+                          alpha * a.dx, alpha * a.dy, alpha * a.dz,
+                          fabsf(alpha) * a.err + fabsf(r_hi - r_lo) / 2.0f));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Affine operator-(const Affine& a) {
+    return Affine(-a.v, -a.dx, -a.dy, -a.dz, a.err);
+}
+
+__device__ inline Affine operator+(const Affine& a, const Affine& b) {
+    return rounded(Affine(a.v + b.v, a.dx + b.dx, a.dy + b.dy, a.dz + b.dz,
+                          a.err + b.err));
+}
+
+__device__ inline Affine operator+(const Affine& a, const float& b) {
+    return rounded(Affine(a.v + b, a.dx, a.dy, a.dz, a.err));
+}
+
+__device__ inline Affine operator+(const float& a, const Affine& b) {
+    return b + a;
+}
+
+__device__ inline Affine operator-(const Affine& a, const Affine& b) {
+    return a + (-b);
+}
+
+__device__ inline Affine operator-(const Affine& a, const float& b) {
+    return a + (-b);
+}
+
+__device__ inline Affine operator-(const float& a, const Affine& b) {
+    return a + (-b);
+}
+
+__device__ inline Affine operator*(const Affine& a, const float& b) {
+    return rounded(Affine(a.v * b, a.dx * b, a.dy * b, a.dz * b,
+                          a.err * fabsf(b)));
+}
+
+__device__ inline Affine operator*(const float& a, const Affine& b) {
+    return b * a;
+}
+
+__device__ inline Affine operator*(const Affine& a, const Affine& b) {
+    // The product of the two deviations is bounded by the product of
+    // their radii, which goes into the error term
+    return rounded(Affine(a.v * b.v,
+                          a.v * b.dx + b.v * a.dx,
+                          a.v * b.dy + b.v * a.dy,
+                          a.v * b.dz + b.v * a.dz,
+                          fabsf(a.v) * b.err + fabsf(b.v) * a.err +
+                          a.rad() * b.rad()));
+}
+
+__device__ inline Affine square(const Affine& a) {
+    // The squared deviation is in [0, rad^2], so we center it
+    const float r2 = a.rad() * a.rad();
+    return rounded(Affine(a.v * a.v + r2 / 2.0f,
+                          2.0f * a.v * a.dx,
+                          2.0f * a.v * a.dy,
+                          2.0f * a.v * a.dz,
+                          2.0f * fabsf(a.v) * a.err + r2 / 2.0f));
+}
+
+__device__ inline Affine abs(const Affine& a) {
+    const float lo = a.lower();
+    const float hi = a.upper();
+    if (lo >= 0.0f) {
+        return a;
+    } else if (hi <= 0.0f) {
+        return -a;
+    }
+    // |x| - alpha * x, with alpha as the slope of the chord, is 0 at x = 0
+    // and the same value e at both ends
+    const float alpha = (hi + lo) / (hi - lo);
+    const float e = hi - alpha * hi;
+    return rounded(Affine(alpha * a.v + e / 2.0f,
+                          alpha * a.dx, alpha * a.dy, alpha * a.dz,
+                          fabsf(alpha) * a.err + e / 2.0f));
+}
+
+__device__ inline Affine sqrt(const Affine& a) {
+    const float lo = a.lower();
+    const float hi = a.upper();
+    if (lo <= 0.0f || hi == lo) {
+        return affine(sqrt(interval(a)));
+    }
+    const float s_hi = sqrtf(hi);
+    return min_range(a, lo, hi, sqrtf(lo), s_hi, 0.5f / s_hi);
+}
+
+__device__ inline Affine exp(const Affine& a) {
+    const float lo = a.lower();
+    const float hi = a.upper();
+    if (hi == lo || hi > 80.0f) {
+        return affine(exp(interval(a)));
+    }
+    const float e_lo = expf(lo);
+    return min_range(a, lo, hi, e_lo, expf(hi), e_lo);
+}
+
+__device__ inline Affine log(const Affine& a) {
+    const float lo = a.lower();
+    const float hi = a.upper();
+    if (lo <= 0.0f || hi == lo) {
+        return affine(log(interval(a)));
+    }
+    return min_range(a, lo, hi, logf(lo), logf(hi), 1.0f / hi);
+}
+
+__device__ inline Affine recip(const Affine& a) {
+    const float lo = a.lower();
+    const float hi = a.upper();
+    if ((lo <= 0.0f && hi >= 0.0f) || hi == lo) {
+        return affine(recip(interval(a)));
+    }
+    // 1/x is shallowest at whichever end is furthest from zero
+    const float far = (lo > 0.0f) ? hi : lo;
+    return min_range(a, lo, hi, 1.0f / lo, 1.0f / hi, -1.0f / (far * far));
+}
+
+__device__ inline Affine operator/(const Affine& a, const Affine& b) {
+    return a * recip(b);
+}
+
+__device__ inline Affine operator/(const Affine& a, const float& b) {
+    return a * (1.0f / b);
+}
+
+__device__ inline Affine operator/(const float& a, const Affine& b) {
+    return a * recip(b);
+}
+
+/*  min and max use the identities min(a, b) = (a + b - |a - b|) / 2 and
+ *  max(a, b) = (a + b + |a - b|) / 2 when the ranges overlap, which keeps
+ *  the result correlated with both branches. */
+__device__ inline Affine min(const Affine& a, const Affine& b) {
+    if (a.upper() <= b.lower()) {
+        return a;
+    } else if (b.upper() <= a.lower()) {
+        return b;
+    }
+    return (a + b - abs(a - b)) * 0.5f;
+}
+
+__device__ inline Affine min(const Affine& a, const float& b) {
+    return min(a, Affine(b));
+}
+
+__device__ inline Affine max(const Affine& a, const Affine& b) {
+    if (a.lower() >= b.upper()) {
+        return a;
+    } else if (b.lower() >= a.upper()) {
+        return b;
+    }
+    return (a + b + abs(a - b)) * 0.5f;
+}
+
+__device__ inline Affine max(const Affine& a, const float& b) {
+    return max(a, Affine(b));
+}
+
+// Everything else is evaluated with intervals, which loses correlation
+// (but is still correct)
+__device__ inline Affine sin(const Affine& a) {
+    return affine(sin(interval(a)));
+}
+
+__device__ inline Affine cos(const Affine& a) {
+    return affine(cos(interval(a)));
+}
+
+__device__ inline Affine tan(const Affine& a) {
+    return affine(tan(interval(a)));
+}
+
+__device__ inline Affine asin(const Affine& a) {
+    return affine(asin(interval(a)));
+}
+
+__device__ inline Affine acos(const Affine& a) {
+    return affine(acos(interval(a)));
+}
+
+__device__ inline Affine atan(const Affine& a) {
+    return affine(atan(interval(a)));
+}
+
+__device__ inline Affine atan2(const Affine& a, const Affine& b) {
+    return affine(atan2(interval(a), interval(b)));
+}
+
+__device__ inline Affine atan2(const Affine& a, const float& b) {
+    return affine(atan2(interval(a), b));
+}
+
+__device__ inline Affine atan2(const float& a, const Affine& b) {
+    return affine(atan2(a, interval(b)));
+}
+
+__device__ inline Affine mod(const Affine& a, const Affine& b) {
+    return affine(mod(interval(a), interval(b)));
+}
+
+__device__ inline Affine mod(const Affine& a, const float& b) {
+    return affine(mod(interval(a), b));
+}
+
+__device__ inline Affine mod(const float& a, const Affine& b) {
+    return affine(mod(a, interval(b)));
+}
+
+__device__ inline Affine pow(const Affine& a, const float& b) {
+    return affine(pow(interval(a), b));
+}
+
+__device__ inline Affine nth_root(const Affine& a, const float& b) {
+    return affine(nth_root(interval(a), b));
+}
+#endif
+
+}   // namespace mpr
@@ -202,6 +202,72 @@ __device__ inline Deriv log(const Deriv& a) {
     const float v = a.value();
     return {logf(v), a.dx() / v, a.dy() / v, a.dz() / v};
 }
+
+__device__ inline Deriv tan(const Deriv& a) {
+    const float c = cosf(a.value());
+    const float d = c * c;
+    return {tanf(a.value()), a.dx() / d, a.dy() / d, a.dz() / d};
+}
+
+__device__ inline Deriv recip(const Deriv& a) {
+    return 1.0f / a;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Deriv atan2(const Deriv& a, const Deriv& b) {
+    // d/dt atan2(a, b) = (b * a' - a * b') / (a^2 + b^2)
+    const float d = a.value() * a.value() + b.value() * b.value();
+    return {atan2f(a.value(), b.value()),
+            (b.value() * a.dx() - a.value() * b.dx()) / d,
+            (b.value() * a.dy() - a.value() * b.dy()) / d,
+            (b.value() * a.dz() - a.value() * b.dz()) / d};
+}
+
+__device__ inline Deriv atan2(const Deriv& a, const float& b) {
+    return atan2(a, Deriv(b));
+}
+
+__device__ inline Deriv atan2(const float& a, const Deriv& b) {
+    return atan2(Deriv(a), b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Deriv pow(const Deriv& a, const float& b) {
+    // The exponent is a constant, so it doesn't contribute a log(a) term
+    const float d = b * powf(a.value(), b - 1.0f);
+    return {powf(a.value(), b), a.dx() * d, a.dy() * d, a.dz() * d};
+}
+
+__device__ inline Deriv nth_root(const Deriv& a, const float& b) {
+    // Odd roots of negative numbers are real, while even roots are NaN
+    const int n = b;
+    const float v = (a.value() < 0.0f && n % 2)
+        ? -powf(-a.value(), 1.0f / n)
+        : powf(a.value(), 1.0f / n);
+    const float d = v / (n * a.value());
+    return {v, a.dx() * d, a.dy() * d, a.dz() * d};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Deriv mod(const Deriv& a, const Deriv& b) {
+    // Floored modulo, as in the Interval and float versions
+    const float k = floorf(a.value() / b.value());
+    return {a.value() - b.value() * k,
+            a.dx() - b.dx() * k,
+            a.dy() - b.dy() * k,
+            a.dz() - b.dz() * k};
+}
+
+__device__ inline Deriv mod(const Deriv& a, const float& b) {
+    return {a.value() - b * floorf(a.value() / b), a.dx(), a.dy(), a.dz()};
+}
+
+__device__ inline Deriv mod(const float& a, const Deriv& b) {
+    return mod(Deriv(a), b);
+}
 #endif
 
 }   // namespace mpr
@@ -433,6 +433,151 @@ __device__ inline Interval log(const Interval& x) {
                 __double2float_ru(::log(x.upper()))};
     }
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Interval tan(const Interval& x) {
+    // tan is increasing between its asymptotes at pi/2 + k*pi, so the result
+    // is unbounded if the interval contains one of them.
+    const double k = floor((x.lower() + M_PI / 2) / M_PI);
+    if (x.upper() >= k * M_PI + M_PI / 2) {
+        return {-CUDART_INF_F, CUDART_INF_F};
+    }
+    // Use double precision, since there aren't _ru / _rd primitives
+    return {__double2float_rd(::tan(x.lower())),
+            __double2float_ru(::tan(x.upper()))};
+}
+
+__device__ inline Interval recip(const Interval& x) {
+    return 1.0f / x;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Interval atan2(const Interval& y, const Interval& x) {
+    // If the box crosses the branch cut along the negative X axis, then the
+    // result could be anything.  Otherwise, atan2 is continuous over the box
+    // and has no interior extrema, so its bounds are found at the corners.
+    if (x.lower() < 0.0f && y.lower() <= 0.0f && y.upper() >= 0.0f) {
+        return {-CUDART_PI_F, CUDART_PI_F};
+    }
+    double lo = ::atan2((double)y.lower(), (double)x.lower());
+    double hi = lo;
+    for (const double a : {::atan2((double)y.lower(), (double)x.upper()),
+                           ::atan2((double)y.upper(), (double)x.lower()),
+                           ::atan2((double)y.upper(), (double)x.upper())})
+    {
+        lo = fmin(lo, a);
+        hi = fmax(hi, a);
+    }
+    return {__double2float_rd(lo), __double2float_ru(hi)};
+}
+
+__device__ inline Interval atan2(const Interval& y, const float& x) {
+    return atan2(y, Interval(x));
+}
+
+__device__ inline Interval atan2(const float& y, const Interval& x) {
+    return atan2(Interval(y), x);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Interval pow(const Interval& x, const float& y) {
+    // Non-integer exponents are only defined for x >= 0 (as in powf), where
+    // pow is monotonic: increasing for y > 0 and decreasing for y < 0.  If
+    // the interval only partly covers that domain, then we can't bound
+    // the result, so it's unbounded (which keeps tiles ambiguous).
+    if (y != floorf(y) || fabsf(y) >= 2147483648.0f) {
+        if (x.upper() < 0.0f) {
+            return {CUDART_NAN_F, CUDART_NAN_F};
+        } else if (x.lower() < 0.0f) {
+            return {-CUDART_INF_F, CUDART_INF_F};
+        }
+        const double lo = ::pow((double)x.lower(), (double)y);
+        const double hi = ::pow((double)x.upper(), (double)y);
+        return (y > 0.0f)
+            ? Interval(__double2float_rd(lo), __double2float_ru(hi))
+            : Interval(__double2float_rd(hi), __double2float_ru(lo));
+    }
+
+    const int n = y;
+    if (n < 0) {
+        return 1.0f / pow(x, -n);
+    } else if (n == 0) {
+        return Interval(1.0f);
+    } else if (n % 2 == 0) {
+        const Interval a = abs(x);
+        return {__double2float_rd(::pow((double)a.lower(), n)),
+                __double2float_ru(::pow((double)a.upper(), n))};
+    } else {
+        return {__double2float_rd(::pow((double)x.lower(), n)),
+                __double2float_ru(::pow((double)x.upper(), n))};
+    }
+}
+
+__device__ inline float nth_root(const float& x, const float& y) {
+    // Odd roots of negative numbers are real, while even roots are NaN
+    const int n = y;
+    if (x < 0.0f && n % 2) {
+        return -powf(-x, 1.0f / n);
+    }
+    return powf(x, 1.0f / n);
+}
+
+__device__ inline Interval nth_root(const Interval& x, const float& y) {
+    const int n = y;
+    auto root = [n](float v) {
+        return (v < 0.0f) ? -::pow(-(double)v, 1.0 / n)
+                          : ::pow((double)v, 1.0 / n);
+    };
+    if (n % 2) {
+        return {__double2float_rd(root(x.lower())),
+                __double2float_ru(root(x.upper()))};
+    } else if (x.upper() < 0.0f) {
+        return {CUDART_NAN_F, CUDART_NAN_F};
+    } else if (x.lower() <= 0.0f) {
+        return {0.0f, __double2float_ru(root(x.upper()))};
+    } else {
+        return {__double2float_rd(root(x.lower())),
+                __double2float_ru(root(x.upper()))};
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Floored modulo, whose result has the same sign as y.  For positive y,
+ *  this matches libfive's behavior. */
+__device__ inline float mod(const float& x, const float& y) {
+    return x - y * floorf(x / y);
+}
+
+__device__ inline Interval mod(const Interval& x, const float& y) {
+    if (y == 0.0f) {
+        return {CUDART_NAN_F, CUDART_NAN_F};
+    }
+    // If the interval falls within a single period, then we shift it into
+    // the range [0, y); otherwise, it could cover the whole range.
+    const double k = floor((double)x.lower() / y);
+    if (floor((double)x.upper() / y) == k) {
+        const float lo = __double2float_rd(x.lower() - k * y);
+        const float hi = __double2float_ru(x.upper() - k * y);
+        return {fmaxf(fminf(lo, hi), fminf(y, 0.0f)),
+                fminf(fmaxf(lo, hi), fmaxf(y, 0.0f))};
+    }
+    return {fminf(y, 0.0f), fmaxf(y, 0.0f)};
+}
+
+__device__ inline Interval mod(const Interval& x, const Interval& y) {
+    if (y.lower() == y.upper()) {
+        return mod(x, y.lower());
+    }
+    return {fminf(y.lower(), 0.0f), fmaxf(y.upper(), 0.0f)};
+}
+
+__device__ inline Interval mod(const float& x, const Interval& y) {
+    return mod(Interval(x), y);
+}
 #endif
 
 }   // namespace mpr
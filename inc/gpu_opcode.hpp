@@ -30,6 +30,8 @@ enum Opcode {
     GPU_OP_EXP_LHS,
     GPU_OP_ABS_LHS,
     GPU_OP_LOG_LHS,
+    GPU_OP_TAN_LHS,
+    GPU_OP_RECIP_LHS,
 
     // Commutative opcodes
     GPU_OP_ADD_LHS_IMM,
@@ -48,6 +50,22 @@ enum Opcode {
     GPU_OP_DIV_LHS_IMM,
     GPU_OP_DIV_IMM_RHS,
     GPU_OP_DIV_LHS_RHS,
+    GPU_OP_ATAN2_LHS_IMM,
+    GPU_OP_ATAN2_IMM_RHS,
+    GPU_OP_ATAN2_LHS_RHS,
+    GPU_OP_MOD_LHS_IMM,
+    GPU_OP_MOD_IMM_RHS,
+    GPU_OP_MOD_LHS_RHS,
+
+    // Like libfive, these require an integer exponent / root
+    GPU_OP_POW_LHS_IMM,
+    GPU_OP_NTH_ROOT_LHS_IMM,
+
+    // Fused opcodes, which replace short chains of clauses
+    GPU_OP_FMA_LHS_IMM_RHS,             // lhs * imm + rhs
+    GPU_OP_SQUARE_ADD_LHS_RHS,          // lhs * lhs + rhs
+    GPU_OP_DIFF_SQUARE_LHS_IMM,         // (lhs - imm)^2
+    GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS, // (lhs - imm)^2 + rhs
 
     // Copy-only opcodes (used after pushing)
     GPU_OP_COPY_IMM,
@@ -0,0 +1,88 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <Eigen/Eigen>
+
+#include "parameters.hpp"
+#include "util.hpp"
+
+// Forward declarations of the CUDA driver API's handles, so that this
+// header doesn't need cuda.h
+struct CUmod_st;
+struct CUfunc_st;
+
+namespace mpr {
+
+// Forward declarations
+struct Tape;
+struct TileNode;
+
+/*  A root tape compiled into straight-line kernels with NVRTC, in the same
+ *  way as the hand-written kernel in benchmark/brute.cu.  Every clause
+ *  becomes a local variable, so there's no tape to fetch and decode, and
+ *  slots live in registers.
+ *
+ *  Only the root tape is compiled: pushed tapes are different for every
+ *  tile, so the interpreter is still used for them.  Context::jit uses
+ *  a JitTape for the tiles and pixels of the voxel and normal stages which
+ *  are still on the root tape (i.e. where pruning didn't help).
+ *
+ *  This is only available in builds with MPR_JIT (the JIT CMake option);
+ *  otherwise, build always returns null. */
+struct JitTape {
+    /*  Compiles the tape, or loads it from `cache_dir` if it was already
+     *  compiled for this device (the cache is keyed by the tape's hash).
+     *  Returns null (after printing an error) if the tape can't be
+     *  compiled, e.g. because it contains jumps. */
+    static std::shared_ptr<const JitTape> build(
+            const Tape& tape, const std::string& cache_dir=JIT_CACHE_DIR);
+
+    /*  Returns the CUDA source that build compiles for this tape, or an
+     *  empty string if the tape can't be compiled. */
+    static std::string source(const Tape& tape);
+
+    ~JitTape();
+
+    /*  Evaluates every voxel pair of the tiles in `tiles` which are on the
+     *  root tape, using positions from calculate_voxels or
+     *  calculate_pixels.  Each pair's result replaces its X values in
+     *  `values`, which eval_voxels_f then reads back.  The root tape must
+     *  be at the start of `tape_data`, which is where variables are read
+     *  from (see Tape::num_vars). */
+    void evalVoxels(const uint64_t* tape_data, const TileNode* tiles,
+                    const int32_t* tile_count, unsigned num_blocks,
+                    float2* values, cudaStream_t stream) const;
+
+    /*  Evaluates normals for the entries of a pixel list (see
+     *  Context::enqueueNormals3D) which are on the root tape, writing them
+     *  to `normals_out`.  Other entries are left for eval_pixel_list_d. */
+    void evalNormals(const Eigen::Matrix4f& mat, const uint64_t* tape_data,
+                     const int32_t* image, uint32_t* normals_out,
+                     int32_t image_size_px,
+                     const int2* list, const int32_t* list_count,
+                     unsigned num_blocks, cudaStream_t stream) const;
+
+    // Hash of the compiled tape, used to check that it matches a render
+    uint64_t hash;
+
+protected:
+    JitTape() {}
+
+    CUmod_st* module=nullptr;
+    CUfunc_st* voxels=nullptr;
+    CUfunc_st* normals=nullptr;
+};
+
+}   // namespace mpr
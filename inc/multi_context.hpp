@@ -0,0 +1,54 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <Eigen/Eigen>
+
+#include "parameters.hpp"
+#include "util.hpp"
+
+namespace mpr {
+
+// Forward declarations
+struct Context;
+struct Tape;
+
+/*  Splits 3D renders between several devices, with one Context per device.
+ *  Each Context has its own copy of the tape, its own tape pool, and its own
+ *  cache configuration (which is per-device state). */
+struct MultiContext {
+    /*  Builds a Context on each of the given devices, or on every visible
+     *  device if `devices` is empty.  The current device is restored
+     *  afterwards. */
+    MultiContext(int32_t image_size_px, std::vector<int> devices={},
+                 int32_t num_subtapes=NUM_SUBTAPES);
+    ~MultiContext();
+
+    /*  Renders a frame as horizontal strips of 64^3 tiles (one per device,
+     *  using Context::tile_row_begin and tile_row_end), then gathers the
+     *  strips into `filled` and `normals`.  Each device is driven by its
+     *  own host thread, since a render waits on the host between stages. */
+    void render3D(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    int32_t image_size_px;
+    std::vector<int> devices;
+    std::vector<std::unique_ptr<Context>> contexts;
+
+    // Combined image_size_px^2 heightmap and normals (packed as in
+    // Context::normals), in pinned host memory
+    HostPtr<int32_t[]> filled;
+    HostPtr<uint32_t[]> normals;
+};
+
+}   // namespace mpr
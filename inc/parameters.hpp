@@ -11,10 +11,100 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
 
+// Default launch configuration: NUM_THREADS threads per block (one per tile)
+// for interval evaluation, and NUM_TILES tiles per block (one warp each) for
+// voxel evaluation.  The evaluation kernels can be re-tuned at runtime (see
+// LaunchConfig), but everything else always uses these values.
 #define NUM_TILES (4)
 #define NUM_THREADS (64 * NUM_TILES)
+
+// Block sizes which the evaluation kernels are instantiated for, as threads
+// per block for interval evaluation and tiles per block for voxels
+#define LAUNCH_TILE_THREADS {64, 128, 256, 512}
+#define LAUNCH_VOXEL_TILES {2, 4, 8, 16}
+#define LAUNCH_NUM_CANDIDATES 4
+
+// Number of timed renders for each candidate when autotuning (see
+// Context::autotune); the fastest of them is used
+#define LAUNCH_PROBE_RENDERS 3
+
 #define SUBTAPE_CHUNK_SIZE 64
 
+// Smallest tile size in the middle level of the 3D hierarchy, which sets the
+// size of that level's filled array (see Context::subtile_size_px)
+#define MIN_SUBTILE_SIZE_PX 8
+
+// Size of the hash table used to deduplicate pushed tapes (a power of two),
+// and the number of slots searched before giving up on a lookup
+#define TAPE_DEDUP_TABLE_SIZE (1 << 16)
+#define TAPE_DEDUP_PROBES 8
+
+// Number of slots searched when welding a mesh vertex (see mesh_tiles)
+#define MESH_HASH_PROBES 32
+
+// Smallest chunk of 4^3 tiles evaluated by each step of a progressive
+// render's voxel stage (see Context::renderProgressive)
+#define PROGRESSIVE_MIN_VOXEL_TILES 1024
+
+// Number of 3D stages which temporal_reuse carries over from a keyframe,
+// and the default margin (in voxels) that keyframes are dilated by
+#define TEMPORAL_STAGES 2
+#define TEMPORAL_MARGIN_PX 8.0f
+
+// Field values below this (in magnitude) are re-evaluated in fp32 when
+// Context::half_precision is set
+#define HALF_TOLERANCE 0.01f
+
+// Largest number of slices which Context::renderSlices renders together,
+// sharing the first stage's tiles and tapes
+#define SLICE_SLAB_LAYERS 8
+
+// Defaults for RenderServer: number of pooled Contexts (and worker
+// threads), largest number of requests per batched render, and how long a
+// request can wait before it goes ahead of higher-priority requests
+#define RENDER_SERVER_CONTEXTS 2
+#define RENDER_SERVER_MAX_BATCH 16
+#define RENDER_SERVER_MAX_WAIT_MS 100.0f
+
+// Directory where JitTape::build caches compiled kernels by default
+#define JIT_CACHE_DIR "/tmp/mpr_jit"
+
+// Smallest number of clauses per thread when building a tape in parallel
+#define TAPE_PARALLEL_MIN_CHUNK 16384
+
+// Number of tapes kept by a TapeCache by default
+#define TAPE_CACHE_CAPACITY 64
+
+// Largest number of free variables which can be set with Context::vars
+#define TAPE_MAX_VARS 64
+
+// Most instances in a leaf node of a Scene's BVH
+#define SCENE_BVH_LEAF_SIZE 4
+
+// Number of per-tile tapes (one per distinct set of instances) that a Scene
+// keeps between renders before it starts over
+#define SCENE_TAPE_CACHE_CAPACITY 4096
+
+// Default number of tiles per side when binning points in Context::query
+#define QUERY_TILES_PER_SIDE 32
+
+// Limits for Context::early_exit: tiles skip the rest of the hierarchy if
+// their pushed tape has at most this many clauses...
+#define EARLY_EXIT_TAPE_LENGTH 32
+
+// ...and retains at least this percentage of its parent tape,
+#define EARLY_EXIT_SHRINK_PERCENT 75
+
+// ...and unpacks into at most this many 4^3 voxel tiles
+#define EARLY_EXIT_MAX_VOXEL_TILES 64
+
+// Version of the binary format written by Tape::save, which must be bumped
+// whenever the file layout or the meaning of a clause changes
+#define TAPE_FILE_VERSION 1
+
+// Number of bins in RenderStats' histogram of pushed tape lengths
+#define RENDER_STATS_TAPE_BINS 16
+
 #ifdef BIG_SERVER
 #define NUM_SUBTAPES 6400000
 #else
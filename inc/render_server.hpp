@@ -0,0 +1,120 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <Eigen/Eigen>
+
+#include "parameters.hpp"
+
+namespace mpr {
+
+// Forward declarations
+struct Context;
+struct Tape;
+
+/*  Result of a RenderServer request: a 3D render's heightmap and normals,
+ *  copied back to the host */
+struct RenderResult {
+    int32_t image_size_px=0;
+    std::vector<int32_t> depth;     // Z heights, where 0 is empty
+    std::vector<uint32_t> normals;  // Packed as in Context::normals
+};
+
+/*  Headless render service, which shares a small pool of Contexts (each
+ *  with its own stream, and its own worker thread) between any number of
+ *  client threads.  This bounds memory use, since tape pools belong to the
+ *  pooled Contexts rather than to each request.
+ *
+ *  Requests are run in order of priority (higher first, then oldest
+ *  first), except that any request which has waited for more than
+ *  `max_wait_ms` goes ahead of everything else, so low-priority requests
+ *  aren't starved under load.  When a worker takes a request, it also takes
+ *  up to `max_batch - 1` other queued requests with the same image size and
+ *  renders them all with Context::renderBatch3D.  Batches are only formed
+ *  from requests which are already waiting, so an idle server renders each
+ *  request as soon as it arrives. */
+struct RenderServer {
+    /*  Starts `num_contexts` workers.  Each worker's Context is built on
+     *  the current device (as of this constructor) when it first needs one,
+     *  with `num_subtapes`
+     *  chunks of tape pool (see Context), and rebuilt if a request needs a
+     *  different image size. */
+    RenderServer(int32_t num_contexts=RENDER_SERVER_CONTEXTS,
+                 int32_t num_subtapes=NUM_SUBTAPES,
+                 int32_t max_batch=RENDER_SERVER_MAX_BATCH,
+                 float max_wait_ms=RENDER_SERVER_MAX_WAIT_MS);
+
+    /*  Finishes every queued request, then stops the workers */
+    ~RenderServer();
+
+    /*  Queues a 3D render, returning a future for its result.  This is safe
+     *  to call from any thread.  The tape is kept alive until the render
+     *  is done. */
+    std::future<RenderResult> submit(std::shared_ptr<const Tape> tape,
+                                     const Eigen::Matrix4f& mat,
+                                     int32_t image_size_px,
+                                     int32_t priority=0);
+
+    /*  Number of requests which are waiting for a worker */
+    size_t pending();
+
+    const int32_t num_subtapes;
+    const int32_t max_batch;
+    const float max_wait_ms;
+    int device;
+
+    // Counters, for monitoring: requests which have been rendered, and the
+    // number of renders (batched or not) which they took
+    std::atomic<size_t> rendered;
+    std::atomic<size_t> batches;
+
+protected:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Request {
+        std::shared_ptr<const Tape> tape;
+        Eigen::Matrix<float, 4, 4, Eigen::DontAlign> mat;
+        int32_t image_size_px;
+        int32_t priority;
+        uint64_t seq;   // Submission order, which breaks ties
+        Clock::time_point submitted;
+        std::promise<RenderResult> promise;
+    };
+
+    /*  Removes the next batch of requests from the queue, which must be
+     *  non-empty (and locked by the caller) */
+    std::vector<Request> takeBatch();
+
+    /*  Renders a batch, fulfilling its promises */
+    void render(std::unique_ptr<Context>& ctx, std::vector<Request>& batch);
+
+    /*  Body of each worker thread */
+    void run();
+
+    std::vector<Request> queue;
+    uint64_t next_seq=0;
+    bool stopping=false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<std::thread> workers;
+};
+
+}   // namespace mpr
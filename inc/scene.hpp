@@ -0,0 +1,119 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include <Eigen/Eigen>
+
+#include "libfive/tree/tree.hpp"
+
+#include "parameters.hpp"
+
+namespace mpr {
+
+// Forward declaration
+struct Tape;
+
+/*  A scene made of many copies of a few parts, which Context::renderScene3D
+ *  renders without building one union of every instance.  Instead, each
+ *  64^3 tile starts on a tape holding only the instances whose bounds
+ *  overlap it, found with a BVH over the instances' bounds.
+ *
+ *  Tapes are built on the host, one per distinct set of instances, and
+ *  are kept between renders (up to SCENE_TAPE_CACHE_CAPACITY of them), so
+ *  a view that only moves a little mostly reuses the previous frame's
+ *  tapes.  This isn't thread-safe. */
+struct Scene {
+    struct Instance {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        libfive::Tree shape;
+
+        // Maps the shape's coordinates into the scene (which must be an
+        // affine transform)
+        Eigen::Matrix4f transform;
+
+        // Bounds of the shape (in its own coordinates), which must be
+        // empty outside of them
+        Eigen::Vector3f lower;
+        Eigen::Vector3f upper;
+    };
+
+    /*  Adds an instance, returning its index.  Instances of the same
+     *  shape share their tree, since libfive deduplicates trees. */
+    int32_t addInstance(const libfive::Tree& shape,
+                        const Eigen::Matrix4f& transform,
+                        const Eigen::Vector3f& lower,
+                        const Eigen::Vector3f& upper);
+
+    /*  Removes every instance, along with any cached tapes */
+    void clear();
+
+    /*  Tapes for a render of the scene.  Every 64^3 tile (indexed by
+     *  position, as in TileNode) starts on tapes[tile_tapes[i]], or is
+     *  skipped if tile_tapes[i] is -1. */
+    struct Frame {
+        std::vector<std::shared_ptr<const Tape>> tapes;
+        std::vector<int32_t> tile_tapes;
+    };
+
+    /*  Finds the instances overlapping each 64^3 tile of a render with the
+     *  given size and matrix (as passed to Context::render3D), and returns
+     *  a tape for each distinct set of them. */
+    Frame prepare(const Eigen::Matrix4f& mat, int32_t image_size_px);
+
+    /*  Returns the union of a set of instances (by index), each remapped
+     *  into scene coordinates */
+    libfive::Tree tree(const std::vector<int32_t>& instances) const;
+
+    // Lookup statistics for per-tile tapes, for display or benchmarking
+    size_t hits=0;
+    size_t misses=0;
+
+protected:
+    /*  Builds the BVH from scratch, splitting at the median of the longest
+     *  axis until nodes hold SCENE_BVH_LEAF_SIZE or fewer instances */
+    void buildBVH();
+
+    /*  Appends every instance whose bounds overlap [lower, upper] to
+     *  `out`, which is left sorted */
+    void query(const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+               std::vector<int32_t>& out) const;
+
+    struct Node {
+        // Bounds of every instance below this node, in scene coordinates
+        Eigen::Vector3f lower;
+        Eigen::Vector3f upper;
+
+        // Leaves hold bvh_order[start, start + count); otherwise, children
+        // are at `start` and `start + 1` (and count is 0)
+        int32_t start;
+        int32_t count;
+    };
+
+    std::vector<Instance, Eigen::aligned_allocator<Instance>> instances;
+
+    // Scene-space bounds of each instance
+    std::vector<Eigen::Vector3f> lowers;
+    std::vector<Eigen::Vector3f> uppers;
+
+    // BVH nodes (with the root at index 0) and instance indices, in leaf
+    // order.  These are empty until the next call to prepare.
+    std::vector<Node> bvh;
+    std::vector<int32_t> bvh_order;
+
+    // Tapes for each set of instances seen so far
+    std::map<std::vector<int32_t>, std::shared_ptr<const Tape>> tapes;
+};
+
+}   // namespace mpr
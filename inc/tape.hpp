@@ -11,6 +11,9 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "util.hpp"
 
@@ -22,11 +25,57 @@ class Tree;
 namespace mpr {
 
 struct Tape {
-    Tape(const libfive::Tree& tree);
+    /*  Flattens a tree into a GPU tape.  If `optimize` is true, then constant
+     *  subexpressions are folded, simple algebraic identities are applied,
+     *  repeated subexpressions are merged, and clauses are reordered to
+     *  reduce the number of live slots. */
+    Tape(const libfive::Tree& tree, bool optimize=true);
+
+    /*  Writes the tape to a binary file, which stores the clauses along with
+     *  the slot count, axis slots, hash, and `metadata` (an optional
+     *  free-form string, e.g. the name of the source model).  Returns false
+     *  (after printing an error) if the file couldn't be written. */
+    bool save(const std::string& path, const std::string& metadata="") const;
+
+    /*  Loads a tape written by `save`, memory-mapping the file and copying
+     *  the clauses straight into GPU memory, so that no tree needs to be
+     *  built.  If `metadata` isn't null, then it's set to the file's
+     *  metadata.  Returns null (after printing an error) if the file can't
+     *  be read, is corrupt, or was saved by a build with different opcodes
+     *  or an older format version (see TAPE_FILE_VERSION). */
+    static std::unique_ptr<Tape> load(const std::string& path,
+                                      std::string* metadata=nullptr);
+
+    /*  Returns the index of a free variable (from libfive::Tree::var()),
+     *  which is its position in Context::vars, or -1 if it isn't in this
+     *  tape.  Tapes from `load` don't know which trees their variables came
+     *  from, so they always return -1 (but can be set by index). */
+    int32_t varIndex(const libfive::Tree& var) const;
 
     // data is a pointer in GPU (unified) memory
     Ptr<uint64_t[]> data;
     int32_t length;
+
+    // Number of slots used during evaluation, which is used to pick the
+    // smallest evaluator kernels that can run this tape
+    int32_t num_slots;
+
+    // Hash of the tape's clauses, which identifies the model when caching
+    // per-model settings (e.g. Context::autotune)
+    uint64_t hash;
+
+    // Number of free variables.  Variable i is loaded by clause i + 1, a
+    // COPY_IMM clause whose immediate is replaced by Context::vars[i] when
+    // a render copies the tape, so that changing a variable doesn't need a
+    // new tape.  The count is also stored in the header (see TAPE_VARS).
+    int32_t num_vars=0;
+
+    // Identity (libfive::Tree::Id) of each variable, by index
+    std::vector<const void*> var_ids;
+
+protected:
+    // Used by load, which fills in every member
+    Tape() {}
 };
 
 } // namespace mpr
@@ -0,0 +1,84 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "parameters.hpp"
+
+// Forward declaration
+namespace libfive {
+class Tree;
+}
+
+namespace mpr {
+
+// Forward declaration
+struct Tape;
+
+/*  Least-recently-used cache of tapes, keyed by a structural hash of the
+ *  tree (so that two separately-built but identical trees share a tape).
+ *  This lets a caller re-evaluate a script and only pay for building the
+ *  shapes that actually changed.  It's safe to share a cache between
+ *  threads; tapes are built outside of the lock. */
+struct TapeCache {
+    TapeCache(size_t capacity=TAPE_CACHE_CAPACITY);
+
+    /*  Returns a tape for the given tree, building it (and evicting the
+     *  least-recently-used tape if the cache is full) on a miss.  Tapes
+     *  that are still in use elsewhere stay alive after eviction, since
+     *  they're reference-counted. */
+    std::shared_ptr<const Tape> get(const libfive::Tree& tree,
+                                    bool optimize=true);
+
+    /*  Drops every cached tape */
+    void clear();
+
+    /*  Hashes a tree by structure (opcodes, constants, and shape of the
+     *  graph), independent of where its nodes live in memory.  Free
+     *  variables are the exception: they're hashed by identity, since a
+     *  tape's variable indices belong to the trees it was built from. */
+    static uint64_t hash(const libfive::Tree& tree);
+
+    /*  Checks whether two trees have the same structure, with the same
+     *  rules as hash.  Lookups check this on a hit, so that a hash
+     *  collision can't return another tree's tape. */
+    static bool equal(const libfive::Tree& a, const libfive::Tree& b);
+
+    size_t capacity;
+
+    // Lookup statistics, for display or benchmarking
+    size_t hits=0;
+    size_t misses=0;
+
+protected:
+    /*  Opcodes which are compared by identity rather than structure */
+    static bool hasIdentity(int op);
+
+    /*  The tree is kept alive alongside its tape, so that lookups can
+     *  compare against it (and the tape's var_ids stay valid). */
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<const libfive::Tree> tree;
+        std::shared_ptr<const Tape> tape;
+    };
+
+    // Most-recently-used entries are at the front of the list
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+};
+
+}   // namespace mpr
@@ -39,16 +39,86 @@ inline void cudaFreeChecked(void* ptr, const char *file, int line) {
     gpuCheck(cudaFree(ptr), file, line);
 }
 
+// Page-locked host memory, used as the target of asynchronous readbacks
+#define CUDA_MALLOC_HOST(T, c) cudaMallocHostChecked<T>(c, __FILE__, __LINE__)
+template <typename T>
+inline T* cudaMallocHostChecked(size_t count, const char *file, int line) {
+    void* ptr;
+    gpuCheck(cudaMallocHost(&ptr, sizeof(T) * count), file, line);
+    return static_cast<T*>(ptr);
+}
+
 namespace mpr {
 
+/*  Interface for pluggable GPU memory allocators.  Memory from an Allocator
+ *  is released through its Deleter, so it can be stored in a Ptr. */
+struct Allocator {
+    virtual ~Allocator() {}
+
+    /*  Allocates `bytes` of memory, usable by work queued on `stream` */
+    virtual void* allocate(size_t bytes, cudaStream_t stream)=0;
+
+    /*  Releases memory, after any work that has been passed to fence() */
+    virtual void deallocate(void* ptr)=0;
+
+    /*  Orders subsequent deallocations after the work currently queued on
+     *  `stream`.  This is a no-op for allocators that free synchronously. */
+    virtual void fence(cudaStream_t stream) { (void)stream; }
+};
+
+/*  By default, a Ptr holds managed memory (from CUDA_MALLOC).  If the Deleter
+ *  has an allocator, then the memory is returned to that allocator. */
 struct Deleter {
+    Deleter() : allocator(nullptr) {}
+    explicit Deleter(Allocator* a) : allocator(a) {}
+
     template <typename T>
-    void operator()(T* ptr) { CUDA_FREE(ptr); }
+    void operator()(T* ptr) {
+        if (allocator) {
+            allocator->deallocate((void*)ptr);
+        } else {
+            CUDA_FREE(ptr);
+        }
+    }
+
+    Allocator* allocator;
 };
 
 template <typename T>
 using Ptr = std::unique_ptr<T, Deleter>;
 
+/*  Allocates an array of `count` objects from the given allocator */
+template <typename T>
+inline Ptr<T[]> allocate(Allocator* a, size_t count, cudaStream_t stream) {
+    return Ptr<T[]>(static_cast<T*>(a->allocate(sizeof(T) * count, stream)),
+                    Deleter(a));
+}
+
+struct HostDeleter {
+    template <typename T>
+    void operator()(T* ptr) { CUDA_CHECK(cudaFreeHost((void*)ptr)); }
+};
+
+template <typename T>
+using HostPtr = std::unique_ptr<T, HostDeleter>;
+
+// cudaStream_t and cudaEvent_t are pointers to opaque structs, so we can
+// manage them with unique_ptr as well (which keeps Context movable).
+struct StreamDeleter {
+    void operator()(cudaStream_t s) { CUDA_CHECK(cudaStreamDestroy(s)); }
+};
+using Stream = std::unique_ptr<CUstream_st, StreamDeleter>;
+
+struct EventDeleter {
+    void operator()(cudaEvent_t e) { CUDA_CHECK(cudaEventDestroy(e)); }
+};
+using Event = std::unique_ptr<CUevent_st, EventDeleter>;
+
+struct GraphExecDeleter {
+    void operator()(cudaGraphExec_t g) { CUDA_CHECK(cudaGraphExecDestroy(g)); }
+};
+using GraphExec = std::unique_ptr<CUgraphExec_st, GraphExecDeleter>;
+
 // Helper function to do constexpr integer powers
 inline constexpr unsigned __host__ __device__ pow(unsigned p, unsigned n) {
     return n ? p * pow(p, n - 1) : 1;
@@ -51,3 +51,24 @@ echo "Bear sculpt"
 ./benchmark/render_3d_table ../benchmark/files/bear.frep
 mkdir -p bear
 mv *.png bear
+
+echo "============================================================"
+echo "                   Per-stage breakdown                      "
+echo "============================================================"
+# Results are written as JSON into bench_json.  If BASELINE_DIR points at
+# a previous run's bench_json, then any frame time which regressed by more
+# than 10% makes the script fail.
+mkdir -p bench_json
+./benchmark/render_bench --2d --sizes 256,512,1024,2048 \
+    --json bench_json/2d.json \
+    ${BASELINE_DIR:+--compare $BASELINE_DIR/2d.json} \
+    ../benchmark/files/prospero.frep \
+    ../benchmark/files/involute_gear_2d.frep
+
+echo "------------------------------------------------------------"
+./benchmark/render_bench --3d --sizes 256,512,1024 \
+    --json bench_json/3d.json \
+    ${BASELINE_DIR:+--compare $BASELINE_DIR/3d.json} \
+    ../benchmark/files/architecture.frep \
+    ../benchmark/files/involute_gear_3d.frep \
+    ../benchmark/files/bear.frep
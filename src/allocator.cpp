@@ -0,0 +1,84 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdint>
+#include "allocator.hpp"
+
+namespace mpr {
+
+void* ManagedAllocator::allocate(size_t bytes, cudaStream_t stream) {
+    (void)stream;
+    void* ptr;
+    CUDA_CHECK(cudaMallocManaged(&ptr, bytes));
+    return ptr;
+}
+
+void ManagedAllocator::deallocate(void* ptr) {
+    CUDA_FREE(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PoolAllocator::PoolAllocator() {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+
+    cudaMemPoolProps props = {};
+    props.allocType = cudaMemAllocationTypePinned;
+    props.location.type = cudaMemLocationTypeDevice;
+    props.location.id = device;
+    CUDA_CHECK(cudaMemPoolCreate(&pool, &props));
+
+    // Never release memory back to the OS when the pool's streams sync
+    uint64_t threshold = UINT64_MAX;
+    CUDA_CHECK(cudaMemPoolSetAttribute(
+                pool, cudaMemPoolAttrReleaseThreshold, &threshold));
+
+    cudaStream_t s;
+    CUDA_CHECK(cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking));
+    stream.reset(s);
+
+    cudaEvent_t e;
+    CUDA_CHECK(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+    event.reset(e);
+}
+
+PoolAllocator::~PoolAllocator() {
+    // Wait for pending deallocations, then release the pool itself
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+    CUDA_CHECK(cudaMemPoolDestroy(pool));
+}
+
+void* PoolAllocator::allocate(size_t bytes, cudaStream_t s) {
+    void* ptr;
+    CUDA_CHECK(cudaMallocFromPoolAsync(&ptr, bytes, pool, s));
+    return ptr;
+}
+
+void PoolAllocator::deallocate(void* ptr) {
+    CUDA_CHECK(cudaFreeAsync(ptr, stream.get()));
+}
+
+void PoolAllocator::fence(cudaStream_t s) {
+    CUDA_CHECK(cudaEventRecord(event.get(), s));
+    CUDA_CHECK(cudaStreamWaitEvent(stream.get(), event.get(), 0));
+}
+
+bool PoolAllocator::supported() {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    int pools = 0;
+    CUDA_CHECK(cudaDeviceGetAttribute(
+                &pools, cudaDevAttrMemoryPoolsSupported, device));
+    return pools != 0;
+}
+
+}   // namespace mpr
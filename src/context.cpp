@@ -9,43 +9,113 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include "allocator.hpp"
 #include "context.hpp"
 #include "parameters.hpp"
+#include "scene.hpp"
 
 namespace mpr {
 
-Context::Context(int32_t image_size_px)
-    : image_size_px(image_size_px)
+Context::Context(int32_t image_size_px, std::shared_ptr<Allocator> a,
+                 int32_t num_subtapes)
+    : image_size_px(image_size_px), allocator(a),
+      tape_capacity(num_subtapes * SUBTAPE_CHUNK_SIZE)
 {
+    if (!allocator) {
+        if (PoolAllocator::supported()) {
+            allocator.reset(new PoolAllocator);
+        } else {
+            allocator.reset(new ManagedAllocator);
+        }
+    }
+
+    {   // Build the stream and event used for asynchronous rendering.  The
+        // stream doesn't synchronize with the legacy default stream, so that
+        // multiple Contexts can share a device.
+        cudaStream_t s;
+        CUDA_CHECK(cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking));
+        stream.reset(s);
+
+        cudaEvent_t e;
+        CUDA_CHECK(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+        done.reset(e);
+    }
+
     // Build the four stages
+    // The middle stage is sized for the smallest subtile_size_px, so that
+    // it can be changed between renders.
     for (unsigned i=0; i < 4; ++i) {
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
+        const unsigned tile_size_px = (i == 1) ? MIN_SUBTILE_SIZE_PX
+                                               : 64 / (1 << (i * 2));
         stages[i].filled.reset(CUDA_MALLOC(
                 int32_t,
                 pow(image_size_px / tile_size_px, 2)));
     }
 
     normals.reset(CUDA_MALLOC(uint32_t, image_size_px * image_size_px));
+    filled_2d.reset(CUDA_MALLOC(uint64_t,
+                                image_size_px * image_size_px / 64));
 
     // Allocate a bunch of memory to store tapes
-    tape_data.reset(CUDA_MALLOC(uint64_t, NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE));
+    tape_data.reset(CUDA_MALLOC(uint64_t, tape_capacity));
     tape_index.reset(CUDA_MALLOC(int32_t, 1));
     *tape_index = 0;
+    tape_overflow = allocate<int32_t>(allocator.get(), 1, stream.get());
+    tape_dedup_keys = allocate<uint64_t>(
+            allocator.get(), TAPE_DEDUP_TABLE_SIZE, stream.get());
+    tape_dedup_values = allocate<int32_t>(
+            allocator.get(), TAPE_DEDUP_TABLE_SIZE, stream.get());
+    tape_stats_host.reset(CUDA_MALLOC_HOST(int32_t, 2));
+
+    // Allocate an index to keep track of active tiles, plus per-stage
+    // tile counts.  These are only used on the GPU.
+    num_active_tiles = allocate<int32_t>(allocator.get(), 1, stream.get());
+    tile_count = allocate<int32_t>(allocator.get(), 4, stream.get());
+    tile_count_wanted = allocate<int32_t>(allocator.get(), 4, stream.get());
+    tile_count_host.reset(CUDA_MALLOC_HOST(int32_t, 4));
 
-    // Allocate an index to keep track of active tiles
-    num_active_tiles.reset(CUDA_MALLOC(int32_t, 1));
+#ifdef MPR_RENDER_STATS
+    // Statistics are recorded per stage, in the evaluation kernels
+    stats_data = allocate<RenderStats::Stage>(allocator.get(), 4,
+                                              stream.get());
+#endif
+    for (unsigned i=0; i < 6; ++i) {
+        cudaEvent_t e;
+        CUDA_CHECK(cudaEventCreate(&e));
+        stats_events[i].reset(e);
+    }
 
     // The first array of tiles must have enough space to hold all of the
     // 64^3 tiles in the volume, which shouldn't be too much.
-    stages[0].tiles.reset(CUDA_MALLOC(
-            TileNode,
-            pow(image_size_px / 64, 3)));
+    stages[0].tile_array_size = pow(image_size_px / 64, 3);
+    stages[0].tiles = allocate<TileNode>(
+            allocator.get(), stages[0].tile_array_size, stream.get());
 
     // We leave the other stage_t's tile arrays unallocated for now, since
     // they're initialized to all zeros and will be resized to fit later.
 
     // Prefer the L1 cache!
     cudaDeviceSetCacheConfig(cudaFuncCachePreferL1);
+
+    // Pool allocations are stream-ordered, so make sure they're finished
+    // before anyone uses them from another stream.
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+}
+
+RenderStats Context::renderScene3D(Scene& scene, const Eigen::Matrix4f& mat)
+{
+    CUDA_CHECK(cudaEventSynchronize(
+                renderScene3D(scene, mat, stream.get())));
+    return readStats();
+}
+
+cudaEvent_t Context::renderScene3D(Scene& scene, const Eigen::Matrix4f& mat,
+                                   cudaStream_t stream)
+{
+    const Scene::Frame frame = scene.prepare(mat, image_size_px);
+    enqueueScene3D(frame.tapes, frame.tile_tapes, mat, stream);
+    CUDA_CHECK(cudaEventRecord(done.get(), stream));
+    return done.get();
 }
 
 } // namespace mpr
@@ -9,11 +9,24 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include <cuda_fp16.h>
+
 #include "clause.hpp"
 #include "context.hpp"
+#include "jit.hpp"
 #include "parameters.hpp"
 #include "tape.hpp"
 
+#include "gpu_affine.hpp"
 #include "gpu_deriv.hpp"
 #include "gpu_interval.hpp"
 #include "gpu_opcode.hpp"
@@ -31,6 +44,30 @@ int4 unpack(int32_t pos, int32_t tiles_per_side)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*  Values of a tape's free variables, which are passed to load_tape_vars
+ *  by value (so that they're in the kernel's constant parameter space) */
+struct TapeVars {
+    float values[TAPE_MAX_VARS];
+    int32_t count;
+};
+
+/*
+ *  load_tape_vars
+ *
+ *  Replaces the immediates of a root tape's variable clauses (clauses 1
+ *  through TAPE_VARS of the header) with the given values.
+ */
+__global__
+void load_tape_vars(uint64_t* const __restrict__ tape, const TapeVars vars)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < vars.count && i < TAPE_VARS(tape)) {
+        IMM(&tape[i + 1]) = vars.values[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 /*
  *  preload_tiles
  *
@@ -39,14 +76,26 @@ int4 unpack(int32_t pos, int32_t tiles_per_side)
  *  to 0 (for the default tape), and its `next` pointer to -1 (indicating
  *  that there is no following node, yet).
  *
+ *  The first thread also stores `in_tile_count` in `tile_count` (the
+ *  GPU-side count of tiles in this stage) and resets `tape_index` to the
+ *  end of the root tape, so that a render can begin without any
+ *  host-to-device copies of scalar values.
+ *
  *  This function should be called before the first stage of per-tile
  *  evaluation, when we want to evaluate every single top-level tile.
  */
 __global__
 void preload_tiles(TileNode* const __restrict__ in_tiles,
-                   const int32_t in_tile_count)
+                   const int32_t in_tile_count,
+                   int32_t* const __restrict__ tile_count,
+                   int32_t* const __restrict__ tape_index,
+                   const int32_t tape_length)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        *tile_count = in_tile_count;
+        *tape_index = tape_length;
+    }
     if (tile_index >= in_tile_count) {
         return;
     }
@@ -54,6 +103,95 @@ void preload_tiles(TileNode* const __restrict__ in_tiles,
     in_tiles[tile_index].position = tile_index;
     in_tiles[tile_index].tape = 0;
     in_tiles[tile_index].next = -1;
+    in_tiles[tile_index].batch = 0;
+}
+
+/*
+ *  preload_tiles_batch
+ *
+ *  Equivalent to `preload_tiles`, but for a batch of `batch_size` renders.
+ *  Tiles are stored layer by layer, with `tiles_per_layer` tiles in each
+ *  layer; each tile's `batch` is set to its layer, and its `tape` is set to
+ *  that layer's root tape (`tape_starts[batch]`).
+ */
+__global__
+void preload_tiles_batch(TileNode* const __restrict__ in_tiles,
+                         const int32_t tiles_per_layer,
+                         const int32_t batch_size,
+                         const int32_t* __restrict__ tape_starts,
+                         int32_t* const __restrict__ tile_count,
+                         int32_t* const __restrict__ tape_index,
+                         const int32_t tape_length)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        *tile_count = tiles_per_layer * batch_size;
+        *tape_index = tape_length;
+    }
+    if (tile_index >= tiles_per_layer * batch_size) {
+        return;
+    }
+
+    const int32_t batch = tile_index / tiles_per_layer;
+    in_tiles[tile_index].position = tile_index % tiles_per_layer;
+    in_tiles[tile_index].tape = tape_starts[batch];
+    in_tiles[tile_index].next = -1;
+    in_tiles[tile_index].batch = batch;
+}
+
+/*
+ *  preload_tiles_scene
+ *
+ *  Equivalent to `preload_tiles`, but for Context::renderScene3D, where
+ *  each tile starts on the tape at tile_tapes[i] (an offset into the tape
+ *  data).  Tiles without a tape (-1) don't overlap any instance, so they're
+ *  masked as in skip_tile_rows.
+ */
+__global__
+void preload_tiles_scene(TileNode* const __restrict__ in_tiles,
+                         const int32_t in_tile_count,
+                         const int32_t* const __restrict__ tile_tapes,
+                         int32_t* const __restrict__ tile_count,
+                         int32_t* const __restrict__ tape_index,
+                         const int32_t tape_length)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        *tile_count = in_tile_count;
+        *tape_index = tape_length;
+    }
+    if (tile_index >= in_tile_count) {
+        return;
+    }
+
+    const int32_t tape = tile_tapes[tile_index];
+    in_tiles[tile_index].position = (tape < 0) ? -1 : tile_index;
+    in_tiles[tile_index].tape = (tape < 0) ? 0 : tape;
+    in_tiles[tile_index].next = -1;
+    in_tiles[tile_index].batch = 0;
+}
+
+/*
+ *  skip_tile_rows
+ *
+ *  Masks every preloaded 3D tile whose Y position is outside of the range
+ *  [row_begin, row_end), so that only a strip of the image is rendered.
+ */
+__global__
+void skip_tile_rows(TileNode* const __restrict__ in_tiles,
+                    const int32_t in_tile_count,
+                    const uint32_t tiles_per_side,
+                    const int32_t row_begin,
+                    const int32_t row_end)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= in_tile_count) {
+        return;
+    }
+    const int4 pos = unpack(tile_index, tiles_per_side);
+    if (pos.y < row_begin || pos.y >= row_end) {
+        in_tiles[tile_index].position = -1;
+    }
 }
 
 /*
@@ -75,18 +213,13 @@ void preload_tiles(TileNode* const __restrict__ in_tiles,
  *  register bloat).  Unfortunately, this reduces performance, at least on
  *  my laptop.
  */
-__global__
-void calculate_intervals_3d(const TileNode* const __restrict__ in_tiles,
-                            const uint32_t in_tile_count,
-                            const uint32_t tiles_per_side,
-                            const Eigen::Matrix4f mat,
-                            Interval* const __restrict__ values)
+__device__ inline
+void calculate_interval_3d(const TileNode* const __restrict__ in_tiles,
+                           const int32_t tile_index,
+                           const uint32_t tiles_per_side,
+                           const Eigen::Matrix4f& mat,
+                           Interval* const __restrict__ values)
 {
-    const uint32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
-        return;
-    }
-
     const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
     const Interval ix = {(pos.x / (float)tiles_per_side - 0.5f) * 2.0f,
                    ((pos.x + 1) / (float)tiles_per_side - 0.5f) * 2.0f};
@@ -119,16 +252,70 @@ void calculate_intervals_3d(const TileNode* const __restrict__ in_tiles,
     values[tile_index * 3 + 2] = iz_;
 }
 
+__global__
+void calculate_intervals_3d(const TileNode* const __restrict__ in_tiles,
+                            const int32_t* __restrict__ in_tile_count,
+                            const uint32_t tiles_per_side,
+                            const Eigen::Matrix4f mat,
+                            Interval* const __restrict__ values)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    calculate_interval_3d(in_tiles, tile_index, tiles_per_side, mat, values);
+}
+
+/*  Batched version of calculate_intervals_3d, which picks each tile's
+ *  matrix from `mats` based on its `batch` index */
+__global__
+void calculate_intervals_3d_batch(const TileNode* const __restrict__ in_tiles,
+                                  const int32_t* __restrict__ in_tile_count,
+                                  const uint32_t tiles_per_side,
+                                  const Eigen::Matrix4f* __restrict__ mats,
+                                  Interval* const __restrict__ values)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    calculate_interval_3d(in_tiles, tile_index, tiles_per_side,
+                          mats[in_tiles[tile_index].batch], values);
+}
+
+/*  Widens each tile's X, Y, Z intervals (as stored by calculate_intervals_3d)
+ *  by `margin`, so that results hold for a slightly different matrix (see
+ *  Context::temporal_reuse) */
+__global__
+void dilate_intervals_3d(const int32_t* __restrict__ in_tile_count,
+                         const float3 margin,
+                         Interval* const __restrict__ values)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const float m[3] = {margin.x, margin.y, margin.z};
+    for (unsigned i=0; i < 3; ++i) {
+        const Interval v = values[tile_index * 3 + i];
+        values[tile_index * 3 + i] = Interval(__fsub_rd(v.lower(), m[i]),
+                                              __fadd_ru(v.upper(), m[i]));
+    }
+}
+
+/*  In 2D, each tile's Z interval is [z_lo, z_hi], offset by z_step for
+ *  each layer of a stack of slices (selected by the tile's `batch`) */
 __global__
 void calculate_intervals_2d(const TileNode* const __restrict__ in_tiles,
-                            const uint32_t in_tile_count,
+                            const int32_t* __restrict__ in_tile_count,
                             const uint32_t tiles_per_side,
                             const Eigen::Matrix3f mat,
-                            const float z,
+                            const float z_lo, const float z_hi,
+                            const float z_step,
                             Interval* const __restrict__ values)
 {
-    const uint32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
@@ -155,78 +342,70 @@ void calculate_intervals_2d(const TileNode* const __restrict__ in_tiles,
 
     values[tile_index * 3] = ix_;
     values[tile_index * 3 + 1] = iy_;
-    values[tile_index * 3 + 2] = {z, z};
+    const int32_t b = in_tiles[tile_index].batch;
+    values[tile_index * 3 + 2] = {fmaf(b, z_step, z_lo),
+                                  fmaf(b, z_step, z_hi)};
 }
 
 /*
- *  eval_tiles_i
+ *  eval_tape_i
  *
- *  This is the important one!
- *
- *  We take a bunch (`in_tile_count`) of tiles in the `in_tiles` array.  Their
- *  values must already be stored in `values` by `calculate_intervals`.
- *
- *  Each tile in the array specifies which tape to use, where tapes are stored
- *  as chunked linked lists in `tape_data`.  By construction, tiles evaluated
- *  by the same warp should have the same tape, which prevents divergence.
+ *  Walks the tape starting at `data` (its first clause, which stores the X,
+ *  Y, Z slots), evaluating it with interval arithmetic on the values already
+ *  stored in `slots`.  Returns a pointer to the tape's final clause.
  *
- *  Each thread walks the tape for its tile values.  If the resulting interval
- *  is filled, then it records that result in the `image` output, using an
- *  `atomicMax` operation to prevent memory issues.  If the interval is empty,
- *  then it returns immediately.  In both of these cases, the tile's `position`
- *  is set to -1, to indicate that it does not require further processing.
- *
- *  Otherwise, it walks *backwards* through the tile's tape, creating a new
- *  tape which only contains active clauses.  This is done with an algorithm
- *  similiar to the "mark" phase of "mark-and-sweep": each clause marks its
- *  children as active, except for min/max clauses, which have the option to
- *  only mark one branch.
+ *  Min/max clauses are counted in `choice_index`, which should start at 0.
+ *  Their choices are recorded in `choices`, which is a ring buffer holding
+ *  2 bits for each of the last CHOICE_RING_SIZE choices; only choices with
+ *  indices in [choice_lo, choice_hi) are recorded.  Every choice which picks
+ *  a single branch is also mixed into `choice_hash`.
  *
- *  The new tape is written to the tile's `tape` variable, because it is valid
- *  for any evaluation which takes place within the tile.
+ *  If `warp_mask` is non-zero, then every thread in the mask must be walking
+ *  the same tape, and they load clauses together (see eval_tiles_i).
  */
-template <int DIMENSION>
-__global__
-void eval_tiles_i(uint64_t* const __restrict__ tape_data,
-                  int32_t* const __restrict__ tape_index,
-                  int32_t* const __restrict__ image,
-                  const uint32_t tiles_per_side,
-
-                  TileNode* const __restrict__ in_tiles,
-                  const int32_t in_tile_count,
-
-                  const Interval* __restrict__ values)
+constexpr static int CHOICE_ARRAY_SIZE = 256;
+constexpr static int CHOICE_RING_SIZE = CHOICE_ARRAY_SIZE * 16;
+
+__device__ inline
+const uint64_t* eval_tape_i(const uint64_t* __restrict__ data,
+                            const uint64_t* const __restrict__ tape_data,
+                            const int32_t tape_capacity,
+                            const uint32_t warp_mask,
+                            Interval* const __restrict__ slots,
+                            uint32_t* const __restrict__ choices,
+                            const int choice_lo, const int choice_hi,
+                            int& choice_index, bool& has_any_choice,
+                            uint64_t& choice_hash)
 {
-    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
-        return;
-    }
-
-    // Check to see if we're masked
-    if (in_tiles[tile_index].position == -1) {
-        return;
-    }
-
-    Interval slots[128];
-    slots[((const uint8_t*)tape_data)[1]] = values[tile_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[tile_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[tile_index * 3 + 2];
-
-    // Pick out the tape based on the pointer stored in the tiles list
-    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
-
-    constexpr static int CHOICE_ARRAY_SIZE = 256;
-    uint32_t choices[CHOICE_ARRAY_SIZE] = {0};
-    int choice_index = 0;
-    bool has_any_choice = false;
+    const int warp_size = __popc(warp_mask);
+    const int warp_rank = __popc(warp_mask & ((1u << (threadIdx.x % 32)) - 1));
+    uint64_t window = 0;
+    int window_pos = warp_size; // the window starts out empty
 
     while (1) {
-        const uint64_t d = *++data;
+        uint64_t d;
+        if (warp_mask) {
+            // Reading past the end of a chunk is harmless, because the
+            // window is discarded when we reach the chunk's jump.
+            if (window_pos == warp_size) {
+                const int64_t i = (data - tape_data) + 1 + warp_rank;
+                window = (i < tape_capacity) ? tape_data[i] : 0;
+                window_pos = 0;
+            }
+            d = __shfl_sync(warp_mask, window,
+                            __fns(warp_mask, 0, ++window_pos));
+            ++data;
+        } else {
+            d = *++data;
+        }
         if (!OP(&d)) {
             break;
         }
         switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+            case GPU_OP_JUMP:
+                data += JUMP_TARGET(&d);
+                window_pos = warp_size;
+                continue;
 
 #define lhs slots[I_LHS(&d)]
 #define rhs slots[I_RHS(&d)]
@@ -244,6 +423,8 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
             case GPU_OP_EXP_LHS:    out = exp(lhs); break;
             case GPU_OP_ABS_LHS:    out = abs(lhs); break;
             case GPU_OP_LOG_LHS:    out = log(lhs); break;
+            case GPU_OP_TAN_LHS:    out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS:  out = recip(lhs); break;
 
             // Commutative opcodes
             case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
@@ -254,8 +435,14 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
 #define CHOICE(f, a, b) {                                               \
     int c = 0;                                                          \
     out = f(a, b, c);                                                   \
-    if (choice_index < CHOICE_ARRAY_SIZE * 16) {                        \
-        choices[choice_index / 16] |= (c << ((choice_index % 16) * 2)); \
+    if (choice_index >= choice_lo && choice_index < choice_hi) {        \
+        const int i = choice_index % CHOICE_RING_SIZE;                  \
+        choices[i / 16] = (choices[i / 16] & ~(3u << ((i % 16) * 2)))   \
+                        | (c << ((i % 16) * 2));                        \
+    }                                                                   \
+    if (c) {                                                            \
+        choice_hash = (choice_hash ^ (((uint64_t)choice_index << 2) | c)) \
+                    * 0x100000001b3ull;                                 \
     }                                                                   \
     choice_index++;                                                     \
     has_any_choice |= (c != 0);                                         \
@@ -273,6 +460,22 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
             case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
             case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
             case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+
+            // Fused opcodes
+            case GPU_OP_FMA_LHS_IMM_RHS: out = lhs * imm + rhs; break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square(lhs) + rhs; break;
+            case GPU_OP_DIFF_SQUARE_LHS_IMM: out = square(lhs - imm); break;
+            case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS:
+                out = square(lhs - imm) + rhs;
+                break;
 
             case GPU_OP_COPY_IMM: out = Interval(imm); break;
             case GPU_OP_COPY_LHS: out = lhs; break;
@@ -286,149 +489,107 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
 #undef out
     }
 
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
-
-    // Empty
-    if (slots[i_out].lower() > 0.0f) {
-        in_tiles[tile_index].position = -1;
-        return;
-    }
-
-    // Masked
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        if (image[pos.w] > pos.z) {
-            in_tiles[tile_index].position = -1;
-            return;
-        }
-    }
-
-    // Filled
-    if (slots[i_out].upper() < 0.0f) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        in_tiles[tile_index].position = -1;
-        if (DIMENSION == 3) {
-            atomicMax(&image[pos.w], pos.z);
-        } else {
-            image[pos.w] = 1;
-        }
-        return;
-    }
-
-    if (!has_any_choice) {
-        return;
-    }
-
-    ////////////////////////////////////////////////////////////////////////////
-    // Tape pushing!
-    // Use this array to track which slots are active
-    int* const __restrict__ active = (int*)slots;
-    for (unsigned i=0; i < 128; ++i) {
-        active[i] = false;
-    }
-    active[i_out] = true;
-
-    // Check to make sure the tape isn't full
-    // This doesn't mean that we'll successfully claim a chunk, because
-    // other threads could claim chunks before us, but it's a way to check
-    // quickly (and prevents tape_index from getting absurdly large).
-    if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-        return;
-    }
-
-    // Claim a chunk of tape
-    int32_t out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-    int32_t out_offset = SUBTAPE_CHUNK_SIZE;
-
-    // If we've run out of tape, then immediately return
-    if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-        return;
-    }
+    return data;
+}
 
-    // Write out the end of the tape, which is the same as the ending
-    // of the previous tape (0 opcode, with i_out as the last slot)
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
+/*
+ *  Helpers for the bitfield of active slots used when pushing tapes
+ */
+#define ACTIVE(i) ((active[(i) / 32] >> ((i) % 32)) & 1)
+#define SET_ACTIVE(i) (active[(i) / 32] |= (1u << ((i) % 32)))
+#define CLEAR_ACTIVE(i) (active[(i) / 32] &= ~(1u << ((i) % 32)))
 
+/*
+ *  next_active_clause
+ *
+ *  Walks *backwards* from `data` to the next clause that is active given the
+ *  tile's choices, marking its children as active (or only one child, for
+ *  min/max clauses with a choice).  The clause is stored in `d`, with its
+ *  opcode rewritten into a copy if it only uses one branch.  Returns false
+ *  once we reach the beginning of the tape, leaving `data` pointing to it.
+ *
+ *  `choices` is a ring buffer of choices with indices in [choice_lo,
+ *  choice_hi), and `choice_index` is the number of choices before `data`.
+ *  If a choice that isn't in the ring buffer is needed, then the tape is
+ *  re-evaluated (using the tile's `values`) to recover the segment that
+ *  ends with that choice.  This is divergent, so we don't try to load
+ *  clauses cooperatively.
+ *
+ *  `visited` is incremented for every clause walked past (active or not),
+ *  so that callers can measure the length of the tape being pruned.
+ */
+__device__ inline
+bool next_active_clause(const uint64_t* __restrict__& data, uint64_t& d,
+                        uint32_t* const __restrict__ active,
+                        const uint64_t* const __restrict__ tape_start,
+                        const uint64_t* const __restrict__ tape_data,
+                        const int32_t tape_capacity,
+                        Interval* const __restrict__ slots,
+                        uint32_t* const __restrict__ choices,
+                        int& choice_index, int& choice_lo, int& choice_hi,
+                        const Interval* const __restrict__ values,
+                        int32_t& visited)
+{
     while (1) {
-        uint64_t d = *--data;
+        d = *--data;
         if (!OP(&d)) {
-            break;
+            return false;
         }
         const uint8_t op = OP(&d);
         if (op == GPU_OP_JUMP) {
             data += JUMP_TARGET(&d);
             continue;
         }
+        visited++;
 
         const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
                                 op <= GPU_OP_MAX_LHS_RHS;
         choice_index -= has_choice;
 
         const uint8_t i_out = I_OUT(&d);
-        if (!active[i_out]) {
+        if (!ACTIVE(i_out)) {
             continue;
         }
 
         assert(!has_choice || choice_index >= 0);
 
-        const int choice = (has_choice && choice_index < CHOICE_ARRAY_SIZE * 16)
-            ? ((choices[choice_index / 16] >>
+        if (has_choice &&
+            (choice_index < choice_lo || choice_index >= choice_hi))
+        {
+            choice_hi = choice_index + 1;
+            choice_lo = (choice_hi > CHOICE_RING_SIZE)
+                ? (choice_hi - CHOICE_RING_SIZE) : 0;
+            slots[((const uint8_t*)tape_start)[1]] = values[0];
+            slots[((const uint8_t*)tape_start)[2]] = values[1];
+            slots[((const uint8_t*)tape_start)[3]] = values[2];
+            int count = 0;
+            bool any = false;
+            uint64_t hash = 0;
+            eval_tape_i(tape_start, tape_data, tape_capacity, 0, slots,
+                        choices, choice_lo, choice_hi, count, any, hash);
+        }
+
+        const int choice = has_choice
+            ? ((choices[(choice_index % CHOICE_RING_SIZE) / 16] >>
               ((choice_index % 16) * 2)) & 3)
             : 0;
 
-        // If we're about to write a new piece of data to the tape,
-        // (and are done with the current chunk), then we need to
-        // add another link to the linked list.
-        --out_offset;
-        if (out_offset == 0) {
-            const int32_t prev_index = out_index;
-
-            // Early exit if we can't finish writing out this tape
-            if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                return;
-            }
-            out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-            out_offset = SUBTAPE_CHUNK_SIZE;
-
-            // Later exit if we claimed a chunk that exceeds the tape array
-            if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                return;
-            }
-            --out_offset;
-
-            // Forward-pointing link
-            OP(&tape_data[out_index + out_offset]) = GPU_OP_JUMP;
-            const int32_t delta = (int32_t)prev_index -
-                                  (int32_t)(out_index + out_offset);
-            JUMP_TARGET(&tape_data[out_index + out_offset]) = delta;
-
-            // Backward-pointing link
-            OP(&tape_data[prev_index]) = GPU_OP_JUMP;
-            JUMP_TARGET(&tape_data[prev_index]) = -delta;
-
-            // We've written the jump, so adjust the offset again
-            --out_offset;
-        }
-
-        active[i_out] = false;
+        CLEAR_ACTIVE(i_out);
         if (choice == 0) {
             const uint8_t i_lhs = I_LHS(&d);
             if (i_lhs) {
-                active[i_lhs] = true;
+                SET_ACTIVE(i_lhs);
             }
             const uint8_t i_rhs = I_RHS(&d);
             if (i_rhs) {
-                active[i_rhs] = true;
+                SET_ACTIVE(i_rhs);
             }
         } else if (choice == 1 /* LHS */) {
             // The non-immediate is always the LHS in commutative ops, and
             // min/max (the only clauses that produce a choice) are commutative
             const uint8_t i_lhs = I_LHS(&d);
-            active[i_lhs] = true;
+            SET_ACTIVE(i_lhs);
             if (i_lhs == i_out) {
-                ++out_offset;
                 continue;
             } else {
                 OP(&d) = GPU_OP_COPY_LHS;
@@ -436,9 +597,8 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
         } else if (choice == 2 /* RHS */) {
             const uint8_t i_rhs = I_RHS(&d);
             if (i_rhs) {
-                active[i_rhs] = true;
+                SET_ACTIVE(i_rhs);
                 if (i_rhs == i_out) {
-                    ++out_offset;
                     continue;
                 } else {
                     OP(&d) = GPU_OP_COPY_RHS;
@@ -447,1894 +607,6104 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
                 OP(&d) = GPU_OP_COPY_IMM;
             }
         }
-        tape_data[out_index + out_offset] = d;
+        return true;
     }
-
-    // Write the beginning of the tape
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
-
-    // Record the beginning of the tape in the output tile
-    in_tiles[tile_index].tape = out_index + out_offset;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
 /*
- *  mask_filled_tiles
+ *  push_tape
  *
- *  For every tile in the `in_tiles` array, compares its z position against
- *  the image's z value at the tile's xy position.  If the tile is below the
- *  image, then it will never contribute, so its position is set to -1 to mark
- *  it as inactive.
+ *  Walks *backwards* through the tape ending at `data`, writing a new tape
+ *  which only contains the clauses that are active given the tile's choices
+ *  (see eval_tiles_i).  `choices` and `choice_index` are the ring buffer and
+ *  choice count left by eval_tape_i; `values` are the tile's X, Y, Z values,
+ *  which are used if the tape must be re-evaluated to recover old choices.
+ *
+ *  If `contiguous` is false, then the tape is written as a linked list of
+ *  SUBTAPE_CHUNK_SIZE chunks, which are claimed as they're needed.
+ *  Otherwise, we walk the tape twice: once to count its active clauses,
+ *  then again to write them into a single run of exactly that many clauses,
+ *  which evaluators can read without following any jumps.
+ *
+ *  Returns the start of the new tape, or -1 if the tape pool is full.  The
+ *  number of clauses in the parent and new tapes (not counting their first
+ *  and last clauses) are written to `in_length` and `out_length`.
  */
-__global__
-void mask_filled_tiles(int32_t* const __restrict__ image,
-                       const uint32_t tiles_per_side,
-
-                       TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count)
+template <int SLOTS>
+__device__ inline
+int32_t push_tape(uint64_t* const __restrict__ tape_data,
+                  int32_t* const __restrict__ tape_index,
+                  const int32_t tape_capacity,
+                  const bool contiguous,
+                  const uint64_t* const __restrict__ tape_start,
+                  const uint64_t* const __restrict__ tape_end,
+                  const uint8_t i_out,
+                  Interval* const __restrict__ slots,
+                  uint32_t* const __restrict__ choices,
+                  const int choice_count,
+                  const Interval* const __restrict__ values,
+                  int32_t& in_length, int32_t& out_length)
 {
-    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
-        return;
+    // Use this bitfield to track which slots are active.  It can't alias
+    // `slots`, because we may need to re-evaluate the tape partway through.
+    uint32_t active[(SLOTS + 31) / 32] = {0};
+    SET_ACTIVE(i_out);
+
+    // Only the last CHOICE_RING_SIZE choices are stored in the ring buffer;
+    // earlier choices are recovered by re-evaluating the tape as needed.
+    int choice_index = choice_count;
+    int choice_hi = choice_count;
+    int choice_lo = (choice_hi > CHOICE_RING_SIZE)
+        ? (choice_hi - CHOICE_RING_SIZE) : 0;
+
+    // Check to make sure the tape isn't full
+    // This doesn't mean that we'll successfully claim a chunk, because
+    // other threads could claim chunks before us, but it's a way to check
+    // quickly (and prevents tape_index from getting absurdly large).
+    if (*tape_index >= tape_capacity) {
+        return -1;
     }
 
-    const int32_t tile = in_tiles[tile_index].position;
-    // Already marked as filled or empty
-    if (tile == -1) {
-        return;
+    const uint64_t* __restrict__ data = tape_end;
+    uint64_t d;
+    in_length = 0;
+    out_length = 0;
+
+    if (contiguous) {
+        // Count the clauses in the new tape, including its first and last
+        int32_t count = 2;
+        while (next_active_clause(data, d, active, tape_start, tape_data,
+                                  tape_capacity, slots, choices, choice_index,
+                                  choice_lo, choice_hi, values, in_length))
+        {
+            count++;
+        }
+        out_length = count - 2;
+
+        // Claim exactly enough tape, then reset and walk it again
+        const int32_t out_index = atomicAdd(tape_index, count);
+        if (out_index + count > tape_capacity) {
+            return -1;
+        }
+        for (unsigned i=0; i < (SLOTS + 31) / 32; ++i) {
+            active[i] = 0;
+        }
+        SET_ACTIVE(i_out);
+        choice_index = choice_count;
+        data = tape_end;
+
+        int32_t out_offset = count - 1;
+        tape_data[out_index + out_offset] = *data;
+        int32_t visited = 0;
+        while (next_active_clause(data, d, active, tape_start, tape_data,
+                                  tape_capacity, slots, choices, choice_index,
+                                  choice_lo, choice_hi, values, visited))
+        {
+            tape_data[out_index + --out_offset] = d;
+        }
+        assert(out_offset == 1);
+        tape_data[out_index] = *data;
+        return out_index;
     }
 
-    const int4 pos = unpack(tile, tiles_per_side);
+    // Claim a chunk of tape
+    int32_t out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
+    int32_t out_offset = SUBTAPE_CHUNK_SIZE;
 
-    // If this tile is completely masked by the image, then skip it
-    if (image[pos.w] > pos.z) {
-        in_tiles[tile_index].position = -1;
+    // If we've run out of tape, then immediately return
+    if (out_index + out_offset >= tape_capacity) {
+        return -1;
+    }
+
+    // Write out the end of the tape, which is the same as the ending
+    // of the previous tape (0 opcode, with i_out as the last slot)
+    out_offset--;
+    tape_data[out_index + out_offset] = *data;
+
+    while (next_active_clause(data, d, active, tape_start, tape_data,
+                              tape_capacity, slots, choices, choice_index,
+                              choice_lo, choice_hi, values, in_length))
+    {
+        out_length++;
+
+        // If we're about to write a new piece of data to the tape,
+        // (and are done with the current chunk), then we need to
+        // add another link to the linked list.
+        --out_offset;
+        if (out_offset == 0) {
+            const int32_t prev_index = out_index;
+
+            // Early exit if we can't finish writing out this tape
+            if (*tape_index >= tape_capacity) {
+                return -1;
+            }
+            out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
+            out_offset = SUBTAPE_CHUNK_SIZE;
+
+            // Later exit if we claimed a chunk that exceeds the tape array
+            if (out_index + out_offset >= tape_capacity) {
+                return -1;
+            }
+            --out_offset;
+
+            // Forward-pointing link
+            OP(&tape_data[out_index + out_offset]) = GPU_OP_JUMP;
+            const int32_t delta = (int32_t)prev_index -
+                                  (int32_t)(out_index + out_offset);
+            JUMP_TARGET(&tape_data[out_index + out_offset]) = delta;
+
+            // Backward-pointing link
+            OP(&tape_data[prev_index]) = GPU_OP_JUMP;
+            JUMP_TARGET(&tape_data[prev_index]) = -delta;
+
+            // We've written the jump, so adjust the offset again
+            --out_offset;
+        }
+        tape_data[out_index + out_offset] = d;
     }
+
+    // Write the beginning of the tape
+    out_offset--;
+    tape_data[out_index + out_offset] = *data;
+
+    return out_index + out_offset;
 }
+#undef ACTIVE
+#undef SET_ACTIVE
+#undef CLEAR_ACTIVE
 
-////////////////////////////////////////////////////////////////////////////////
+#ifdef MPR_RENDER_STATS
+/*
+ *  Helpers for RenderStats.  tape_length counts the clauses in the tape
+ *  starting at `data` (following jumps), and record_work adds `work` to the
+ *  heatmap, spread over every pixel covered by the given tile.
+ */
+__device__ inline
+int32_t tape_length(const uint64_t* __restrict__ data)
+{
+    int32_t count = 0;
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        } else if (OP(&d) == GPU_OP_JUMP) {
+            data += JUMP_TARGET(&d);
+        } else {
+            count++;
+        }
+    }
+    return count;
+}
+
+__device__ inline
+void record_work(const StatsSink& stats, const int4 pos,
+                 const uint32_t tiles_per_side, const float work)
+{
+    const int32_t tile_size_px = stats.heatmap_size_px / tiles_per_side;
+    const float w = work / (tile_size_px * tile_size_px);
+    for (int32_t y=0; y < tile_size_px; ++y) {
+        for (int32_t x=0; x < tile_size_px; ++x) {
+            const int32_t px = x + pos.x * tile_size_px;
+            const int32_t py = y + pos.y * tile_size_px;
+            atomicAdd(&stats.heatmap[px + py * stats.heatmap_size_px], w);
+        }
+    }
+}
+
+// Counts the current tile in one of the RenderStats::Stage fields
+#define RECORD_TILE(field) if (stats.stage && !retry) {     \
+    atomicAdd(&stats.stage->field, 1);                      \
+}
+#else
+#define RECORD_TILE(field)
+#endif
 
 /*
- *  assign_next_nodes
+ *  eval_tiles_i
  *
- *  For every tile in `in_tiles`, which is active (i.e. has a position that
- *  has not been set to -1), set its `next` value to a unique value.
+ *  This is the important one!
+ *
+ *  We take a bunch (`in_tile_count`) of tiles in the `in_tiles` array.  Their
+ *  values must already be stored in `values` by `calculate_intervals`.
+ *
+ *  Each tile in the array specifies which tape to use, where tapes are stored
+ *  as chunked linked lists in `tape_data`.  By construction, tiles evaluated
+ *  by the same warp should have the same tape, which prevents divergence.
+ *
+ *  Each thread walks the tape for its tile values.  If the resulting interval
+ *  is filled, then it records that result in the `image` output, using an
+ *  `atomicMax` operation to prevent memory issues.  If the interval is empty,
+ *  then it returns immediately.  In both of these cases, the tile's `position`
+ *  is set to -1, to indicate that it does not require further processing.
+ *
+ *  Otherwise, it walks *backwards* through the tile's tape, creating a new
+ *  tape which only contains active clauses.  This is done with an algorithm
+ *  similiar to the "mark" phase of "mark-and-sweep": each clause marks its
+ *  children as active, except for min/max clauses, which have the option to
+ *  only mark one branch.
+ *
+ *  Choices are kept in a fixed-size ring buffer, so only the last
+ *  CHOICE_RING_SIZE are available when pushing begins.  If the backwards walk
+ *  needs an earlier choice, then the tape is re-evaluated to recover the
+ *  previous segment of choices, so tapes of any length are pushed correctly.
+ *
+ *  The new tape is written to the tile's `tape` variable, because it is valid
+ *  for any evaluation which takes place within the tile.
+ *
+ *  Tapes are pushed into the first `tape_capacity` clauses of `tape_data`.
+ *  If a tile can't push its tape because the pool is full, then it keeps its
+ *  parent's tape, increments `tape_overflow`, and sets its `next` to -2.
+ *  When `retry` is true, only those tiles are evaluated, which lets us re-run
+ *  the failed part of a stage after growing the pool.
  *
- *  The total number of active tiles is stored in `num_active_tiles`; `next`
- *  values range from 0 to `num_active_tiles - 1`.
+ *  `SLOTS` is the size of the slot array, which must be at least the tape's
+ *  slot count, and `BLOCK` is the number of threads per block, which lets
+ *  the compiler budget registers for it (see `select_eval_tiles_i`).
  *
- *  Philosophically, this function packs sparse items (active tiles in
- *  `in_tiles`) tightly.  It could also be implemented as a scan, but this is
- *  far from the limiting factor.
+ *  If `cooperative` is true, then warps in which every active tile has the
+ *  same tape load clauses together (see Context::warp_cooperative).
+ *
+ *  If `contiguous` is true, then each tape is pushed into a single run of
+ *  clauses, rather than a linked list of chunks (see push_tape).
+ *
+ *  If `push_all` is true, then tiles are never classified as empty, filled
+ *  or masked: every tile with choices pushes a tape, and keeps its position
+ *  (see Context::query, which needs values everywhere, not just a sign).
+ *  `image` isn't used in that case.
+ *
+ *  If `dedup_keys` is not null, then tiles which would push identical tapes
+ *  share a single copy, found through the hash table in `dedup_keys` and
+ *  `dedup_tapes` (see Context::dedup_tapes).  Choices are compared by their
+ *  64-bit hash, so a collision would give a tile the wrong tape; this is
+ *  unlikely enough that we don't store the full choice arrays to check.
+ *
+ *  If `filled_tiles` is not null, then filled tiles are appended to it (by
+ *  position, using `filled_count` as the index) instead of being written to
+ *  the image.  It must have room for every tile in `in_tiles`.
+ *
+ *  If `leaf_tiles` is not null, then tiles whose pushed tapes are short and
+ *  have stopped shrinking (see Context::early_exit) are appended to it,
+ *  using `leaf_count` as the index, with their new tapes.  Their `position`
+ *  is then set to -1, so they aren't subdivided; they're sent straight to
+ *  the voxel stage instead (see expand_leaf_tiles).  It must also have room
+ *  for every tile in `in_tiles`.
+ *
+ *  In 3D, only tiles with z in [slab_lo, slab_hi) are evaluated, which lets
+ *  a stage run as several front-to-back slabs (see Context::z_slabs).
+ *
+ *  When built with MPR_RENDER_STATS, per-tile statistics are recorded in
+ *  `stats` (see RenderStats); retries aren't counted again.
  */
-__global__
-void assign_next_nodes(TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count,
+template <int DIMENSION, int SLOTS, int BLOCK>
+__global__ __launch_bounds__(BLOCK)
+void eval_tiles_i(uint64_t* const __restrict__ tape_data,
+                  int32_t* const __restrict__ tape_index,
+                  const int32_t tape_capacity,
+                  int32_t* const __restrict__ tape_overflow,
+                  const bool retry,
+                  const bool cooperative,
+                  const bool contiguous,
+                  const bool push_all,
+                  uint64_t* const __restrict__ dedup_keys,
+                  int32_t* const __restrict__ dedup_tapes,
+
+                  int32_t* __restrict__ image,
+                  const uint32_t tiles_per_side,
+                  const int32_t slab_lo,
+                  const int32_t slab_hi,
 
-                       int32_t* __restrict__ const num_active_tiles)
+                  TileNode* const __restrict__ in_tiles,
+                  const int32_t* __restrict__ in_tile_count,
+
+                  const Interval* __restrict__ values,
+
+                  int32_t* const __restrict__ filled_tiles,
+                  int32_t* const __restrict__ filled_count,
+
+                  TileNode* const __restrict__ leaf_tiles,
+                  int32_t* const __restrict__ leaf_count,
+
+                  const StatsSink stats)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    const bool is_active = tile_index < in_tile_count &&
-                           in_tiles[tile_index].position != -1;
-
-    // Do two levels of accumulation, to reduce atomic pressure on a single
-    // global variable.  Does this help?  Who knows!
-    __shared__ int local_offset;
-    if (threadIdx.x == 0) {
-        local_offset = 0;
+    // When retrying, skip every tile that didn't overflow the tape pool
+    if (retry && in_tiles[tile_index].next != -2) {
+        return;
     }
-    __syncthreads();
 
-    int my_offset;
-    if (is_active) {
-        my_offset = atomicAdd(&local_offset, 1);
+    // Check to see if we're masked
+    if (in_tiles[tile_index].position == -1) {
+        return;
     }
-    __syncthreads();
 
-    // Only one thread gets to contribute to the global offset
-    if (threadIdx.x == 0) {
-        local_offset = atomicAdd(num_active_tiles, local_offset);
+    // Skip tiles outside of the current slab
+    if (DIMENSION == 3) {
+        const int32_t z = unpack(in_tiles[tile_index].position,
+                                 tiles_per_side).z;
+        if (z < slab_lo || z >= slab_hi) {
+            return;
+        }
     }
-    __syncthreads();
 
-    if (is_active) {
-        in_tiles[tile_index].next = local_offset + my_offset;
-    } else {
-        in_tiles[tile_index].next = -1;
+    // Pick out the tape based on the pointer stored in the tiles list.
+    // Every tape begins with a copy of its root tape's first clause, which
+    // stores the X, Y, Z slots.
+    const uint64_t* const __restrict__ tape_start =
+        &tape_data[in_tiles[tile_index].tape];
+
+    Interval slots[SLOTS];
+    slots[((const uint8_t*)tape_start)[1]] = values[tile_index * 3];
+    slots[((const uint8_t*)tape_start)[2]] = values[tile_index * 3 + 1];
+    slots[((const uint8_t*)tape_start)[3]] = values[tile_index * 3 + 2];
+
+    uint32_t choices[CHOICE_ARRAY_SIZE] = {0};
+    int choice_index = 0;
+    bool has_any_choice = false;
+    uint64_t choice_hash = 0xcbf29ce484222325ull;
+
+    // Sibling tiles are stored contiguously and inherit their parent's tape,
+    // so every thread in a warp is usually walking the same tape.  In that
+    // case, the warp loads a window of clauses at once (one per thread),
+    // then broadcasts them with shuffles, rather than having every thread
+    // load every clause.  Masked tiles have already returned, so we only
+    // shuffle between the remaining threads.
+    const uint32_t warp_mask = __activemask();
+    const int32_t tape = in_tiles[tile_index].tape;
+    const bool warp_tape = cooperative && __all_sync(warp_mask,
+            tape == __shfl_sync(warp_mask, tape, __ffs(warp_mask) - 1));
+
+    const uint64_t* __restrict__ data = eval_tape_i(
+        tape_start, tape_data, tape_capacity, warp_tape ? warp_mask : 0,
+        slots, choices, 0, INT32_MAX, choice_index, has_any_choice,
+        choice_hash);
+
+    // Check the result
+    const uint8_t i_out = I_OUT(data);
+
+#ifdef MPR_RENDER_STATS
+    if (stats.stage && !retry) {
+        const int32_t length = tape_length(tape_start);
+        atomicAdd(&stats.stage->tiles, 1);
+        atomicAdd((unsigned long long*)&stats.stage->clauses,
+                  (unsigned long long)length);
+        if (stats.heatmap) {
+            record_work(stats, unpack(in_tiles[tile_index].position,
+                                      tiles_per_side),
+                        tiles_per_side, length);
+        }
     }
-}
+#endif
 
-/*
- *  subdivide_active_tiles
- *
- *  For each active tile in `in_tiles`, unpack it into 64 subtiles in
- *  `out_tiles`.  Subtiles are tightly packed using `next` indices assigned
- *  in `assign_next_nodes`.
- *
- *  Subtiles inherit the `tape` value from their parent tiles, since they're
- *  contained within the parent and can reuse its tape.  They are assigned
- *  `next` = -1, because we don't yet know whether they have children.
- */
-__global__
-void subdivide_active_tiles_3d(
-        const TileNode* const __restrict__ in_tiles,
-        const int32_t in_tile_count,
-        const int32_t tiles_per_side,
-        TileNode* const __restrict__ out_tiles)
-{
-    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t subtile_index = index % 64;
-    const int32_t tile_index = index / 64;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    // Empty
+    if (!push_all && slots[i_out].lower() > 0.0f) {
+        RECORD_TILE(empty);
+        in_tiles[tile_index].position = -1;
         return;
     }
 
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    const int32_t subtiles_per_side = tiles_per_side * 4;
-
-    const int4 sub = unpack(subtile_index, 4);
-    const int32_t sx = pos.x * 4 + sub.x;
-    const int32_t sy = pos.y * 4 + sub.y;
-    const int32_t sz = pos.z * 4 + sub.z;
-    const int32_t next_tile =
-        sx +
-        sy * subtiles_per_side +
-        sz * subtiles_per_side * subtiles_per_side;
+    // Batch renders store one image per layer
+    image += in_tiles[tile_index].batch * tiles_per_side * tiles_per_side;
 
-    const int t = in_tiles[tile_index].next * 64 + subtile_index;
-    out_tiles[t].position = next_tile;
-    out_tiles[t].tape = in_tiles[tile_index].tape;
-    out_tiles[t].next = -1;
-}
+    // Masked
+    if (DIMENSION == 3 && !push_all) {
+        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+        if (image[pos.w] > pos.z) {
+            RECORD_TILE(masked);
+            in_tiles[tile_index].position = -1;
+            return;
+        }
+    }
 
-__global__
-void subdivide_active_tiles_2d(
-        const TileNode* const __restrict__ in_tiles,
-        const int32_t in_tile_count,
-        const int32_t tiles_per_side,
-        TileNode* const __restrict__ out_tiles)
-{
-    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t subtile_index = index % 64;
-    const int32_t tile_index = index / 64;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    // Filled
+    if (!push_all && slots[i_out].upper() < 0.0f) {
+        RECORD_TILE(filled);
+        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+        if (filled_tiles) {
+            filled_tiles[atomicAdd(filled_count, 1)] =
+                in_tiles[tile_index].position;
+        } else if (DIMENSION == 3) {
+            atomicMax(&image[pos.w], pos.z);
+        } else {
+            image[pos.w] = 1;
+        }
+        in_tiles[tile_index].position = -1;
         return;
     }
 
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    assert(pos.z == 0);
-    const int32_t subtiles_per_side = tiles_per_side * 8;
+    RECORD_TILE(ambiguous);
+    if (!has_any_choice) {
+        return;
+    }
 
-    const int4 sub = unpack(subtile_index, 8);
-    const int32_t sx = pos.x * 8 + sub.x;
-    const int32_t sy = pos.y * 8 + sub.y;
-    const int32_t next_tile = sx + sy * subtiles_per_side;
+    ////////////////////////////////////////////////////////////////////////////
+    // Tape pushing!
+    int32_t pushed = -1;
+    int32_t in_length = -1;
+    int32_t out_length = -1;
+    if (dedup_keys) {
+        // Tiles with the same parent tape and the same choices will push
+        // identical tapes, so we share one copy between them.  Matching
+        // tiles within a warp elect a leader, which looks for an existing
+        // copy in the hash table before pushing (and publishing) its own.
+        const uint64_t key = ((choice_hash ^ (uint32_t)tape) *
+                              0x100000001b3ull) | 1;
+#if __CUDA_ARCH__ >= 700
+        const uint32_t peers = __match_any_sync(__activemask(), key);
+#else   // Older GPUs can't match within a warp, so only use the table
+        const uint32_t peers = 1u << (threadIdx.x % 32);
+#endif
+        const int leader = __ffs(peers) - 1;
+        if (threadIdx.x % 32 == leader) {
+            int32_t slot = -1;
+            for (unsigned i=0; i < TAPE_DEDUP_PROBES; ++i) {
+                const uint32_t j = (uint32_t)((key >> 32) + i) %
+                                   TAPE_DEDUP_TABLE_SIZE;
+                const uint64_t prev = atomicCAS(
+                        (unsigned long long*)&dedup_keys[j], 0ull,
+                        (unsigned long long)key);
+                if (prev == 0) {
+                    slot = j;
+                    break;
+                } else if (prev == key) {
+                    // If the other tile hasn't finished pushing its tape,
+                    // then push our own rather than waiting for it.
+                    pushed = *((volatile int32_t*)&dedup_tapes[j]);
+                    break;
+                }
+            }
+            if (pushed < 0) {
+                pushed = push_tape<SLOTS>(tape_data, tape_index,
+                                          tape_capacity, contiguous,
+                                          tape_start, data, i_out, slots,
+                                          choices, choice_index,
+                                          &values[tile_index * 3],
+                                          in_length, out_length);
+                if (slot != -1 && pushed >= 0) {
+                    atomicExch(&dedup_tapes[slot], pushed);
+                }
+            }
+        }
+        pushed = __shfl_sync(peers, pushed, leader);
+        in_length = __shfl_sync(peers, in_length, leader);
+        out_length = __shfl_sync(peers, out_length, leader);
+    } else {
+        pushed = push_tape<SLOTS>(tape_data, tape_index, tape_capacity,
+                                  contiguous, tape_start, data, i_out,
+                                  slots, choices, choice_index,
+                                  &values[tile_index * 3],
+                                  in_length, out_length);
+    }
 
-    const int t = in_tiles[tile_index].next * 64 + subtile_index;
-    out_tiles[t].position = next_tile;
-    out_tiles[t].tape = in_tiles[tile_index].tape;
-    out_tiles[t].next = -1;
+    if (pushed < 0) {
+        in_tiles[tile_index].next = -2;
+        atomicAdd(tape_overflow, 1);
+    } else {
+        // Record the beginning of the tape in the output tile
+        in_tiles[tile_index].tape = pushed;
+#ifdef MPR_RENDER_STATS
+        if (stats.stage) {
+            const int32_t length = tape_length(&tape_data[pushed]);
+            const int32_t bin = 31 - __clz(length > 0 ? length : 1);
+            atomicAdd(&stats.stage->tape_lengths[
+                        bin < RENDER_STATS_TAPE_BINS
+                            ? bin : (RENDER_STATS_TAPE_BINS - 1)], 1);
+        }
+#endif
+
+        // Lengths are unknown (-1) if the tape came from the dedup table
+        if (leaf_tiles && out_length >= 0 &&
+            out_length <= EARLY_EXIT_TAPE_LENGTH &&
+            out_length * 100 >= in_length * EARLY_EXIT_SHRINK_PERCENT)
+        {
+            const int32_t j = atomicAdd(leaf_count, 1);
+            leaf_tiles[j].position = in_tiles[tile_index].position;
+            leaf_tiles[j].tape = pushed;
+            leaf_tiles[j].next = -1;
+            leaf_tiles[j].batch = in_tiles[tile_index].batch;
+            in_tiles[tile_index].position = -1;
+        }
+    }
 }
+#undef RECORD_TILE
 
 /*
- *  copy_active_tiles
+ *  eval_tiles_a
  *
- *  For each active tile in `in_tiles`, copy it into `out_tiles`.  This
- *  operation turns a sparse array of active tiles into a tightly packed array.
+ *  Re-evaluates every tile that eval_tiles_i left ambiguous with reduced
+ *  affine arithmetic (see Affine), using the tile's pushed tape.  The inputs
+ *  are built from the tile's position and `mat` (or `mats[batch]`, if not
+ *  null), so X, Y, and Z stay correlated with each other through the tape.
+ *  Tiles which are proven filled or empty are retired exactly as in
+ *  eval_tiles_i; the rest are left alone, with the tape (and choices) that
+ *  interval arithmetic gave them.
  *
- *  This is used right before per-pixel evaluation, which wants a compact list
- *  of active tiles, but doesn't want them to be subdivided by 64.
+ *  2D renders pass their 3x3 matrix and z value as a 4x4 matrix whose third
+ *  column is zero (see mat2d_as_3d).  In 3D, only tiles with z in [slab_lo,
+ *  slab_hi) are checked, as in eval_tiles_i.
  *
- *  Tiles keep the `tape` value when copied, but `next` is assigned to -1
- *  (since we're at the bottom of the evaluation stack).
+ *  `SLOTS` is the size of the slot array, as in eval_tiles_i.
  */
+template <int DIMENSION, int SLOTS>
 __global__
-void copy_active_tiles(TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count,
-                       TileNode* const __restrict__ out_tiles)
+void eval_tiles_a(const uint64_t* const __restrict__ tape_data,
+
+                  int32_t* __restrict__ image,
+                  const uint32_t tiles_per_side,
+                  const int32_t slab_lo,
+                  const int32_t slab_hi,
+
+                  TileNode* const __restrict__ in_tiles,
+                  const int32_t* __restrict__ in_tile_count,
+
+                  const Eigen::Matrix4f mat,
+                  const Eigen::Matrix4f* __restrict__ mats,
+
+                  int32_t* const __restrict__ filled_tiles,
+                  int32_t* const __restrict__ filled_count,
+
+                  const StatsSink stats)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
-    const int t = in_tiles[tile_index].next;
-    out_tiles[t].position = in_tiles[tile_index].position;
-    out_tiles[t].tape = in_tiles[tile_index].tape;
-    out_tiles[t].next = -1;
-    in_tiles[tile_index].next = -1;
+
+    // Filled, empty, and masked tiles have already been retired
+    const int32_t position = in_tiles[tile_index].position;
+    if (position == -1) {
+        return;
+    }
+
+    // Build affine forms for the tile's (transformed) X, Y, Z values, with
+    // one noise symbol per screen-space axis
+    const int4 pos = unpack(position, tiles_per_side);
+    if (DIMENSION == 3 && (pos.z < slab_lo || pos.z >= slab_hi)) {
+        return;
+    }
+    const float r = 1.0f / tiles_per_side;
+    const float c[3] = {((pos.x + 0.5f) * r - 0.5f) * 2.0f,
+                        ((pos.y + 0.5f) * r - 0.5f) * 2.0f,
+                        (DIMENSION == 3) ? ((pos.z + 0.5f) * r - 0.5f) * 2.0f
+                                         : 0.0f};
+    const float rz = (DIMENSION == 3) ? r : 0.0f;
+    const Eigen::Matrix4f& m = mats ? mats[in_tiles[tile_index].batch] : mat;
+    Affine row[4];
+    for (unsigned i=0; i < 4; ++i) {
+        row[i] = rounded(Affine(m(i, 0) * c[0] + m(i, 1) * c[1] +
+                                m(i, 2) * c[2] + m(i, 3),
+                                m(i, 0) * r, m(i, 1) * r, m(i, 2) * rz,
+                                0.0f));
+    }
+
+    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
+    Affine slots[SLOTS];
+    slots[((const uint8_t*)data)[1]] = row[0] / row[3];
+    slots[((const uint8_t*)data)[2]] = row[1] / row[3];
+    slots[((const uint8_t*)data)[3]] = row[2] / row[3];
+
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm IMM(&d)
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = square(lhs); break;
+            case GPU_OP_SQRT_LHS:   out = sqrt(lhs); break;
+            case GPU_OP_NEG_LHS:    out = -lhs; break;
+            case GPU_OP_SIN_LHS:    out = sin(lhs); break;
+            case GPU_OP_COS_LHS:    out = cos(lhs); break;
+            case GPU_OP_ASIN_LHS:   out = asin(lhs); break;
+            case GPU_OP_ACOS_LHS:   out = acos(lhs); break;
+            case GPU_OP_ATAN_LHS:   out = atan(lhs); break;
+            case GPU_OP_EXP_LHS:    out = exp(lhs); break;
+            case GPU_OP_ABS_LHS:    out = abs(lhs); break;
+            case GPU_OP_LOG_LHS:    out = log(lhs); break;
+            case GPU_OP_TAN_LHS:    out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS:  out = recip(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
+            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
+            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
+            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
+            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
+            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
+            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
+            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
+            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
+            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
+            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+
+            // Fused opcodes
+            case GPU_OP_FMA_LHS_IMM_RHS: out = lhs * imm + rhs; break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square(lhs) + rhs; break;
+            case GPU_OP_DIFF_SQUARE_LHS_IMM: out = square(lhs - imm); break;
+            case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS:
+                out = square(lhs - imm) + rhs;
+                break;
+
+            case GPU_OP_COPY_IMM: out = Affine(imm); break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+
+            default: assert(false);
+        }
+#undef lhs
+#undef rhs
+#undef imm
+#undef out
+    }
+    const Affine result = slots[I_OUT(data)];
+
+    const bool empty = result.lower() > 0.0f;
+    const bool filled = result.upper() < 0.0f;
+    if (!empty && !filled) {
+        return;
+    }
+#ifdef MPR_RENDER_STATS
+    if (stats.stage) {
+        atomicSub(&stats.stage->ambiguous, 1);
+        atomicAdd(empty ? &stats.stage->empty : &stats.stage->filled, 1);
+    }
+#endif
+    if (filled) {
+        image += in_tiles[tile_index].batch * tiles_per_side * tiles_per_side;
+        if (filled_tiles) {
+            filled_tiles[atomicAdd(filled_count, 1)] = position;
+        } else if (DIMENSION == 3) {
+            atomicMax(&image[pos.w], pos.z);
+        } else {
+            image[pos.w] = 1;
+        }
+    }
+    in_tiles[tile_index].position = -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
- *  copy_filled
- *
- *  Copies a lower-resolution (4x undersampled) image into a higher-resolution
- *  image, expanding every active (non-zero) "pixel" by 4x.
+ *  mask_filled_tiles
  *
- *  The higher-resolution image must be empty (all 0) when this is called;
- *  no comparison of Z values is done.
+ *  For every tile in the `in_tiles` array, compares its z position against
+ *  the image's z value at the tile's xy position.  If the tile is below the
+ *  image, then it will never contribute, so its position is set to -1 to mark
+ *  it as inactive.
  */
 __global__
-void copy_filled_3d(const int32_t* __restrict__ prev,
-                    int32_t* __restrict__ image,
-                    const int32_t image_size_px)
+void mask_filled_tiles(int32_t* const __restrict__ image,
+                       const uint32_t tiles_per_side,
+
+                       TileNode* const __restrict__ in_tiles,
+                       const int32_t* __restrict__ in_tile_count)
 {
-    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
 
-    if (x < image_size_px && y < image_size_px) {
-        int32_t t = prev[x / 4 + y / 4 * (image_size_px / 4)];
-        if (t) {
-            image[x + y * image_size_px] = t * 4 + 3;
-        }
+    const int32_t tile = in_tiles[tile_index].position;
+    // Already marked as filled or empty
+    if (tile == -1) {
+        return;
     }
-}
-__global__
-void copy_filled_2d(const int32_t* __restrict__ prev,
-                    int32_t* __restrict__ image,
-                    const int32_t image_size_px)
-{
-    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
 
-    if (x < image_size_px && y < image_size_px &&
-        prev[x / 8 + y / 8 * (image_size_px / 8)])
-    {
-        image[x + y * image_size_px] = 1;
+    const int4 pos = unpack(tile, tiles_per_side);
+    const int32_t layer = in_tiles[tile_index].batch *
+                          tiles_per_side * tiles_per_side;
+
+    // If this tile is completely masked by the image, then skip it
+    if (image[layer + pos.w] > pos.z) {
+        in_tiles[tile_index].position = -1;
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
- *  calculate_voxels
+ *  count_active_tiles
  *
- *  For a given set of input tiles, each is divided into 64 voxels.  Each
- *  voxel's position in (orthographic, screen-aligned, +/-1) render space is
- *  transformed by `mat`, then written to the `values` array.
+ *  For every block of tiles in `in_tiles`, counts the active tiles (i.e.
+ *  those with a position that has not been set to -1), storing the result
+ *  in `block_counts[blockIdx.x]`.
  *
- *  For efficiency, we actually calculate two voxels per thread and store them
- *  in a float2, i.e. data is packed as
- *  [x0 x1 | y0 y1 | z0 z1 | x2 x3 | y2 y3 | z2 z3 | ...]
+ *  This is the first step of the stream compaction done by `compact_tiles`.
  */
 __global__
-void calculate_voxels(const TileNode* const __restrict__ in_tiles,
-                      const uint32_t in_tile_count,
-                      const uint32_t tiles_per_side,
-                      const Eigen::Matrix4f mat,
-                      float2* const __restrict__ values)
+void count_active_tiles(const TileNode* const __restrict__ in_tiles,
+                        const int32_t* __restrict__ in_tile_count,
+                        int32_t* __restrict__ const block_counts)
 {
-    // Each tile is executed by 32 threads (one for each pair of voxels).
-    //
-    // This is different from the eval_tiles_i function, which evaluates one
-    // tile per thread, because the tiles are already expanded by 64x by the
-    // time they're stored in the in_tiles list.
-    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t tile_index = voxel_index / 32;
-
-    if (tile_index >= in_tile_count) {
-        return;
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const bool is_active = tile_index < *in_tile_count &&
+                           in_tiles[tile_index].position != -1;
+    const int32_t count = __syncthreads_count(is_active);
+    if (threadIdx.x == 0) {
+        block_counts[blockIdx.x] = count;
     }
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    const int4 sub = unpack(threadIdx.x % 32, 4);
-
-    const int32_t px = pos.x * 4 + sub.x;
-    const int32_t py = pos.y * 4 + sub.y;
-    const int32_t pz_a = pos.z * 4 + sub.z;
-
-    const float size_recip = 1.0f / (tiles_per_side * 4);
+}
 
-    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
-    const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
-    const float fz_a = ((pz_a + 0.5f) * size_recip - 0.5f) * 2.0f;
+/*
+ *  scan_active_tiles
+ *
+ *  Converts the `num_blocks` per-block counts from `count_active_tiles` into
+ *  an exclusive prefix sum (in place), and stores the total number of active
+ *  tiles in `num_active_tiles`.
+ *
+ *  This runs as a single block, which walks through the counts in chunks of
+ *  `blockDim.x`.  There's only one count per NUM_THREADS tiles, so this is
+ *  cheap compared to the rest of the stage.
+ */
+__global__
+void scan_active_tiles(int32_t* __restrict__ const block_counts,
+                       const int32_t num_blocks,
+                       int32_t* __restrict__ const num_active_tiles)
+{
+    __shared__ int32_t scratch[NUM_THREADS];
+    int32_t carry = 0;
+    for (int32_t base=0; base < num_blocks; base += blockDim.x) {
+        const int32_t i = base + threadIdx.x;
+        const int32_t count = (i < num_blocks) ? block_counts[i] : 0;
+        scratch[threadIdx.x] = count;
+        __syncthreads();
+
+        // Inclusive scan within the chunk (Hillis-Steele)
+        for (unsigned offset=1; offset < blockDim.x; offset *= 2) {
+            const int32_t t = (threadIdx.x >= offset)
+                ? scratch[threadIdx.x - offset] : 0;
+            __syncthreads();
+            scratch[threadIdx.x] += t;
+            __syncthreads();
+        }
 
-    // Otherwise, calculate the X/Y/Z values
-    const float fw_a = mat(3, 0) * fx +
-                       mat(3, 1) * fy +
-                       mat(3, 2) * fz_a + mat(3, 3);
-    for (unsigned i=0; i < 3; ++i) {
-        values[voxel_index * 3 + i].x =
-            (mat(i, 0) * fx +
-             mat(i, 1) * fy +
-             mat(i, 2) * fz_a + mat(i, 3)) / fw_a;
+        if (i < num_blocks) {
+            block_counts[i] = carry + scratch[threadIdx.x] - count;
+        }
+        carry += scratch[blockDim.x - 1];
+        __syncthreads();
     }
-
-    // Do the same calculation for the second pixel
-    const int32_t pz_b = pz_a + 2;
-    const float fz_b = ((pz_b + 0.5f) * size_recip - 0.5f) * 2.0f;
-    const float fw_b = mat(3, 0) * fx +
-                       mat(3, 1) * fy +
-                       mat(3, 2) * fz_b + mat(3, 3);
-
-    for (unsigned i=0; i < 3; ++i) {
-        values[voxel_index * 3 + i].y =
-            (mat(i, 0) * fx +
-             mat(i, 1) * fy +
-             mat(i, 2) * fz_b + mat(i, 3)) / fw_b;
+    if (threadIdx.x == 0) {
+        *num_active_tiles = carry;
     }
 }
 
+/*
+ *  assign_next_nodes
+ *
+ *  For every tile in `in_tiles`, which is active (i.e. has a position that
+ *  has not been set to -1), set its `next` value to a unique value.
+ *
+ *  `block_offsets` must be the prefix sum of active tiles per block (from
+ *  `scan_active_tiles`).  Within a block, tiles are ranked with warp ballots,
+ *  so `next` values increase with tile index: the compaction is
+ *  deterministic, and the next stage keeps the same spatial ordering.
+ */
 __global__
-void calculate_pixels(const TileNode* const __restrict__ in_tiles,
-                      const uint32_t in_tile_count,
-                      const uint32_t tiles_per_side,
-                      const Eigen::Matrix3f mat, const float z,
-                      float2* const __restrict__ values)
+void assign_next_nodes(TileNode* const __restrict__ in_tiles,
+                       const int32_t* __restrict__ in_tile_count,
+                       const int32_t* __restrict__ const block_offsets)
 {
-    // Each tile is executed by 32 threads (one for each pair of voxels).
-    //
-    // This is different from the eval_tiles_i function, which evaluates one
-    // tile per thread, because the tiles are already expanded by 64x by the
-    // time they're stored in the in_tiles list.
-    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t tile_index = voxel_index / 32;
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const bool is_active = tile_index < *in_tile_count &&
+                           in_tiles[tile_index].position != -1;
 
-    if (tile_index >= in_tile_count) {
-        return;
+    // Count active tiles in every warp of the block
+    __shared__ int32_t warp_counts[NUM_THREADS / 32];
+    const uint32_t ballot = __ballot_sync(0xFFFFFFFF, is_active);
+    const unsigned warp = threadIdx.x / 32;
+    const unsigned lane = threadIdx.x % 32;
+    if (lane == 0) {
+        warp_counts[warp] = __popc(ballot);
     }
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    const int4 sub = unpack(threadIdx.x % 32, 8);
-
-    const int32_t px = pos.x * 8 + sub.x;
-    const int32_t py_a = pos.y * 8 + sub.y;
-    assert(sub.y < 4);
-    assert(sub.z == 0);
-
-    const float size_recip = 1.0f / (tiles_per_side * 8);
-
-    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
-    const float fy_a = ((py_a + 0.5f) * size_recip - 0.5f) * 2.0f;
+    __syncthreads();
 
-    // Otherwise, calculate the X/Y/Z values
-    const float fw_a = mat(2, 0) * fx + mat(2, 1) * fy_a + mat(2, 2);
-    for (unsigned i=0; i < 2; ++i) {
-        values[voxel_index * 3 + i].x =
-            (mat(i, 0) * fx + mat(i, 1) * fy_a + mat(i, 2)) / fw_a;
+    if (tile_index >= *in_tile_count) {
+        return;
     }
 
-    // Do the same calculation for the second pixel
-    const int32_t py_b = py_a + 4;
-    const float fy_b = ((py_b + 0.5f) * size_recip - 0.5f) * 2.0f;
-    const float fw_b = mat(2, 0) * fx + mat(2, 1) * fy_b + mat(2, 2);
-
-    for (unsigned i=0; i < 2; ++i) {
-        values[voxel_index * 3 + i].y =
-            (mat(i, 0) * fx + mat(i, 1) * fy_b + mat(i, 2)) / fw_b;
+    int32_t offset = block_offsets[blockIdx.x];
+    for (unsigned i=0; i < warp; ++i) {
+        offset += warp_counts[i];
     }
+    offset += __popc(ballot & ((1u << lane) - 1));
 
-    values[voxel_index * 3 + 2] = make_float2(z, z);
+    in_tiles[tile_index].next = is_active ? offset : -1;
 }
 
 /*
- *  eval_voxels_f
- *
- *  Evaluates the 64 voxels which make up every tile in `in_tiles` (of which
- *  there should be `in_tile_count`.  This must be called after
- *  `calculate_voxels`, which writes voxel positions to the `values` array.
+ *  compact_tiles
  *
- *  For efficiency, this function calculates two voxels per thread, reading and
- *  writing float2 data (which improves memory access patterns).
+ *  Queues up a deterministic stream compaction of the active tiles in
+ *  `in_tiles`, which assigns them `next` values in order (see
+ *  `assign_next_nodes`) and stores the total in `num_active_tiles`.
  *
- *  Filled voxels are written to `image`, using atomic operations to accumulate
- *  the voxel with the tallest Z value.
+ *  `num_blocks` is the number of NUM_THREADS blocks for the tile array,
+ *  and `scratch` must have room for that many values.
  */
-template <unsigned DIMENSION>
-__global__
-void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
-                   int32_t* const __restrict__ image,
+static void compact_tiles(TileNode* const in_tiles,
+                          const int32_t* in_tile_count,
+                          const int32_t num_blocks,
+                          int32_t* const scratch,
+                          int32_t* const num_active_tiles,
+                          cudaStream_t stream)
+{
+    count_active_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        in_tiles, in_tile_count, scratch);
+    scan_active_tiles<<<1, NUM_THREADS, 0, stream>>>(
+        scratch, num_blocks, num_active_tiles);
+    assign_next_nodes<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        in_tiles, in_tile_count, scratch);
+}
+
+/*
+ *  count_next_tiles
+ *
+ *  Converts the number of active tiles (counted by `compact_tiles`)
+ *  into the number of tiles in the next stage, which is `subdivision` times
+ *  larger (or equal, before per-voxel evaluation).
+ *
+ *  The result is clamped to `capacity`, the size of the next stage's tile
+ *  array, and the unclamped value is written to `wanted`.  The eager render
+ *  path resizes the tile array before calling this, so clamping only happens
+ *  when replaying a CUDA graph, where the host checks `wanted` afterwards.
+ */
+__global__
+void count_next_tiles(const int32_t* __restrict__ const num_active_tiles,
+                      const int32_t subdivision,
+                      const int32_t capacity,
+                      int32_t* __restrict__ const next_count,
+                      int32_t* __restrict__ const wanted)
+{
+    const int32_t n = *num_active_tiles * subdivision;
+    *wanted = n;
+    *next_count = (n < capacity) ? n : capacity;
+}
+
+/*
+ *  subdivide_active_tiles
+ *
+ *  For each active tile in `in_tiles`, unpack it into 64 subtiles in
+ *  `out_tiles` (or `split`^3 subtiles in 3D, where `split` is the number of
+ *  subtiles per side, since the 3D tile hierarchy is configurable).
+ *  Subtiles are tightly packed using `next` indices assigned in
+ *  `assign_next_nodes`, so they're stored in the same order as their
+ *  parents (and siblings are contiguous).
+ *
+ *  Subtiles inherit the `tape` value from their parent tiles, since they're
+ *  contained within the parent and can reuse its tape.  They are assigned
+ *  `next` = -1, because we don't yet know whether they have children.
+ *
+ *  Subtiles past `out_tile_capacity` are dropped (see `count_next_tiles`).
+ */
+__global__
+void subdivide_active_tiles_3d(
+        const TileNode* const __restrict__ in_tiles,
+        const int32_t* __restrict__ in_tile_count,
+        const int32_t tiles_per_side,
+        const int32_t split,
+        TileNode* const __restrict__ out_tiles,
+        const int32_t out_tile_capacity)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t subtile_count = split * split * split;
+    const int32_t subtile_index = index % subtile_count;
+    const int32_t tile_index = index / subtile_count;
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
+        return;
+    }
+
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int32_t subtiles_per_side = tiles_per_side * split;
+
+    const int4 sub = unpack(subtile_index, split);
+    const int32_t sx = pos.x * split + sub.x;
+    const int32_t sy = pos.y * split + sub.y;
+    const int32_t sz = pos.z * split + sub.z;
+    const int32_t next_tile =
+        sx +
+        sy * subtiles_per_side +
+        sz * subtiles_per_side * subtiles_per_side;
+
+    const int t = in_tiles[tile_index].next * subtile_count + subtile_index;
+    if (t >= out_tile_capacity) {
+        return;
+    }
+    out_tiles[t].position = next_tile;
+    out_tiles[t].tape = in_tiles[tile_index].tape;
+    out_tiles[t].next = -1;
+    out_tiles[t].batch = in_tiles[tile_index].batch;
+}
+
+/*  In 2D, each active tile is also copied into `layers` consecutive layers
+ *  (with `batch` set to the layer), so that one tile (and its tape) from
+ *  the first stage can be shared by a stack of slices. */
+__global__
+void subdivide_active_tiles_2d(
+        const TileNode* const __restrict__ in_tiles,
+        const int32_t* __restrict__ in_tile_count,
+        const int32_t tiles_per_side,
+        const int32_t layers,
+        TileNode* const __restrict__ out_tiles,
+        const int32_t out_tile_capacity)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t subtile_index = index % 64;
+    const int32_t layer = (index / 64) % layers;
+    const int32_t tile_index = index / (64 * layers);
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
+        return;
+    }
+
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    assert(pos.z == 0);
+    const int32_t subtiles_per_side = tiles_per_side * 8;
+
+    const int4 sub = unpack(subtile_index, 8);
+    const int32_t sx = pos.x * 8 + sub.x;
+    const int32_t sy = pos.y * 8 + sub.y;
+    const int32_t next_tile = sx + sy * subtiles_per_side;
+
+    const int t = (in_tiles[tile_index].next * layers + layer) * 64 +
+                  subtile_index;
+    if (t >= out_tile_capacity) {
+        return;
+    }
+    out_tiles[t].position = next_tile;
+    out_tiles[t].tape = in_tiles[tile_index].tape;
+    out_tiles[t].next = -1;
+    out_tiles[t].batch = in_tiles[tile_index].batch + layer;
+}
+
+/*
+ *  copy_active_tiles
+ *
+ *  For each active tile in `in_tiles`, copy it into `out_tiles`.  This
+ *  operation turns a sparse array of active tiles into a tightly packed array.
+ *
+ *  This is used right before per-pixel evaluation, which wants a compact list
+ *  of active tiles, but doesn't want them to be subdivided by 64.
+ *
+ *  Tiles keep the `tape` value when copied, but `next` is assigned to -1
+ *  (since we're at the bottom of the evaluation stack).
+ */
+__global__
+void copy_active_tiles(TileNode* const __restrict__ in_tiles,
+                       const int32_t* __restrict__ in_tile_count,
+                       TileNode* const __restrict__ out_tiles,
+                       const int32_t out_tile_capacity)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
+        return;
+    }
+    const int t = in_tiles[tile_index].next;
+    if (t >= out_tile_capacity) {
+        return;
+    }
+    out_tiles[t].position = in_tiles[tile_index].position;
+    out_tiles[t].tape = in_tiles[tile_index].tape;
+    out_tiles[t].next = -1;
+    out_tiles[t].batch = in_tiles[tile_index].batch;
+    in_tiles[tile_index].next = -1;
+}
+
+/*
+ *  expand_leaf_tiles
+ *
+ *  Unpacks each of the `leaf_count` tiles in `leaf_tiles` (which were sent
+ *  straight to the voxel stage by eval_tiles_i) into `split`^3 voxel tiles
+ *  (i.e. 4^3 tiles) in `out_tiles`, starting at index `offset`.  As in
+ *  subdivide_active_tiles_3d, the voxel tiles inherit their leaf's tape;
+ *  leaves are stored back to back, so every leaf must be the same size.
+ */
+__global__
+void expand_leaf_tiles(const TileNode* const __restrict__ leaf_tiles,
+                       const int32_t leaf_count,
+                       const int32_t tiles_per_side,
+                       const int32_t split,
+                       TileNode* const __restrict__ out_tiles,
+                       const int32_t offset)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t subtile_count = split * split * split;
+    const int32_t leaf_index = index / subtile_count;
+    if (leaf_index >= leaf_count) {
+        return;
+    }
+
+    const int4 pos = unpack(leaf_tiles[leaf_index].position, tiles_per_side);
+    const int4 sub = unpack(index % subtile_count, split);
+    const int32_t subtiles_per_side = tiles_per_side * split;
+    const int32_t t = offset + index;
+    out_tiles[t].position = (pos.x * split + sub.x) +
+                            (pos.y * split + sub.y) * subtiles_per_side +
+                            (pos.z * split + sub.z) * subtiles_per_side *
+                                                      subtiles_per_side;
+    out_tiles[t].tape = leaf_tiles[leaf_index].tape;
+    out_tiles[t].next = -1;
+    out_tiles[t].batch = leaf_tiles[leaf_index].batch;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  copy_filled
+ *
+ *  Copies a lower-resolution (4x undersampled) image into a higher-resolution
+ *  image, expanding every active (non-zero) "pixel" by 4x.
+ *
+ *  The higher-resolution image must be empty (all 0) when this is called;
+ *  no comparison of Z values is done.
+ *
+ *  In 3D, the z index of the block selects a layer of a batch render, and the
+ *  lower-resolution image is undersampled by `split` rather than 4x (with Z
+ *  values scaled to match).
+ */
+__global__
+void copy_filled_3d(const int32_t* __restrict__ prev,
+                    int32_t* __restrict__ image,
+                    const int32_t image_size_px,
+                    const int32_t split)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    prev += blockIdx.z * (image_size_px / split) * (image_size_px / split);
+    image += blockIdx.z * image_size_px * image_size_px;
+
+    if (x < image_size_px && y < image_size_px) {
+        int32_t t = prev[x / split + y / split * (image_size_px / split)];
+        if (t) {
+            image[x + y * image_size_px] = t * split + split - 1;
+        }
+    }
+}
+
+/*
+ *  seed_filled_3d
+ *
+ *  Marks every pixel of a stage's (volume_size_px / tile_size_px)^2 image as
+ *  occluded if all of the volume_size_px^2 pixels that it covers are set in
+ *  `mask`, so that every tile in that column is skipped.  This is used when
+ *  rendering a volume in pieces (see Context::renderTiled3D).
+ *
+ *  Occluded pixels are set to a Z value past the top of the volume, which
+ *  masks out every tile, but can't be confused with a real result.
+ */
+__global__
+void seed_filled_3d(const int32_t* __restrict__ mask,
+                    int32_t* __restrict__ image,
+                    const int32_t volume_size_px,
+                    const int32_t tile_size_px)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    const int32_t image_size_px = volume_size_px / tile_size_px;
+    if (x >= image_size_px || y >= image_size_px) {
+        return;
+    }
+
+    for (int32_t j=0; j < tile_size_px; ++j) {
+        for (int32_t i=0; i < tile_size_px; ++i) {
+            const int32_t px = x * tile_size_px + i;
+            const int32_t py = y * tile_size_px + j;
+            if (!mask[px + py * volume_size_px]) {
+                return;
+            }
+        }
+    }
+    image[x + y * image_size_px] = image_size_px;
+}
+
+/*
+ *  preview_tiles_3d / expand_preview_3d
+ *
+ *  Draws the top faces of a partially-rendered stage's unfinished tiles
+ *  into a pixel image, as a blocky stand-in for the surface which they
+ *  may contain (see Context::renderProgressive).
+ *
+ *  preview_tiles_3d marks each of the `count` tiles in its column of the
+ *  (tiles_per_side)^2 image `tops`, storing Z + 1 (so that 0 stays empty);
+ *  expand_preview_3d then raises each pixel of `image` to the top of the
+ *  highest tile above it, where `split` is the tile size in pixels.
+ */
+__global__
+void preview_tiles_3d(const TileNode* const __restrict__ tiles,
+                      const int32_t count,
+                      const int32_t tiles_per_side,
+                      int32_t* __restrict__ tops)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= count) {
+        return;
+    }
+    const int4 pos = unpack(tiles[tile_index].position, tiles_per_side);
+    atomicMax(&tops[pos.w], pos.z + 1);
+}
+
+__global__
+void expand_preview_3d(const int32_t* __restrict__ tops,
+                       int32_t* __restrict__ image,
+                       const int32_t image_size_px,
+                       const int32_t split)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+
+    if (x < image_size_px && y < image_size_px) {
+        const int32_t t = tops[x / split + y / split * (image_size_px / split)];
+        if (t) {
+            const int32_t h = (t - 1) * split + split - 1;
+            int32_t& p = image[x + y * image_size_px];
+            if (h > p) {
+                p = h;
+            }
+        }
+    }
+}
+
+/*  Returns the height of a pixel for preview_normals, falling back to `h`
+ *  for pixels that are empty, masked, or outside of the image */
+__device__ inline
+float preview_height(const int32_t* __restrict__ image,
+                     const int32_t x, const int32_t y,
+                     const int32_t image_size_px, const int32_t h)
+{
+    if (x < 0 || y < 0 || x >= image_size_px || y >= image_size_px) {
+        return h;
+    }
+    const int32_t p = image[x + y * image_size_px];
+    return (p && p < image_size_px) ? p : h;
+}
+
+/*
+ *  preview_normals
+ *
+ *  Estimates normals from the slope of the depth image, for previews
+ *  where the tape hasn't been evaluated at every visible pixel.  `nm` is
+ *  the inverse transpose of the view matrix's upper 3x3 block, which takes
+ *  screen-space gradients into the tape's coordinates, so that normals are
+ *  packed exactly like the ones from eval_normal_d.
+ */
+__global__
+void preview_normals(const int32_t* __restrict__ image,
+                     uint32_t* __restrict__ normals,
+                     const int32_t image_size_px,
+                     const Eigen::Matrix3f nm)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    if (x >= image_size_px || y >= image_size_px) {
+        return;
+    }
+    const int32_t h = image[x + y * image_size_px];
+    if (!h || h >= image_size_px) {
+        return;
+    }
+
+    const float gx = (preview_height(image, x + 1, y, image_size_px, h) -
+                      preview_height(image, x - 1, y, image_size_px, h)) / 2;
+    const float gy = (preview_height(image, x, y + 1, image_size_px, h) -
+                      preview_height(image, x, y - 1, image_size_px, h)) / 2;
+    float n[3];
+    for (unsigned i=0; i < 3; ++i) {
+        n[i] = nm(i, 0) * -gx + nm(i, 1) * -gy + nm(i, 2);
+    }
+    const float norm = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    const uint8_t dx = (n[0] / norm) * 127 + 128;
+    const uint8_t dy = (n[1] / norm) * 127 + 128;
+    const uint8_t dz = (n[2] / norm) * 127 + 128;
+    normals[x + y * image_size_px] =
+        (0xFF << 24) | (dz << 16) | (dy << 8) | dx;
+}
+
+/*  Stores a host-side tile count on the GPU, for kernels which read their
+ *  count from device memory (so that they can be run on part of a list) */
+__global__
+void store_tile_count(int32_t* __restrict__ out, const int32_t count)
+{
+    *out = count;
+}
+
+/*  Expands the previous level's 2D image into the next level's image (which
+ *  is 8x larger on each side).  Every pixel is written, empty or not, so the
+ *  next level's image doesn't need to be cleared beforehand.
+ *
+ *  The z index of the block selects a layer of a stack of slices, where
+ *  the previous level's layers are `prev_layer_size` apart (which is 0 if
+ *  every layer shares one image). */
+__global__
+void copy_filled_2d(const int32_t* __restrict__ prev,
+                    int32_t* __restrict__ image,
+                    const int32_t image_size_px,
+                    const int32_t prev_layer_size)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    prev += blockIdx.z * prev_layer_size;
+    image += blockIdx.z * image_size_px * image_size_px;
+
+    if (x < image_size_px && y < image_size_px) {
+        image[x + y * image_size_px] =
+            prev[x / 8 + y / 8 * (image_size_px / 8)] != 0;
+    }
+}
+
+/*  Equivalent to copy_filled_2d, but writes into a 1-bit-per-pixel image
+ *  (see Context::filled_2d).  Each thread builds one 64-bit word (which
+ *  covers eight of the previous level's tiles) and writes it in one go. */
+__global__
+void copy_filled_2d_packed(const int32_t* __restrict__ prev,
+                           uint64_t* __restrict__ bits,
+                           const int32_t image_size_px,
+                           const int32_t prev_layer_size)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    const int32_t words_per_row = image_size_px / 64;
+    prev += blockIdx.z * prev_layer_size;
+    bits += blockIdx.z * words_per_row * image_size_px;
+
+    if (x < words_per_row && y < image_size_px) {
+        const int32_t* const row = &prev[x * 8 + y / 8 * (image_size_px / 8)];
+        uint64_t word = 0;
+        for (unsigned i=0; i < 8; ++i) {
+            if (row[i]) {
+                word |= 0xFFull << (i * 8);
+            }
+        }
+        bits[x + y * words_per_row] = word;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  calculate_voxels
+ *
+ *  For a given set of input tiles, each is divided into 64 voxels.  Each
+ *  voxel's position in (orthographic, screen-aligned, +/-1) render space is
+ *  transformed by `mat`, then written to the `values` array.
+ *
+ *  For efficiency, we actually calculate two voxels per thread and store them
+ *  in a float2, i.e. data is packed as
+ *  [x0 x1 | y0 y1 | z0 z1 | x2 x3 | y2 y3 | z2 z3 | ...]
+ */
+__device__ inline
+void calculate_voxel(const TileNode* const __restrict__ in_tiles,
+                     const int32_t voxel_index,
+                     const uint32_t tiles_per_side,
+                     const Eigen::Matrix4f& mat,
+                     float2* const __restrict__ values)
+{
+    const int32_t tile_index = voxel_index / 32;
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int4 sub = unpack(threadIdx.x % 32, 4);
+
+    const int32_t px = pos.x * 4 + sub.x;
+    const int32_t py = pos.y * 4 + sub.y;
+    const int32_t pz_a = pos.z * 4 + sub.z;
+
+    const float size_recip = 1.0f / (tiles_per_side * 4);
+
+    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fz_a = ((pz_a + 0.5f) * size_recip - 0.5f) * 2.0f;
+
+    // Otherwise, calculate the X/Y/Z values
+    const float fw_a = mat(3, 0) * fx +
+                       mat(3, 1) * fy +
+                       mat(3, 2) * fz_a + mat(3, 3);
+    for (unsigned i=0; i < 3; ++i) {
+        values[voxel_index * 3 + i].x =
+            (mat(i, 0) * fx +
+             mat(i, 1) * fy +
+             mat(i, 2) * fz_a + mat(i, 3)) / fw_a;
+    }
+
+    // Do the same calculation for the second pixel
+    const int32_t pz_b = pz_a + 2;
+    const float fz_b = ((pz_b + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fw_b = mat(3, 0) * fx +
+                       mat(3, 1) * fy +
+                       mat(3, 2) * fz_b + mat(3, 3);
+
+    for (unsigned i=0; i < 3; ++i) {
+        values[voxel_index * 3 + i].y =
+            (mat(i, 0) * fx +
+             mat(i, 1) * fy +
+             mat(i, 2) * fz_b + mat(i, 3)) / fw_b;
+    }
+}
+
+__global__
+void calculate_voxels(const TileNode* const __restrict__ in_tiles,
+                      const int32_t* __restrict__ in_tile_count,
+                      const uint32_t tiles_per_side,
+                      const Eigen::Matrix4f mat,
+                      float2* const __restrict__ values)
+{
+    // Each tile is executed by 32 threads (one for each pair of voxels).
+    //
+    // This is different from the eval_tiles_i function, which evaluates one
+    // tile per thread, because the tiles are already expanded by 64x by the
+    // time they're stored in the in_tiles list.
+    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = voxel_index / 32;
+
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    calculate_voxel(in_tiles, voxel_index, tiles_per_side, mat, values);
+}
+
+/*  Batched version of calculate_voxels, which picks each tile's matrix
+ *  from `mats` based on its `batch` index */
+__global__
+void calculate_voxels_batch(const TileNode* const __restrict__ in_tiles,
+                            const int32_t* __restrict__ in_tile_count,
+                            const uint32_t tiles_per_side,
+                            const Eigen::Matrix4f* __restrict__ mats,
+                            float2* const __restrict__ values)
+{
+    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = voxel_index / 32;
+
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    calculate_voxel(in_tiles, voxel_index, tiles_per_side,
+                    mats[in_tiles[tile_index].batch], values);
+}
+
+__global__
+void calculate_pixels(const TileNode* const __restrict__ in_tiles,
+                      const int32_t* __restrict__ in_tile_count,
+                      const uint32_t tiles_per_side,
+                      const Eigen::Matrix3f mat, float z,
+                      const float z_step,
+                      float2* const __restrict__ values)
+{
+    // Each tile is executed by 32 threads (one for each pair of voxels).
+    //
+    // This is different from the eval_tiles_i function, which evaluates one
+    // tile per thread, because the tiles are already expanded by 64x by the
+    // time they're stored in the in_tiles list.
+    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = voxel_index / 32;
+
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int4 sub = unpack(threadIdx.x % 32, 8);
+    z = fmaf(in_tiles[tile_index].batch, z_step, z);
+
+    const int32_t px = pos.x * 8 + sub.x;
+    const int32_t py_a = pos.y * 8 + sub.y;
+    assert(sub.y < 4);
+    assert(sub.z == 0);
+
+    const float size_recip = 1.0f / (tiles_per_side * 8);
+
+    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fy_a = ((py_a + 0.5f) * size_recip - 0.5f) * 2.0f;
+
+    // Otherwise, calculate the X/Y/Z values
+    const float fw_a = mat(2, 0) * fx + mat(2, 1) * fy_a + mat(2, 2);
+    for (unsigned i=0; i < 2; ++i) {
+        values[voxel_index * 3 + i].x =
+            (mat(i, 0) * fx + mat(i, 1) * fy_a + mat(i, 2)) / fw_a;
+    }
+
+    // Do the same calculation for the second pixel
+    const int32_t py_b = py_a + 4;
+    const float fy_b = ((py_b + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fw_b = mat(2, 0) * fx + mat(2, 1) * fy_b + mat(2, 2);
+
+    for (unsigned i=0; i < 2; ++i) {
+        values[voxel_index * 3 + i].y =
+            (mat(i, 0) * fx + mat(i, 1) * fy_b + mat(i, 2)) / fw_b;
+    }
+
+    values[voxel_index * 3 + 2] = make_float2(z, z);
+}
+
+/*
+ *  eval_tape_f
+ *
+ *  Evaluates a tape on two points at once, with their X, Y, Z values already
+ *  loaded into `slots`.  Returns a pointer to the tape's final clause, whose
+ *  output slot holds the result.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__device__ inline
+const uint64_t* eval_tape_f(const uint64_t* __restrict__ data,
+                            float2 (&slots)[SLOTS])
+{
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm IMM(&d)
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = make_float2(lhs.x * lhs.x, lhs.y * lhs.y); break;
+            case GPU_OP_SQRT_LHS: out = make_float2(sqrtf(lhs.x), sqrtf(lhs.y)); break;
+            case GPU_OP_NEG_LHS: out = make_float2(-lhs.x, -lhs.y); break;
+            case GPU_OP_SIN_LHS: out = make_float2(sinf(lhs.x), sinf(lhs.y)); break;
+            case GPU_OP_COS_LHS: out = make_float2(cosf(lhs.x), cosf(lhs.y)); break;
+            case GPU_OP_ASIN_LHS: out = make_float2(asinf(lhs.x), asinf(lhs.y)); break;
+            case GPU_OP_ACOS_LHS: out = make_float2(acosf(lhs.x), acosf(lhs.y)); break;
+            case GPU_OP_ATAN_LHS: out = make_float2(atanf(lhs.x), atanf(lhs.y)); break;
+            case GPU_OP_EXP_LHS: out = make_float2(expf(lhs.x), expf(lhs.y)); break;
+            case GPU_OP_ABS_LHS: out = make_float2(fabsf(lhs.x), fabsf(lhs.y)); break;
+            case GPU_OP_LOG_LHS: out = make_float2(logf(lhs.x), logf(lhs.y)); break;
+            case GPU_OP_TAN_LHS: out = make_float2(tanf(lhs.x), tanf(lhs.y)); break;
+            case GPU_OP_RECIP_LHS: out = make_float2(1.0f / lhs.x, 1.0f / lhs.y); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = make_float2(lhs.x + imm, lhs.y + imm); break;
+            case GPU_OP_ADD_LHS_RHS: out = make_float2(lhs.x + rhs.x, lhs.y + rhs.y); break;
+            case GPU_OP_MUL_LHS_IMM: out = make_float2(lhs.x * imm, lhs.y * imm); break;
+            case GPU_OP_MUL_LHS_RHS: out = make_float2(lhs.x * rhs.x, lhs.y * rhs.y); break;
+            case GPU_OP_MIN_LHS_IMM: out = make_float2(fminf(lhs.x, imm), fminf(lhs.y, imm)); break;
+            case GPU_OP_MIN_LHS_RHS: out = make_float2(fminf(lhs.x, rhs.x), fminf(lhs.y, rhs.y)); break;
+            case GPU_OP_MAX_LHS_IMM: out = make_float2(fmaxf(lhs.x, imm), fmaxf(lhs.y, imm)); break;
+            case GPU_OP_MAX_LHS_RHS: out = make_float2(fmaxf(lhs.x, rhs.x), fmaxf(lhs.y, rhs.y)); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = make_float2(lhs.x - imm, lhs.y - imm); break;
+            case GPU_OP_SUB_IMM_RHS: out = make_float2(imm - rhs.x, imm - rhs.y); break;
+            case GPU_OP_SUB_LHS_RHS: out = make_float2(lhs.x - rhs.x, lhs.y - rhs.y); break;
+
+            case GPU_OP_DIV_LHS_IMM: out = make_float2(lhs.x / imm, lhs.y / imm); break;
+            case GPU_OP_DIV_IMM_RHS: out = make_float2(imm / rhs.x, imm / rhs.y); break;
+            case GPU_OP_DIV_LHS_RHS: out = make_float2(lhs.x / rhs.x, lhs.y / rhs.y); break;
+            case GPU_OP_ATAN2_LHS_IMM: out = make_float2(atan2f(lhs.x, imm), atan2f(lhs.y, imm)); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = make_float2(atan2f(imm, rhs.x), atan2f(imm, rhs.y)); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = make_float2(atan2f(lhs.x, rhs.x), atan2f(lhs.y, rhs.y)); break;
+            case GPU_OP_MOD_LHS_IMM: out = make_float2(mod(lhs.x, imm), mod(lhs.y, imm)); break;
+            case GPU_OP_MOD_IMM_RHS: out = make_float2(mod(imm, rhs.x), mod(imm, rhs.y)); break;
+            case GPU_OP_MOD_LHS_RHS: out = make_float2(mod(lhs.x, rhs.x), mod(lhs.y, rhs.y)); break;
+            case GPU_OP_POW_LHS_IMM: out = make_float2(powf(lhs.x, imm), powf(lhs.y, imm)); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = make_float2(nth_root(lhs.x, imm), nth_root(lhs.y, imm)); break;
+
+            // Fused opcodes
+            case GPU_OP_FMA_LHS_IMM_RHS: out = make_float2(fmaf(lhs.x, imm, rhs.x), fmaf(lhs.y, imm, rhs.y)); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = make_float2(fmaf(lhs.x, lhs.x, rhs.x), fmaf(lhs.y, lhs.y, rhs.y)); break;
+            case GPU_OP_DIFF_SQUARE_LHS_IMM: out = make_float2((lhs.x - imm) * (lhs.x - imm), (lhs.y - imm) * (lhs.y - imm)); break;
+            case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS: out = make_float2(fmaf(lhs.x - imm, lhs.x - imm, rhs.x), fmaf(lhs.y - imm, lhs.y - imm, rhs.y)); break;
+
+            case GPU_OP_COPY_IMM: out = make_float2(imm, imm); break;
+            case GPU_OP_COPY_LHS: out = make_float2(lhs.x, lhs.y); break;
+            case GPU_OP_COPY_RHS: out = make_float2(rhs.x, rhs.y); break;
+
+#undef lhs
+#undef rhs
+#undef imm
+#undef out
+        }
+    }
+    return data;
+}
+
+/*
+ *  eval_tape_h
+ *
+ *  Evaluates a tape on two points at once in half precision, with their
+ *  X, Y, Z values already loaded into `slots` as packed half2 values.
+ *  Operations without a fast half2 form are evaluated in fp32 and rounded
+ *  back down.  Returns a pointer to the tape's final clause, whose output
+ *  slot holds the result.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__device__ inline
+const uint64_t* eval_tape_h(const uint64_t* __restrict__ data,
+                            __half2 (&slots)[SLOTS])
+{
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm __float2half2_rn(IMM(&d))
+#define out slots[I_OUT(&d)]
+
+// Opcodes without a half2 intrinsic are evaluated in fp32
+#define lhs_f __half22float2(lhs)
+#define rhs_f __half22float2(rhs)
+#define imm_f make_float2(IMM(&d), IMM(&d))
+#define F32_1(f, A) { const float2 a = A;                                   \
+                      out = __floats2half2_rn(f(a.x), f(a.y)); break; }
+#define F32(f, A, B) { const float2 a = A; const float2 b = B;              \
+                       out = __floats2half2_rn(f(a.x, b.x), f(a.y, b.y));   \
+                       break; }
+
+            case GPU_OP_SQUARE_LHS: out = __hmul2(lhs, lhs); break;
+            case GPU_OP_SQRT_LHS: out = h2sqrt(lhs); break;
+            case GPU_OP_NEG_LHS: out = __hneg2(lhs); break;
+            case GPU_OP_SIN_LHS: out = h2sin(lhs); break;
+            case GPU_OP_COS_LHS: out = h2cos(lhs); break;
+            case GPU_OP_ASIN_LHS: F32_1(asinf, lhs_f)
+            case GPU_OP_ACOS_LHS: F32_1(acosf, lhs_f)
+            case GPU_OP_ATAN_LHS: F32_1(atanf, lhs_f)
+            case GPU_OP_EXP_LHS: out = h2exp(lhs); break;
+            case GPU_OP_ABS_LHS: out = __hmax2(lhs, __hneg2(lhs)); break;
+            case GPU_OP_LOG_LHS: out = h2log(lhs); break;
+            case GPU_OP_TAN_LHS: F32_1(tanf, lhs_f)
+            case GPU_OP_RECIP_LHS: out = h2rcp(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = __hadd2(lhs, imm); break;
+            case GPU_OP_ADD_LHS_RHS: out = __hadd2(lhs, rhs); break;
+            case GPU_OP_MUL_LHS_IMM: out = __hmul2(lhs, imm); break;
+            case GPU_OP_MUL_LHS_RHS: out = __hmul2(lhs, rhs); break;
+            case GPU_OP_MIN_LHS_IMM: out = __hmin2(lhs, imm); break;
+            case GPU_OP_MIN_LHS_RHS: out = __hmin2(lhs, rhs); break;
+            case GPU_OP_MAX_LHS_IMM: out = __hmax2(lhs, imm); break;
+            case GPU_OP_MAX_LHS_RHS: out = __hmax2(lhs, rhs); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = __hsub2(lhs, imm); break;
+            case GPU_OP_SUB_IMM_RHS: out = __hsub2(imm, rhs); break;
+            case GPU_OP_SUB_LHS_RHS: out = __hsub2(lhs, rhs); break;
+
+            case GPU_OP_DIV_LHS_IMM: out = __h2div(lhs, imm); break;
+            case GPU_OP_DIV_IMM_RHS: out = __h2div(imm, rhs); break;
+            case GPU_OP_DIV_LHS_RHS: out = __h2div(lhs, rhs); break;
+            case GPU_OP_ATAN2_LHS_IMM: F32(atan2f, lhs_f, imm_f)
+            case GPU_OP_ATAN2_IMM_RHS: F32(atan2f, imm_f, rhs_f)
+            case GPU_OP_ATAN2_LHS_RHS: F32(atan2f, lhs_f, rhs_f)
+            case GPU_OP_MOD_LHS_IMM: F32(mod, lhs_f, imm_f)
+            case GPU_OP_MOD_IMM_RHS: F32(mod, imm_f, rhs_f)
+            case GPU_OP_MOD_LHS_RHS: F32(mod, lhs_f, rhs_f)
+            case GPU_OP_POW_LHS_IMM: F32(powf, lhs_f, imm_f)
+            case GPU_OP_NTH_ROOT_LHS_IMM: F32(nth_root, lhs_f, imm_f)
+
+            // Fused opcodes
+            case GPU_OP_FMA_LHS_IMM_RHS: out = __hfma2(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = __hfma2(lhs, lhs, rhs); break;
+            case GPU_OP_DIFF_SQUARE_LHS_IMM: {
+                const __half2 v = __hsub2(lhs, imm);
+                out = __hmul2(v, v);
+                break;
+            }
+            case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS: {
+                const __half2 v = __hsub2(lhs, imm);
+                out = __hfma2(v, v, rhs);
+                break;
+            }
+
+            case GPU_OP_COPY_IMM: out = imm; break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+
+#undef F32_1
+#undef F32
+#undef lhs_f
+#undef rhs_f
+#undef imm_f
+#undef lhs
+#undef rhs
+#undef imm
+#undef out
+        }
+    }
+    return data;
+}
+
+/*
+ *  eval_voxels_f
+ *
+ *  Evaluates the 64 voxels which make up every tile in `in_tiles` (of which
+ *  there should be `in_tile_count`.  This must be called after
+ *  `calculate_voxels`, which writes voxel positions to the `values` array.
+ *
+ *  For efficiency, this function calculates two voxels per thread, reading and
+ *  writing float2 data (which improves memory access patterns).
+ *
+ *  Filled voxels are written to `image`, using atomic operations to accumulate
+ *  the voxel with the tallest Z value.
+ *
+ *  In 3D, if `occupancy` is not null, then each tile's 64 voxels are instead
+ *  written to `occupancy[tile_index]` as a bitmask (with voxel (x, y, z) at
+ *  bit x + y * 4 + z * 16), and no voxels are skipped by the image.  In 2D,
+ *  a non-null `occupancy` is a 1-bit-per-pixel image (see Context::filled_2d)
+ *  which is written instead of `image`, one row of each tile at a time.
+ *
+ *  If `HALF` is true, then each pair of voxels is evaluated as a packed half2
+ *  (with eval_tape_h), which doubles arithmetic throughput on GPUs with fast
+ *  fp16 math.  Pairs where either result is within `half_tolerance` of zero
+ *  (or isn't finite) are re-evaluated in fp32, so voxels near the surface
+ *  keep the sign that a full-precision render would give them.
+ *
+ *  If `jit` is true, then tiles which are still on the root tape were
+ *  already evaluated by JitTape::evalVoxels, which left each pair's result
+ *  in place of its X values, so they're only written out here.
+ *
+ *  When built with MPR_RENDER_STATS, statistics are recorded in `stats`.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.  `TILES` is
+ *  the number of tiles per block, so blocks have TILES * 32 threads.
+ */
+template <unsigned DIMENSION, int SLOTS, int TILES, bool HALF>
+__global__ __launch_bounds__(TILES * 32)
+void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
+                   int32_t* __restrict__ image,
                    const uint32_t tiles_per_side,
 
-                   TileNode* const __restrict__ in_tiles,
-                   const int32_t in_tile_count,
+                   TileNode* const __restrict__ in_tiles,
+                   const int32_t* __restrict__ in_tile_count,
+
+                   const float2* const __restrict__ values,
+                   const bool jit,
+
+                   uint64_t* __restrict__ occupancy,
+
+                   const float half_tolerance,
+
+                   const StatsSink stats)
+{
+    // Each tile is executed by 32 threads (one for each pair of voxels, so
+    // we can do all of our load/stores as float2s and make memory happier).
+    //
+    // This is different from the eval_tiles_i function, which evaluates one
+    // tile per thread, because the tiles are already expanded by 64x by the
+    // time they're stored in the in_tiles list.
+    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = voxel_index / 32;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+
+    // Batch renders store one image per layer
+    {
+        const int32_t side = tiles_per_side * ((DIMENSION == 3) ? 4 : 8);
+        image += in_tiles[tile_index].batch * side * side;
+        if (DIMENSION == 2 && occupancy) {
+            occupancy += in_tiles[tile_index].batch * side * side / 64;
+        }
+    }
+
+#ifdef MPR_RENDER_STATS
+    if (stats.stage && threadIdx.x % 32 == 0) {
+        atomicAdd(&stats.stage->tiles, 1);
+    }
+#endif
+
+    // Check whether this pixel is masked in the output image.  When building
+    // an occupancy mask, every voxel is needed (and the whole warp must stay
+    // active for the ballots below).
+    if (DIMENSION == 3 && !occupancy) {
+        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+        const int4 sub = unpack(threadIdx.x % 32, 4);
+
+        const int32_t px = pos.x * 4 + sub.x;
+        const int32_t py = pos.y * 4 + sub.y;
+        const int32_t pz = pos.z * 4 + sub.z;
+
+        // Early return if this pixel won't ever be filled
+        if (image[px + py * tiles_per_side * 4] >= pz + 2) {
+#ifdef MPR_RENDER_STATS
+            if (stats.stage) {
+                atomicAdd(&stats.stage->masked, 2);
+            }
+#endif
+            return;
+        }
+    }
+
+    // Pick out the tape based on the pointer stored in the tiles list
+    const uint64_t* const __restrict__ tape =
+        &tape_data[in_tiles[tile_index].tape];
+    const bool compiled = jit && !in_tiles[tile_index].tape;
+    float2 result;
+    bool exact = !compiled;
+    if (compiled) {
+        result = values[voxel_index * 3];
+    } else if (HALF) {
+        __half2 slots[SLOTS];
+        slots[((const uint8_t*)tape)[1]] =
+            __float22half2_rn(values[voxel_index * 3]);
+        slots[((const uint8_t*)tape)[2]] =
+            __float22half2_rn(values[voxel_index * 3 + 1]);
+        slots[((const uint8_t*)tape)[3]] =
+            __float22half2_rn(values[voxel_index * 3 + 2]);
+
+        const uint64_t* const data = eval_tape_h(tape, slots);
+        result = __half22float2(slots[I_OUT(data)]);
+
+        // Overflow produces infinities or NaNs, which fail these checks
+        // (65504 is the largest finite fp16 value)
+        exact = !(fabsf(result.x) >= half_tolerance &&
+                  fabsf(result.y) >= half_tolerance &&
+                  fabsf(result.x) <= 65504.0f && fabsf(result.y) <= 65504.0f);
+    }
+    if (exact) {
+        float2 slots[SLOTS];
+        slots[((const uint8_t*)tape)[1]] = values[voxel_index * 3];
+        slots[((const uint8_t*)tape)[2]] = values[voxel_index * 3 + 1];
+        slots[((const uint8_t*)tape)[3]] = values[voxel_index * 3 + 2];
+
+        const uint64_t* const data = eval_tape_f(tape, slots);
+        result = slots[I_OUT(data)];
+    }
+#ifdef MPR_RENDER_STATS
+    if (stats.stage) {
+        const int32_t length = tape_length(tape);
+        atomicAdd((unsigned long long*)&stats.stage->clauses,
+                  2ull * length * ((HALF && exact) ? 2 : 1));
+        const int32_t filled = (result.x < 0.0f) + (result.y < 0.0f);
+        atomicAdd(&stats.stage->filled, filled);
+        atomicAdd(&stats.stage->empty, 2 - filled);
+        if (stats.heatmap) {
+            const int4 pos = unpack(in_tiles[tile_index].position,
+                                    tiles_per_side);
+            const int32_t side = stats.heatmap_size_px;
+            if (DIMENSION == 3) {
+                const int4 sub = unpack(threadIdx.x % 32, 4);
+                const int32_t px = pos.x * 4 + sub.x;
+                const int32_t py = pos.y * 4 + sub.y;
+                atomicAdd(&stats.heatmap[px + py * side], length);
+            } else {
+                const int4 sub = unpack(threadIdx.x % 32, 8);
+                const int32_t px = pos.x * 8 + sub.x;
+                const int32_t py = pos.y * 8 + sub.y;
+                atomicAdd(&stats.heatmap[px + py * side], length / 2.0f);
+                atomicAdd(&stats.heatmap[px + (py + 4) * side],
+                          length / 2.0f);
+            }
+        }
+    }
+#endif
+
+    // Check the result
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    if (DIMENSION == 3 && occupancy) {
+        // Each warp evaluates one tile, with the lower and upper halves of
+        // the tile in the x and y values, so two ballots cover every voxel
+        const uint64_t lower = __ballot_sync(0xFFFFFFFF, result.x < 0.0f);
+        const uint64_t upper = __ballot_sync(0xFFFFFFFF, result.y < 0.0f);
+        if (threadIdx.x % 32 == 0) {
+            occupancy[tile_index] = lower | (upper << 32);
+        }
+    } else if (DIMENSION == 3) {
+        const int4 sub = unpack(threadIdx.x % 32, 4);
+        // The second voxel is always higher in Z, so it masks the lower voxel
+        if (result.y < 0.0f) {
+            const int32_t px = pos.x * 4 + sub.x;
+            const int32_t py = pos.y * 4 + sub.y;
+            const int32_t pz = pos.z * 4 + sub.z + 2;
+
+            atomicMax(&image[px + py * tiles_per_side * 4], pz);
+        } else if (result.x < 0.0f) {
+            const int32_t px = pos.x * 4 + sub.x;
+            const int32_t py = pos.y * 4 + sub.y;
+            const int32_t pz = pos.z * 4 + sub.z;
+
+            atomicMax(&image[px + py * tiles_per_side * 4], pz);
+        }
+    } else if (DIMENSION == 2 && occupancy) {
+        // As above, the ballots store pixel (x, y) of the tile at bit
+        // x + y * 8, so each byte is one row of the tile.  Eight tiles share
+        // each word of the output, so the rows are merged in atomically.
+        const uint64_t lower = __ballot_sync(0xFFFFFFFF, result.x < 0.0f);
+        const uint64_t upper = __ballot_sync(0xFFFFFFFF, result.y < 0.0f);
+        const uint32_t row = threadIdx.x % 32;
+        if (row < 8) {
+            const uint64_t mask = (((row < 4) ? lower : upper)
+                                   >> ((row % 4) * 8)) & 0xFF;
+            if (mask) {
+                const int32_t words_per_row = tiles_per_side / 8;
+                atomicOr(reinterpret_cast<unsigned long long*>(
+                            &occupancy[pos.x / 8 +
+                                       (pos.y * 8 + row) * words_per_row]),
+                         (unsigned long long)(mask << ((pos.x % 8) * 8)));
+            }
+        }
+    } else if (DIMENSION == 2) {
+        const int4 sub = unpack(threadIdx.x % 32, 8);
+        if (result.y < 0.0f) {
+            const int32_t px = pos.x * 8 + sub.x;
+            const int32_t py = pos.y * 8 + sub.y + 4;
+
+            image[px + py * tiles_per_side * 8] = 1;
+        }
+        if (result.x < 0.0f) {
+            const int32_t px = pos.x * 8 + sub.x;
+            const int32_t py = pos.y * 8 + sub.y;
+
+            image[px + py * tiles_per_side * 8] = 1;
+        }
+    }
+}
+
+/*
+ *  copy_coverage_2d
+ *
+ *  Writes the coverage of every pixel in the image, from the (8x smaller)
+ *  image of filled 8^2 tiles: pixels in filled tiles are fully covered,
+ *  and every other pixel is empty until `eval_pixels_aa` runs.
+ */
+__global__
+void copy_coverage_2d(const int32_t* __restrict__ prev,
+                      float* __restrict__ coverage,
+                      const int32_t image_size_px)
+{
+    const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+
+    if (x < image_size_px && y < image_size_px) {
+        coverage[x + y * image_size_px] =
+            prev[x / 8 + y / 8 * (image_size_px / 8)] ? 1.0f : 0.0f;
+    }
+}
+
+/*
+ *  eval_pixels_aa
+ *
+ *  Estimates the coverage of every pixel in the ambiguous 8^2 tiles of
+ *  `in_tiles`, by evaluating a `grid` x `grid` pattern of subsamples with
+ *  each tile's pushed tape.  As in `calculate_pixels`, each tile is handled
+ *  by 32 threads, and each thread owns two pixels (four rows apart), whose
+ *  subsamples are evaluated together as a float2.
+ *
+ *  The fraction of subsamples inside the shape is written to `coverage`.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__global__
+void eval_pixels_aa(const uint64_t* const __restrict__ tape_data,
+                    const TileNode* const __restrict__ in_tiles,
+                    const int32_t* __restrict__ in_tile_count,
+                    const uint32_t tiles_per_side,
+                    const Eigen::Matrix3f mat, const float z,
+                    const int32_t grid,
+                    float* const __restrict__ coverage)
+{
+    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = voxel_index / 32;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+
+    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int4 sub = unpack(threadIdx.x % 32, 8);
+    const int32_t image_size_px = tiles_per_side * 8;
+    const int32_t px = pos.x * 8 + sub.x;
+    const int32_t py = pos.y * 8 + sub.y; // the second pixel is at py + 4
+    const float size_recip = 1.0f / image_size_px;
+
+    const uint64_t* const __restrict__ tape =
+        &tape_data[in_tiles[tile_index].tape];
+    int32_t inside_a = 0;
+    int32_t inside_b = 0;
+    for (int32_t j=0; j < grid; ++j) {
+        const float dy = (j + 0.5f) / grid;
+        const float fy_a = ((py + dy) * size_recip - 0.5f) * 2.0f;
+        const float fy_b = ((py + 4 + dy) * size_recip - 0.5f) * 2.0f;
+        for (int32_t i=0; i < grid; ++i) {
+            const float fx =
+                ((px + (i + 0.5f) / grid) * size_recip - 0.5f) * 2.0f;
+            const float fw_a = mat(2, 0) * fx + mat(2, 1) * fy_a + mat(2, 2);
+            const float fw_b = mat(2, 0) * fx + mat(2, 1) * fy_b + mat(2, 2);
+
+            float2 slots[SLOTS];
+            for (unsigned k=0; k < 2; ++k) {
+                slots[((const uint8_t*)tape)[k + 1]] = make_float2(
+                    (mat(k, 0) * fx + mat(k, 1) * fy_a + mat(k, 2)) / fw_a,
+                    (mat(k, 0) * fx + mat(k, 1) * fy_b + mat(k, 2)) / fw_b);
+            }
+            slots[((const uint8_t*)tape)[3]] = make_float2(z, z);
+
+            const uint64_t* const data = eval_tape_f(tape, slots);
+            const float2 result = slots[I_OUT(data)];
+            inside_a += result.x < 0.0f;
+            inside_b += result.y < 0.0f;
+        }
+    }
+
+    const float scale = 1.0f / (grid * grid);
+    coverage[px + py * image_size_px] = inside_a * scale;
+    coverage[px + (py + 4) * image_size_px] = inside_b * scale;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  count_leaf_columns, bucket_leaf_columns, sort_leaf_columns
+ *
+ *  Sort the active 4^3 tiles in `in_tiles` into buckets by (x, y) column
+ *  for trace_voxels_3d.  count_leaf_columns counts the tiles in each column
+ *  into `columns`, which scan_active_tiles then turns into the starting
+ *  offset of each column's bucket.  bucket_leaf_columns writes each tile's
+ *  index into its bucket in `column_tiles`, advancing the offsets as it
+ *  goes, so that `columns[c]` ends up as the end of column c's bucket (and
+ *  the start of column c + 1's).  Finally, sort_leaf_columns sorts each
+ *  bucket from front to back (by descending Z), with one thread per column.
+ */
+__global__
+void count_leaf_columns(const TileNode* const __restrict__ in_tiles,
+                        const int32_t* __restrict__ in_tile_count,
+                        const uint32_t tiles_per_side,
+                        int32_t* const __restrict__ columns)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const int32_t position = in_tiles[tile_index].position;
+    if (position != -1) {
+        atomicAdd(&columns[unpack(position, tiles_per_side).w], 1);
+    }
+}
+
+__global__
+void bucket_leaf_columns(const TileNode* const __restrict__ in_tiles,
+                         const int32_t* __restrict__ in_tile_count,
+                         const uint32_t tiles_per_side,
+                         int32_t* const __restrict__ columns,
+                         int32_t* const __restrict__ column_tiles)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const int32_t position = in_tiles[tile_index].position;
+    if (position != -1) {
+        const int32_t w = unpack(position, tiles_per_side).w;
+        column_tiles[atomicAdd(&columns[w], 1)] = tile_index;
+    }
+}
+
+__global__
+void sort_leaf_columns(const TileNode* const __restrict__ in_tiles,
+                       const uint32_t tiles_per_side,
+                       const int32_t* const __restrict__ columns,
+                       int32_t* const __restrict__ column_tiles)
+{
+    const int32_t column = threadIdx.x + blockIdx.x * blockDim.x;
+    if (column >= (int32_t)(tiles_per_side * tiles_per_side)) {
+        return;
+    }
+    const int32_t begin = column ? columns[column - 1] : 0;
+    const int32_t end = columns[column];
+
+    // Columns usually hold a handful of tiles, so insertion sort is fine
+    for (int32_t i=begin + 1; i < end; ++i) {
+        const int32_t t = column_tiles[i];
+        const int32_t z = unpack(in_tiles[t].position, tiles_per_side).z;
+        int32_t j = i;
+        while (j > begin && unpack(in_tiles[column_tiles[j - 1]].position,
+                                   tiles_per_side).z < z) {
+            column_tiles[j] = column_tiles[j - 1];
+            --j;
+        }
+        column_tiles[j] = t;
+    }
+}
+
+/*
+ *  trace_voxels_3d
+ *
+ *  Alternative to eval_voxels_f for shapes whose field is a distance bound,
+ *  i.e. changes by at most `lipschitz` per unit of distance.  Each thread
+ *  handles one pixel, visiting the 4^3 tiles in its column (as bucketed and
+ *  sorted by sort_leaf_columns) from front to back, and stops at the first
+ *  filled voxel, so tiles behind the surface are never evaluated.
+ *
+ *  Within a tile, voxels are evaluated two at a time (the next candidate
+ *  and the one behind it).  If neither is filled, then the field value
+ *  gives a distance that can be skipped safely, measured in voxels along
+ *  the pixel's (possibly perspective) ray.  Steps never leave the tile:
+ *  its tape has been pruned, so it only matches the full field inside the
+ *  tile's bounds.
+ *
+ *  Filled voxels are written to `image`, which must already hold the
+ *  results of earlier stages, as in eval_voxels_f.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__global__
+void trace_voxels_3d(const uint64_t* const __restrict__ tape_data,
+                     int32_t* const __restrict__ image,
+                     const int32_t image_size_px,
+
+                     const TileNode* const __restrict__ in_tiles,
+                     const int32_t* const __restrict__ columns,
+                     const int32_t* const __restrict__ column_tiles,
+
+                     const Eigen::Matrix4f mat,
+                     const float lipschitz,
+
+                     const StatsSink stats)
+{
+    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
+    if (px >= image_size_px || py >= image_size_px) {
+        return;
+    }
+
+    const uint32_t tiles_per_side = image_size_px / 4;
+    const int32_t column = px / 4 + (py / 4) * tiles_per_side;
+    const int32_t begin = column ? columns[column - 1] : 0;
+    const int32_t end = columns[column];
+    int32_t* const __restrict__ pixel = &image[px + py * image_size_px];
+
+    const float size_recip = 1.0f / image_size_px;
+    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+
+    // The column's tiles are already sorted from front to back
+    for (int32_t i=begin; i < end; ++i) {
+        const int32_t tile = column_tiles[i];
+        const int32_t tile_z = unpack(in_tiles[tile].position,
+                                      tiles_per_side).z;
+
+        // Everything from here on back is hidden behind a filled voxel
+        const int32_t bottom = tile_z * 4;
+        int32_t z = bottom + 3;
+        if (*pixel >= z) {
+            break;
+        }
+
+        const uint64_t* const __restrict__ tape =
+            &tape_data[in_tiles[tile].tape];
+#ifdef MPR_RENDER_STATS
+        const int32_t length = stats.stage ? tape_length(tape) : 0;
+#endif
+        while (z >= bottom) {
+            // Transform both voxel centers into model space
+            float2 p[3];
+            float fz[2];
+            for (unsigned j=0; j < 2; ++j) {
+                fz[j] = ((z - j + 0.5f) * size_recip - 0.5f) * 2.0f;
+            }
+            const float fw_a = mat(3, 0) * fx + mat(3, 1) * fy +
+                               mat(3, 2) * fz[0] + mat(3, 3);
+            const float fw_b = mat(3, 0) * fx + mat(3, 1) * fy +
+                               mat(3, 2) * fz[1] + mat(3, 3);
+            for (unsigned i=0; i < 3; ++i) {
+                const float v = mat(i, 0) * fx + mat(i, 1) * fy + mat(i, 3);
+                p[i] = make_float2((v + mat(i, 2) * fz[0]) / fw_a,
+                                   (v + mat(i, 2) * fz[1]) / fw_b);
+            }
+
+            float2 slots[SLOTS];
+            slots[((const uint8_t*)tape)[1]] = p[0];
+            slots[((const uint8_t*)tape)[2]] = p[1];
+            slots[((const uint8_t*)tape)[3]] = p[2];
+            const uint64_t* const data = eval_tape_f(tape, slots);
+            const float2 f = slots[I_OUT(data)];
+#ifdef MPR_RENDER_STATS
+            if (stats.stage) {
+                atomicAdd((unsigned long long*)&stats.stage->clauses,
+                          2ull * length);
+            }
+#endif
+
+            // The second voxel is only meaningful if it's in this tile
+            const bool has_b = z > bottom;
+            int32_t hit = -1;
+            if (f.x < 0.0f) {
+                hit = z;
+            } else if (has_b && f.y < 0.0f) {
+                hit = z - 1;
+            }
+            if (hit != -1) {
+#ifdef MPR_RENDER_STATS
+                if (stats.stage) {
+                    atomicAdd(&stats.stage->filled, 1);
+                }
+#endif
+                if (hit > *pixel) {
+                    *pixel = hit;
+                }
+                return;
+            }
+
+            if (!has_b) {
+                break;
+            }
+
+            // The deeper voxel's value bounds the distance to the surface,
+            // so we can skip every voxel within that distance of it.  The
+            // distance between the two voxel centers gives the length of
+            // one voxel along this ray, in model space.
+            const float dx = p[0].y - p[0].x;
+            const float dy = p[1].y - p[1].x;
+            const float dz = p[2].y - p[2].x;
+            const float s = f.y / (lipschitz * sqrtf(dx * dx + dy * dy +
+                                                     dz * dz));
+            z -= 2 + ((s >= 4.0f) ? 4 : ((s >= 1.0f) ? (int32_t)s : 0));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
-                   const float2* const __restrict__ values)
+/*
+ *  eval_tape_d
+ *
+ *  Evaluates a tape with automatic differentiation, with the X, Y, Z values
+ *  (and their derivatives) already loaded into `slots`.  Returns a pointer to
+ *  the tape's final clause, whose output slot holds the result.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__device__ inline
+const uint64_t* eval_tape_d(const uint64_t* __restrict__ data,
+                            Deriv (&slots)[SLOTS])
 {
-    // Each tile is executed by 32 threads (one for each pair of voxels, so
-    // we can do all of our load/stores as float2s and make memory happier).
-    //
-    // This is different from the eval_tiles_i function, which evaluates one
-    // tile per thread, because the tiles are already expanded by 64x by the
-    // time they're stored in the in_tiles list.
-    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t tile_index = voxel_index / 32;
-    if (tile_index >= in_tile_count) {
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm IMM(&d)
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = lhs * lhs; break;
+            case GPU_OP_SQRT_LHS: out = sqrt(lhs); break;
+            case GPU_OP_NEG_LHS: out = -lhs; break;
+            case GPU_OP_SIN_LHS: out = sin(lhs); break;
+            case GPU_OP_COS_LHS: out = cos(lhs); break;
+            case GPU_OP_ASIN_LHS: out = asin(lhs); break;
+            case GPU_OP_ACOS_LHS: out = acos(lhs); break;
+            case GPU_OP_ATAN_LHS: out = atan(lhs); break;
+            case GPU_OP_EXP_LHS: out = exp(lhs); break;
+            case GPU_OP_ABS_LHS: out = abs(lhs); break;
+            case GPU_OP_LOG_LHS: out = log(lhs); break;
+            case GPU_OP_TAN_LHS: out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS: out = recip(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
+            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
+            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
+            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
+            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
+            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
+            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
+            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
+            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+
+            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
+            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
+            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+
+            // Fused opcodes
+            case GPU_OP_FMA_LHS_IMM_RHS: out = lhs * imm + rhs; break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square(lhs) + rhs; break;
+            case GPU_OP_DIFF_SQUARE_LHS_IMM: out = square(lhs - imm); break;
+            case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS:
+                out = square(lhs - imm) + rhs;
+                break;
+
+            case GPU_OP_COPY_IMM: out = Deriv(imm); break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+
+#undef lhs
+#undef rhs
+#undef imm
+#undef out
+        }
+    }
+    return data;
+}
+
+/*
+ *  Helpers for normal evaluation
+ *
+ *  normal_height returns the Z position at which to evaluate the normal of
+ *  pixel `pxy` in `image`, or 0 if the pixel doesn't need a normal.
+ *
+ *  find_leaf_tile searches through the `tiles`, `subtiles`, `microtiles`
+ *  structure to find the smallest tile containing a voxel (which has the
+ *  shortest tape useful for it), and writes that tile's tape to `tape`.  It
+ *  returns the leaf's index in the three tile arrays taken end to end, where
+ *  the first two arrays hold `num_tiles` and `num_subtiles` tiles.
+ *
+ *  eval_normal_d evaluates the partial derivatives of the tape at `data`
+ *  (using automatic differentiation), returning them as a packed normal.
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+__device__ inline
+int32_t normal_height(const int32_t* const __restrict__ image,
+                      const int32_t pxy, const int32_t image_size_px)
+{
+    int32_t pz = image[pxy];
+    // Pixels past the top of the volume were occluded by seed_filled_3d
+    if (pz == 0 || pz >= image_size_px) {
+        return 0;
+    }
+    // Move slightly in front of the surface, unless we're at the top of the
+    // region (in which case moving would put us in an invalid tile)
+    if (pz < image_size_px - 1) {
+        pz += 1;
+    }
+    return pz;
+}
+
+/*  Writes the color for a pixel with height `h` (0 if empty) and packed
+ *  normal `normal` into a SurfaceOutput, if it has a surface */
+__device__ inline
+void write_surface(const SurfaceOutput& out, const int32_t px,
+                   const int32_t py, const int32_t h, const uint32_t normal,
+                   const int32_t image_size_px)
+{
+    if (out.mode == SurfaceOutput::NONE) {
         return;
+    } else if (!h || h >= image_size_px) {
+        if (!out.append) {
+            surf2Dwrite(0u, out.surface, px * 4, py);
+        }
+    } else if (out.mode == SurfaceOutput::DEPTH) {
+        const uint32_t a = (h * 255) / image_size_px;
+        surf2Dwrite(0x00FFFFFFu | (a << 24), out.surface, px * 4, py);
+    } else {
+        surf2Dwrite(normal, out.surface, px * 4, py);
     }
+}
 
-    // Check whether this pixel is masked in the output image
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        const int4 sub = unpack(threadIdx.x % 32, 4);
+__device__ inline
+int32_t find_leaf_tile(const int32_t px, const int32_t py, const int32_t pz,
+                       const int32_t image_size_px,
 
-        const int32_t px = pos.x * 4 + sub.x;
-        const int32_t py = pos.y * 4 + sub.y;
-        const int32_t pz = pos.z * 4 + sub.z;
+                       const TileNode* const __restrict__ tiles,
+                       const TileNode* const __restrict__ subtiles,
+                       const TileNode* const __restrict__ microtiles,
+                       const int32_t subtile_size_px,
 
-        // Early return if this pixel won't ever be filled
-        if (image[px + py * tiles_per_side * 4] >= pz + 2) {
-            return;
+                       const int32_t num_tiles,
+                       const int32_t num_subtiles,
+                       int32_t& tape)
+{
+    const int32_t tile_x = px / 64;
+    const int32_t tile_y = py / 64;
+    const int32_t tile_z = pz / 64;
+    const int32_t tile = tile_x +
+                         tile_y * (image_size_px / 64) +
+                         tile_z * (image_size_px / 64) * (image_size_px / 64);
+
+    if (tiles[tile].next == -1) {
+        tape = tiles[tile].tape;
+        return tile;
+    }
+
+    const int32_t s = 64 / subtile_size_px;
+    const int32_t sx = (px % 64) / subtile_size_px;
+    const int32_t sy = (py % 64) / subtile_size_px;
+    const int32_t sz = (pz % 64) / subtile_size_px;
+    const int32_t subtile = tiles[tile].next * s * s * s +
+                            sx +
+                            sy * s +
+                            sz * s * s;
+
+    if (subtiles[subtile].next == -1) {
+        tape = subtiles[subtile].tape;
+        return num_tiles + subtile;
+    }
+
+    const int32_t u = subtile_size_px / 4;
+    const int32_t ux = (px % subtile_size_px) / 4;
+    const int32_t uy = (py % subtile_size_px) / 4;
+    const int32_t uz = (pz % subtile_size_px) / 4;
+    const int32_t microtile = subtiles[subtile].next * u * u * u +
+                              ux +
+                              uy * u +
+                              uz * u * u;
+    tape = microtiles[microtile].tape;
+    return num_tiles + num_subtiles + microtile;
+}
+
+template <int SLOTS>
+__device__ inline
+uint32_t eval_normal_d(const uint64_t* __restrict__ data,
+                       const int32_t px, const int32_t py, const int32_t pz,
+                       const uint32_t image_size_px,
+                       const Eigen::Matrix4f& mat)
+{
+    Deriv slots[SLOTS];
+
+    {   // Calculate size and load into initial slots
+        const float size_recip = 1.0f / image_size_px;
+
+        const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
+
+        // Otherwise, calculate the X/Y/Z values
+        const float fw_ = mat(3, 0) * fx +
+                          mat(3, 1) * fy +
+                          mat(3, 2) * fz + mat(3, 3);
+        for (unsigned i=0; i < 3; ++i) {
+            slots[((const uint8_t*)data)[i + 1]] = Deriv(
+                (mat(i, 0) * fx +
+                 mat(i, 1) * fy +
+                 mat(i, 2) * fz + mat(i, 3)) / fw_);
+        }
+        slots[((const uint8_t*)data)[1]].v.x = 1.0f;
+        slots[((const uint8_t*)data)[2]].v.y = 1.0f;
+        slots[((const uint8_t*)data)[3]].v.z = 1.0f;
+    }
+
+    data = eval_tape_d(data, slots);
+
+    const uint8_t i_out = I_OUT(data);
+    const Deriv result = slots[i_out];
+    float norm = sqrtf(powf(result.dx(), 2) +
+                       powf(result.dy(), 2) +
+                       powf(result.dz(), 2));
+    uint8_t dx = (result.dx() / norm) * 127 + 128;
+    uint8_t dy = (result.dy() / norm) * 127 + 128;
+    uint8_t dz = (result.dz() / norm) * 127 + 128;
+    return (0xFF << 24) | (dz << 16) | (dy << 8) | dx;
+}
+
+/*
+ *  eval_pixels_d
+ *
+ *  For each active pixel in `image`, renders its partial derivatives
+ *  (using automatic differentiation), interpreting the result as its normal
+ *  and saving it to the `output` image.
+ *
+ *  This runs on every pixel of the image, so it's used for batches and for
+ *  sized (captured) renders; otherwise, see `eval_pixel_list_d`.
+ */
+template <int SLOTS>
+__device__ inline
+void eval_pixel_d(const uint64_t* const __restrict__ tape_data,
+                  const int32_t* const __restrict__ image,
+                  uint32_t* const __restrict__ output,
+                  const uint32_t image_size_px,
+                  const int32_t px, const int32_t py,
+
+                  const Eigen::Matrix4f& mat,
+
+                  const TileNode* const __restrict__ tiles,
+                  const TileNode* const __restrict__ subtiles,
+                  const TileNode* const __restrict__ microtiles,
+                  const int32_t subtile_size_px,
+
+                  const SurfaceOutput& surface)
+{
+    const int32_t pxy = px + py * image_size_px;
+    const int32_t pz = normal_height(image, pxy, image_size_px);
+    if (!pz) {
+        write_surface(surface, px, py, 0, 0, image_size_px);
+        return;
+    }
+    int32_t tape;
+    find_leaf_tile(px, py, pz, image_size_px,
+                   tiles, subtiles, microtiles, subtile_size_px,
+                   0, 0, tape);
+    const uint32_t n = eval_normal_d<SLOTS>(&tape_data[tape], px, py, pz,
+                                            image_size_px, mat);
+    output[pxy] = n;
+    write_surface(surface, px, py, image[pxy], n, image_size_px);
+}
+
+template <int SLOTS>
+__global__
+void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
+                   const int32_t* const __restrict__ image,
+                   uint32_t* const __restrict__ output,
+                   const uint32_t image_size_px,
+
+                   Eigen::Matrix4f mat,
+
+                   const TileNode* const __restrict__ tiles,
+                   const TileNode* const __restrict__ subtiles,
+                   const TileNode* const __restrict__ microtiles,
+                   const int32_t subtile_size_px,
+
+                   const SurfaceOutput surface)
+{
+    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
+    if (px >= image_size_px || py >= image_size_px) {
+        return;
+    }
+    eval_pixel_d<SLOTS>(tape_data, image, output, image_size_px, px, py, mat,
+                 tiles, subtiles, microtiles, subtile_size_px, surface);
+}
+
+/*  Batched version of eval_pixels_d, where the z index of the block selects
+ *  the layer (and its matrix in `mats`).  Top-level tiles are stored layer
+ *  by layer, as in `preload_tiles_batch`. */
+template <int SLOTS>
+__global__
+void eval_pixels_d_batch(const uint64_t* const __restrict__ tape_data,
+                         const int32_t* const __restrict__ image,
+                         uint32_t* const __restrict__ output,
+                         const uint32_t image_size_px,
+
+                         const Eigen::Matrix4f* __restrict__ mats,
+
+                         const TileNode* const __restrict__ tiles,
+                         const TileNode* const __restrict__ subtiles,
+                         const TileNode* const __restrict__ microtiles,
+                         const int32_t subtile_size_px)
+{
+    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
+    if (px >= image_size_px || py >= image_size_px) {
+        return;
+    }
+    const int32_t batch = blockIdx.z;
+    const int32_t layer_px = image_size_px * image_size_px;
+    const int32_t layer_tiles = pow(image_size_px / 64, 3);
+    eval_pixel_d<SLOTS>(tape_data, image + batch * layer_px,
+                        output + batch * layer_px, image_size_px, px, py,
+                        mats[batch], tiles + batch * layer_tiles,
+                        subtiles, microtiles, subtile_size_px,
+                        SurfaceOutput{0, SurfaceOutput::NONE, false});
+}
+
+/*
+ *  Compacted normal evaluation
+ *
+ *  Rather than running eval_pixels_d over the whole image, we build a list
+ *  of the visible pixels, grouped by the leaf tile (and so the tape) that
+ *  they resolve to, with a counting sort:
+ *
+ *  - count_pixel_leaves finds every visible pixel's leaf tile (by its index
+ *    in the three tile arrays taken end to end, see `find_leaf_tile`),
+ *    storing it in `pixel_leaves` (or -1) and counting pixels per leaf in
+ *    `leaf_counts`.
+ *  - sum_leaf_counts and offset_leaf_counts (with scan_active_tiles between
+ *    them) convert `leaf_counts` into an exclusive prefix sum, in place.
+ *  - scatter_pixel_leaves writes each pixel and its tape to its leaf's
+ *    range of `list`.
+ *
+ *  eval_pixel_list_d then evaluates one list entry per thread, so
+ *  neighbouring threads almost always share a tape, and the work scales
+ *  with the number of visible pixels rather than the image size.
+ */
+__global__
+void count_pixel_leaves(const int32_t* const __restrict__ image,
+                        const int32_t image_size_px,
+
+                        const TileNode* const __restrict__ tiles,
+                        const TileNode* const __restrict__ subtiles,
+                        const TileNode* const __restrict__ microtiles,
+                        const int32_t subtile_size_px,
+                        const int32_t num_tiles,
+                        const int32_t num_subtiles,
+
+                        int32_t* const __restrict__ pixel_leaves,
+                        int32_t* const __restrict__ leaf_counts,
+
+                        const SurfaceOutput surface)
+{
+    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
+    if (px >= image_size_px || py >= image_size_px) {
+        return;
+    }
+    const int32_t pxy = px + py * image_size_px;
+    const int32_t pz = normal_height(image, pxy, image_size_px);
+    if (!pz) {
+        pixel_leaves[pxy] = -1;
+        write_surface(surface, px, py, 0, 0, image_size_px);
+        return;
+    }
+    int32_t tape;
+    const int32_t leaf = find_leaf_tile(
+            px, py, pz, image_size_px,
+            tiles, subtiles, microtiles, subtile_size_px,
+            num_tiles, num_subtiles, tape);
+    pixel_leaves[pxy] = leaf;
+    atomicAdd(&leaf_counts[leaf], 1);
+}
+
+__global__
+void sum_leaf_counts(const int32_t* const __restrict__ leaf_counts,
+                     const int32_t num_leaves,
+                     int32_t* const __restrict__ block_sums)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    int32_t count = (i < num_leaves) ? leaf_counts[i] : 0;
+    for (unsigned offset=16; offset > 0; offset /= 2) {
+        count += __shfl_down_sync(0xFFFFFFFF, count, offset);
+    }
+
+    __shared__ int32_t warp_sums[NUM_THREADS / 32];
+    if (threadIdx.x % 32 == 0) {
+        warp_sums[threadIdx.x / 32] = count;
+    }
+    __syncthreads();
+    if (threadIdx.x == 0) {
+        int32_t sum = 0;
+        for (unsigned w=0; w < blockDim.x / 32; ++w) {
+            sum += warp_sums[w];
+        }
+        block_sums[blockIdx.x] = sum;
+    }
+}
+
+__global__
+void offset_leaf_counts(int32_t* const __restrict__ leaf_counts,
+                        const int32_t num_leaves,
+                        const int32_t* const __restrict__ block_offsets)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t count = (i < num_leaves) ? leaf_counts[i] : 0;
+
+    // Inclusive scan within each warp, then across the block's warps
+    const unsigned lane = threadIdx.x % 32;
+    int32_t sum = count;
+    for (unsigned offset=1; offset < 32; offset *= 2) {
+        const int32_t t = __shfl_up_sync(0xFFFFFFFF, sum, offset);
+        if (lane >= offset) {
+            sum += t;
+        }
+    }
+    __shared__ int32_t warp_sums[NUM_THREADS / 32];
+    if (lane == 31) {
+        warp_sums[threadIdx.x / 32] = sum;
+    }
+    __syncthreads();
+
+    if (i < num_leaves) {
+        int32_t offset = block_offsets[blockIdx.x];
+        for (unsigned w=0; w < threadIdx.x / 32; ++w) {
+            offset += warp_sums[w];
         }
+        leaf_counts[i] = offset + sum - count;
+    }
+}
+
+__global__
+void scatter_pixel_leaves(const int32_t* const __restrict__ pixel_leaves,
+                          const int32_t image_size_px,
+
+                          const TileNode* const __restrict__ tiles,
+                          const TileNode* const __restrict__ subtiles,
+                          const TileNode* const __restrict__ microtiles,
+                          const int32_t num_tiles,
+                          const int32_t num_subtiles,
+
+                          int32_t* const __restrict__ leaf_offsets,
+                          int2* const __restrict__ list)
+{
+    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
+    if (px >= image_size_px || py >= image_size_px) {
+        return;
+    }
+    const int32_t pxy = px + py * image_size_px;
+    const int32_t leaf = pixel_leaves[pxy];
+    if (leaf < 0) {
+        return;
     }
+    const int32_t tape =
+        (leaf < num_tiles) ? tiles[leaf].tape
+      : (leaf < num_tiles + num_subtiles) ? subtiles[leaf - num_tiles].tape
+      : microtiles[leaf - num_tiles - num_subtiles].tape;
+    list[atomicAdd(&leaf_offsets[leaf], 1)] = make_int2(pxy, tape);
+}
 
-    float2 slots[128];
-
-    // Pick out the tape based on the pointer stored in the tiles list
-    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
-    slots[((const uint8_t*)tape_data)[1]] = values[voxel_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[voxel_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[voxel_index * 3 + 2];
-
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
-        }
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+template <int SLOTS>
+__global__
+void eval_pixel_list_d(const uint64_t* const __restrict__ tape_data,
+                       const int32_t* const __restrict__ image,
+                       uint32_t* const __restrict__ output,
+                       const uint32_t image_size_px,
 
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
+                       Eigen::Matrix4f mat,
 
-            case GPU_OP_SQUARE_LHS: out = make_float2(lhs.x * lhs.x, lhs.y * lhs.y); break;
-            case GPU_OP_SQRT_LHS: out = make_float2(sqrtf(lhs.x), sqrtf(lhs.y)); break;
-            case GPU_OP_NEG_LHS: out = make_float2(-lhs.x, -lhs.y); break;
-            case GPU_OP_SIN_LHS: out = make_float2(sinf(lhs.x), sinf(lhs.y)); break;
-            case GPU_OP_COS_LHS: out = make_float2(cosf(lhs.x), cosf(lhs.y)); break;
-            case GPU_OP_ASIN_LHS: out = make_float2(asinf(lhs.x), asinf(lhs.y)); break;
-            case GPU_OP_ACOS_LHS: out = make_float2(acosf(lhs.x), acosf(lhs.y)); break;
-            case GPU_OP_ATAN_LHS: out = make_float2(atanf(lhs.x), atanf(lhs.y)); break;
-            case GPU_OP_EXP_LHS: out = make_float2(expf(lhs.x), expf(lhs.y)); break;
-            case GPU_OP_ABS_LHS: out = make_float2(fabsf(lhs.x), fabsf(lhs.y)); break;
-            case GPU_OP_LOG_LHS: out = make_float2(logf(lhs.x), logf(lhs.y)); break;
+                       const int2* const __restrict__ list,
+                       const int32_t* const __restrict__ list_count,
+                       const bool jit,
 
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = make_float2(lhs.x + imm, lhs.y + imm); break;
-            case GPU_OP_ADD_LHS_RHS: out = make_float2(lhs.x + rhs.x, lhs.y + rhs.y); break;
-            case GPU_OP_MUL_LHS_IMM: out = make_float2(lhs.x * imm, lhs.y * imm); break;
-            case GPU_OP_MUL_LHS_RHS: out = make_float2(lhs.x * rhs.x, lhs.y * rhs.y); break;
-            case GPU_OP_MIN_LHS_IMM: out = make_float2(fminf(lhs.x, imm), fminf(lhs.y, imm)); break;
-            case GPU_OP_MIN_LHS_RHS: out = make_float2(fminf(lhs.x, rhs.x), fminf(lhs.y, rhs.y)); break;
-            case GPU_OP_MAX_LHS_IMM: out = make_float2(fmaxf(lhs.x, imm), fmaxf(lhs.y, imm)); break;
-            case GPU_OP_MAX_LHS_RHS: out = make_float2(fmaxf(lhs.x, rhs.x), fmaxf(lhs.y, rhs.y)); break;
+                       const SurfaceOutput surface)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= *list_count) {
+        return;
+    }
+    const int2 entry = list[i];
+    const int32_t px = entry.x % image_size_px;
+    const int32_t py = entry.x / image_size_px;
+    const int32_t pz = normal_height(image, entry.x, image_size_px);
+    // Pixels on the root tape were already done by JitTape::evalNormals
+    const uint32_t n = (jit && !entry.y)
+        ? output[entry.x]
+        : eval_normal_d<SLOTS>(&tape_data[entry.y], px, py, pz,
+                               image_size_px, mat);
+    output[entry.x] = n;
+    write_surface(surface, px, py, image[entry.x], n, image_size_px);
+}
 
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = make_float2(lhs.x - imm, lhs.y - imm); break;
-            case GPU_OP_SUB_IMM_RHS: out = make_float2(imm - rhs.x, imm - rhs.y); break;
-            case GPU_OP_SUB_LHS_RHS: out = make_float2(lhs.x - rhs.x, lhs.y - rhs.y); break;
+////////////////////////////////////////////////////////////////////////////////
 
-            case GPU_OP_DIV_LHS_IMM: out = make_float2(lhs.x / imm, lhs.y / imm); break;
-            case GPU_OP_DIV_IMM_RHS: out = make_float2(imm / rhs.x, imm / rhs.y); break;
-            case GPU_OP_DIV_LHS_RHS: out = make_float2(lhs.x / rhs.x, lhs.y / rhs.y); break;
+/*
+ *  Mesh extraction
+ *
+ *  Meshes are built from the 4^3 tiles that are left at the end of the 3D
+ *  hierarchy, since every other tile is known to be entirely empty or
+ *  filled.  Each tile samples its 5^3 voxel corners with its own pruned
+ *  tape, then runs marching tetrahedra over its 64 cells.  Corners on a
+ *  tile's faces are shared with its neighbours, so the mesh is watertight.
+ *
+ *  Vertices lie on edges of the corner lattice, and are welded through a
+ *  hash table keyed by edge.  Until the table is compacted (by
+ *  `assign_mesh_vertices`), a vertex's slot in the table is its index.
+ */
 
-            case GPU_OP_COPY_IMM: out = make_float2(imm, imm); break;
-            case GPU_OP_COPY_LHS: out = make_float2(lhs.x, lhs.y); break;
-            case GPU_OP_COPY_RHS: out = make_float2(rhs.x, rhs.y); break;
+// Corners of the six tetrahedra in a cell, where the cell's corners are
+// numbered x + y * 2 + z * 4.  Every tetrahedron contains the main diagonal
+// (from corner 0 to 7), so neighbouring cells split their shared faces the
+// same way.
+__constant__ uint8_t MESH_TETS[6][4] = {
+    {0, 7, 1, 3}, {0, 7, 3, 2}, {0, 7, 2, 6},
+    {0, 7, 6, 4}, {0, 7, 4, 5}, {0, 7, 5, 1},
+};
+
+__device__ inline
+float3 transform_point(const Eigen::Matrix4f& mat,
+                       const float x, const float y, const float z)
+{
+    const float w = mat(3, 0) * x + mat(3, 1) * y + mat(3, 2) * z + mat(3, 3);
+    return make_float3(
+        (mat(0, 0) * x + mat(0, 1) * y + mat(0, 2) * z + mat(0, 3)) / w,
+        (mat(1, 0) * x + mat(1, 1) * y + mat(1, 2) * z + mat(1, 3)) / w,
+        (mat(2, 0) * x + mat(2, 1) * y + mat(2, 2) * z + mat(2, 3)) / w);
+}
 
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
+/*
+ *  Finds (or inserts) the vertex on the lattice edge identified by `key`,
+ *  returning its slot in the hash table.  The thread which inserts the
+ *  vertex also stores its position and tape.  Returns -1 (and increments
+ *  `overflow`) if the table is too full to find a slot.
+ */
+__device__ inline
+int32_t mesh_vertex(uint64_t* const __restrict__ vert_keys,
+                    float3* const __restrict__ vert_pos,
+                    int32_t* const __restrict__ vert_tapes,
+                    const int32_t table_bits,
+                    int32_t* const __restrict__ overflow,
+                    const uint64_t key, const float3 pos, const int32_t tape)
+{
+    uint32_t slot = (key * 0x9E3779B97F4A7C15ull) >> (64 - table_bits);
+    for (unsigned i=0; i < MESH_HASH_PROBES; ++i) {
+        const uint64_t prev = atomicCAS(
+                (unsigned long long*)&vert_keys[slot], 0ull,
+                (unsigned long long)key);
+        if (prev == 0) {
+            vert_pos[slot] = pos;
+            vert_tapes[slot] = tape;
+            return slot;
+        } else if (prev == key) {
+            return slot;
         }
+        slot = (slot + 1) & ((1u << table_bits) - 1);
     }
+    atomicAdd(overflow, 1);
+    return -1;
+}
 
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
+/*
+ *  mesh_tiles
+ *
+ *  Runs marching tetrahedra on every 4^3 tile in `in_tiles`, with one warp
+ *  per tile (so it should be launched with NUM_TILES * 32 threads per block).
+ *  Corner values are found with `eval_tape_f`, two at a time, and stored in
+ *  shared memory; then each thread meshes two cells.
+ *
+ *  Vertices are written to the hash table of 2^`table_bits` slots in
+ *  `vert_keys`, `vert_pos` (in lattice coordinates), and `vert_tapes`.
+ *  Triangles are written to `tris` as triples of slots, wound
+ *  counter-clockwise when seen from outside the shape.  `tri_count` is the
+ *  number of triangles found, which may be more than `tri_capacity`;
+ *  triangles past the capacity (or with a vertex that couldn't be stored)
+ *  are dropped and counted in `overflow`.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__global__
+void mesh_tiles(const uint64_t* const __restrict__ tape_data,
+                const TileNode* const __restrict__ in_tiles,
+                const int32_t* __restrict__ in_tile_count,
+                const uint32_t tiles_per_side,
+                const Eigen::Matrix4f mat,
+
+                uint64_t* const __restrict__ vert_keys,
+                float3* const __restrict__ vert_pos,
+                int32_t* const __restrict__ vert_tapes,
+                const int32_t table_bits,
+
+                int3* const __restrict__ tris,
+                int32_t* const __restrict__ tri_count,
+                const int32_t tri_capacity,
+                int32_t* const __restrict__ overflow)
+{
+    const int32_t tile_index = (threadIdx.x + blockIdx.x * blockDim.x) / 32;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const unsigned warp = threadIdx.x / 32;
+    const unsigned lane = threadIdx.x % 32;
 
     const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    if (DIMENSION == 3) {
-        const int4 sub = unpack(threadIdx.x % 32, 4);
-        // The second voxel is always higher in Z, so it masks the lower voxel
-        if (slots[i_out].y < 0.0f) {
-            const int32_t px = pos.x * 4 + sub.x;
-            const int32_t py = pos.y * 4 + sub.y;
-            const int32_t pz = pos.z * 4 + sub.z + 2;
-
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
-        } else if (slots[i_out].x < 0.0f) {
-            const int32_t px = pos.x * 4 + sub.x;
-            const int32_t py = pos.y * 4 + sub.y;
-            const int32_t pz = pos.z * 4 + sub.z;
+    const int32_t tape = in_tiles[tile_index].tape;
+    const float size_recip = 1.0f / (tiles_per_side * 4);
 
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
+    // Evaluate the tile's 125 corners, as two pairs per thread (padded out
+    // to 128 by repeating the last corner)
+    __shared__ float corners[NUM_TILES][128];
+    for (unsigned i=0; i < 2; ++i) {
+        float3 p[2];
+        for (unsigned j=0; j < 2; ++j) {
+            int32_t c = lane + i * 64 + j * 32;
+            c = (c < 125) ? c : 124;
+            p[j] = transform_point(mat,
+                ((pos.x * 4 + c % 5) * size_recip - 0.5f) * 2.0f,
+                ((pos.y * 4 + (c / 5) % 5) * size_recip - 0.5f) * 2.0f,
+                ((pos.z * 4 + c / 25) * size_recip - 0.5f) * 2.0f);
         }
-    } else if (DIMENSION == 2) {
-        const int4 sub = unpack(threadIdx.x % 32, 8);
-        if (slots[i_out].y < 0.0f) {
-            const int32_t px = pos.x * 8 + sub.x;
-            const int32_t py = pos.y * 8 + sub.y + 4;
 
-            image[px + py * tiles_per_side * 8] = 1;
-        }
-        if (slots[i_out].x < 0.0f) {
-            const int32_t px = pos.x * 8 + sub.x;
-            const int32_t py = pos.y * 8 + sub.y;
+        float2 slots[SLOTS];
+        const uint64_t* __restrict__ data = &tape_data[tape];
+        slots[((const uint8_t*)data)[1]] = make_float2(p[0].x, p[1].x);
+        slots[((const uint8_t*)data)[2]] = make_float2(p[0].y, p[1].y);
+        slots[((const uint8_t*)data)[3]] = make_float2(p[0].z, p[1].z);
+        data = eval_tape_f(data, slots);
 
-            image[px + py * tiles_per_side * 8] = 1;
+        const float2 result = slots[I_OUT(data)];
+        corners[warp][lane + i * 64] = result.x;
+        corners[warp][lane + i * 64 + 32] = result.y;
+    }
+    __syncwarp();
+
+    // Every tetrahedron runs from corner 0 to corner 7 of its cell, so each
+    // edge goes from a lower corner to an upper one along one of 7 steps in
+    // {0,1}^3.  Edges are keyed by the lower corner's index in the global
+    // lattice (which has tiles_per_side * 4 + 1 corners per side), times 8,
+    // plus the step's bits; this is never 0, which marks an empty slot.
+    const uint64_t side = tiles_per_side * 4 + 1;
+
+    for (unsigned n=0; n < 2; ++n) {
+        const int32_t cell = lane + n * 32;
+        const int32_t cx = cell % 4;
+        const int32_t cy = (cell / 4) % 4;
+        const int32_t cz = cell / 16;
+
+        for (unsigned t=0; t < 6; ++t) {
+            int3 lattice[4];
+            float values[4];
+            unsigned inside = 0;
+            for (unsigned k=0; k < 4; ++k) {
+                const uint8_t q = MESH_TETS[t][k];
+                const int32_t x = cx + (q & 1);
+                const int32_t y = cy + ((q >> 1) & 1);
+                const int32_t z = cz + ((q >> 2) & 1);
+                lattice[k] = make_int3(pos.x * 4 + x,
+                                       pos.y * 4 + y,
+                                       pos.z * 4 + z);
+                values[k] = corners[warp][x + y * 5 + z * 25];
+                inside |= (values[k] < 0.0f) << k;
+            }
+            if (inside == 0 || inside == 15) {
+                continue;
+            }
+
+            // Edges which cross the surface (as pairs of corners), which
+            // make a triangle (if one corner is inside or outside) or a
+            // quad (if two corners are inside)
+            uint8_t edges[4][2];
+            unsigned num_edges = 0;
+            const unsigned num_inside = __popc(inside);
+            if (num_inside == 2) {
+                uint8_t in[2], out[2];
+                unsigned a = 0, b = 0;
+                for (unsigned k=0; k < 4; ++k) {
+                    if (inside & (1 << k)) {
+                        in[a++] = k;
+                    } else {
+                        out[b++] = k;
+                    }
+                }
+                const uint8_t quad[4][2] = {{in[0], out[0]}, {in[0], out[1]},
+                                            {in[1], out[1]}, {in[1], out[0]}};
+                for (unsigned k=0; k < 4; ++k) {
+                    edges[k][0] = quad[k][0];
+                    edges[k][1] = quad[k][1];
+                }
+                num_edges = 4;
+            } else {
+                const unsigned lone_mask = (num_inside == 1) ? inside
+                                                             : (~inside & 15);
+                const uint8_t lone = __ffs(lone_mask) - 1;
+                for (unsigned k=0; k < 4; ++k) {
+                    if (k != lone) {
+                        edges[num_edges][0] = lone;
+                        edges[num_edges][1] = k;
+                        num_edges++;
+                    }
+                }
+            }
+
+            // Direction from the inside corners to the outside corners,
+            // which is used to pick each triangle's winding
+            float3 outward = make_float3(0.0f, 0.0f, 0.0f);
+            for (unsigned k=0; k < 4; ++k) {
+                const float s = (inside & (1 << k)) ? -1.0f : 1.0f;
+                outward.x += s * lattice[k].x;
+                outward.y += s * lattice[k].y;
+                outward.z += s * lattice[k].z;
+            }
+
+            int32_t verts[4];
+            float3 vpos[4];
+            for (unsigned k=0; k < num_edges; ++k) {
+                const unsigned a = edges[k][0];
+                const unsigned b = edges[k][1];
+                const float f = values[a] / (values[a] - values[b]);
+                vpos[k] = make_float3(
+                    lattice[a].x + f * (lattice[b].x - lattice[a].x),
+                    lattice[a].y + f * (lattice[b].y - lattice[a].y),
+                    lattice[a].z + f * (lattice[b].z - lattice[a].z));
+
+                const bool a_lower =
+                    lattice[a].x + lattice[a].y + lattice[a].z <
+                    lattice[b].x + lattice[b].y + lattice[b].z;
+                const int3 lo = a_lower ? lattice[a] : lattice[b];
+                const int3 hi = a_lower ? lattice[b] : lattice[a];
+                const uint64_t step = (hi.x - lo.x) | ((hi.y - lo.y) << 1) |
+                                      ((hi.z - lo.z) << 2);
+                const uint64_t key = (lo.x + lo.y * side +
+                                      lo.z * side * side) * 8 + step;
+                verts[k] = mesh_vertex(vert_keys, vert_pos, vert_tapes,
+                                       table_bits, overflow,
+                                       key, vpos[k], tape);
+            }
+
+            // Quads are split into two triangles, as a fan from vertex 0
+            for (unsigned k=1; k + 1 < num_edges; ++k) {
+                int32_t a = verts[0];
+                int32_t b = verts[k];
+                int32_t c = verts[k + 1];
+                if (a < 0 || b < 0 || c < 0) {
+                    continue;
+                }
+                const float3 pa = vpos[0];
+                const float3 pb = vpos[k];
+                const float3 pc = vpos[k + 1];
+                const float ux = pb.x - pa.x, uy = pb.y - pa.y,
+                            uz = pb.z - pa.z;
+                const float vx = pc.x - pa.x, vy = pc.y - pa.y,
+                            vz = pc.z - pa.z;
+                const float dot = (uy * vz - uz * vy) * outward.x +
+                                  (uz * vx - ux * vz) * outward.y +
+                                  (ux * vy - uy * vx) * outward.z;
+                if (dot < 0.0f) {
+                    const int32_t tmp = b;
+                    b = c;
+                    c = tmp;
+                }
+                const int32_t i = atomicAdd(tri_count, 1);
+                if (i < tri_capacity) {
+                    tris[i] = make_int3(a, b, c);
+                } else {
+                    atomicAdd(overflow, 1);
+                }
+            }
         }
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
 /*
- *  eval_pixels_d
- *
- *  For each active pixel in `image`, renders its partial derivatives
- *  (using automatic differentiation), interpreting the result as its normal
- *  and saving it to the `output` image.
+ *  count_mesh_vertices, assign_mesh_vertices
  *
- *  We search through the `tiles`, `subtiles`, `microtiles` structure to
- *  find the shortest tape useful for each pixel, as an optimization.
+ *  Compacts the vertex hash table from `mesh_tiles`, in the same way that
+ *  `compact_tiles` compacts tile lists: `count_mesh_vertices` counts the
+ *  vertices in each block of slots, `scan_active_tiles` sums the counts, then
+ *  `assign_mesh_vertices` writes each slot's vertex index to `vert_index`.
  */
 __global__
-void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
-                   const int32_t* const __restrict__ image,
-                   uint32_t* const __restrict__ output,
-                   const uint32_t image_size_px,
-
-                   Eigen::Matrix4f mat,
+void count_mesh_vertices(const uint64_t* const __restrict__ vert_keys,
+                         const int32_t table_size,
+                         int32_t* __restrict__ const block_counts)
+{
+    const int32_t slot = threadIdx.x + blockIdx.x * blockDim.x;
+    const bool is_used = slot < table_size && vert_keys[slot] != 0;
+    const int32_t count = __syncthreads_count(is_used);
+    if (threadIdx.x == 0) {
+        block_counts[blockIdx.x] = count;
+    }
+}
 
-                   const TileNode* const __restrict__ tiles,
-                   const TileNode* const __restrict__ subtiles,
-                   const TileNode* const __restrict__ microtiles)
+__global__
+void assign_mesh_vertices(const uint64_t* const __restrict__ vert_keys,
+                          const int32_t table_size,
+                          const int32_t* __restrict__ const block_offsets,
+                          int32_t* __restrict__ const vert_index)
 {
-    const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
-    if (px >= image_size_px || py >= image_size_px) {
-        return;
+    const int32_t slot = threadIdx.x + blockIdx.x * blockDim.x;
+    const bool is_used = slot < table_size && vert_keys[slot] != 0;
+
+    __shared__ int32_t warp_counts[NUM_THREADS / 32];
+    const uint32_t ballot = __ballot_sync(0xFFFFFFFF, is_used);
+    const unsigned warp = threadIdx.x / 32;
+    const unsigned lane = threadIdx.x % 32;
+    if (lane == 0) {
+        warp_counts[warp] = __popc(ballot);
     }
+    __syncthreads();
 
-    const int32_t pxy = px + py * image_size_px;
-    int32_t pz = image[pxy];
-    if (pz == 0) {
+    if (slot >= table_size) {
         return;
     }
-    // Move slightly in front of the surface, unless we're at the top of the
-    // region (in which case moving would put us in an invalid tile)
-    if (pz < image_size_px - 1) {
-        pz += 1;
+
+    int32_t offset = block_offsets[blockIdx.x];
+    for (unsigned i=0; i < warp; ++i) {
+        offset += warp_counts[i];
     }
+    offset += __popc(ballot & ((1u << lane) - 1));
 
-    Deriv slots[128];
+    vert_index[slot] = is_used ? offset : -1;
+}
 
-    {   // Calculate size and load into initial slots
-        const float size_recip = 1.0f / image_size_px;
+/*
+ *  eval_mesh_vertices
+ *
+ *  For every vertex in the hash table, writes its position (transformed by
+ *  `mat`) and its normal (found with automatic differentiation, using the
+ *  pruned tape of the tile which created it) to `out_pos` and `out_norm`,
+ *  at the index assigned by `assign_mesh_vertices`.
+ *
+ *  As in `eval_tiles_i`, `SLOTS` is the size of the slot array.
+ */
+template <int SLOTS>
+__global__
+void eval_mesh_vertices(const uint64_t* const __restrict__ tape_data,
+                        const uint64_t* const __restrict__ vert_keys,
+                        const float3* const __restrict__ vert_pos,
+                        const int32_t* const __restrict__ vert_tapes,
+                        const int32_t* const __restrict__ vert_index,
+                        const int32_t table_size,
+                        const uint32_t tiles_per_side,
+                        const Eigen::Matrix4f mat,
+
+                        float3* const __restrict__ out_pos,
+                        float3* const __restrict__ out_norm)
+{
+    const int32_t slot = threadIdx.x + blockIdx.x * blockDim.x;
+    if (slot >= table_size || !vert_keys[slot]) {
+        return;
+    }
 
-        const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
-        const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
-        const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float size_recip = 1.0f / (tiles_per_side * 4);
+    const float3 p = vert_pos[slot];
+    const float3 q = transform_point(mat, (p.x * size_recip - 0.5f) * 2.0f,
+                                          (p.y * size_recip - 0.5f) * 2.0f,
+                                          (p.z * size_recip - 0.5f) * 2.0f);
+
+    Deriv slots[SLOTS];
+    const uint64_t* __restrict__ data = &tape_data[vert_tapes[slot]];
+    slots[((const uint8_t*)data)[1]] = Deriv(q.x);
+    slots[((const uint8_t*)data)[2]] = Deriv(q.y);
+    slots[((const uint8_t*)data)[3]] = Deriv(q.z);
+    slots[((const uint8_t*)data)[1]].v.x = 1.0f;
+    slots[((const uint8_t*)data)[2]].v.y = 1.0f;
+    slots[((const uint8_t*)data)[3]].v.z = 1.0f;
+    data = eval_tape_d(data, slots);
+
+    const Deriv result = slots[I_OUT(data)];
+    const float norm = sqrtf(powf(result.dx(), 2) +
+                             powf(result.dy(), 2) +
+                             powf(result.dz(), 2));
+    const int32_t index = vert_index[slot];
+    out_pos[index] = q;
+    out_norm[index] = make_float3(result.dx() / norm,
+                                  result.dy() / norm,
+                                  result.dz() / norm);
+}
 
-        // Otherwise, calculate the X/Y/Z values
-        const float fw_ = mat(3, 0) * fx +
-                          mat(3, 1) * fy +
-                          mat(3, 2) * fz + mat(3, 3);
-        for (unsigned i=0; i < 3; ++i) {
-            slots[((const uint8_t*)tape_data)[i + 1]] = Deriv(
-                (mat(i, 0) * fx +
-                 mat(i, 1) * fy +
-                 mat(i, 2) * fz + mat(i, 3)) / fw_);
-        }
-        slots[((const uint8_t*)tape_data)[1]].v.x = 1.0f;
-        slots[((const uint8_t*)tape_data)[2]].v.y = 1.0f;
-        slots[((const uint8_t*)tape_data)[3]].v.z = 1.0f;
+/*
+ *  remap_mesh_triangles
+ *
+ *  Converts triangles from hash table slots into compacted vertex indices.
+ */
+__global__
+void remap_mesh_triangles(int3* const __restrict__ tris,
+                          const int32_t tri_count,
+                          const int32_t* const __restrict__ vert_index)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= tri_count) {
+        return;
     }
+    const int3 t = tris[i];
+    tris[i] = make_int3(vert_index[t.x], vert_index[t.y], vert_index[t.z]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
+/*
+ *  Point queries (see Context::query)
+ *
+ *  Points are binned into a grid of tiles over their bounding box, and each
+ *  tile with points goes through eval_tiles_i once (as a single level of the
+ *  usual hierarchy), which pushes a tape that's exact within the tile.
+ *  Points are then sorted by tile, so that neighbouring threads usually
+ *  share a pruned tape, and evaluated with the float or Deriv evaluators.
+ */
 
-    const uint64_t* __restrict__ data = tape_data;
+/*  Maps a float to an int with the same ordering, so that bounds can be
+ *  found with integer atomics */
+__device__ inline int32_t query_order(const float f)
+{
+    const int32_t i = __float_as_int(f);
+    return (i >= 0) ? i : (i ^ 0x7FFFFFFF);
+}
 
-    {   // Pick out the tape based on the pointer stored in the tiles list
-        const int32_t tile_x = px / 64;
-        const int32_t tile_y = py / 64;
-        const int32_t tile_z = pz / 64;
-        const int32_t tile = tile_x +
-                             tile_y * (image_size_px / 64) +
-                             tile_z * (image_size_px / 64) * (image_size_px / 64);
+__device__ inline float query_unorder(const int32_t i)
+{
+    return __int_as_float((i >= 0) ? i : (i ^ 0x7FFFFFFF));
+}
 
-        if (tiles[tile].next == -1) {
-            data = &tape_data[tiles[tile].tape];
-        } else {
-            const int32_t sx = (px % 64) / 16;
-            const int32_t sy = (py % 64) / 16;
-            const int32_t sz = (pz % 64) / 16;
-            const int32_t subtile = tiles[tile].next * 64 +
-                                    sx +
-                                    sy * 4 +
-                                    sz * 16;
-
-            if (subtiles[subtile].next == -1) {
-                data = &tape_data[subtiles[subtile].tape];
-            } else {
-                const int32_t ux = (px % 16) / 4;
-                const int32_t uy = (py % 16) / 4;
-                const int32_t uz = (pz % 16) / 4;
-                const int32_t microtile = subtiles[subtile].next * 64 +
-                                        ux +
-                                        uy * 4 +
-                                        uz * 16;
-                data = &tape_data[microtiles[microtile].tape];
-            }
+/*
+ *  query_bounds
+ *
+ *  Accumulates the bounding box of `points` into `bounds`, which stores the
+ *  lower then upper corner (from query_order), and must be initialized to
+ *  an empty box.  Each warp reduces its points with shuffles, then does a
+ *  single round of atomics.  Threads past the end reuse the last point, so
+ *  that every lane takes part in the shuffles.
+ */
+__global__
+void query_bounds(const float3* const __restrict__ points,
+                  const int32_t count,
+                  int32_t* const __restrict__ bounds)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    const float3 p = points[(i < count) ? i : (count - 1)];
+    int32_t lower[3] = {query_order(p.x), query_order(p.y), query_order(p.z)};
+    int32_t upper[3] = {lower[0], lower[1], lower[2]};
+    for (unsigned offset=16; offset > 0; offset /= 2) {
+        for (unsigned j=0; j < 3; ++j) {
+            const int32_t lo = __shfl_down_sync(0xFFFFFFFF, lower[j], offset);
+            const int32_t hi = __shfl_down_sync(0xFFFFFFFF, upper[j], offset);
+            lower[j] = (lo < lower[j]) ? lo : lower[j];
+            upper[j] = (hi > upper[j]) ? hi : upper[j];
         }
     }
-
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
+    if (threadIdx.x % 32 == 0) {
+        for (unsigned j=0; j < 3; ++j) {
+            atomicMin(&bounds[j], lower[j]);
+            atomicMax(&bounds[j + 3], upper[j]);
         }
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+    }
+}
 
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
+/*  Returns the index of the tile containing `p`, in a grid of
+ *  tiles_per_side^3 tiles spread over `bounds` */
+__device__ inline int32_t query_tile(const float3 p,
+                                     const int32_t* const __restrict__ bounds,
+                                     const int32_t tiles_per_side)
+{
+    const float q[3] = {p.x, p.y, p.z};
+    int32_t index = 0;
+    for (int j=2; j >= 0; --j) {
+        const float lo = query_unorder(bounds[j]);
+        const float hi = query_unorder(bounds[j + 3]);
+        const float t = (hi > lo) ? (q[j] - lo) / (hi - lo) : 0.0f;
+        int32_t c = t * tiles_per_side;
+        c = (c < 0) ? 0 : ((c >= tiles_per_side) ? (tiles_per_side - 1) : c);
+        index = index * tiles_per_side + c;
+    }
+    return index;
+}
 
-            case GPU_OP_SQUARE_LHS: out = lhs * lhs; break;
-            case GPU_OP_SQRT_LHS: out = sqrt(lhs); break;
-            case GPU_OP_NEG_LHS: out = -lhs; break;
-            case GPU_OP_SIN_LHS: out = sin(lhs); break;
-            case GPU_OP_COS_LHS: out = cos(lhs); break;
-            case GPU_OP_ASIN_LHS: out = asin(lhs); break;
-            case GPU_OP_ACOS_LHS: out = acos(lhs); break;
-            case GPU_OP_ATAN_LHS: out = atan(lhs); break;
-            case GPU_OP_EXP_LHS: out = exp(lhs); break;
-            case GPU_OP_ABS_LHS: out = abs(lhs); break;
-            case GPU_OP_LOG_LHS: out = log(lhs); break;
+/*
+ *  query_count_tiles
+ *
+ *  Stores each point's tile in `point_tiles`, and counts points per tile
+ *  in `tile_counts` (which must be zeroed beforehand).
+ */
+__global__
+void query_count_tiles(const float3* const __restrict__ points,
+                       const int32_t count,
+                       const int32_t* const __restrict__ bounds,
+                       const int32_t tiles_per_side,
+                       int32_t* const __restrict__ point_tiles,
+                       int32_t* const __restrict__ tile_counts)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= count) {
+        return;
+    }
+    const int32_t t = query_tile(points[i], bounds, tiles_per_side);
+    point_tiles[i] = t;
+    atomicAdd(&tile_counts[t], 1);
+}
 
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
-            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
-            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
-            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
-            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
-            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
-            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
-            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+/*
+ *  query_preload_tiles
+ *
+ *  Fills in a TileNode for every tile in the grid, on the root tape, with
+ *  empty tiles masked out (as in preload_tiles), and stores each tile's
+ *  X, Y, Z intervals in `values` (as in calculate_intervals_3d).
+ *
+ *  Intervals are widened by a sixteenth of a tile, plus a few ULPs of the
+ *  bounds, so that points which were rounded into a tile by query_tile are
+ *  still covered by its interval.
+ */
+__global__
+void query_preload_tiles(const int32_t* const __restrict__ bounds,
+                         const int32_t* const __restrict__ tile_counts,
+                         const int32_t tiles_per_side,
+                         const int32_t tape_length,
+                         TileNode* const __restrict__ tiles,
+                         int32_t* const __restrict__ tile_count,
+                         int32_t* const __restrict__ tape_index,
+                         Interval* const __restrict__ values)
+{
+    const int32_t num_tiles = tiles_per_side * tiles_per_side * tiles_per_side;
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        *tile_count = num_tiles;
+        *tape_index = tape_length;
+    }
+    if (tile_index >= num_tiles) {
+        return;
+    }
 
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
-            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
-            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+    tiles[tile_index].position = tile_counts[tile_index] ? tile_index : -1;
+    tiles[tile_index].tape = 0;
+    tiles[tile_index].next = -1;
+    tiles[tile_index].batch = 0;
+
+    const int4 pos = unpack(tile_index, tiles_per_side);
+    const int32_t p[3] = {pos.x, pos.y, pos.z};
+    for (unsigned j=0; j < 3; ++j) {
+        const float lo = query_unorder(bounds[j]);
+        const float hi = query_unorder(bounds[j + 3]);
+        const float size = (hi - lo) / tiles_per_side;
+        const float margin = size / 16.0f +
+                             fmaxf(fabsf(lo), fabsf(hi)) * 1e-6f;
+        values[tile_index * 3 + j] = Interval(
+                __fsub_rd(lo + size * p[j], margin),
+                __fadd_ru(lo + size * (p[j] + 1), margin));
+    }
+}
 
-            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
-            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
-            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+/*
+ *  query_scatter
+ *
+ *  Writes each point (and its tile's pruned tape) into its tile's range of
+ *  `list`.  `tile_offsets` must be the exclusive prefix sum of the tile
+ *  counts (from offset_leaf_counts), and is used up as a cursor.
+ */
+__global__
+void query_scatter(const int32_t* const __restrict__ point_tiles,
+                   const int32_t count,
+                   const TileNode* const __restrict__ tiles,
+                   int32_t* const __restrict__ tile_offsets,
+                   int2* const __restrict__ list)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= count) {
+        return;
+    }
+    const int32_t t = point_tiles[i];
+    list[atomicAdd(&tile_offsets[t], 1)] = make_int2(i, tiles[t].tape);
+}
 
-            case GPU_OP_COPY_IMM: out = Deriv(imm); break;
-            case GPU_OP_COPY_LHS: out = lhs; break;
-            case GPU_OP_COPY_RHS: out = rhs; break;
+/*  Evaluates a pair of points on one tape */
+template <int SLOTS>
+__device__ inline float2 query_pair_f(
+        const uint64_t* const __restrict__ tape_data, const int32_t tape,
+        const float3 a, const float3 b)
+{
+    float2 slots[SLOTS];
+    const uint64_t* __restrict__ data = &tape_data[tape];
+    slots[((const uint8_t*)data)[1]] = make_float2(a.x, b.x);
+    slots[((const uint8_t*)data)[2]] = make_float2(a.y, b.y);
+    slots[((const uint8_t*)data)[3]] = make_float2(a.z, b.z);
+    data = eval_tape_f(data, slots);
+    return slots[I_OUT(data)];
+}
 
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
-        }
+/*
+ *  query_eval_f
+ *
+ *  Evaluates two neighbouring entries of the sorted list per thread, which
+ *  share a single pass through the tape if they're in the same tile.
+ */
+template <int SLOTS>
+__global__
+void query_eval_f(const uint64_t* const __restrict__ tape_data,
+                  const float3* const __restrict__ points,
+                  const int2* const __restrict__ list,
+                  const int32_t count,
+                  float* const __restrict__ values_out)
+{
+    const int32_t i = (threadIdx.x + blockIdx.x * blockDim.x) * 2;
+    if (i >= count) {
+        return;
+    }
+    const int2 a = list[i];
+    if (i + 1 == count) {
+        const float3 p = points[a.x];
+        values_out[a.x] = query_pair_f<SLOTS>(tape_data, a.y, p, p).x;
+        return;
+    }
+    const int2 b = list[i + 1];
+    const float3 pa = points[a.x];
+    const float3 pb = points[b.x];
+    if (a.y == b.y) {
+        const float2 out = query_pair_f<SLOTS>(tape_data, a.y, pa, pb);
+        values_out[a.x] = out.x;
+        values_out[b.x] = out.y;
+    } else {
+        values_out[a.x] = query_pair_f<SLOTS>(tape_data, a.y, pa, pa).x;
+        values_out[b.x] = query_pair_f<SLOTS>(tape_data, b.y, pb, pb).x;
     }
+}
 
-    const uint8_t i_out = I_OUT(data);
-    const Deriv result = slots[i_out];
-    float norm = sqrtf(powf(result.dx(), 2) +
-                       powf(result.dy(), 2) +
-                       powf(result.dz(), 2));
-    uint8_t dx = (result.dx() / norm) * 127 + 128;
-    uint8_t dy = (result.dy() / norm) * 127 + 128;
-    uint8_t dz = (result.dz() / norm) * 127 + 128;
-    output[pxy] = (0xFF << 24) | (dz << 16) | (dy << 8) | dx;
+/*
+ *  query_eval_d
+ *
+ *  Evaluates the value and gradient of each entry of the sorted list.
+ */
+template <int SLOTS>
+__global__
+void query_eval_d(const uint64_t* const __restrict__ tape_data,
+                  const float3* const __restrict__ points,
+                  const int2* const __restrict__ list,
+                  const int32_t count,
+                  float* const __restrict__ values_out,
+                  float3* const __restrict__ grads_out)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= count) {
+        return;
+    }
+    const int2 entry = list[i];
+    const float3 p = points[entry.x];
+
+    Deriv slots[SLOTS];
+    const uint64_t* __restrict__ data = &tape_data[entry.y];
+    slots[((const uint8_t*)data)[1]] = Deriv(p.x);
+    slots[((const uint8_t*)data)[2]] = Deriv(p.y);
+    slots[((const uint8_t*)data)[3]] = Deriv(p.z);
+    slots[((const uint8_t*)data)[1]].v.x = 1.0f;
+    slots[((const uint8_t*)data)[2]].v.y = 1.0f;
+    slots[((const uint8_t*)data)[3]].v.z = 1.0f;
+    data = eval_tape_d(data, slots);
+
+    const Deriv result = slots[I_OUT(data)];
+    values_out[entry.x] = result.value();
+    grads_out[entry.x] = make_float3(result.dx(), result.dy(), result.dz());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void Context::render2D(const Tape& tape, const Eigen::Matrix3f& mat, const float z) {
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
-
-    // Reset all of the data arrays.  In 2D, we only use stages 0, 2, and 3
-    // for 64^2, 8^2, and per-voxel evaluation steps.
-    CUDA_CHECK(cudaMemsetAsync(stages[0].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 64, 2)));
-    CUDA_CHECK(cudaMemsetAsync(stages[2].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 8, 2)));
-    CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px, 2)));
+/*
+ *  select_*
+ *
+ *  Slot arrays live in per-thread local memory, so their size sets each
+ *  thread's stack frame (and with it, how many threads can be resident).
+ *  The evaluators are instantiated for a handful of slot array sizes, and
+ *  these functions pick the smallest instantiation that fits a tape using
+ *  `num_slots` slots.  Slot indices are 8-bit, so 256 fits any tape.
+ */
+template <int DIMENSION, int BLOCK>
+static decltype(&eval_tiles_i<DIMENSION, 256, BLOCK>)
+select_eval_tiles_i_block(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_tiles_i<DIMENSION, 16, BLOCK>;
+    else if (num_slots <= 32)  return eval_tiles_i<DIMENSION, 32, BLOCK>;
+    else if (num_slots <= 64)  return eval_tiles_i<DIMENSION, 64, BLOCK>;
+    else if (num_slots <= 128) return eval_tiles_i<DIMENSION, 128, BLOCK>;
+    else                       return eval_tiles_i<DIMENSION, 256, BLOCK>;
+}
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Evaluation of 64x64 tiles
-    ////////////////////////////////////////////////////////////////////////////
+/*  The evaluation kernels are also instantiated for each of the block sizes
+ *  in LAUNCH_TILE_THREADS and LAUNCH_VOXEL_TILES (see LaunchConfig).  Sizes
+ *  which weren't instantiated fall back to the defaults. */
+template <int DIMENSION>
+static decltype(&eval_tiles_i<DIMENSION, 256, NUM_THREADS>)
+select_eval_tiles_i(const int32_t num_slots, const int32_t block)
+{
+    switch (block) {
+        case 64:  return select_eval_tiles_i_block<DIMENSION, 64>(num_slots);
+        case 128: return select_eval_tiles_i_block<DIMENSION, 128>(num_slots);
+        case 512: return select_eval_tiles_i_block<DIMENSION, 512>(num_slots);
+        default:  return select_eval_tiles_i_block<DIMENSION, 256>(num_slots);
+    }
+}
 
-    // Go the whole list of first-stage tiles, assigning each to
-    // be [position, tape = 0, next = -1]
-    unsigned count = pow(image_size_px / 64, 2);
-    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+template <int DIMENSION>
+static decltype(&eval_tiles_a<DIMENSION, 256>)
+select_eval_tiles_a(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_tiles_a<DIMENSION, 16>;
+    else if (num_slots <= 32)  return eval_tiles_a<DIMENSION, 32>;
+    else if (num_slots <= 64)  return eval_tiles_a<DIMENSION, 64>;
+    else if (num_slots <= 128) return eval_tiles_a<DIMENSION, 128>;
+    else                       return eval_tiles_a<DIMENSION, 256>;
+}
 
-    // Iterate over 64^2, 8^2 tiles
-    for (unsigned i=0; i < 3; i += 2) {
-        const unsigned tile_size_px = i ? 8 : 64;
-        const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+static decltype(&eval_pixels_aa<256>)
+select_eval_pixels_aa(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_pixels_aa<16>;
+    else if (num_slots <= 32)  return eval_pixels_aa<32>;
+    else if (num_slots <= 64)  return eval_pixels_aa<64>;
+    else if (num_slots <= 128) return eval_pixels_aa<128>;
+    else                       return eval_pixels_aa<256>;
+}
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
-        }
+static decltype(&trace_voxels_3d<256>)
+select_trace_voxels_3d(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return trace_voxels_3d<16>;
+    else if (num_slots <= 32)  return trace_voxels_3d<32>;
+    else if (num_slots <= 64)  return trace_voxels_3d<64>;
+    else if (num_slots <= 128) return trace_voxels_3d<128>;
+    else                       return trace_voxels_3d<256>;
+}
 
-        // Unpack position values into interval X/Y/Z in the values array
-        // This is done in a separate kernel to avoid bloating the
-        // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            image_size_px / tile_size_px,
-            mat, z,
-            reinterpret_cast<Interval*>(values.get()));
+/*  Packs a 2D render's matrix and z value into the 4x4 form used by
+ *  eval_tiles_a, where screen-space Z has no effect */
+static Eigen::Matrix4f mat2d_as_3d(const Eigen::Matrix3f& mat, const float z)
+{
+    Eigen::Matrix4f out = Eigen::Matrix4f::Zero();
+    for (unsigned i=0; i < 2; ++i) {
+        out(i, 0) = mat(i, 0);
+        out(i, 1) = mat(i, 1);
+        out(i, 3) = mat(i, 2);
+    }
+    out(2, 3) = z;
+    out(3, 0) = mat(2, 0);
+    out(3, 1) = mat(2, 1);
+    out(3, 3) = mat(2, 2);
+    return out;
+}
 
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i<2><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
+template <unsigned DIMENSION, int TILES, bool HALF>
+static decltype(&eval_voxels_f<DIMENSION, 256, TILES, HALF>)
+select_eval_voxels_f_block(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_voxels_f<DIMENSION, 16, TILES, HALF>;
+    else if (num_slots <= 32)  return eval_voxels_f<DIMENSION, 32, TILES, HALF>;
+    else if (num_slots <= 64)  return eval_voxels_f<DIMENSION, 64, TILES, HALF>;
+    else if (num_slots <= 128) return eval_voxels_f<DIMENSION, 128, TILES, HALF>;
+    else                       return eval_voxels_f<DIMENSION, 256, TILES, HALF>;
+}
 
-            stages[i].tiles.get(),
-            count,
+template <unsigned DIMENSION, bool HALF>
+static decltype(&eval_voxels_f<DIMENSION, 256, NUM_TILES, HALF>)
+select_eval_voxels_f_tiles(const int32_t num_slots, const int32_t tiles)
+{
+    switch (tiles) {
+        case 2:  return select_eval_voxels_f_block<DIMENSION, 2, HALF>(num_slots);
+        case 8:  return select_eval_voxels_f_block<DIMENSION, 8, HALF>(num_slots);
+        case 16: return select_eval_voxels_f_block<DIMENSION, 16, HALF>(num_slots);
+        default: return select_eval_voxels_f_block<DIMENSION, 4, HALF>(num_slots);
+    }
+}
 
-            reinterpret_cast<Interval*>(values.get()));
+/*  Voxel kernels are also instantiated for both precisions (see
+ *  Context::half_precision) */
+template <unsigned DIMENSION>
+static decltype(&eval_voxels_f<DIMENSION, 256, NUM_TILES, false>)
+select_eval_voxels_f(const int32_t num_slots, const int32_t tiles,
+                     const bool half=false)
+{
+    return half
+        ? select_eval_voxels_f_tiles<DIMENSION, true>(num_slots, tiles)
+        : select_eval_voxels_f_tiles<DIMENSION, false>(num_slots, tiles);
+}
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+static decltype(&eval_pixels_d<256>)
+select_eval_pixels_d(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_pixels_d<16>;
+    else if (num_slots <= 32)  return eval_pixels_d<32>;
+    else if (num_slots <= 64)  return eval_pixels_d<64>;
+    else if (num_slots <= 128) return eval_pixels_d<128>;
+    else                       return eval_pixels_d<256>;
+}
 
-        // Count up active tiles, to figure out how much memory needs to be
-        // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
+static decltype(&eval_pixel_list_d<256>)
+select_eval_pixel_list_d(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_pixel_list_d<16>;
+    else if (num_slots <= 32)  return eval_pixel_list_d<32>;
+    else if (num_slots <= 64)  return eval_pixel_list_d<64>;
+    else if (num_slots <= 128) return eval_pixel_list_d<128>;
+    else                       return eval_pixel_list_d<256>;
+}
 
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i == 0) {
-            active_tile_count *= 64;
-        }
+static decltype(&eval_pixels_d_batch<256>)
+select_eval_pixels_d_batch(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_pixels_d_batch<16>;
+    else if (num_slots <= 32)  return eval_pixels_d_batch<32>;
+    else if (num_slots <= 64)  return eval_pixels_d_batch<64>;
+    else if (num_slots <= 128) return eval_pixels_d_batch<128>;
+    else                       return eval_pixels_d_batch<256>;
+}
 
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        const int next = i ? 3 : 2;
-        if (active_tile_count > stages[next].tile_array_size) {
-            stages[next].tile_array_size = active_tile_count;
-            stages[next].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
-        }
+static decltype(&mesh_tiles<256>)
+select_mesh_tiles(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return mesh_tiles<16>;
+    else if (num_slots <= 32)  return mesh_tiles<32>;
+    else if (num_slots <= 64)  return mesh_tiles<64>;
+    else if (num_slots <= 128) return mesh_tiles<128>;
+    else                       return mesh_tiles<256>;
+}
 
-        if (i < 2) {
-            // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                image_size_px / tile_size_px,
-                stages[next].tiles.get());
-        } else {
-            // Special case for per-pixel evaluation, which
-            // doesn't unpack every single pixel (since that would take up
-            // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                stages[next].tiles.get());
-        }
+static decltype(&eval_mesh_vertices<256>)
+select_eval_mesh_vertices(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return eval_mesh_vertices<16>;
+    else if (num_slots <= 32)  return eval_mesh_vertices<32>;
+    else if (num_slots <= 64)  return eval_mesh_vertices<64>;
+    else if (num_slots <= 128) return eval_mesh_vertices<128>;
+    else                       return eval_mesh_vertices<256>;
+}
 
-        {   // Copy filled tiles into the next level's image (expanding them
-            // by 64x).  This is cleaner that accumulating all of the levels
-            // in a single pass, and could (possibly?) help with skipping
-            // fully occluded tiles.
-            const unsigned next_tile_size = tile_size_px / 8;
-            const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[next].filled.get(),
-                    image_size_px / next_tile_size);
-        }
+static decltype(&query_eval_f<256>)
+select_query_eval_f(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return query_eval_f<16>;
+    else if (num_slots <= 32)  return query_eval_f<32>;
+    else if (num_slots <= 64)  return query_eval_f<64>;
+    else if (num_slots <= 128) return query_eval_f<128>;
+    else                       return query_eval_f<256>;
+}
 
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
-    }
+static decltype(&query_eval_d<256>)
+select_query_eval_d(const int32_t num_slots)
+{
+    if (num_slots <= 16)       return query_eval_d<16>;
+    else if (num_slots <= 32)  return query_eval_d<32>;
+    else if (num_slots <= 64)  return query_eval_d<64>;
+    else if (num_slots <= 128) return query_eval_d<128>;
+    else                       return query_eval_d<256>;
+}
 
-    // Time to render individual pixels!
-    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
-    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
-    calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
-        stages[3].tiles.get(),
-        count,
-        image_size_px / 8,
-        mat, z,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<2><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 8,
+////////////////////////////////////////////////////////////////////////////////
 
-        stages[3].tiles.get(),
-        count,
+RenderStats Context::render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                              const float z)
+{
+    CUDA_CHECK(cudaEventSynchronize(render2D(tape, mat, z, stream.get())));
+    return readStats();
+}
 
-        reinterpret_cast<float2*>(values.get()));
-    CUDA_CHECK(cudaDeviceSynchronize());
+cudaEvent_t Context::render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                              const float z, cudaStream_t stream)
+{
+    autotune2D(tape, mat, z);
+    setTapeWindow(tape.length, stream);
+
+    // We can only replay a graph once every stage's tile array (and the
+    // coverage image, if needed) has been allocated by a regular render.
+    if (graph_mode && stages[2].tile_array_size &&
+                      stages[3].tile_array_size &&
+                      (antialias <= 1 || coverage))
+    {
+        reserveValues(stream);
+
+        cudaGraph_t graph;
+        CUDA_CHECK(cudaStreamBeginCapture(stream,
+                                          cudaStreamCaptureModeThreadLocal));
+        enqueue2D(tape, mat, z, stream, true);
+        CUDA_CHECK(cudaStreamEndCapture(stream, &graph));
+        launchGraph(graph_2d, graph, stream);
+
+        // If any stage ran out of room, then re-render the frame with the
+        // regular path, which will grow the tile arrays.
+        // The same goes for the tape pool, if tape_retry is set.
+        CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                   tile_count_wanted.get(),
+                                   sizeof(int32_t) * 4,
+                                   cudaMemcpyDeviceToHost, stream));
+        queueTapeStats(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        updateTapeStats();
+        if (tile_count_host[2] > stages[2].tile_array_size ||
+            tile_count_host[3] > stages[3].tile_array_size ||
+            (tape_retry && tape_stats.overflows))
+        {
+            enqueue2D(tape, mat, z, stream, false);
+        }
+    } else {
+        enqueue2D(tape, mat, z, stream, false);
+    }
+    setTapeWindow(0, stream);
+    CUDA_CHECK(cudaEventRecord(done.get(), stream));
+    return done.get();
 }
 
-void Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
+void Context::enqueue2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                        const float z, cudaStream_t stream, bool sized)
+{
+    if (antialias > 1 && !coverage && !sized) {
+        coverage.reset(CUDA_MALLOC(float, pow(image_size_px, 2)));
+    }
+    int32_t* const images[3] = {stages[0].filled.get(),
+                                stages[2].filled.get(),
+                                stages[3].filled.get()};
+    enqueueLayers2D(tape, mat, z, 0.0f, 1, images,
+                    packed_2d ? filled_2d.get() : nullptr, stream, sized);
+}
+
+void Context::enqueueLayers2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                              const float z, const float z_step,
+                              const int32_t layers,
+                              int32_t* const images[3], uint64_t* const bits,
+                              cudaStream_t stream, bool sized)
+{
+    progress.step = -1;
+    temporal.valid = false;
+
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset by preload_tiles.
+    loadTape(tape, 0, stream);
+    resetCounters(stream);
+    jit_tape = (jit && jit->hash == tape.hash) ? jit.get() : nullptr;
+
+    // In 2D, we only use stages 0, 2, and 3 for 64^2, 8^2, and per-voxel
+    // evaluation steps.  Only the first stage's image needs to be cleared,
+    // because the later images are completely rewritten by copy_filled_2d.
+    CUDA_CHECK(cudaMemsetAsync(images[0], 0, sizeof(int32_t) *
+                               pow(image_size_px / 64, 2), stream));
+    beginStats(stream);
+
+    // Range of Z values covered by every layer.  Layer positions are
+    // computed with a fused multiply-add here and on the GPU, so that they
+    // match exactly.
+    const float z_last = std::fma(float(layers - 1), z_step, z);
+    const float z_lo = std::min(z, z_last);
+    const float z_hi = std::max(z, z_last);
 
     ////////////////////////////////////////////////////////////////////////////
-    // Evaluation of 64x64x64 tiles
+    // Evaluation of 64x64 tiles
     ////////////////////////////////////////////////////////////////////////////
 
-    // Reset all of the data arrays
-    for (unsigned i=0; i < 4; ++i) {
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
-        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
-                                   pow(image_size_px / tile_size_px, 2)));
-    }
-    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
-                               pow(image_size_px, 2)));
-
     // Go the whole list of first-stage tiles, assigning each to
     // be [position, tape = 0, next = -1]
-    unsigned count = pow(image_size_px / 64, 3);
+    unsigned count = pow(image_size_px / 64, 2);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+    preload_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[0].tiles.get(), count,
+        tile_count.get(), tape_index.get(), tape.length);
 
-    // Iterate over 64^3, 16^3, 4^3 tiles
-    for (unsigned i=0; i < 3; ++i) {
-        //printf("BEGINNING STAGE %u\n", i);
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
+    // Iterate over 64^2, 8^2 tiles
+    for (unsigned i=0; i < 3; i += 2) {
+        const unsigned tile_size_px = i ? 8 : 64;
         const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
+        if (i == 2) {
+            recordStats(1, stream); // stage 1 isn't used in 2D
         }
+        recordStats(i, stream);
+
+        growValues(num_blocks * NUM_THREADS * 3, stream);
 
         // Unpack position values into interval X/Y/Z in the values array
         // This is done in a separate kernel to avoid bloating the
         // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_3d<<<num_blocks, NUM_THREADS>>>(
+        // to occupancy.  The first stage covers every layer's Z value, so
+        // that its tiles (and tapes) are valid for the whole stack.
+        calculate_intervals_2d<<<num_blocks, NUM_THREADS, 0, stream>>>(
             stages[i].tiles.get(),
-            count,
+            tile_count.get() + i,
             image_size_px / tile_size_px,
-            mat,
+            mat, i ? z : z_lo, i ? z : z_hi, i ? z_step : 0.0f,
             reinterpret_cast<Interval*>(values.get()));
 
-        // Mark every tile which is covered in the image as masked,
-        // which means it will be skipped later on.  We do this again below,
-        // but it's basically free, so we should do it here and simplify
-        // the logic in eval_tiles_i.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
+        // Do the actual tape evaluation, which is the expensive step.  If
+        // the tape pool overflows (and tape_retry is set), then we grow the
+        // pool and re-run the tiles which failed to push their tapes.
+        const int32_t eval_threads = launch_config.tile_threads[i];
+        const unsigned eval_blocks = (count + eval_threads - 1) / eval_threads;
+        const auto eval = select_eval_tiles_i<2>(tape.num_slots, eval_threads);
+        bool retry = false;
+        do {
+            eval<<<eval_blocks, eval_threads, 0, stream>>>(
+                tape_data.get(),
+                tape_index.get(),
+                tape_capacity,
+                tape_overflow.get(),
+                retry,
+                warp_cooperative,
+                contiguous_tapes,
+                false,
+                dedup_tapes ? tape_dedup_keys.get() : nullptr,
+                tape_dedup_values.get(),
+
+                images[i / 2],
+                image_size_px / tile_size_px,
+                0, INT32_MAX,
 
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i<3><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
+                stages[i].tiles.get(),
+                tile_count.get() + i,
 
-            stages[i].tiles.get(),
-            count,
+                reinterpret_cast<Interval*>(values.get()),
 
-            reinterpret_cast<Interval*>(values.get()));
+                nullptr, nullptr,
+                nullptr, nullptr,
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+                statsSink(i));
+            retry = true;
+        } while (tape_retry && !sized && growTapes(stream));
 
-        // Now that we have evaluated every tile at this level, we do one more
-        // round of occlusion culling before accumulating tiles to render at
-        // the next phase.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
+        if (affine_tiles && layers == 1) {
+            select_eval_tiles_a<2>(tape.num_slots)<<<num_blocks, NUM_THREADS,
+                                                     0, stream>>>(
+                tape_data.get(),
+                images[i / 2],
+                image_size_px / tile_size_px,
+                0, INT32_MAX,
+                stages[i].tiles.get(),
+                tile_count.get() + i,
+                mat2d_as_3d(mat, z), nullptr,
+                nullptr, nullptr,
+                statsSink(i));
+        }
 
         // Count up active tiles, to figure out how much memory needs to be
-        // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
-
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i < 2) {
-            active_tile_count *= 64;
-        }
+        // allocated in the next stage.  The per-block counts are stored in
+        // `values`, which isn't needed again until the next stage.
+        compact_tiles(stages[i].tiles.get(),
+                      tile_count.get() + i,
+                      num_blocks,
+                      reinterpret_cast<int32_t*>(values.get()),
+                      num_active_tiles.get(),
+                      stream);
 
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        if (active_tile_count > stages[i + 1].tile_array_size) {
-            stages[i + 1].tile_array_size = active_tile_count;
-            stages[i + 1].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
+        const int next = i ? 3 : 2;
+        const int32_t subdivision = i ? 1 : 64 * layers;
+        if (!sized) {
+            // Read back the number of active tiles, which was counted by
+            // compact_tiles.  This only waits on our own stream, not the
+            // whole device.
+            CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                       num_active_tiles.get(),
+                                       sizeof(int32_t),
+                                       cudaMemcpyDeviceToHost, stream));
+            queueTapeStats(stream);
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            updateTapeStats();
+            count = tile_count_host[0] * subdivision;
+
+            // Make sure that the subtiles buffer has enough room
+            // This wastes a small amount of data for the per-pixel
+            // evaluation, where the `next` indexes aren't used, but it's
+            // relatively small.
+            growTiles(next, count, stream);
+        } else {
+            count = stages[next].tile_array_size;
         }
 
+        // Store the next stage's tile count on the GPU
+        count_next_tiles<<<1, 1, 0, stream>>>(
+            num_active_tiles.get(),
+            subdivision,
+            stages[next].tile_array_size,
+            tile_count.get() + next,
+            tile_count_wanted.get() + next);
+
         if (i < 2) {
             // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS>>>(
+            subdivide_active_tiles_2d<<<num_blocks * 64 * layers, NUM_THREADS,
+                                        0, stream>>>(
                 stages[i].tiles.get(),
-                count,
+                tile_count.get() + i,
                 image_size_px / tile_size_px,
-                stages[i + 1].tiles.get());
+                layers,
+                stages[next].tiles.get(),
+                stages[next].tile_array_size);
         } else {
             // Special case for per-pixel evaluation, which
             // doesn't unpack every single pixel (since that would take up
             // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
+            copy_active_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
                 stages[i].tiles.get(),
-                count,
-                stages[i + 1].tiles.get());
+                tile_count.get() + i,
+                stages[next].tiles.get(),
+                stages[next].tile_array_size);
         }
 
         {   // Copy filled tiles into the next level's image (expanding them
             // by 64x).  This is cleaner that accumulating all of the levels
             // in a single pass, and could (possibly?) help with skipping
             // fully occluded tiles.
-            const unsigned next_tile_size = tile_size_px / 4;
+            // Every layer shares the first stage's image.
+            const unsigned next_tile_size = tile_size_px / 8;
             const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_3d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[i + 1].filled.get(),
-                    image_size_px / next_tile_size);
+            const int32_t prev_layer_size =
+                i ? pow(image_size_px / tile_size_px, 2) : 0;
+            if (next == 3 && bits) {
+                const uint32_t w = (image_size_px / 64 + 31) / 32;
+                copy_filled_2d_packed<<<dim3(w, u + 1, layers), dim3(32, 32),
+                                        0, stream>>>(
+                        images[i / 2],
+                        bits,
+                        image_size_px,
+                        prev_layer_size);
+            } else {
+                copy_filled_2d<<<dim3(u + 1, u + 1, layers), dim3(32, 32),
+                                 0, stream>>>(
+                        images[i / 2],
+                        images[i / 2 + 1],
+                        image_size_px / next_tile_size,
+                        prev_layer_size);
+            }
         }
-
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
-    }
-
-    // Time to render individual pixels!
-    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
-    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
-    calculate_voxels<<<num_blocks, NUM_TILES * 32>>>(
-        stages[3].tiles.get(),
-        count,
-        image_size_px / 4,
-        mat,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<3><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 4,
-
-        stages[3].tiles.get(),
-        count,
-
-        reinterpret_cast<float2*>(values.get()));
-
-    {   // Then render normals into those pixels
-        const uint32_t u = ((image_size_px + 15) / 16);
-        eval_pixels_d<<<dim3(u, u), dim3(16, 16)>>>(
-                tape_data.get(),
-                stages[3].filled.get(),
-                normals.get(),
-                image_size_px,
-                mat,
-                stages[0].tiles.get(),
-                stages[1].tiles.get(),
-                stages[2].tiles.get());
-    }
-    CUDA_CHECK(cudaDeviceSynchronize());
-}
-
-
-void Context::render2D_brute(const Tape& tape,
-                             const Eigen::Matrix3f& mat,
-                             const float z)
-{
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
-
-    // Reset the final image array, since we'll be rendering directly to it
-    CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px, 2)));
-
-    // We'll only be evaluating 8x8 tiles, so preload all of them
-    unsigned count = pow(image_size_px / 8, 2);
-    if (count > stages[3].tile_array_size) {
-        stages[3].tile_array_size = count;
-        stages[3].tiles.reset(CUDA_MALLOC(TileNode, count));
     }
-    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[3].tiles.get(), count);
 
     // Time to render individual pixels!
+    recordStats(3, stream);
     num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
     const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
-    calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
+    growValues(num_values, stream);
+    calculate_pixels<<<num_blocks, NUM_TILES * 32, 0, stream>>>(
         stages[3].tiles.get(),
-        count,
+        tile_count.get() + 3,
         image_size_px / 8,
-        mat, z,
+        mat, z, z_step,
         reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<2><<<num_blocks, NUM_TILES * 32>>>(
+    if (jit_tape) {
+        jit_tape->evalVoxels(tape_data.get(), stages[3].tiles.get(),
+                             tile_count.get() + 3, num_blocks,
+                             reinterpret_cast<float2*>(values.get()), stream);
+    }
+    const int32_t eval_tiles = launch_config.voxel_tiles;
+    const auto eval_voxels = select_eval_voxels_f<2>(tape.num_slots,
+                                                     eval_tiles,
+                                                     half_precision);
+    eval_voxels<<<(count + eval_tiles - 1) / eval_tiles, eval_tiles * 32,
+                  0, stream>>>(
         tape_data.get(),
-        stages[3].filled.get(),
+        images[2],
         image_size_px / 8,
 
         stages[3].tiles.get(),
-        count,
+        tile_count.get() + 3,
 
-        reinterpret_cast<float2*>(values.get()));
-    CUDA_CHECK(cudaDeviceSynchronize());
-}
+        reinterpret_cast<float2*>(values.get()),
+        jit_tape != nullptr,
 
-////////////////////////////////////////////////////////////////////////////////
+        bits,
 
+        half_tolerance,
 
-template <int DIMENSION>
-__global__
-void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
-                          int32_t* const __restrict__ tape_index,
-                          int32_t* const __restrict__ image,
-                          const uint32_t tiles_per_side,
+        statsSink(3));
 
-                          TileNode* const __restrict__ in_tiles,
-                          const int32_t in_tile_count,
+    // Antialiasing reuses the final tile list (and its tapes), so only the
+    // ambiguous tiles are supersampled
+    if (antialias > 1 && layers == 1) {
+        const uint32_t u = (image_size_px + 31) / 32;
+        copy_coverage_2d<<<dim3(u, u), dim3(32, 32), 0, stream>>>(
+            images[1], coverage.get(), image_size_px);
+        select_eval_pixels_aa(tape.num_slots)<<<num_blocks, NUM_TILES * 32,
+                                                0, stream>>>(
+            tape_data.get(),
+            stages[3].tiles.get(),
+            tile_count.get() + 3,
+            image_size_px / 8,
+            mat, z,
+            std::min(antialias, 8),
+            coverage.get());
+    }
+    recordStats(4, stream); // there are no normals in 2D
+    recordStats(5, stream);
+}
 
-                          const Interval* __restrict__ values,
+RenderStats Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    CUDA_CHECK(cudaEventSynchronize(render3D(tape, mat, stream.get())));
+    return readStats();
+}
 
-                          const int tile_size_px,
-                          float* __restrict__ const heatmap)
+cudaEvent_t Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                              cudaStream_t stream)
 {
-    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
-        return;
+    autotune3D(tape, mat);
+    setTapeWindow(tape.length, stream);
+
+    // We can only replay a graph once every stage's tile array has been
+    // allocated by a regular render.
+    if (graph_mode && stages[1].tile_array_size &&
+                      stages[2].tile_array_size &&
+                      stages[3].tile_array_size)
+    {
+        reserveValues(stream);
+
+        cudaGraph_t graph;
+        CUDA_CHECK(cudaStreamBeginCapture(stream,
+                                          cudaStreamCaptureModeThreadLocal));
+        enqueue3D(tape, mat, stream, true);
+        CUDA_CHECK(cudaStreamEndCapture(stream, &graph));
+        launchGraph(graph_3d, graph, stream);
+
+        // If any stage ran out of room, then re-render the frame with the
+        // regular path, which will grow the tile arrays.
+        // The same goes for the tape pool, if tape_retry is set.
+        CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                   tile_count_wanted.get(),
+                                   sizeof(int32_t) * 4,
+                                   cudaMemcpyDeviceToHost, stream));
+        queueTapeStats(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        updateTapeStats();
+        bool overflow = false;
+        for (unsigned i=1; i < 4; ++i) {
+            overflow |= tile_count_host[i] > stages[i].tile_array_size;
+        }
+        if (overflow || (tape_retry && tape_stats.overflows)) {
+            enqueue3D(tape, mat, stream, false);
+        }
+    } else if (temporal_reuse) {
+        enqueueTemporal3D(tape, mat, stream);
+    } else {
+        enqueue3D(tape, mat, stream, false);
     }
+    setTapeWindow(0, stream);
+    CUDA_CHECK(cudaEventRecord(done.get(), stream));
+    return done.get();
+}
 
-    // Check to see if we're masked
-    if (in_tiles[tile_index].position == -1) {
-        return;
+void Context::enqueueTemporal3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                                cudaStream_t stream)
+{
+    auto& t = temporal;
+    const unsigned r = TEMPORAL_STAGES;
+    const Eigen::RowVector4f affine(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // The saved stages can be reused if every point of the volume moves by
+    // less than the keyframe's margin.  For affine matrices, the motion of
+    // a point is an affine function of its position, so it's largest at
+    // one of the volume's corners.
+    bool reuse = t.valid && t.tape == &tape && t.tape_hash == tape.hash &&
+                 t.vars == vars &&
+                 t.subtile_size_px == subtile_size_px &&
+                 t.tile_row_begin == tile_row_begin &&
+                 t.tile_row_end == tile_row_end &&
+                 mat.row(3) == affine;
+    for (unsigned i=0; reuse && i < 8; ++i) {
+        const Eigen::Vector4f c((i & 1) ? 1.0f : -1.0f,
+                                (i & 2) ? 1.0f : -1.0f,
+                                (i & 4) ? 1.0f : -1.0f, 1.0f);
+        const Eigen::Vector4f d = (mat - Eigen::Matrix4f(t.mat)) * c;
+        reuse = (d.head<3>().cwiseAbs().array() <= t.margin.array()).all();
     }
 
-    Interval slots[128];
-    slots[((const uint8_t*)tape_data)[1]] = values[tile_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[tile_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[tile_index * 3 + 2];
+    unsigned count;
+    if (reuse) {
+        resetCounters(stream);
+        jit_tape = (jit && jit->hash == tape.hash) ? jit.get() : nullptr;
+        for (unsigned i=r + 1; i < 4; ++i) {
+            CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0,
+                       sizeof(int32_t) * pow(image_size_px / tileSize3D(i), 2),
+                       stream));
+        }
+        CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
+                                   pow(image_size_px, 2), stream));
+
+        // Restore the inputs to the first stage that isn't reused
+        CUDA_CHECK(cudaMemcpyAsync(stages[r].tiles.get(), t.tiles.get(),
+                                   sizeof(TileNode) * t.count,
+                                   cudaMemcpyDeviceToDevice, stream));
+        CUDA_CHECK(cudaMemcpyAsync(stages[r].filled.get(), t.filled.get(),
+                       sizeof(int32_t) * pow(image_size_px / tileSize3D(r), 2),
+                       cudaMemcpyDeviceToDevice, stream));
+        CUDA_CHECK(cudaMemcpyAsync(tape_index.get(), t.tape_index.get(),
+                                   sizeof(int32_t),
+                                   cudaMemcpyDeviceToDevice, stream));
+        store_tile_count<<<1, 1, 0, stream>>>(tile_count.get() + r, t.count);
+        std::copy(t.stage_counts, t.stage_counts + r, stage_counts);
+        count = t.count;
+
+        beginStats(stream);
+        for (unsigned i=0; i < r; ++i) {
+            recordStats(i, stream);
+        }
+    } else {
+        // Render a new keyframe, evaluating the saved stages over tiles
+        // dilated by the margin (converted into the tape's coordinates)
+        count = preloadTiles3D(tape, stream, nullptr);
+        t.margin = mat.block<3, 3>(0, 0).cwiseAbs().rowwise().sum() *
+                   temporal_margin_px * 2.0f / image_size_px;
+        if (mat.row(3) != affine) {
+            t.margin.setZero();
+        }
+        beginStats(stream);
+        for (unsigned i=0; i < r; ++i) {
+            recordStats(i, stream);
+            count = enqueueTiles3D(i, count, mat, 0, tape.num_slots,
+                                   stream, false, nullptr, &t.margin);
+        }
 
-    // Pick out the tape based on the pointer stored in the tiles list
-    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
+        if (count > t.tiles_size) {
+            allocator->fence(stream);
+            t.tiles = allocate<TileNode>(allocator.get(), count, stream);
+            t.tiles_size = count;
+        }
+        if (!t.filled) {
+            t.filled = allocate<int32_t>(allocator.get(),
+                    pow(image_size_px / tileSize3D(r), 2), stream);
+            t.tape_index = allocate<int32_t>(allocator.get(), 1, stream);
+        }
+        CUDA_CHECK(cudaMemcpyAsync(t.tiles.get(), stages[r].tiles.get(),
+                                   sizeof(TileNode) * count,
+                                   cudaMemcpyDeviceToDevice, stream));
+        CUDA_CHECK(cudaMemcpyAsync(t.filled.get(), stages[r].filled.get(),
+                       sizeof(int32_t) * pow(image_size_px / tileSize3D(r), 2),
+                       cudaMemcpyDeviceToDevice, stream));
+        CUDA_CHECK(cudaMemcpyAsync(t.tape_index.get(), tape_index.get(),
+                                   sizeof(int32_t),
+                                   cudaMemcpyDeviceToDevice, stream));
+        std::copy(stage_counts, stage_counts + r, t.stage_counts);
+        t.count = count;
+        t.tape = &tape;
+        t.tape_hash = tape.hash;
+        t.vars = vars;
+        t.mat = mat;
+        t.subtile_size_px = subtile_size_px;
+        t.tile_row_begin = tile_row_begin;
+        t.tile_row_end = tile_row_end;
+        t.valid = mat.row(3) == affine;
+    }
+    enqueueStages3D(count, mat, 0, tape.num_slots, stream, false, nullptr, r);
+}
 
-    constexpr static int CHOICE_ARRAY_SIZE = 256;
-    uint32_t choices[CHOICE_ARRAY_SIZE] = {0};
-    int choice_index = 0;
-    bool has_any_choice = false;
+void Context::enqueue3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                        cudaStream_t stream, bool sized, const int32_t* mask,
+                        SparseVolume* volume)
+{
+    const unsigned count = preloadTiles3D(tape, stream, mask);
+    enqueueStages3D(count, mat, 0, tape.num_slots, stream, sized, volume);
+}
 
-    unsigned work = 0;
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
-        }
-        work++;
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+unsigned Context::preloadTiles3D(const Tape& tape, cudaStream_t stream,
+                                 const int32_t* mask)
+{
+    // Any other render replaces the saved state of a progressive render
+    // or a temporal_reuse keyframe
+    progress.step = -1;
+    temporal.valid = false;
 
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset by preload_tiles.
+    loadTape(tape, 0, stream);
+    resetCounters(stream);
+    jit_tape = (jit && jit->hash == tape.hash) ? jit.get() : nullptr;
 
-            case GPU_OP_SQUARE_LHS: out = square(lhs); break;
-            case GPU_OP_SQRT_LHS:   out = sqrt(lhs); break;
-            case GPU_OP_NEG_LHS:    out = -lhs; break;
-            case GPU_OP_SIN_LHS:    out = sin(lhs); break;
-            case GPU_OP_COS_LHS:    out = cos(lhs); break;
-            case GPU_OP_ASIN_LHS:   out = asin(lhs); break;
-            case GPU_OP_ACOS_LHS:   out = acos(lhs); break;
-            case GPU_OP_ATAN_LHS:   out = atan(lhs); break;
-            case GPU_OP_EXP_LHS:    out = exp(lhs); break;
-            case GPU_OP_ABS_LHS:    out = abs(lhs); break;
-            case GPU_OP_LOG_LHS:    out = log(lhs); break;
+    ////////////////////////////////////////////////////////////////////////////
+    // Evaluation of 64x64x64 tiles
+    ////////////////////////////////////////////////////////////////////////////
 
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
-            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
-            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
-            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+    // Reset all of the data arrays
+    for (unsigned i=0; i < 4; ++i) {
+        const unsigned tile_size_px = tileSize3D(i);
+        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
+                                   pow(image_size_px / tile_size_px, 2),
+                                   stream));
+    }
+    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
+                               pow(image_size_px, 2), stream));
+
+    // Mark pixels which are already occluded at every level
+    if (mask) {
+        for (unsigned i=0; i < 4; ++i) {
+            const unsigned tile_size_px = tileSize3D(i);
+            const uint32_t u = ((image_size_px / tile_size_px) / 32);
+            seed_filled_3d<<<dim3(u + 1, u + 1), dim3(32, 32), 0, stream>>>(
+                mask, stages[i].filled.get(), image_size_px, tile_size_px);
+        }
+    }
 
-#define CHOICE(f, a, b) {                                               \
-    int c = 0;                                                          \
-    out = f(a, b, c);                                                   \
-    if (choice_index < CHOICE_ARRAY_SIZE * 16) {                        \
-        choices[choice_index / 16] |= (c << ((choice_index % 16) * 2)); \
-    }                                                                   \
-    choice_index++;                                                     \
-    has_any_choice |= (c != 0);                                         \
-    break;                                                              \
+    // Go the whole list of first-stage tiles, assigning each to
+    // be [position, tape = 0, next = -1]
+    unsigned count = pow(image_size_px / 64, 3);
+    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    preload_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[0].tiles.get(), count,
+        tile_count.get(), tape_index.get(), tape.length);
+    if (tile_row_begin > 0 || tile_row_end < (int32_t)(image_size_px / 64)) {
+        skip_tile_rows<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            stages[0].tiles.get(), count, image_size_px / 64,
+            tile_row_begin, tile_row_end);
+    }
+    return count;
 }
-            case GPU_OP_MIN_LHS_IMM: CHOICE(min, lhs, imm);
-            case GPU_OP_MIN_LHS_RHS: CHOICE(min, lhs, rhs);
-            case GPU_OP_MAX_LHS_IMM: CHOICE(max, lhs, imm);
-            case GPU_OP_MAX_LHS_RHS: CHOICE(max, lhs, rhs);
 
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
-            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
-            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
-            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
-            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
-            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+void Context::enqueueStages3D(unsigned count, const Eigen::Matrix4f& mat,
+                              const int32_t batch_size,
+                              const int32_t num_slots,
+                              cudaStream_t stream, bool sized,
+                              SparseVolume* volume, unsigned first_stage)
+{
+    // Iterate over 64^3, subtile_size_px^3, 4^3 tiles.  Renders which pick
+    // up at a later stage have already started recording statistics.
+    if (first_stage == 0) {
+        beginStats(stream);
+    }
+    for (unsigned i=first_stage; i < 3; ++i) {
+        recordStats(i, stream);
+        count = enqueueTiles3D(i, count, mat, batch_size, num_slots,
+                               stream, sized, volume);
+    }
 
-            case GPU_OP_COPY_IMM: out = Interval(imm); break;
-            case GPU_OP_COPY_LHS: out = lhs; break;
-            case GPU_OP_COPY_RHS: out = rhs; break;
+    // Time to render individual pixels!
+    recordStats(3, stream);
+    Ptr<uint64_t[]> occupancy;
+    if (volume) {
+        occupancy = allocate<uint64_t>(allocator.get(),
+                                       std::max(count, 1u), stream);
+    }
+    if (sphere_trace && !batch_size && !volume) {
+        traceVoxels3D(count, mat, num_slots, stream);
+    } else {
+        enqueueVoxels3D(0, count, tile_count.get() + 3, mat, batch_size,
+                        num_slots, stream, volume ? occupancy.get() : nullptr);
+    }
 
-            default: assert(false);
+    // Sparse volumes don't need normals, so we read back the surface bricks
+    // (skipping any which turned out to be empty) and stop here.
+    if (volume) {
+        CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                   tile_count.get() + 3, sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        const int32_t n = tile_count_host[0];
+        std::vector<TileNode> tiles(n);
+        std::vector<uint64_t> bits(n);
+        CUDA_CHECK(cudaMemcpyAsync(tiles.data(), stages[3].tiles.get(),
+                                   sizeof(TileNode) * n,
+                                   cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaMemcpyAsync(bits.data(), occupancy.get(),
+                                   sizeof(uint64_t) * n,
+                                   cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        for (int32_t j=0; j < n; ++j) {
+            if (bits[j]) {
+                volume->bricks.push_back(tiles[j].position);
+                volume->occupancy.push_back(bits[j]);
+            }
         }
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
+        recordStats(4, stream);
+        recordStats(5, stream);
+        return;
     }
 
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
+    // Then render normals into those pixels
+    recordStats(4, stream);
+    enqueueNormals3D(mat, batch_size, num_slots, stream, sized);
+    recordStats(5, stream);
+}
 
-    {   // Write the work to the heatmap
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        for (int x=0; x < tile_size_px; ++x) {
-            for (int y=0; y < tile_size_px; ++y) {
-                int px = x + pos.x * tile_size_px;
-                int py = y + pos.y * tile_size_px;
-                atomicAdd(&heatmap[px + py * tile_size_px * tiles_per_side],
-                          work / powf(tile_size_px, 2.0f));
-            }
-        }
-        work = 0;
+unsigned Context::enqueueTiles3D(unsigned i, unsigned count,
+                                 const Eigen::Matrix4f& mat,
+                                 const int32_t batch_size,
+                                 const int32_t num_slots,
+                                 cudaStream_t stream, bool sized,
+                                 SparseVolume* volume,
+                                 const Eigen::Vector3f* margin)
+{
+    // When building a sparse volume, filled tiles are collected here (then
+    // read back at the end of the stage) instead of being written to the
+    // images
+    Ptr<int32_t[]> volume_tiles;
+    Ptr<int32_t[]> volume_count;
+    if (volume) {
+        volume_count = allocate<int32_t>(allocator.get(), 1, stream);
+        volume_tiles = allocate<int32_t>(allocator.get(),
+                                         std::max(count, 1u), stream);
+        CUDA_CHECK(cudaMemsetAsync(volume_count.get(), 0,
+                                   sizeof(int32_t), stream));
     }
 
-    // Empty
-    if (slots[i_out].lower() > 0.0f) {
-        in_tiles[tile_index].position = -1;
-        return;
+    stage_counts[i] = count;
+    const unsigned tile_size_px = tileSize3D(i);
+    const unsigned next_tile_size = tileSize3D(i + 1);
+    const int32_t split = tile_size_px / next_tile_size;
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+
+    // Tiles which stop subdividing early (see early_exit) are collected
+    // here, then unpacked into voxel tiles at the end of the stage.  The
+    // host needs to size the voxel tile list, so this is skipped when
+    // replaying a graph; temporal keyframes also skip it, because their
+    // saved stages are restored without the leaves.
+    const int32_t leaf_split = tile_size_px / 4;
+    const bool leaves = early_exit && i < 2 && !sized && !margin &&
+        leaf_split * leaf_split * leaf_split <= EARLY_EXIT_MAX_VOXEL_TILES;
+    Ptr<TileNode[]> leaf_tiles;
+    Ptr<int32_t[]> leaf_count;
+    if (leaves) {
+        leaf_count = allocate<int32_t>(allocator.get(), 1, stream);
+        leaf_tiles = allocate<TileNode>(allocator.get(),
+                                        std::max(count, 1u), stream);
+        CUDA_CHECK(cudaMemsetAsync(leaf_count.get(), 0,
+                                   sizeof(int32_t), stream));
     }
 
-    // Masked
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        if (image[pos.w] > pos.z) {
-            in_tiles[tile_index].position = -1;
-            return;
+    growValues(num_blocks * NUM_THREADS * 3, stream);
+
+    // Unpack position values into interval X/Y/Z in the values array
+    // This is done in a separate kernel to avoid bloating the
+    // eval_tiles_i kernel with more registers, which is detrimental
+    // to occupancy.
+    if (batch_size) {
+        calculate_intervals_3d_batch<<<num_blocks, NUM_THREADS,
+                                       0, stream>>>(
+            stages[i].tiles.get(),
+            tile_count.get() + i,
+            image_size_px / tile_size_px,
+            batch_mats.get(),
+            reinterpret_cast<Interval*>(values.get()));
+    } else {
+        calculate_intervals_3d<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            stages[i].tiles.get(),
+            tile_count.get() + i,
+            image_size_px / tile_size_px,
+            mat,
+            reinterpret_cast<Interval*>(values.get()));
+    }
+    if (margin) {
+        dilate_intervals_3d<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            tile_count.get() + i,
+            make_float3(margin->x(), margin->y(), margin->z()),
+            reinterpret_cast<Interval*>(values.get()));
+    }
+
+    // Mark every tile which is covered in the image as masked,
+    // which means it will be skipped later on.  We do this again below,
+    // but it's basically free, so we should do it here and simplify
+    // the logic in eval_tiles_i.
+    mask_filled_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[i].filled.get(),
+        image_size_px / tile_size_px,
+        stages[i].tiles.get(),
+        tile_count.get() + i);
+
+    // Do the actual tape evaluation, which is the expensive step.  If
+    // the tape pool overflows (and tape_retry is set), then we grow the
+    // pool and re-run the tiles which failed to push their tapes.
+    //
+    // With z_slabs > 1, tiles are evaluated in slabs from front to back,
+    // masking between slabs, so tiles behind a surface that was found in
+    // an earlier slab are culled before they're evaluated (or push tapes).
+    const int32_t eval_threads = launch_config.tile_threads[i];
+    const unsigned eval_blocks = (count + eval_threads - 1) / eval_threads;
+    const auto eval = select_eval_tiles_i<3>(num_slots, eval_threads);
+    const int32_t tiles_per_side = image_size_px / tile_size_px;
+    const int32_t slabs = (z_slabs < 1) ? 1
+                        : std::min(z_slabs, tiles_per_side);
+    for (int32_t s=0; s < slabs; ++s) {
+        const int32_t slab_hi = tiles_per_side - s * tiles_per_side / slabs;
+        const int32_t slab_lo = tiles_per_side -
+                                (s + 1) * tiles_per_side / slabs;
+        if (s) {
+            mask_filled_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                stages[i].filled.get(),
+                tiles_per_side,
+                stages[i].tiles.get(),
+                tile_count.get() + i);
+        }
+        bool retry = false;
+        do {
+            eval<<<eval_blocks, eval_threads, 0, stream>>>(
+                tape_data.get(),
+                tape_index.get(),
+                tape_capacity,
+                tape_overflow.get(),
+                retry,
+                warp_cooperative,
+                contiguous_tapes,
+                false,
+                dedup_tapes ? tape_dedup_keys.get() : nullptr,
+                tape_dedup_values.get(),
+
+                stages[i].filled.get(),
+                tiles_per_side,
+                slab_lo, slab_hi,
+
+                stages[i].tiles.get(),
+                tile_count.get() + i,
+
+                reinterpret_cast<Interval*>(values.get()),
+
+                volume ? volume_tiles.get() : nullptr,
+                volume ? volume_count.get() : nullptr,
+
+                leaves ? leaf_tiles.get() : nullptr,
+                leaves ? leaf_count.get() : nullptr,
+
+                statsSink(i));
+            retry = true;
+        } while (tape_retry && !sized && growTapes(stream));
+
+        // Margins widen the intervals used above, which affine forms built
+        // from the matrix wouldn't respect, so temporal keyframes skip this
+        if (affine_tiles && !margin) {
+            select_eval_tiles_a<3>(num_slots)<<<num_blocks, NUM_THREADS,
+                                                0, stream>>>(
+                tape_data.get(),
+                stages[i].filled.get(),
+                tiles_per_side,
+                slab_lo, slab_hi,
+                stages[i].tiles.get(),
+                tile_count.get() + i,
+                mat, batch_size ? batch_mats.get() : nullptr,
+                volume ? volume_tiles.get() : nullptr,
+                volume ? volume_count.get() : nullptr,
+                statsSink(i));
         }
     }
 
-    // Filled
-    if (slots[i_out].upper() < 0.0f) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        in_tiles[tile_index].position = -1;
-        if (DIMENSION == 3) {
-            atomicMax(&image[pos.w], pos.z);
-        } else {
-            image[pos.w] = 1;
+    // Now that we have evaluated every tile at this level, we do one more
+    // round of occlusion culling before accumulating tiles to render at
+    // the next phase.
+    mask_filled_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[i].filled.get(),
+        image_size_px / tile_size_px,
+        stages[i].tiles.get(),
+        tile_count.get() + i);
+
+    // Count up active tiles, to figure out how much memory needs to be
+    // allocated in the next stage.  The per-block counts are stored in
+    // `values`, which isn't needed again until the next stage.
+    compact_tiles(stages[i].tiles.get(),
+                  tile_count.get() + i,
+                  num_blocks,
+                  reinterpret_cast<int32_t*>(values.get()),
+                  num_active_tiles.get(),
+                  stream);
+
+    const int32_t subdivision = (i < 2) ? (split * split * split) : 1;
+    if (!sized) {
+        // Read back the number of active tiles, which was counted by
+        // compact_tiles.  This only waits on our own stream, not the
+        // whole device.
+        CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                   num_active_tiles.get(),
+                                   sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+        queueTapeStats(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        updateTapeStats();
+        count = tile_count_host[0] * subdivision;
+
+        if (volume) {
+            CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                       volume_count.get(),
+                                       sizeof(int32_t),
+                                       cudaMemcpyDeviceToHost, stream));
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            auto& filled = volume->filled[i];
+            filled.resize(tile_count_host[0]);
+            CUDA_CHECK(cudaMemcpyAsync(filled.data(), volume_tiles.get(),
+                                       sizeof(int32_t) * filled.size(),
+                                       cudaMemcpyDeviceToHost, stream));
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            std::sort(filled.begin(), filled.end());
         }
-        return;
+
+        if (leaves) {
+            CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                       leaf_count.get(),
+                                       sizeof(int32_t),
+                                       cudaMemcpyDeviceToHost, stream));
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            const int32_t n = tile_count_host[0] *
+                              leaf_split * leaf_split * leaf_split;
+            if (n) {
+                growLeafBricks(leaf_brick_count + n, stream);
+                expand_leaf_tiles<<<(n + NUM_THREADS - 1) / NUM_THREADS,
+                                    NUM_THREADS, 0, stream>>>(
+                    leaf_tiles.get(),
+                    tile_count_host[0],
+                    tiles_per_side,
+                    leaf_split,
+                    leaf_bricks.get(),
+                    leaf_brick_count);
+                leaf_brick_count += n;
+
+                // leaf_tiles and leaf_count go back to the pool when they
+                // go out of scope, which must wait for this kernel.
+                allocator->fence(stream);
+            }
+        }
+
+        // Voxel tiles from leaves go after the ones from the last stage
+        if (i == 2) {
+            count += leaf_brick_count;
+        }
+
+        // Make sure that the subtiles buffer has enough room
+        // This wastes a small amount of data for the per-pixel
+        // evaluation, where the `next` indexes aren't used, but it's
+        // relatively small.
+        growTiles(i + 1, count, stream);
+    } else {
+        count = stages[i + 1].tile_array_size;
     }
 
-    if (!has_any_choice) {
-        return;
+    // Store the next stage's tile count on the GPU
+    count_next_tiles<<<1, 1, 0, stream>>>(
+        num_active_tiles.get(),
+        subdivision,
+        stages[i + 1].tile_array_size,
+        tile_count.get() + i + 1,
+        tile_count_wanted.get() + i + 1);
+
+    if (i < 2) {
+        // Build the new tile list from active tiles in the previous list
+        subdivide_active_tiles_3d<<<num_blocks * subdivision,
+                                    NUM_THREADS, 0, stream>>>(
+            stages[i].tiles.get(),
+            tile_count.get() + i,
+            image_size_px / tile_size_px,
+            split,
+            stages[i + 1].tiles.get(),
+            stages[i + 1].tile_array_size);
+    } else {
+        // Special case for per-pixel evaluation, which
+        // doesn't unpack every single pixel (since that would take up
+        // 64x extra space).
+        copy_active_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            stages[i].tiles.get(),
+            tile_count.get() + i,
+            stages[i + 1].tiles.get(),
+            stages[i + 1].tile_array_size);
+
+        if (!sized && leaf_brick_count) {
+            CUDA_CHECK(cudaMemcpyAsync(
+                    stages[i + 1].tiles.get() + count - leaf_brick_count,
+                    leaf_bricks.get(), sizeof(TileNode) * leaf_brick_count,
+                    cudaMemcpyDeviceToDevice, stream));
+            store_tile_count<<<1, 1, 0, stream>>>(tile_count.get() + i + 1,
+                                                  count);
+        }
     }
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Tape pushing!
-    // Use this array to track which slots are active
-    int* const __restrict__ active = (int*)slots;
-    for (unsigned i=0; i < 128; ++i) {
-        active[i] = false;
+    {   // Copy filled tiles into the next level's image (expanding them
+        // by split^2).  This is cleaner that accumulating all of the
+        // levels in a single pass, and could (possibly?) help with
+        // skipping fully occluded tiles.
+        const uint32_t u = ((image_size_px / next_tile_size) / 32);
+        const unsigned layers = batch_size ? batch_size : 1;
+        copy_filled_3d<<<dim3(u + 1, u + 1, layers), dim3(32, 32),
+                         0, stream>>>(
+                stages[i].filled.get(),
+                stages[i + 1].filled.get(),
+                image_size_px / next_tile_size,
+                split);
     }
-    active[i_out] = true;
+    return count;
+}
 
-    // Check to make sure the tape isn't full
-    // This doesn't mean that we'll successfully claim a chunk, because
-    // other threads could claim chunks before us, but it's a way to check
-    // quickly (and prevents tape_index from getting absurdly large).
-    if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-        return;
+void Context::enqueueVoxels3D(unsigned offset, unsigned count,
+                              const int32_t* num_tiles,
+                              const Eigen::Matrix4f& mat,
+                              const int32_t batch_size,
+                              const int32_t num_slots,
+                              cudaStream_t stream, uint64_t* occupancy)
+{
+    TileNode* const tiles = stages[3].tiles.get() + offset;
+    const unsigned num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
+    growValues(num_values, stream);
+    if (batch_size) {
+        calculate_voxels_batch<<<num_blocks, NUM_TILES * 32, 0, stream>>>(
+            tiles,
+            num_tiles,
+            image_size_px / 4,
+            batch_mats.get(),
+            reinterpret_cast<float2*>(values.get()));
+    } else {
+        calculate_voxels<<<num_blocks, NUM_TILES * 32, 0, stream>>>(
+            tiles,
+            num_tiles,
+            image_size_px / 4,
+            mat,
+            reinterpret_cast<float2*>(values.get()));
+    }
+    // Batches have one root tape per layer, so they're always interpreted
+    const bool use_jit = jit_tape && !batch_size;
+    if (use_jit) {
+        jit_tape->evalVoxels(tape_data.get(), tiles, num_tiles, num_blocks,
+                             reinterpret_cast<float2*>(values.get()), stream);
     }
+    const int32_t eval_tiles = launch_config.voxel_tiles;
+    const auto eval_voxels = select_eval_voxels_f<3>(num_slots, eval_tiles,
+                                                     half_precision);
+    eval_voxels<<<(count + eval_tiles - 1) / eval_tiles, eval_tiles * 32,
+                  0, stream>>>(
+        tape_data.get(),
+        stages[3].filled.get(),
+        image_size_px / 4,
 
-    // Claim a chunk of tape
-    int32_t out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-    int32_t out_offset = SUBTAPE_CHUNK_SIZE;
+        tiles,
+        num_tiles,
 
-    // If we've run out of tape, then immediately return
-    if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-        return;
-    }
+        reinterpret_cast<float2*>(values.get()),
+        use_jit,
 
-    // Write out the end of the tape, which is the same as the ending
-    // of the previous tape (0 opcode, with i_out as the last slot)
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
+        occupancy ? occupancy + offset : nullptr,
 
-    while (1) {
-        uint64_t d = *--data;
-        if (!OP(&d)) {
-            break;
-        }
-        work++;
-        const uint8_t op = OP(&d);
-        if (op == GPU_OP_JUMP) {
-            data += JUMP_TARGET(&d);
-            continue;
+        half_tolerance,
+
+        statsSink(3));
+}
+
+/*  Number of values (in float2 units) used by traceVoxels3D to bucket
+ *  `count` tiles into the columns of an image */
+static size_t trace_values_size(const int32_t image_size_px,
+                                const size_t count)
+{
+    const size_t columns = (image_size_px / 4) * (image_size_px / 4);
+    return (columns + 1 + count + 1) / 2;
+}
+
+void Context::traceVoxels3D(unsigned count, const Eigen::Matrix4f& mat,
+                            const int32_t num_slots, cudaStream_t stream)
+{
+    // The bucketed tile lists are stored in `values`, which isn't otherwise
+    // used by this stage: first the column offsets, then the tile indices.
+    const int32_t tiles_per_side = image_size_px / 4;
+    const int32_t num_columns = tiles_per_side * tiles_per_side;
+    growValues(trace_values_size(image_size_px, count), stream);
+    int32_t* const columns = reinterpret_cast<int32_t*>(values.get());
+    int32_t* const column_tiles = columns + num_columns + 1;
+
+    CUDA_CHECK(cudaMemsetAsync(columns, 0, sizeof(int32_t) * num_columns,
+                               stream));
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    count_leaf_columns<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[3].tiles.get(),
+        tile_count.get() + 3,
+        tiles_per_side,
+        columns);
+    scan_active_tiles<<<1, NUM_THREADS, 0, stream>>>(
+        columns, num_columns, columns + num_columns);
+    bucket_leaf_columns<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[3].tiles.get(),
+        tile_count.get() + 3,
+        tiles_per_side,
+        columns,
+        column_tiles);
+    sort_leaf_columns<<<(num_columns + NUM_THREADS - 1) / NUM_THREADS,
+                        NUM_THREADS, 0, stream>>>(
+        stages[3].tiles.get(),
+        tiles_per_side,
+        columns,
+        column_tiles);
+
+    const uint32_t u = ((image_size_px + 15) / 16);
+    select_trace_voxels_3d(num_slots)<<<dim3(u, u), dim3(16, 16),
+                                        0, stream>>>(
+        tape_data.get(),
+        stages[3].filled.get(),
+        image_size_px,
+
+        stages[3].tiles.get(),
+        columns,
+        column_tiles,
+
+        mat,
+        lipschitz,
+
+        statsSink(3));
+}
+
+void Context::enqueueNormals3D(const Eigen::Matrix4f& mat,
+                               const int32_t batch_size,
+                               const int32_t num_slots,
+                               cudaStream_t stream, bool sized)
+{
+    const uint32_t u = ((image_size_px + 15) / 16);
+    if (batch_size) {
+        const auto eval_pixels = select_eval_pixels_d_batch(num_slots);
+        eval_pixels<<<dim3(u, u, batch_size), dim3(16, 16), 0, stream>>>(
+                tape_data.get(),
+                stages[3].filled.get(),
+                normals.get(),
+                image_size_px,
+                batch_mats.get(),
+                stages[0].tiles.get(),
+                stages[1].tiles.get(),
+                stages[2].tiles.get(),
+                subtile_size_px);
+    } else if (sized) {
+        const auto eval_pixels = select_eval_pixels_d(num_slots);
+        eval_pixels<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
+                tape_data.get(),
+                stages[3].filled.get(),
+                normals.get(),
+                image_size_px,
+                mat,
+                stages[0].tiles.get(),
+                stages[1].tiles.get(),
+                stages[2].tiles.get(),
+                subtile_size_px,
+                surface_output);
+    } else {
+        // Build a list of visible pixels, grouped by their leaf tiles, then
+        // evaluate normals for just those pixels.  The list is sized on the
+        // host, so this isn't used for sized (captured) renders.
+        const int32_t num_leaves =
+            stage_counts[0] + stage_counts[1] + stage_counts[2];
+        const unsigned leaf_blocks =
+            (num_leaves + NUM_THREADS - 1) / NUM_THREADS;
+        auto pixel_leaves = allocate<int32_t>(
+                allocator.get(), pow(image_size_px, 2), stream);
+        auto leaf_counts = allocate<int32_t>(
+                allocator.get(), std::max(num_leaves, 1), stream);
+        auto block_sums = allocate<int32_t>(
+                allocator.get(), std::max(leaf_blocks, 1u), stream);
+        CUDA_CHECK(cudaMemsetAsync(leaf_counts.get(), 0,
+                                   sizeof(int32_t) * num_leaves, stream));
+
+        count_pixel_leaves<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
+                stages[3].filled.get(),
+                image_size_px,
+                stages[0].tiles.get(),
+                stages[1].tiles.get(),
+                stages[2].tiles.get(),
+                subtile_size_px,
+                stage_counts[0],
+                stage_counts[1],
+                pixel_leaves.get(),
+                leaf_counts.get(),
+                surface_output);
+        sum_leaf_counts<<<leaf_blocks, NUM_THREADS, 0, stream>>>(
+                leaf_counts.get(), num_leaves, block_sums.get());
+        scan_active_tiles<<<1, NUM_THREADS, 0, stream>>>(
+                block_sums.get(), leaf_blocks, num_active_tiles.get());
+        offset_leaf_counts<<<leaf_blocks, NUM_THREADS, 0, stream>>>(
+                leaf_counts.get(), num_leaves, block_sums.get());
+
+        // Read back the number of visible pixels, to size the list
+        CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(),
+                                   num_active_tiles.get(),
+                                   sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+        const int32_t num_pixels = tile_count_host[0];
+
+        auto list = allocate<int2>(
+                allocator.get(), std::max(num_pixels, 1), stream);
+        scatter_pixel_leaves<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
+                pixel_leaves.get(),
+                image_size_px,
+                stages[0].tiles.get(),
+                stages[1].tiles.get(),
+                stages[2].tiles.get(),
+                stage_counts[0],
+                stage_counts[1],
+                leaf_counts.get(),
+                list.get());
+        if (num_pixels) {
+            const unsigned num_blocks =
+                (num_pixels + NUM_THREADS - 1) / NUM_THREADS;
+            if (jit_tape) {
+                jit_tape->evalNormals(mat, tape_data.get(),
+                                      stages[3].filled.get(),
+                                      normals.get(), image_size_px,
+                                      list.get(), num_active_tiles.get(),
+                                      num_blocks, stream);
+            }
+            const auto eval_pixels = select_eval_pixel_list_d(num_slots);
+            eval_pixels<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                    tape_data.get(),
+                    stages[3].filled.get(),
+                    normals.get(),
+                    image_size_px,
+                    mat,
+                    list.get(),
+                    num_active_tiles.get(),
+                    jit_tape != nullptr,
+                    surface_output);
         }
 
-        const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
-                                op <= GPU_OP_MAX_LHS_RHS;
-        choice_index -= has_choice;
+        // The temporary buffers are freed when they go out of scope, which
+        // must happen after the kernels above are done with them.
+        allocator->fence(stream);
+    }
+}
 
-        const uint8_t i_out = I_OUT(&d);
-        if (!active[i_out]) {
-            continue;
+void Context::renderBatch3D(const std::vector<const Tape*>& tapes,
+                            const MatrixList& mats)
+{
+    CUDA_CHECK(cudaEventSynchronize(
+                renderBatch3D(tapes, mats, stream.get())));
+}
+
+cudaEvent_t Context::renderBatch3D(const std::vector<const Tape*>& tapes,
+                                   const MatrixList& mats,
+                                   cudaStream_t stream)
+{
+    assert(tapes.size() == mats.size());
+    const int32_t batch_size = tapes.size();
+    if (batch_size == 0) {
+        CUDA_CHECK(cudaEventRecord(done.get(), stream));
+        return done.get();
+    }
+
+    // Make sure that every stage's image (and the normals) has one layer
+    // per item in the batch.  Freeing memory synchronizes the device, so
+    // this is safe even if a previous render is still running.
+    if (batch_size > num_layers) {
+        for (unsigned i=0; i < 4; ++i) {
+            const unsigned tile_size_px = (i == 1) ? MIN_SUBTILE_SIZE_PX
+                                                   : tileSize3D(i);
+            stages[i].filled.reset(CUDA_MALLOC(
+                    int32_t,
+                    batch_size * pow(image_size_px / tile_size_px, 2)));
         }
+        normals.reset(CUDA_MALLOC(uint32_t,
+                                  batch_size * pow(image_size_px, 2)));
+        num_layers = batch_size;
+    }
+    if (batch_size > batch_capacity) {
+        allocator->fence(stream);
+        batch_mats = allocate<Eigen::Matrix4f>(
+                allocator.get(), batch_size, stream);
+        batch_tape_starts = allocate<int32_t>(
+                allocator.get(), batch_size, stream);
+        batch_capacity = batch_size;
+    }
 
-        assert(!has_choice || choice_index >= 0);
+    // Every layer gets its own set of top-level tiles
+    progress.step = -1;
+    temporal.valid = false;
+    const unsigned tiles_per_layer = pow(image_size_px / 64, 3);
+    const unsigned count = tiles_per_layer * batch_size;
+    growTiles(0, count, stream);
+
+    // Copy the tapes back-to-back into the beginning of the context's tape
+    // buffer area, recording where each one starts.
+    std::vector<int32_t> tape_starts;
+    int32_t tape_length = 0;
+    int32_t num_slots = 0;
+    for (const auto& t : tapes) {
+        tape_starts.push_back(tape_length);
+        tape_length += t->length;
+        num_slots = std::max(num_slots, t->num_slots);
+    }
+    if (tape_length >= tape_capacity) {
+        fprintf(stderr, "Batch tapes do not fit in tape buffer\n");
+        exit(1);
+    }
+    for (int32_t i=0; i < batch_size; ++i) {
+        loadTape(*tapes[i], tape_starts[i], stream);
+    }
+    setTapeWindow(tape_length, stream);
+    CUDA_CHECK(cudaMemcpyAsync(batch_tape_starts.get(), tape_starts.data(),
+                               sizeof(int32_t) * batch_size,
+                               cudaMemcpyHostToDevice, stream));
+    CUDA_CHECK(cudaMemcpyAsync(batch_mats.get(), mats.data(),
+                               sizeof(Eigen::Matrix4f) * batch_size,
+                               cudaMemcpyHostToDevice, stream));
+    resetCounters(stream);
 
-        const int choice = (has_choice && choice_index < CHOICE_ARRAY_SIZE * 16)
-            ? ((choices[choice_index / 16] >>
-              ((choice_index % 16) * 2)) & 3)
-            : 0;
+    // Reset all of the data arrays
+    for (unsigned i=0; i < 4; ++i) {
+        const unsigned tile_size_px = tileSize3D(i);
+        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
+                                   batch_size *
+                                   pow(image_size_px / tile_size_px, 2),
+                                   stream));
+    }
+    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
+                               batch_size * pow(image_size_px, 2), stream));
 
-        // If we're about to write a new piece of data to the tape,
-        // (and are done with the current chunk), then we need to
-        // add another link to the linked list.
-        --out_offset;
-        if (out_offset == 0) {
-            const int32_t prev_index = out_index;
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    preload_tiles_batch<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[0].tiles.get(), tiles_per_layer, batch_size,
+        batch_tape_starts.get(),
+        tile_count.get(), tape_index.get(), tape_length);
 
-            // Early exit if we can't finish writing out this tape
-            if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-                for (int x=0; x < tile_size_px; ++x) {
-                    for (int y=0; y < tile_size_px; ++y) {
-                        int px = x + pos.x * tile_size_px;
-                        int py = y + pos.y * tile_size_px;
-                        atomicAdd(&heatmap[px + py * tile_size_px * tiles_per_side],
-                                  work / powf(tile_size_px, 2.0f));
-                    }
-                }
-                return;
-            }
-            out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-            out_offset = SUBTAPE_CHUNK_SIZE;
+    enqueueStages3D(count, mats[0], batch_size, num_slots, stream, false);
 
-            // Later exit if we claimed a chunk that exceeds the tape array
-            if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-                for (int x=0; x < tile_size_px; ++x) {
-                    for (int y=0; y < tile_size_px; ++y) {
-                        int px = x + pos.x * tile_size_px;
-                        int py = y + pos.y * tile_size_px;
-                        atomicAdd(&heatmap[px + py * tile_size_px * tiles_per_side],
-                                  work / powf(tile_size_px, 2.0f));
-                    }
-                }
-                return;
-            }
-            --out_offset;
+    setTapeWindow(0, stream);
+    CUDA_CHECK(cudaEventRecord(done.get(), stream));
+    return done.get();
+}
 
-            // Forward-pointing link
-            OP(&tape_data[out_index + out_offset]) = GPU_OP_JUMP;
-            const int32_t delta = (int32_t)prev_index -
-                                  (int32_t)(out_index + out_offset);
-            JUMP_TARGET(&tape_data[out_index + out_offset]) = delta;
+void Context::enqueueScene3D(
+        const std::vector<std::shared_ptr<const Tape>>& tapes,
+        const std::vector<int32_t>& tile_tapes,
+        const Eigen::Matrix4f& mat, cudaStream_t stream)
+{
+    progress.step = -1;
+    temporal.valid = false;
+    jit_tape = nullptr;
+
+    // Copy the tapes back-to-back into the beginning of the context's tape
+    // buffer area, as in renderBatch3D
+    std::vector<int32_t> tape_starts;
+    int32_t tape_length = 0;
+    int32_t num_slots = 1;
+    for (const auto& t : tapes) {
+        tape_starts.push_back(tape_length);
+        tape_length += t->length;
+        num_slots = std::max(num_slots, t->num_slots);
+    }
+    if (tape_length >= tape_capacity) {
+        fprintf(stderr, "Scene tapes do not fit in tape buffer\n");
+        exit(1);
+    }
+    for (unsigned i=0; i < tapes.size(); ++i) {
+        loadTape(*tapes[i], tape_starts[i], stream);
+    }
+    setTapeWindow(tape_length, stream);
+    resetCounters(stream);
+
+    // Convert each tile's index into `tapes` into the start of its tape
+    const unsigned count = tile_tapes.size();
+    std::vector<int32_t> starts(count);
+    for (unsigned i=0; i < count; ++i) {
+        const int32_t t = tile_tapes[i];
+        starts[i] = (t < 0) ? -1 : tape_starts[t];
+    }
+    if (!scene_tile_tapes) {
+        scene_tile_tapes = allocate<int32_t>(allocator.get(), count, stream);
+    }
+    CUDA_CHECK(cudaMemcpyAsync(scene_tile_tapes.get(), starts.data(),
+                               sizeof(int32_t) * count,
+                               cudaMemcpyHostToDevice, stream));
 
-            // Backward-pointing link
-            OP(&tape_data[prev_index]) = GPU_OP_JUMP;
-            JUMP_TARGET(&tape_data[prev_index]) = -delta;
+    for (unsigned i=0; i < 4; ++i) {
+        const unsigned tile_size_px = tileSize3D(i);
+        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
+                                   pow(image_size_px / tile_size_px, 2),
+                                   stream));
+    }
+    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
+                               pow(image_size_px, 2), stream));
+
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    preload_tiles_scene<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[0].tiles.get(), count, scene_tile_tapes.get(),
+        tile_count.get(), tape_index.get(), tape_length);
+    if (tile_row_begin > 0 || tile_row_end < (int32_t)(image_size_px / 64)) {
+        skip_tile_rows<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            stages[0].tiles.get(), count, image_size_px / 64,
+            tile_row_begin, tile_row_end);
+    }
+    enqueueStages3D(count, mat, 0, num_slots, stream, false);
+    setTapeWindow(0, stream);
+}
 
-            // We've written the jump, so adjust the offset again
-            --out_offset;
+bool Context::renderProgressive(const Tape& tape, const Eigen::Matrix4f& mat,
+                                const float budget_ms)
+{
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    const auto elapsed_ms = [&start]() {
+        return duration<float, std::milli>(steady_clock::now() - start)
+            .count();
+    };
+
+    cudaStream_t s = stream.get();
+    auto& p = progress;
+    if (p.step < 0 || p.tape != &tape || p.tape_hash != tape.hash ||
+        p.vars != vars || p.mat != mat ||
+        p.subtile_size_px != subtile_size_px ||
+        p.tile_row_begin != tile_row_begin ||
+        p.tile_row_end != tile_row_end)
+    {
+        if (p.tape_hash != tape.hash) {
+            p.ms_per_voxel_tile = 0.0f;
+        }
+        p.count = preloadTiles3D(tape, s, nullptr);
+        p.tape = &tape;
+        p.tape_hash = tape.hash;
+        p.vars = vars;
+        p.mat = mat;
+        p.subtile_size_px = subtile_size_px;
+        p.tile_row_begin = tile_row_begin;
+        p.tile_row_end = tile_row_end;
+        p.step = 0;
+        p.voxels_done = 0;
+
+        // The stages are spread across several calls, so they aren't timed
+        beginStats(s);
+        stats_timed = false;
+
+        if (!progress_filled) {
+            progress_filled = allocate<int32_t>(
+                    allocator.get(), pow(image_size_px, 2), s);
         }
+    } else if (p.step == Progress::DONE) {
+        return true;
+    } else {
+        // Put back the working image, which the preview was drawn over
+        CUDA_CHECK(cudaMemcpyAsync(stages[3].filled.get(),
+                                   progress_filled.get(),
+                                   sizeof(int32_t) * pow(image_size_px, 2),
+                                   cudaMemcpyDeviceToDevice, s));
+    }
 
-        active[i_out] = false;
-        if (choice == 0) {
-            const uint8_t i_lhs = I_LHS(&d);
-            if (i_lhs) {
-                active[i_lhs] = true;
-            }
-            const uint8_t i_rhs = I_RHS(&d);
-            if (i_rhs) {
-                active[i_rhs] = true;
+    do {
+        if (p.step < 3) {
+            p.count = enqueueTiles3D(p.step, p.count, mat, 0, tape.num_slots,
+                                     s, false);
+            p.step++;
+        } else if (p.step == 3) {
+            // Size the chunk of voxel tiles to fill the rest of the budget,
+            // based on how long previous chunks took
+            unsigned n = std::min(p.count - p.voxels_done,
+                                  (unsigned)PROGRESSIVE_MIN_VOXEL_TILES);
+            if (p.ms_per_voxel_tile > 0.0f) {
+                const float t = (budget_ms - elapsed_ms()) /
+                                p.ms_per_voxel_tile;
+                n = std::max(n, (unsigned)std::min(
+                            t, (float)(p.count - p.voxels_done)));
             }
-        } else if (choice == 1 /* LHS */) {
-            // The non-immediate is always the LHS in commutative ops, and
-            // min/max (the only clauses that produce a choice) are commutative
-            const uint8_t i_lhs = I_LHS(&d);
-            active[i_lhs] = true;
-            if (i_lhs == i_out) {
-                ++out_offset;
-                continue;
-            } else {
-                OP(&d) = GPU_OP_COPY_LHS;
+            if (n) {
+                // num_active_tiles isn't used again until normals
+                const auto t0 = steady_clock::now();
+                store_tile_count<<<1, 1, 0, s>>>(num_active_tiles.get(), n);
+                enqueueVoxels3D(p.voxels_done, n, num_active_tiles.get(),
+                                mat, 0, tape.num_slots, s, nullptr);
+                CUDA_CHECK(cudaStreamSynchronize(s));
+                p.ms_per_voxel_tile = duration<float, std::milli>(
+                        steady_clock::now() - t0).count() / n;
+                p.voxels_done += n;
             }
-        } else if (choice == 2 /* RHS */) {
-            const uint8_t i_rhs = I_RHS(&d);
-            if (i_rhs) {
-                active[i_rhs] = true;
-                if (i_rhs == i_out) {
-                    ++out_offset;
-                    continue;
-                } else {
-                    OP(&d) = GPU_OP_COPY_RHS;
-                }
-            } else {
-                OP(&d) = GPU_OP_COPY_IMM;
+            if (p.voxels_done >= p.count) {
+                p.step++;
             }
+        } else {
+            // Clear normals left over from the preview
+            CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
+                                       pow(image_size_px, 2), s));
+            enqueueNormals3D(mat, 0, tape.num_slots, s, false);
+            p.step++;
         }
-        tape_data[out_index + out_offset] = d;
+        CUDA_CHECK(cudaStreamSynchronize(s));
+    } while (p.step != Progress::DONE && elapsed_ms() < budget_ms);
+
+    if (p.step != Progress::DONE) {
+        drawPreview3D(mat, s);
     }
+    CUDA_CHECK(cudaEventRecord(done.get(), s));
+    CUDA_CHECK(cudaStreamSynchronize(s));
+    return p.step == Progress::DONE;
+}
 
-    {   // Accumulate the work of walking backwards through the tape
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        for (int x=0; x < tile_size_px; ++x) {
-            for (int y=0; y < tile_size_px; ++y) {
-                int px = x + pos.x * tile_size_px;
-                int py = y + pos.y * tile_size_px;
-                atomicAdd(&heatmap[px + py * tile_size_px * tiles_per_side],
-                          work / powf(tile_size_px, 2.0f));
-            }
+void Context::drawPreview3D(const Eigen::Matrix4f& mat, cudaStream_t stream)
+{
+    const auto& p = progress;
+
+    // Save the working image, then draw over it
+    CUDA_CHECK(cudaMemcpyAsync(progress_filled.get(), stages[3].filled.get(),
+                               sizeof(int32_t) * pow(image_size_px, 2),
+                               cudaMemcpyDeviceToDevice, stream));
+
+    // Tiles in the pending stage are drawn as solid blocks.  Until the
+    // final stage, filled tiles from coarser stages haven't reached the
+    // pixel image yet, so they're copied in as well.
+    const uint32_t u = (image_size_px + 31) / 32;
+    if (p.step < 4) {
+        const int32_t tile_size_px = tileSize3D(std::min(p.step, 2));
+        const int32_t tiles_per_side = image_size_px / tile_size_px;
+        if (p.step < 3) {
+            copy_filled_3d<<<dim3(u, u), dim3(32, 32), 0, stream>>>(
+                stages[p.step].filled.get(),
+                stages[3].filled.get(),
+                image_size_px,
+                tile_size_px);
+        }
+        const int32_t offset = (p.step == 3) ? p.voxels_done : 0;
+        const int32_t n = p.count - offset;
+        auto tops = allocate<int32_t>(allocator.get(),
+                                      pow(tiles_per_side, 2), stream);
+        CUDA_CHECK(cudaMemsetAsync(tops.get(), 0, sizeof(int32_t) *
+                                   pow(tiles_per_side, 2), stream));
+        if (n) {
+            preview_tiles_3d<<<(n + NUM_THREADS - 1) / NUM_THREADS,
+                               NUM_THREADS, 0, stream>>>(
+                stages[p.step].tiles.get() + offset, n,
+                tiles_per_side, tops.get());
         }
+        expand_preview_3d<<<dim3(u, u), dim3(32, 32), 0, stream>>>(
+            tops.get(), stages[3].filled.get(), image_size_px, tile_size_px);
+        allocator->fence(stream);
     }
 
-    // Write the beginning of the tape
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
-
-    // Record the beginning of the tape in the output tile
-    in_tiles[tile_index].tape = out_index + out_offset;
+    const Eigen::Matrix3f nm = mat.block<3, 3>(0, 0).inverse().transpose();
+    preview_normals<<<dim3(u, u), dim3(32, 32), 0, stream>>>(
+        stages[3].filled.get(), normals.get(), image_size_px, nm);
+    CUDA_CHECK(cudaGetLastError());
 }
 
-template <unsigned DIMENSION>
-__global__
-void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
-                           int32_t* const __restrict__ image,
-                           const uint32_t tiles_per_side,
-
-                           TileNode* const __restrict__ in_tiles,
-                           const int32_t in_tile_count,
-
-                           const float2* const __restrict__ values,
+void Context::reserve(const unsigned stage, const size_t tile_count) {
+    growTiles(stage, tile_count, stream.get());
+    reserveValues(stream.get());
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+}
 
-                           float* __restrict__ const heatmap)
+void Context::growTiles(const unsigned stage, const size_t count,
+                        cudaStream_t stream)
 {
-    // Each tile is executed by 32 threads (one for each pair of voxels, so
-    // we can do all of our load/stores as float2s and make memory happier).
-    //
-    // This is different from the eval_tiles_i function, which evaluates one
-    // tile per thread, because the tiles are already expanded by 64x by the
-    // time they're stored in the in_tiles list.
-    const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
-    const int32_t tile_index = voxel_index / 32;
-    if (tile_index >= in_tile_count) {
+    if (count <= stages[stage].tile_array_size) {
         return;
     }
+    // Grow geometrically, so that a shape which slowly becomes more complex
+    // doesn't reallocate on every frame.  The old array is released once
+    // the work already queued on `stream` is done with it.
+    const size_t size = std::max(count, stages[stage].tile_array_size * 2);
+    allocator->fence(stream);
+    stages[stage].tiles = allocate<TileNode>(allocator.get(), size, stream);
+    stages[stage].tile_array_size = size;
+}
 
-    // Check whether this pixel is masked in the output image
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        const int4 sub = unpack(threadIdx.x % 32, 4);
-
-        const int32_t px = pos.x * 4 + sub.x;
-        const int32_t py = pos.y * 4 + sub.y;
-        const int32_t pz = pos.z * 4 + sub.z;
+void Context::beginStats(cudaStream_t stream) {
+#ifdef MPR_RENDER_STATS
+    CUDA_CHECK(cudaMemsetAsync(stats_data.get(), 0,
+                               sizeof(RenderStats::Stage) * 4, stream));
+#endif
+    // Events can't be timed once they're part of a captured graph
+    cudaStreamCaptureStatus status;
+    CUDA_CHECK(cudaStreamIsCapturing(stream, &status));
+    stats_timed = stage_timing && status == cudaStreamCaptureStatusNone;
+}
 
-        // Early return if this pixel won't ever be filled
-        if (image[px + py * tiles_per_side * 4] >= pz + 2) {
-            return;
-        }
+void Context::recordStats(unsigned stage, cudaStream_t stream) {
+    if (stats_timed) {
+        CUDA_CHECK(cudaEventRecord(stats_events[stage].get(), stream));
     }
+}
 
-    float2 slots[128];
-
-    // Pick out the tape based on the pointer stored in the tiles list
-    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
-    slots[((const uint8_t*)tape_data)[1]] = values[voxel_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[voxel_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[voxel_index * 3 + 2];
+StatsSink Context::statsSink(unsigned stage) const {
+#ifdef MPR_RENDER_STATS
+    return StatsSink{stats_data.get() + stage, stats_heatmap, image_size_px};
+#else
+    (void)stage;
+    return StatsSink{nullptr, nullptr, 0};
+#endif
+}
 
-    unsigned work = 0;
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
+RenderStats Context::readStats() {
+    CUDA_CHECK(cudaEventSynchronize(done.get()));
+
+    RenderStats out = {};
+#ifdef MPR_RENDER_STATS
+    CUDA_CHECK(cudaMemcpyAsync(out.stages, stats_data.get(),
+                               sizeof(RenderStats::Stage) * 4,
+                               cudaMemcpyDeviceToHost, stream.get()));
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+#endif
+    if (stats_timed) {
+        for (unsigned i=0; i < 4; ++i) {
+            CUDA_CHECK(cudaEventElapsedTime(&out.stages[i].time_ms,
+                                            stats_events[i].get(),
+                                            stats_events[i + 1].get()));
         }
-        work++;
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
-
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
-
-            case GPU_OP_SQUARE_LHS: out = make_float2(lhs.x * lhs.x, lhs.y * lhs.y); break;
-            case GPU_OP_SQRT_LHS: out = make_float2(sqrtf(lhs.x), sqrtf(lhs.y)); break;
-            case GPU_OP_NEG_LHS: out = make_float2(-lhs.x, -lhs.y); break;
-            case GPU_OP_SIN_LHS: out = make_float2(sinf(lhs.x), sinf(lhs.y)); break;
-            case GPU_OP_COS_LHS: out = make_float2(cosf(lhs.x), cosf(lhs.y)); break;
-            case GPU_OP_ASIN_LHS: out = make_float2(asinf(lhs.x), asinf(lhs.y)); break;
-            case GPU_OP_ACOS_LHS: out = make_float2(acosf(lhs.x), acosf(lhs.y)); break;
-            case GPU_OP_ATAN_LHS: out = make_float2(atanf(lhs.x), atanf(lhs.y)); break;
-            case GPU_OP_EXP_LHS: out = make_float2(expf(lhs.x), expf(lhs.y)); break;
-            case GPU_OP_ABS_LHS: out = make_float2(fabsf(lhs.x), fabsf(lhs.y)); break;
-            case GPU_OP_LOG_LHS: out = make_float2(logf(lhs.x), logf(lhs.y)); break;
-
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = make_float2(lhs.x + imm, lhs.y + imm); break;
-            case GPU_OP_ADD_LHS_RHS: out = make_float2(lhs.x + rhs.x, lhs.y + rhs.y); break;
-            case GPU_OP_MUL_LHS_IMM: out = make_float2(lhs.x * imm, lhs.y * imm); break;
-            case GPU_OP_MUL_LHS_RHS: out = make_float2(lhs.x * rhs.x, lhs.y * rhs.y); break;
-            case GPU_OP_MIN_LHS_IMM: out = make_float2(fminf(lhs.x, imm), fminf(lhs.y, imm)); break;
-            case GPU_OP_MIN_LHS_RHS: out = make_float2(fminf(lhs.x, rhs.x), fminf(lhs.y, rhs.y)); break;
-            case GPU_OP_MAX_LHS_IMM: out = make_float2(fmaxf(lhs.x, imm), fmaxf(lhs.y, imm)); break;
-            case GPU_OP_MAX_LHS_RHS: out = make_float2(fmaxf(lhs.x, rhs.x), fmaxf(lhs.y, rhs.y)); break;
-
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = make_float2(lhs.x - imm, lhs.y - imm); break;
-            case GPU_OP_SUB_IMM_RHS: out = make_float2(imm - rhs.x, imm - rhs.y); break;
-            case GPU_OP_SUB_LHS_RHS: out = make_float2(lhs.x - rhs.x, lhs.y - rhs.y); break;
-
-            case GPU_OP_DIV_LHS_IMM: out = make_float2(lhs.x / imm, lhs.y / imm); break;
-            case GPU_OP_DIV_IMM_RHS: out = make_float2(imm / rhs.x, imm / rhs.y); break;
-            case GPU_OP_DIV_LHS_RHS: out = make_float2(lhs.x / rhs.x, lhs.y / rhs.y); break;
-
-            case GPU_OP_COPY_IMM: out = make_float2(imm, imm); break;
-            case GPU_OP_COPY_LHS: out = make_float2(lhs.x, lhs.y); break;
-            case GPU_OP_COPY_RHS: out = make_float2(rhs.x, rhs.y); break;
+        CUDA_CHECK(cudaEventElapsedTime(&out.normals_ms,
+                                        stats_events[4].get(),
+                                        stats_events[5].get()));
+    }
+    out.tape_capacity = tape_capacity;
+    out.tape_high_water = tape_stats.high_water;
+    out.tape_overflows = tape_stats.overflows;
+    return out;
+}
 
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
+/*  Packs one layer of the depth and normal images into staging buffers,
+ *  in the layout given by `format`.  Outputs are written in order, so the
+ *  inputs are read transposed (if requested). */
+__global__
+void pack_readback(const int32_t* const __restrict__ depth,
+                   const uint32_t* const __restrict__ normals,
+                   void* const __restrict__ depth_out,
+                   uint32_t* const __restrict__ normals_out,
+                   const int32_t image_size_px,
+                   const ReadbackFormat format)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (index >= image_size_px * image_size_px) {
+        return;
+    }
+    const int32_t i = format.transpose
+        ? index / image_size_px + (index % image_size_px) * image_size_px
+        : index;
+
+    if (depth_out) {
+        const int32_t d = depth[i];
+        switch (format.depth) {
+            case ReadbackFormat::INT32:
+                ((int32_t*)depth_out)[index] = d;
+                break;
+            case ReadbackFormat::UINT16:
+                ((uint16_t*)depth_out)[index] = (d < 65535) ? d : 65535;
+                break;
+            case ReadbackFormat::FLOAT:
+                ((float*)depth_out)[index] = d;
+                break;
         }
     }
+    if (normals_out) {
+        normals_out[index] = normals[i];
+    }
+}
 
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
+cudaEvent_t Context::readback(void* depth_out, uint32_t* normals_out,
+                              cudaStream_t stream,
+                              const ReadbackFormat& format, int32_t layer)
+{
+    if (layer < 0 || layer >= num_layers) {
+        fprintf(stderr, "Readback layer %i is out of range\n", layer);
+        exit(1);
+    }
+    const size_t pixels = image_size_px * image_size_px;
+    if (!readback_stream) {
+        cudaStream_t s;
+        CUDA_CHECK(cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking));
+        readback_stream.reset(s);
+
+        cudaEvent_t e;
+        CUDA_CHECK(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+        readback_packed.reset(e);
+        CUDA_CHECK(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+        readback_done.reset(e);
+
+        readback_depth = allocate<uint32_t>(allocator.get(), pixels, stream);
+        readback_normals = allocate<uint32_t>(allocator.get(), pixels,
+                                              stream);
+    }
 
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    if (DIMENSION == 3) {
-        const int4 sub = unpack(threadIdx.x % 32, 4);
-        // The second voxel is always higher in Z, so it masks the lower voxel
-        if (slots[i_out].y < 0.0f) {
-            const int32_t px = pos.x * 4 + sub.x;
-            const int32_t py = pos.y * 4 + sub.y;
-            const int32_t pz = pos.z * 4 + sub.z + 2;
+    // Don't overwrite the staging buffers until the previous copy is done
+    CUDA_CHECK(cudaStreamWaitEvent(stream, readback_done.get(), 0));
+    if (depth_out || normals_out) {
+        const unsigned num_blocks = (pixels + NUM_THREADS - 1) / NUM_THREADS;
+        pack_readback<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            stages[3].filled.get() + layer * pixels,
+            normals.get() + layer * pixels,
+            depth_out ? readback_depth.get() : nullptr,
+            normals_out ? readback_normals.get() : nullptr,
+            image_size_px, format);
+        CUDA_CHECK(cudaGetLastError());
+    }
+    CUDA_CHECK(cudaEventRecord(readback_packed.get(), stream));
+
+    cudaStream_t s = readback_stream.get();
+    CUDA_CHECK(cudaStreamWaitEvent(s, readback_packed.get(), 0));
+    if (depth_out) {
+        const size_t bytes = (format.depth == ReadbackFormat::UINT16)
+            ? sizeof(uint16_t) : sizeof(int32_t);
+        CUDA_CHECK(cudaMemcpyAsync(depth_out, readback_depth.get(),
+                                   bytes * pixels, cudaMemcpyDeviceToHost,
+                                   s));
+    }
+    if (normals_out) {
+        CUDA_CHECK(cudaMemcpyAsync(normals_out, readback_normals.get(),
+                                   sizeof(uint32_t) * pixels,
+                                   cudaMemcpyDeviceToHost, s));
+    }
+    CUDA_CHECK(cudaEventRecord(readback_done.get(), s));
+    return readback_done.get();
+}
 
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
-        } else if (slots[i_out].x < 0.0f) {
-            const int32_t px = pos.x * 4 + sub.x;
-            const int32_t py = pos.y * 4 + sub.y;
-            const int32_t pz = pos.z * 4 + sub.z;
+////////////////////////////////////////////////////////////////////////////////
 
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
+// Launch configurations found by autotuning, keyed by device, tape hash,
+// dimension and image size.  This is shared by every Context (which may be
+// on different threads, e.g. in a MultiContext).
+static std::mutex launch_cache_mutex;
+static std::map<std::tuple<int, uint64_t, int, int32_t>, LaunchConfig>
+    launch_cache;
+
+/*  Picks launch_config for `ctx` by rendering with every worthwhile
+ *  candidate block size and timing each stage.  The stages are independent
+ *  (block size doesn't change which tiles reach the next stage), so all
+ *  stages are probed at once, then each keeps its own fastest candidate. */
+template <int DIMENSION>
+static LaunchConfig probe_launch(Context& ctx, const int32_t num_slots,
+                                 std::function<void()> render)
+{
+    const int32_t tile_threads[] = LAUNCH_TILE_THREADS;
+    const int32_t voxel_tiles[] = LAUNCH_VOXEL_TILES;
+
+    // Use the occupancy API to skip candidates which can't launch (e.g. if
+    // a large block needs too many registers) or that have much less
+    // occupancy than the best one.
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    int sm_threads;
+    CUDA_CHECK(cudaDeviceGetAttribute(
+                &sm_threads, cudaDevAttrMaxThreadsPerMultiProcessor, device));
+    float tile_occupancy[LAUNCH_NUM_CANDIDATES];
+    float voxel_occupancy[LAUNCH_NUM_CANDIDATES];
+    float best_tile_occupancy = 0.0f;
+    float best_voxel_occupancy = 0.0f;
+    for (unsigned c=0; c < LAUNCH_NUM_CANDIDATES; ++c) {
+        int blocks;
+        CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+                    &blocks,
+                    select_eval_tiles_i<DIMENSION>(num_slots, tile_threads[c]),
+                    tile_threads[c], 0));
+        tile_occupancy[c] = blocks * tile_threads[c] / float(sm_threads);
+        best_tile_occupancy = std::max(best_tile_occupancy,
+                                       tile_occupancy[c]);
+
+        CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+                    &blocks,
+                    select_eval_voxels_f<DIMENSION>(num_slots, voxel_tiles[c],
+                                                    ctx.half_precision),
+                    voxel_tiles[c] * 32, 0));
+        voxel_occupancy[c] = blocks * voxel_tiles[c] * 32 / float(sm_threads);
+        best_voxel_occupancy = std::max(best_voxel_occupancy,
+                                        voxel_occupancy[c]);
+    }
+
+    const LaunchConfig prev = ctx.launch_config;
+    const bool prev_timing = ctx.stage_timing;
+    const bool prev_graph = ctx.graph_mode;
+    ctx.stage_timing = true;
+    ctx.graph_mode = false; // stages aren't timed in graph replays
+    ctx.autotune = false;   // don't recurse into the probe
+
+    LaunchConfig out = {{NUM_THREADS, NUM_THREADS, NUM_THREADS}, NUM_TILES};
+    float best_ms[4];
+    std::fill(best_ms, best_ms + 4, std::numeric_limits<float>::infinity());
+    for (unsigned c=0; c < LAUNCH_NUM_CANDIDATES; ++c) {
+        const bool use_tiles = tile_occupancy[c] > 0.0f &&
+            tile_occupancy[c] >= best_tile_occupancy / 2.0f;
+        const bool use_voxels = voxel_occupancy[c] > 0.0f &&
+            voxel_occupancy[c] >= best_voxel_occupancy / 2.0f;
+        if (!use_tiles && !use_voxels) {
+            continue;
+        }
+        const int32_t t = use_tiles ? tile_threads[c] : NUM_THREADS;
+        ctx.launch_config = {{t, t, t},
+                             use_voxels ? voxel_tiles[c] : NUM_TILES};
+
+        // The first render is a warmup (which also grows any buffers)
+        render();
+        float ms[4];
+        std::fill(ms, ms + 4, std::numeric_limits<float>::infinity());
+        for (unsigned i=0; i < LAUNCH_PROBE_RENDERS; ++i) {
+            render();
+            const auto stats = ctx.readStats();
+            for (unsigned s=0; s < 4; ++s) {
+                ms[s] = std::min(ms[s], stats.stages[s].time_ms);
+            }
         }
-        const int px = pos.x * 4 + sub.x;
-        const int py = pos.y * 4 + sub.y;
-        atomicAdd(&heatmap[px + py * tiles_per_side * 4], work);
-    } else if (DIMENSION == 2) {
-        const int4 sub = unpack(threadIdx.x % 32, 8);
-        if (slots[i_out].y < 0.0f) {
-            const int32_t px = pos.x * 8 + sub.x;
-            const int32_t py = pos.y * 8 + sub.y + 4;
 
-            image[px + py * tiles_per_side * 8] = 1;
+        for (unsigned s=0; s < 3; ++s) {
+            if (use_tiles && ms[s] < best_ms[s] && (DIMENSION == 3 || s != 1))
+            {
+                best_ms[s] = ms[s];
+                out.tile_threads[s] = tile_threads[c];
+            }
         }
-        if (slots[i_out].x < 0.0f) {
-            const int32_t px = pos.x * 8 + sub.x;
-            const int32_t py = pos.y * 8 + sub.y;
+        if (use_voxels && ms[3] < best_ms[3]) {
+            best_ms[3] = ms[3];
+            out.voxel_tiles = voxel_tiles[c];
+        }
+    }
 
-            image[px + py * tiles_per_side * 8] = 1;
+    ctx.launch_config = prev;
+    ctx.stage_timing = prev_timing;
+    ctx.graph_mode = prev_graph;
+    ctx.autotune = true;
+    return out;
+}
+
+/*  Looks up the tuned configuration for `tape`, probing it if needed */
+template <int DIMENSION>
+static LaunchConfig tuned_launch(Context& ctx, const Tape& tape,
+                                 std::function<void()> render)
+{
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    const auto key = std::make_tuple(device, tape.hash, DIMENSION,
+                                     ctx.image_size_px);
+    {
+        std::lock_guard<std::mutex> lock(launch_cache_mutex);
+        const auto itr = launch_cache.find(key);
+        if (itr != launch_cache.end()) {
+            return itr->second;
         }
-        const int px = pos.x * 8 + sub.x;
-        const int py = pos.y * 8 + sub.y;
-        atomicAdd(&heatmap[px + py * tiles_per_side * 8], work / 2.0f);
-        atomicAdd(&heatmap[px + (py + 4) * tiles_per_side * 8], work / 2.0f);
     }
+    // The lock isn't held while probing, since that takes a while; if two
+    // Contexts probe the same tape at once, then the last one wins.
+    const auto out = probe_launch<DIMENSION>(ctx, tape.num_slots, render);
+    std::lock_guard<std::mutex> lock(launch_cache_mutex);
+    launch_cache[key] = out;
+    return out;
 }
 
-Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
-                                       const Eigen::Matrix3f& mat,
-                                       const float z)
+void Context::autotune2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                         const float z)
 {
-    // Build the heatmap for this render
-    Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
-    cudaMemset(heatmap.get(), 0, sizeof(float) * pow(image_size_px, 2));
-
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
-
-    // Reset all of the data arrays.  In 2D, we only use stages 0, 2, and 3
-    // for 64^2, 8^2, and per-voxel evaluation steps.
-    CUDA_CHECK(cudaMemsetAsync(stages[0].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 64, 2)));
-    CUDA_CHECK(cudaMemsetAsync(stages[2].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 8, 2)));
-    CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px, 2)));
+    if (autotune) {
+        launch_config = tuned_launch<2>(*this, tape,
+            [&]() { render2D(tape, mat, z); });
+    }
+}
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Evaluation of 64x64 tiles
-    ////////////////////////////////////////////////////////////////////////////
+void Context::autotune3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    if (autotune) {
+        launch_config = tuned_launch<3>(*this, tape,
+            [&]() { render3D(tape, mat); });
+    }
+}
 
-    // Go the whole list of first-stage tiles, assigning each to
-    // be [position, tape = 0, next = -1]
-    unsigned count = pow(image_size_px / 64, 2);
-    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+int32_t Context::tileSize3D(unsigned stage) const {
+    switch (stage) {
+        case 0: return 64;
+        case 1: return (subtile_size_px == 8 || subtile_size_px == 16 ||
+                        subtile_size_px == 32) ? subtile_size_px : 16;
+        case 2: return 4;
+        default: return 1;
+    }
+}
 
-    // Iterate over 64^2, 8^2 tiles
-    for (unsigned i=0; i < 3; i += 2) {
-        const unsigned tile_size_px = i ? 8 : 64;
-        const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+int32_t Context::tuneHierarchy(const Tape& tape, const Eigen::Matrix4f& mat)
+{
+    Event start, end;
+    {
+        cudaEvent_t e;
+        CUDA_CHECK(cudaEventCreate(&e));
+        start.reset(e);
+        CUDA_CHECK(cudaEventCreate(&e));
+        end.reset(e);
+    }
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
+    int32_t best = tileSize3D(1);
+    float best_ms = -1.0f;
+    for (const int32_t size : {8, 16, 32}) {
+        subtile_size_px = size;
+        render3D(tape, mat);
+
+        CUDA_CHECK(cudaEventRecord(start.get(), stream.get()));
+        render3D(tape, mat, stream.get());
+        CUDA_CHECK(cudaEventRecord(end.get(), stream.get()));
+        CUDA_CHECK(cudaEventSynchronize(end.get()));
+
+        float ms;
+        CUDA_CHECK(cudaEventElapsedTime(&ms, start.get(), end.get()));
+        if (best_ms < 0.0f || ms < best_ms) {
+            best_ms = ms;
+            best = size;
         }
+    }
+    subtile_size_px = best;
+    return best;
+}
 
-        // Unpack position values into interval X/Y/Z in the values array
-        // This is done in a separate kernel to avoid bloating the
-        // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            image_size_px / tile_size_px,
-            mat, z,
-            reinterpret_cast<Interval*>(values.get()));
-
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i_heatmap<2><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-
-            stages[i].tiles.get(),
-            count,
+void Context::renderTiled3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                            const int32_t width, const int32_t height,
+                            const int32_t depth, int32_t* const depth_out,
+                            uint32_t* const normals_out)
+{
+    const int32_t n = image_size_px;
+    const int32_t size = std::max(std::max(width, height), depth);
+    const int32_t nx = (width + n - 1) / n;
+    const int32_t ny = (height + n - 1) / n;
+    const int32_t nz = (depth + n - 1) / n;
+
+    if (!tiled_mask) {
+        tiled_mask = allocate<int32_t>(allocator.get(), n * n, stream.get());
+    }
+    HostPtr<int32_t[]> filled_host(CUDA_MALLOC_HOST(int32_t, n * n));
+    HostPtr<uint32_t[]> normals_host(CUDA_MALLOC_HOST(uint32_t, n * n));
+    std::vector<uint8_t> covered(n * n);
+
+    for (int32_t ty=0; ty < ny; ++ty) {
+        for (int32_t tx=0; tx < nx; ++tx) {
+            const int32_t ox = tx * n;
+            const int32_t oy = ty * n;
+            const int32_t w = std::min(n, width - ox);
+            const int32_t h = std::min(n, height - oy);
+            for (int32_t y=0; y < h; ++y) {
+                for (int32_t x=0; x < w; ++x) {
+                    const int32_t p = (ox + x) + (oy + y) * width;
+                    depth_out[p] = 0;
+                    if (normals_out) {
+                        normals_out[p] = 0;
+                    }
+                }
+            }
+            std::fill(covered.begin(), covered.end(), 0);
+            int32_t remaining = w * h;
+
+            // Render sub-volumes from the top down, aligned with the top
+            // of the region, so that the bottom sub-volume is the only one
+            // which extends past the region (and anything that it finds
+            // below the region is discarded).
+            for (int32_t tz=0; tz < nz && remaining; ++tz) {
+                const int32_t oz = depth - (tz + 1) * n;
+
+                // Map this sub-volume's [-1, 1] cube into the region
+                Eigen::Matrix4f t = Eigen::Matrix4f::Identity();
+                const int32_t offsets[3] = {ox, oy, oz};
+                const int32_t sizes[3] = {width, height, depth};
+                for (unsigned i=0; i < 3; ++i) {
+                    t(i, i) = n / (float)size;
+                    t(i, 3) = (2 * offsets[i] + n - sizes[i]) / (float)size;
+                }
 
-            reinterpret_cast<Interval*>(values.get()),
+                enqueue3D(tape, mat * t, stream.get(), false,
+                          tz ? tiled_mask.get() : nullptr);
+                CUDA_CHECK(cudaMemcpyAsync(
+                        filled_host.get(), stages[3].filled.get(),
+                        sizeof(int32_t) * n * n,
+                        cudaMemcpyDeviceToHost, stream.get()));
+                CUDA_CHECK(cudaMemcpyAsync(
+                        normals_host.get(), normals.get(),
+                        sizeof(uint32_t) * n * n,
+                        cudaMemcpyDeviceToHost, stream.get()));
+                CUDA_CHECK(cudaMemcpyAsync(
+                        tiled_mask.get(), stages[3].filled.get(),
+                        sizeof(int32_t) * n * n,
+                        cudaMemcpyDeviceToDevice, stream.get()));
+                CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+
+                for (int32_t y=0; y < h; ++y) {
+                    for (int32_t x=0; x < w; ++x) {
+                        const int32_t i = x + y * n;
+                        const int32_t z = filled_host[i];
+                        if (covered[i] || !z || z >= n || oz + z < 0) {
+                            continue;
+                        }
+                        const int32_t p = (ox + x) + (oy + y) * width;
+                        depth_out[p] = oz + z;
+                        if (normals_out) {
+                            normals_out[p] = normals_host[i];
+                        }
+                        covered[i] = 1;
+                        remaining--;
+                    }
+                }
+            }
+        }
+    }
+}
 
-            tile_size_px,
-            heatmap.get());
+SparseVolume Context::renderVolume(const Tape& tape,
+                                   const Eigen::Matrix4f& mat)
+{
+    SparseVolume volume;
+    volume.image_size_px = image_size_px;
+    for (unsigned i=0; i < 3; ++i) {
+        volume.tile_sizes[i] = tileSize3D(i);
+    }
+    enqueue3D(tape, mat, stream.get(), false, nullptr, &volume);
+    return volume;
+}
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+SliceStack Context::renderSlices(const Tape& tape,
+                                 const Eigen::Matrix3f& mat,
+                                 const float z_begin, const float z_end,
+                                 const int32_t count)
+{
+    SliceStack out;
+    out.image_size_px = image_size_px;
+    if (count <= 0) {
+        return out;
+    }
 
-        // Count up active tiles, to figure out how much memory needs to be
-        // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
+    // Each slice's Z value is computed in the same way as enqueueLayers2D,
+    // from the first slice of its slab
+    const int32_t layers = std::min(count, SLICE_SLAB_LAYERS);
+    const float z_step = (count > 1) ? (z_end - z_begin) / (count - 1)
+                                     : 0.0f;
+    for (int32_t i=0; i < count; ++i) {
+        const int32_t start = i - i % layers;
+        out.z.push_back(std::fma(float(i - start), z_step,
+                                 std::fma(float(start), z_step, z_begin)));
+    }
+    const size_t words = pow(image_size_px, 2) / 64;
+    out.bits.resize(words * count);
+
+    // Allocate images for a full slab on first use.  Freeing the old
+    // images synchronizes the device, so this is safe even if a previous
+    // render is still running.
+    if (layers > slice_layers) {
+        slice_filled.reset(CUDA_MALLOC(
+                int32_t, pow(image_size_px / 64, 2) +
+                         layers * pow(image_size_px / 8, 2)));
+        slice_bits.reset(CUDA_MALLOC(uint64_t, layers * words));
+        slice_layers = layers;
+    }
+    int32_t* const images[3] = {
+        slice_filled.get(),
+        slice_filled.get() + (int32_t)pow(image_size_px / 64, 2),
+        nullptr};
+
+    // Each slab waits for its readback before the next slab starts
+    // reusing the images, since everything is on the same stream.
+    for (int32_t start=0; start < count; start += layers) {
+        const int32_t n = std::min(layers, count - start);
+        enqueueLayers2D(tape, mat, out.z[start], z_step, n, images,
+                        slice_bits.get(), stream.get(), false);
+        CUDA_CHECK(cudaMemcpyAsync(&out.bits[start * words],
+                                   slice_bits.get(),
+                                   sizeof(uint64_t) * words * n,
+                                   cudaMemcpyDeviceToHost, stream.get()));
+    }
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+    return out;
+}
 
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i == 0) {
-            active_tile_count *= 64;
-        }
+Mesh Context::renderMesh(const Tape& tape, const Eigen::Matrix4f& mat)
+{
+    // Run the tile stages without occlusion culling (filled tiles go into
+    // a throwaway volume instead of the images), which leaves every
+    // ambiguous 4^3 tile (along with its pruned tape) in stages[3].  There's
+    // no need to render the voxels themselves.
+    SparseVolume volume;
+    unsigned tiles = preloadTiles3D(tape, stream.get(), nullptr);
+    beginStats(stream.get());
+    for (unsigned i=0; i < 3; ++i) {
+        recordStats(i, stream.get());
+        tiles = enqueueTiles3D(i, tiles, mat, 0, tape.num_slots,
+                               stream.get(), false, &volume);
+    }
+    recordStats(3, stream.get()); // there are no voxels or normals to shade
+    recordStats(4, stream.get());
+    recordStats(5, stream.get());
+
+    CUDA_CHECK(cudaMemcpyAsync(tile_count_host.get(), tile_count.get() + 3,
+                               sizeof(int32_t), cudaMemcpyDeviceToHost,
+                               stream.get()));
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+    const int32_t count = tile_count_host[0];
+
+    Mesh mesh;
+    if (!count) {
+        return mesh;
+    }
 
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        const int next = i ? 3 : 2;
-        if (active_tile_count > stages[next].tile_array_size) {
-            stages[next].tile_array_size = active_tile_count;
-            stages[next].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
-        }
+    // Start with room for 128 vertices and 64 triangles per tile, then grow
+    // the buffers and try again if either one overflows.
+    int32_t table_bits = 10;
+    while ((1 << table_bits) < count * 128 && table_bits < 30) {
+        table_bits++;
+    }
+    int32_t tri_capacity = count * 64;
+
+    Ptr<int32_t[]> counters = allocate<int32_t>(allocator.get(), 3,
+                                                stream.get());
+    Ptr<uint64_t[]> vert_keys;
+    Ptr<float3[]> vert_pos;
+    Ptr<int32_t[]> vert_tapes;
+    Ptr<int3[]> tris;
+    int32_t counts_host[3];
+    const auto mesh_tiles = select_mesh_tiles(tape.num_slots);
+    while (true) {
+        const int32_t table_size = 1 << table_bits;
+        vert_keys = allocate<uint64_t>(allocator.get(), table_size,
+                                       stream.get());
+        vert_pos = allocate<float3>(allocator.get(), table_size, stream.get());
+        vert_tapes = allocate<int32_t>(allocator.get(), table_size,
+                                       stream.get());
+        tris = allocate<int3>(allocator.get(), tri_capacity, stream.get());
+        CUDA_CHECK(cudaMemsetAsync(vert_keys.get(), 0,
+                                   sizeof(uint64_t) * table_size,
+                                   stream.get()));
+        CUDA_CHECK(cudaMemsetAsync(counters.get(), 0, sizeof(int32_t) * 3,
+                                   stream.get()));
+
+        const unsigned num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+        mesh_tiles<<<num_blocks, NUM_TILES * 32, 0, stream.get()>>>(
+            tape_data.get(),
+            stages[3].tiles.get(),
+            tile_count.get() + 3,
+            image_size_px / 4,
+            mat,
 
-        if (i < 2) {
-            // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                image_size_px / tile_size_px,
-                stages[next].tiles.get());
+            vert_keys.get(),
+            vert_pos.get(),
+            vert_tapes.get(),
+            table_bits,
+
+            tris.get(),
+            counters.get(),
+            tri_capacity,
+            counters.get() + 1);
+        CUDA_CHECK(cudaMemcpyAsync(counts_host, counters.get(),
+                                   sizeof(int32_t) * 2,
+                                   cudaMemcpyDeviceToHost, stream.get()));
+        CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+
+        if (!counts_host[1]) {
+            break;
+        } else if (counts_host[0] > tri_capacity) {
+            tri_capacity = counts_host[0];
+        } else if (table_bits < 30) {
+            table_bits++;
         } else {
-            // Special case for per-pixel evaluation, which
-            // doesn't unpack every single pixel (since that would take up
-            // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                stages[next].tiles.get());
+            fprintf(stderr, "Mesh vertex table is full; dropped %i "
+                            "triangles\n", counts_host[1]);
+            break;
         }
+    }
+    const int32_t table_size = 1 << table_bits;
+    const int32_t tri_count = std::min(counts_host[0], tri_capacity);
+
+    // Compact the vertex table, then evaluate positions and normals
+    const unsigned num_blocks = (table_size + NUM_THREADS - 1) / NUM_THREADS;
+    Ptr<int32_t[]> block_counts = allocate<int32_t>(allocator.get(),
+                                                    num_blocks, stream.get());
+    Ptr<int32_t[]> vert_index = allocate<int32_t>(allocator.get(),
+                                                  table_size, stream.get());
+    count_mesh_vertices<<<num_blocks, NUM_THREADS, 0, stream.get()>>>(
+        vert_keys.get(), table_size, block_counts.get());
+    scan_active_tiles<<<1, NUM_THREADS, 0, stream.get()>>>(
+        block_counts.get(), num_blocks, counters.get() + 2);
+    assign_mesh_vertices<<<num_blocks, NUM_THREADS, 0, stream.get()>>>(
+        vert_keys.get(), table_size, block_counts.get(), vert_index.get());
+    CUDA_CHECK(cudaMemcpyAsync(counts_host + 2, counters.get() + 2,
+                               sizeof(int32_t), cudaMemcpyDeviceToHost,
+                               stream.get()));
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+    const int32_t vert_count = counts_host[2];
+    if (!vert_count || !tri_count) {
+        return mesh;
+    }
 
-        {   // Copy filled tiles into the next level's image (expanding them
-            // by 64x).  This is cleaner that accumulating all of the levels
-            // in a single pass, and could (possibly?) help with skipping
-            // fully occluded tiles.
-            const unsigned next_tile_size = tile_size_px / 8;
-            const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[next].filled.get(),
-                    image_size_px / next_tile_size);
-        }
+    Ptr<float3[]> out_pos = allocate<float3>(allocator.get(), vert_count,
+                                             stream.get());
+    Ptr<float3[]> out_norm = allocate<float3>(allocator.get(), vert_count,
+                                              stream.get());
+    const auto eval_vertices = select_eval_mesh_vertices(tape.num_slots);
+    eval_vertices<<<num_blocks, NUM_THREADS, 0, stream.get()>>>(
+        tape_data.get(),
+        vert_keys.get(),
+        vert_pos.get(),
+        vert_tapes.get(),
+        vert_index.get(),
+        table_size,
+        image_size_px / 4,
+        mat,
 
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
-    }
+        out_pos.get(),
+        out_norm.get());
+    remap_mesh_triangles<<<(tri_count + NUM_THREADS - 1) / NUM_THREADS,
+                           NUM_THREADS, 0, stream.get()>>>(
+        tris.get(), tri_count, vert_index.get());
+
+    static_assert(sizeof(Eigen::Vector3f) == sizeof(float3),
+                  "Vertices must be tightly packed");
+    static_assert(sizeof(Eigen::Vector3i) == sizeof(int3),
+                  "Triangles must be tightly packed");
+    mesh.vertices.resize(vert_count);
+    mesh.normals.resize(vert_count);
+    mesh.triangles.resize(tri_count);
+    CUDA_CHECK(cudaMemcpyAsync(mesh.vertices.data(), out_pos.get(),
+                               sizeof(float3) * vert_count,
+                               cudaMemcpyDeviceToHost, stream.get()));
+    CUDA_CHECK(cudaMemcpyAsync(mesh.normals.data(), out_norm.get(),
+                               sizeof(float3) * vert_count,
+                               cudaMemcpyDeviceToHost, stream.get()));
+    CUDA_CHECK(cudaMemcpyAsync(mesh.triangles.data(), tris.get(),
+                               sizeof(int3) * tri_count,
+                               cudaMemcpyDeviceToHost, stream.get()));
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
+    return mesh;
+}
 
-    // Time to render individual pixels!
-    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
-    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
+void Context::query(const Tape& tape, const float3* points,
+                    const int32_t count, float* values_out,
+                    float3* grads_out)
+{
+    // The tile arrays and tape pool are reused, so the next render can't
+    // replay progressive or temporal state
+    progress.step = -1;
+    temporal.valid = false;
+    if (count <= 0) {
+        return;
     }
-    calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
-        stages[3].tiles.get(),
-        count,
-        image_size_px / 8,
-        mat, z,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f_heatmap<2><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 8,
 
-        stages[3].tiles.get(),
-        count,
+    const int32_t n = (query_tiles_per_side < 1) ? 1 : query_tiles_per_side;
+    const int32_t num_tiles = n * n * n;
+    const unsigned point_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    const unsigned tile_blocks = (num_tiles + NUM_THREADS - 1) / NUM_THREADS;
+
+    growValues(num_tiles * 3, stream.get());
+    // Bounds are followed by a slot for scan_active_tiles' total
+    Ptr<int32_t[]> bounds = allocate<int32_t>(allocator.get(), 7,
+                                              stream.get());
+    Ptr<int32_t[]> point_tiles = allocate<int32_t>(allocator.get(), count,
+                                                   stream.get());
+    Ptr<int32_t[]> tile_counts = allocate<int32_t>(allocator.get(),
+                                                   num_tiles, stream.get());
+    Ptr<int32_t[]> block_sums = allocate<int32_t>(allocator.get(),
+                                                  tile_blocks, stream.get());
+    Ptr<TileNode[]> tiles = allocate<TileNode>(allocator.get(), num_tiles,
+                                               stream.get());
+    Ptr<int2[]> list = allocate<int2>(allocator.get(), count, stream.get());
+
+    // Start from an empty box (in query_order's ordering)
+    const int32_t empty[6] = {INT32_MAX, INT32_MAX, INT32_MAX,
+                              INT32_MIN, INT32_MIN, INT32_MIN};
+    CUDA_CHECK(cudaMemcpyAsync(bounds.get(), empty, sizeof(empty),
+                               cudaMemcpyHostToDevice, stream.get()));
+    CUDA_CHECK(cudaMemsetAsync(tile_counts.get(), 0,
+                               sizeof(int32_t) * num_tiles, stream.get()));
+    loadTape(tape, 0, stream.get());
+    resetCounters(stream.get());
+
+    // Bin the points into tiles over their bounding box
+    query_bounds<<<point_blocks, NUM_THREADS, 0, stream.get()>>>(
+        points, count, bounds.get());
+    query_count_tiles<<<point_blocks, NUM_THREADS, 0, stream.get()>>>(
+        points, count, bounds.get(), n, point_tiles.get(), tile_counts.get());
+    query_preload_tiles<<<tile_blocks, NUM_THREADS, 0, stream.get()>>>(
+        bounds.get(), tile_counts.get(), n, tape.length,
+        tiles.get(), tile_count.get(), tape_index.get(),
+        reinterpret_cast<Interval*>(values.get()));
+
+    // Push a tape for every tile with points.  If the tape pool overflows,
+    // tiles keep their parent's tape, which is correct (just slower).
+    const auto eval = select_eval_tiles_i<3>(tape.num_slots, NUM_THREADS);
+    bool retry = false;
+    do {
+        eval<<<tile_blocks, NUM_THREADS, 0, stream.get()>>>(
+            tape_data.get(),
+            tape_index.get(),
+            tape_capacity,
+            tape_overflow.get(),
+            retry,
+            warp_cooperative,
+            contiguous_tapes,
+            true,
+            dedup_tapes ? tape_dedup_keys.get() : nullptr,
+            tape_dedup_values.get(),
+
+            nullptr,
+            n,
+            0, INT32_MAX,
+
+            tiles.get(),
+            tile_count.get(),
 
-        reinterpret_cast<float2*>(values.get()),
-        heatmap.get());
-    CUDA_CHECK(cudaDeviceSynchronize());
+            reinterpret_cast<Interval*>(values.get()),
 
-    for (unsigned x=0; x < image_size_px; ++x) {
-        for (unsigned y=0; y < image_size_px; ++y) {
-            heatmap[x + y * image_size_px] /= tape.length - 2;
-        }
+            nullptr,
+            nullptr,
+
+            nullptr,
+            nullptr,
+
+            StatsSink{nullptr, nullptr, 0});
+        retry = true;
+    } while (tape_retry && growTapes(stream.get()));
+
+    // Sort the points by tile, then evaluate them on their tiles' tapes
+    sum_leaf_counts<<<tile_blocks, NUM_THREADS, 0, stream.get()>>>(
+        tile_counts.get(), num_tiles, block_sums.get());
+    scan_active_tiles<<<1, NUM_THREADS, 0, stream.get()>>>(
+        block_sums.get(), tile_blocks, bounds.get() + 6);
+    offset_leaf_counts<<<tile_blocks, NUM_THREADS, 0, stream.get()>>>(
+        tile_counts.get(), num_tiles, block_sums.get());
+    query_scatter<<<point_blocks, NUM_THREADS, 0, stream.get()>>>(
+        point_tiles.get(), count, tiles.get(), tile_counts.get(), list.get());
+
+    if (grads_out) {
+        select_query_eval_d(tape.num_slots)<<<point_blocks, NUM_THREADS, 0,
+                                              stream.get()>>>(
+            tape_data.get(), points, list.get(), count,
+            values_out, grads_out);
+    } else {
+        const unsigned pair_blocks = (count + 2 * NUM_THREADS - 1) /
+                                     (2 * NUM_THREADS);
+        select_query_eval_f(tape.num_slots)<<<pair_blocks, NUM_THREADS, 0,
+                                              stream.get()>>>(
+            tape_data.get(), points, list.get(), count, values_out);
     }
-    return heatmap;
+    CUDA_CHECK(cudaStreamSynchronize(stream.get()));
 }
 
-Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
-                                       const Eigen::Matrix4f& mat)
-{
-    // Build the heatmap for this render
-    Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
-    cudaMemset(heatmap.get(), 0, sizeof(float) * pow(image_size_px, 2));
-
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
-
-    ////////////////////////////////////////////////////////////////////////////
-    // Evaluation of 64x64x64 tiles
-    ////////////////////////////////////////////////////////////////////////////
+void Context::growValues(const size_t count, cudaStream_t stream) {
+    if (count <= values_size) {
+        return;
+    }
+    // Interval and float2 are the same size, so values_size counts either
+    const size_t size = std::max(count, values_size * 2);
+    allocator->fence(stream);
+    values = Ptr<void>(allocator->allocate(sizeof(float2) * size, stream),
+                       Deleter(allocator.get()));
+    values_size = size;
+}
 
-    // Reset all of the data arrays
-    for (unsigned i=0; i < 4; ++i) {
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
-        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
-                                   pow(image_size_px / tile_size_px, 2)));
+void Context::growLeafBricks(const size_t count, cudaStream_t stream) {
+    if (count <= leaf_bricks_size) {
+        return;
     }
-    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
-                               pow(image_size_px, 2)));
+    // Unlike growValues, this keeps the voxel tiles from earlier stages
+    const size_t size = std::max(count, leaf_bricks_size * 2);
+    Ptr<TileNode[]> bricks = allocate<TileNode>(allocator.get(), size,
+                                                stream);
+    if (leaf_brick_count) {
+        CUDA_CHECK(cudaMemcpyAsync(bricks.get(), leaf_bricks.get(),
+                                   sizeof(TileNode) * leaf_brick_count,
+                                   cudaMemcpyDeviceToDevice, stream));
+    }
+    allocator->fence(stream);
+    leaf_bricks = std::move(bricks);
+    leaf_bricks_size = size;
+}
 
-    // Go the whole list of first-stage tiles, assigning each to
-    // be [position, tape = 0, next = -1]
-    unsigned count = pow(image_size_px / 64, 3);
-    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+void Context::loadTape(const Tape& tape, int32_t offset,
+                       cudaStream_t stream)
+{
+    CUDA_CHECK(cudaMemcpyAsync(tape_data.get() + offset, tape.data.get(),
+                               sizeof(uint64_t) * tape.length,
+                               cudaMemcpyDeviceToDevice, stream));
+    TapeVars v;
+    v.count = std::min(std::min(tape.num_vars, (int32_t)vars.size()),
+                       (int32_t)TAPE_MAX_VARS);
+    if (v.count) {
+        std::copy(vars.begin(), vars.begin() + v.count, v.values);
+        load_tape_vars<<<1, TAPE_MAX_VARS, 0, stream>>>(
+            tape_data.get() + offset, v);
+    }
+}
 
-    // Iterate over 64^3, 16^3, 4^3 tiles
-    for (unsigned i=0; i < 3; ++i) {
-        //printf("BEGINNING STAGE %u\n", i);
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
-        const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+void Context::setTapeWindow(int32_t length, cudaStream_t stream) {
+    if (!persist_tape || !stream) {
+        return;
+    }
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    int max_window, max_persist;
+    CUDA_CHECK(cudaDeviceGetAttribute(
+                &max_window, cudaDevAttrMaxAccessPolicyWindowSize, device));
+    CUDA_CHECK(cudaDeviceGetAttribute(
+                &max_persist, cudaDevAttrMaxPersistingL2CacheSize, device));
+    if (!max_window || !max_persist) {
+        return;
+    }
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
+    cudaStreamAttrValue attr = {};
+    tape_window = length;
+    if (length) {
+        const size_t bytes = std::min(
+                sizeof(uint64_t) * std::min(length, tape_capacity),
+                (size_t)max_window);
+
+        // Grow the device's persisting L2 to fit the tape, but never shrink
+        // it, since other Contexts may be using it too.
+        size_t reserved;
+        CUDA_CHECK(cudaDeviceGetLimit(&reserved,
+                                      cudaLimitPersistingL2CacheSize));
+        if (reserved < bytes && reserved < (size_t)max_persist) {
+            reserved = std::min(bytes, (size_t)max_persist);
+            CUDA_CHECK(cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize,
+                                          reserved));
         }
+        attr.accessPolicyWindow.base_ptr = tape_data.get();
+        attr.accessPolicyWindow.num_bytes = bytes;
+        attr.accessPolicyWindow.hitRatio = std::min(1.0f,
+                                                    reserved / (float)bytes);
+        attr.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+        attr.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+    }
+    CUDA_CHECK(cudaStreamSetAttribute(
+                stream, cudaStreamAttributeAccessPolicyWindow, &attr));
+}
 
-        // Unpack position values into interval X/Y/Z in the values array
-        // This is done in a separate kernel to avoid bloating the
-        // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_3d<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            image_size_px / tile_size_px,
-            mat,
-            reinterpret_cast<Interval*>(values.get()));
+void Context::resetCounters(cudaStream_t stream) {
+    leaf_brick_count = 0;
+    CUDA_CHECK(cudaMemsetAsync(tile_count_wanted.get(), 0,
+                               sizeof(int32_t) * 4, stream));
+    CUDA_CHECK(cudaMemsetAsync(tape_overflow.get(), 0, sizeof(int32_t),
+                               stream));
+    if (dedup_tapes) {
+        CUDA_CHECK(cudaMemsetAsync(tape_dedup_keys.get(), 0,
+                                   sizeof(uint64_t) * TAPE_DEDUP_TABLE_SIZE,
+                                   stream));
+        CUDA_CHECK(cudaMemsetAsync(tape_dedup_values.get(), 0xFF,
+                                   sizeof(int32_t) * TAPE_DEDUP_TABLE_SIZE,
+                                   stream));
+    }
+}
 
-        // Mark every tile which is covered in the image as masked,
-        // which means it will be skipped later on.  We do this again below,
-        // but it's basically free, so we should do it here and simplify
-        // the logic in eval_tiles_i.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
+void Context::queueTapeStats(cudaStream_t stream) {
+    CUDA_CHECK(cudaMemcpyAsync(tape_stats_host.get(), tape_index.get(),
+                               sizeof(int32_t), cudaMemcpyDeviceToHost,
+                               stream));
+    CUDA_CHECK(cudaMemcpyAsync(tape_stats_host.get() + 1, tape_overflow.get(),
+                               sizeof(int32_t), cudaMemcpyDeviceToHost,
+                               stream));
+}
 
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i_heatmap<3><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
+void Context::updateTapeStats() {
+    tape_stats.high_water = std::max(tape_stats.high_water,
+                                     tape_stats_host[0]);
+    tape_stats.overflows = tape_stats_host[1];
+}
 
-            stages[i].tiles.get(),
-            count,
+bool Context::growTapes(cudaStream_t stream) {
+    queueTapeStats(stream);
+    CUDA_CHECK(cudaStreamSynchronize(stream));
+    updateTapeStats();
 
-            reinterpret_cast<Interval*>(values.get()),
-            tile_size_px,
-            heatmap.get());
+    // Indices into the tape are 32-bit, so we stop growing at some point
+    static const int32_t MAX_TAPE_CAPACITY = 1 << 30;
+    if (tape_stats.overflows == 0 || tape_capacity >= MAX_TAPE_CAPACITY) {
+        return false;
+    }
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+    // tape_index may have run past the end of the pool, so leave room for
+    // everything that was claimed, then double it.
+    const int64_t wanted = 2 * (int64_t)std::max(tape_capacity,
+                                                 tape_stats_host[0]);
+    const int32_t capacity = std::min(wanted, (int64_t)MAX_TAPE_CAPACITY);
+
+    // Tapes pushed by earlier stages are still in use, so we copy the whole
+    // pool.  The old pool is freed with cudaFree, which waits for the copy.
+    Ptr<uint64_t[]> data(CUDA_MALLOC(uint64_t, capacity));
+    CUDA_CHECK(cudaMemcpyAsync(data.get(), tape_data.get(),
+                               sizeof(uint64_t) * tape_capacity,
+                               cudaMemcpyDeviceToDevice, stream));
+    tape_data = std::move(data);
+    tape_capacity = capacity;
+
+    // The L2 window (if any) pointed into the old pool
+    if (tape_window) {
+        setTapeWindow(tape_window, stream);
+    }
 
-        // Now that we have evaluated every tile at this level, we do one more
-        // round of occlusion culling before accumulating tiles to render at
-        // the next phase.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
+    CUDA_CHECK(cudaMemsetAsync(tape_overflow.get(), 0, sizeof(int32_t),
+                               stream));
+    tape_stats.retries++;
+    return true;
+}
 
-        // Count up active tiles, to figure out how much memory needs to be
-        // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
-
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i < 2) {
-            active_tile_count *= 64;
-        }
+void Context::reserveValues(cudaStream_t stream) {
+    // Interval evaluation uses 3 values per thread, while per-voxel
+    // evaluation uses 3 values per voxel in a block of NUM_TILES tiles.
+    // Interval and float2 are the same size, so we can compare counts.
+    size_t num_values = 0;
+    for (unsigned i=0; i < 3; ++i) {
+        const size_t num_blocks =
+            (stages[i].tile_array_size + NUM_THREADS - 1) / NUM_THREADS;
+        num_values = std::max(num_values, num_blocks * NUM_THREADS * 3);
+    }
+    {
+        const size_t num_blocks =
+            (stages[3].tile_array_size + NUM_TILES - 1) / NUM_TILES;
+        num_values = std::max(num_values, num_blocks * NUM_TILES * 32 * 3);
+    }
+    if (sphere_trace) {
+        num_values = std::max(num_values, trace_values_size(
+                    image_size_px, stages[3].tile_array_size));
+    }
+    growValues(num_values, stream);
+}
 
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        if (active_tile_count > stages[i + 1].tile_array_size) {
-            stages[i + 1].tile_array_size = active_tile_count;
-            stages[i + 1].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
+void Context::launchGraph(GraphExec& exec, cudaGraph_t graph,
+                          cudaStream_t stream)
+{
+    // The pipeline's topology only changes when a tile array is resized, so
+    // we can usually update the existing executable graph in place (which
+    // is much cheaper than instantiating a new one).
+    if (exec) {
+#if CUDART_VERSION >= 12000
+        cudaGraphExecUpdateResultInfo info;
+        const cudaError_t err = cudaGraphExecUpdate(exec.get(), graph, &info);
+#else
+        cudaGraphNode_t error_node;
+        cudaGraphExecUpdateResult result;
+        const cudaError_t err = cudaGraphExecUpdate(exec.get(), graph,
+                                                    &error_node, &result);
+#endif
+        if (err != cudaSuccess) {
+            cudaGetLastError(); // Clear the error and re-instantiate
+            exec.reset();
         }
+    }
+    if (!exec) {
+        cudaGraphExec_t e;
+#if CUDART_VERSION >= 12000
+        CUDA_CHECK(cudaGraphInstantiate(&e, graph, 0));
+#else
+        CUDA_CHECK(cudaGraphInstantiate(&e, graph, nullptr, nullptr, 0));
+#endif
+        exec.reset(e);
+    }
+    CUDA_CHECK(cudaGraphDestroy(graph));
+    CUDA_CHECK(cudaGraphLaunch(exec.get(), stream));
+}
 
-        if (i < 2) {
-            // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                image_size_px / tile_size_px,
-                stages[i + 1].tiles.get());
-        } else {
-            // Special case for per-pixel evaluation, which
-            // doesn't unpack every single pixel (since that would take up
-            // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                stages[i + 1].tiles.get());
-        }
+void Context::render2D_brute(const Tape& tape,
+                             const Eigen::Matrix3f& mat,
+                             const float z)
+{
+    progress.step = -1;
+    temporal.valid = false;
 
-        {   // Copy filled tiles into the next level's image (expanding them
-            // by 64x).  This is cleaner that accumulating all of the levels
-            // in a single pass, and could (possibly?) help with skipping
-            // fully occluded tiles.
-            const unsigned next_tile_size = tile_size_px / 4;
-            const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_3d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[i + 1].filled.get(),
-                    image_size_px / next_tile_size);
-        }
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset by preload_tiles.
+    loadTape(tape, 0, 0);
 
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
+    // Reset the final image array, since we'll be rendering directly to it
+    if (packed_2d) {
+        CUDA_CHECK(cudaMemsetAsync(filled_2d.get(), 0, sizeof(uint64_t) *
+                                   pow(image_size_px, 2) / 64));
+    } else {
+        CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0, sizeof(int32_t) *
+                                   pow(image_size_px, 2)));
     }
 
+    // We'll only be evaluating 8x8 tiles, so preload all of them
+    unsigned count = pow(image_size_px / 8, 2);
+    growTiles(3, count, 0);
+    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    preload_tiles<<<num_blocks, NUM_THREADS>>>(
+        stages[3].tiles.get(), count,
+        tile_count.get() + 3, tape_index.get(), tape.length);
+
     // Time to render individual pixels!
     num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
     const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
-    calculate_voxels<<<num_blocks, NUM_TILES * 32>>>(
+    growValues(num_values, 0);
+    calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
         stages[3].tiles.get(),
-        count,
-        image_size_px / 4,
-        mat,
+        tile_count.get() + 3,
+        image_size_px / 8,
+        mat, z, 0.0f,
         reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f_heatmap<3><<<num_blocks, NUM_TILES * 32>>>(
+    const auto eval_voxels = select_eval_voxels_f<2>(tape.num_slots, NUM_TILES);
+    eval_voxels<<<num_blocks, NUM_TILES * 32>>>(
         tape_data.get(),
         stages[3].filled.get(),
-        image_size_px / 4,
+        image_size_px / 8,
 
         stages[3].tiles.get(),
-        count,
+        tile_count.get() + 3,
 
         reinterpret_cast<float2*>(values.get()),
-        heatmap.get());
+        false,
 
-    {   // Then render normals into those pixels
-        const uint32_t u = ((image_size_px + 15) / 16);
-        eval_pixels_d<<<dim3(u, u), dim3(16, 16)>>>(
-                tape_data.get(),
-                stages[3].filled.get(),
-                normals.get(),
-                image_size_px,
-                mat,
-                stages[0].tiles.get(),
-                stages[1].tiles.get(),
-                stages[2].tiles.get());
+        packed_2d ? filled_2d.get() : nullptr,
+
+        half_tolerance,
+
+        StatsSink{});
+    CUDA_CHECK(cudaDeviceSynchronize());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
+                                       const Eigen::Matrix3f& mat,
+                                       const float z)
+{
+    Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
+    CUDA_CHECK(cudaMemset(heatmap.get(), 0,
+                          sizeof(float) * pow(image_size_px, 2)));
+#ifdef MPR_RENDER_STATS
+    stats_heatmap = heatmap.get();
+    render2D(tape, mat, z);
+    stats_heatmap = nullptr;
+    CUDA_CHECK(cudaDeviceSynchronize());
+
+    for (unsigned i=0; i < pow(image_size_px, 2); ++i) {
+        heatmap[i] /= tape.length - 2;
     }
+#else
+    (void)tape;
+    (void)mat;
+    (void)z;
+    fprintf(stderr, "render2D_heatmap requires MPR_RENDER_STATS\n");
+#endif
+    return heatmap;
+}
+
+Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
+                                       const Eigen::Matrix4f& mat)
+{
+    Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
+    CUDA_CHECK(cudaMemset(heatmap.get(), 0,
+                          sizeof(float) * pow(image_size_px, 2)));
+#ifdef MPR_RENDER_STATS
+    stats_heatmap = heatmap.get();
+    render3D(tape, mat);
+    stats_heatmap = nullptr;
     CUDA_CHECK(cudaDeviceSynchronize());
 
-    for (unsigned x=0; x < image_size_px; ++x) {
-        for (unsigned y=0; y < image_size_px; ++y) {
-            heatmap[x + y * image_size_px] /= tape.length - 2;
-        }
+    for (unsigned i=0; i < pow(image_size_px, 2); ++i) {
+        heatmap[i] /= tape.length - 2;
     }
+#else
+    (void)tape;
+    (void)mat;
+    fprintf(stderr, "render3D_heatmap requires MPR_RENDER_STATS\n");
+#endif
     return heatmap;
 }
@@ -14,6 +14,30 @@ Copyright (C) 2019-2020  Matt Keeter
 
 namespace mpr {
 
+// Each block of the effects kernels covers SSAO_TILE^2 output values.  The
+// SSAO pass stages a tile of depth values plus a SSAO_HALO_PX border in
+// shared memory; samples which land outside of it are read from global
+// memory.  SSAO_BLUR_RADIUS is the size of the (edge-preserving) blur.
+//
+// Normals aren't staged: draw_ssao reads one normal per output texel (at
+// the tallest pixel of its footprint), and draw_shaded reads one per
+// pixel, so nothing would be reused from shared memory.  Neighbouring
+// threads read neighbouring (or, at half resolution, nearby) normals, so
+// those reads are already close to coalesced.
+constexpr int SSAO_TILE = 16;
+constexpr int SSAO_HALO_PX = 16;
+constexpr int SSAO_BLUR_RADIUS = 2;
+
+/*
+ *  draw_ssao
+ *
+ *  Computes ambient occlusion at 1 / SCALE of the image resolution.  Each
+ *  output value at (x, y) is based on the tallest pixel in its SCALE^2
+ *  footprint, and is packed as (height << 8) | occlusion, where height is
+ *  zero for empty texels.  Every value in the (image_size_px / SCALE)^2
+ *  output is written, so it doesn't need to be cleared.
+ */
+template <int SCALE>
 __global__
 void draw_ssao(const int32_t* const __restrict__ depth,
                const uint32_t* const __restrict__ norm,
@@ -24,27 +48,58 @@ void draw_ssao(const int32_t* const __restrict__ depth,
 
                int32_t* const __restrict__ output)
 {
-    const int x = threadIdx.x + blockIdx.x * blockDim.x;
-    const int y = threadIdx.y + blockIdx.y * blockDim.y;
-
     constexpr float RADIUS = 0.1f;
+    constexpr int SPAN = SSAO_TILE * SCALE + 2 * SSAO_HALO_PX;
+    __shared__ int32_t tile[SPAN][SPAN];
+
+    // Stage this block's footprint (plus its halo) in shared memory
+    const int x0 = blockIdx.x * SSAO_TILE * SCALE - SSAO_HALO_PX;
+    const int y0 = blockIdx.y * SSAO_TILE * SCALE - SSAO_HALO_PX;
+    for (int i=threadIdx.x + threadIdx.y * SSAO_TILE; i < SPAN * SPAN;
+         i += SSAO_TILE * SSAO_TILE)
+    {
+        const int tx = x0 + i % SPAN;
+        const int ty = y0 + i / SPAN;
+        tile[i / SPAN][i % SPAN] =
+            (tx >= 0 && tx < image_size_px && ty >= 0 && ty < image_size_px)
+            ? depth[tx + ty * image_size_px]
+            : 0;
+    }
+    __syncthreads();
 
-    if (x >= image_size_px && y >= image_size_px) {
+    const int output_size = image_size_px / SCALE;
+    const int x = threadIdx.x + blockIdx.x * SSAO_TILE;
+    const int y = threadIdx.y + blockIdx.y * SSAO_TILE;
+    if (x >= output_size || y >= output_size) {
         return;
     }
 
-    const int h = depth[x + y * image_size_px];
+    // Pick the tallest pixel in this texel's footprint
+    int px = x * SCALE;
+    int py = y * SCALE;
+    int h = 0;
+    for (int j=0; j < SCALE; ++j) {
+        for (int i=0; i < SCALE; ++i) {
+            const int d = tile[y * SCALE + j - y0][x * SCALE + i - x0];
+            if (d > h) {
+                h = d;
+                px = x * SCALE + i;
+                py = y * SCALE + j;
+            }
+        }
+    }
     if (!h) {
+        output[x + y * output_size] = 0;
         return;
     }
 
     const float3 pos = make_float3(
-        2.0f * ((x + 0.5f) / image_size_px - 0.5f),
-        2.0f * ((y + 0.5f) / image_size_px - 0.5f),
+        2.0f * ((px + 0.5f) / image_size_px - 0.5f),
+        2.0f * ((py + 0.5f) / image_size_px - 0.5f),
         2.0f * ((h + 0.5f) / image_size_px - 0.5f));
 
     // Based on http://john-chapman-graphics.blogspot.com/2013/01/ssao-tutorial.html
-    const uint32_t n = norm[x + y * image_size_px];
+    const uint32_t n = norm[px + py * image_size_px];
 
     // Get normal from image
     const float dx = (float)(n & 0xFF) - 128.0f;
@@ -66,12 +121,22 @@ void draw_ssao(const int32_t* const __restrict__ depth,
             tbn * ssao_kernel.row(i).transpose() * RADIUS +
             Eigen::Vector3f{pos.x, pos.y, pos.z};
 
-        const unsigned px = (sample_pos.x() / 2.0f + 0.5f) * image_size_px;
-        const unsigned py = (sample_pos.y() / 2.0f + 0.5f) * image_size_px;
-        const unsigned actual_h =
-            (px < image_size_px && py < image_size_px)
-            ? depth[px + py * image_size_px]
-            : 0;
+        const float fx = (sample_pos.x() / 2.0f + 0.5f) * image_size_px;
+        const float fy = (sample_pos.y() / 2.0f + 0.5f) * image_size_px;
+        const int sx = fx;
+        const int sy = fy;
+        const int lx = sx - x0;
+        const int ly = sy - y0;
+        int actual_h = 0;
+        if (fx < 0.0f || fy < 0.0f ||
+            sx >= image_size_px || sy >= image_size_px)
+        {
+            // Outside of the image, so leave actual_h as zero
+        } else if (lx >= 0 && ly >= 0 && lx < SPAN && ly < SPAN) {
+            actual_h = tile[ly][lx];
+        } else {
+            actual_h = __ldg(&depth[sx + sy * image_size_px]);
+        }
         const float actual_z = 2.0f * ((actual_h + 0.5f) / image_size_px - 0.5f);
 
         const auto dz = fabsf(sample_pos.z() - actual_z);
@@ -85,102 +150,18 @@ void draw_ssao(const int32_t* const __restrict__ depth,
     }
     occlusion = 1.0 - (occlusion / ssao_kernel.rows());
     const uint8_t o = occlusion * 255;
-    output[x + y * image_size_px] = o;
+    output[x + y * output_size] = (h << 8) | o;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-__global__
-void blur_ssao(const int32_t* const __restrict__ image,
-               const int32_t* const __restrict__ ssao,
-               const int image_size_px,
-               int32_t* const __restrict__ output)
+/*  Applies a single light, dimmed by ambient occlusion `ssao` (0-255), and
+ *  returns an opaque grayscale RGBA color. */
+__device__ inline
+int32_t shade_pixel(const int x, const int y, const int h, const uint32_t n,
+                    const float ssao, const int image_size_px)
 {
-    unsigned x = threadIdx.x + blockIdx.x * blockDim.x;
-    unsigned y = threadIdx.y + blockIdx.y * blockDim.y;
-
-    if (x >= image_size_px || y >= image_size_px) {
-        return;
-    }
-
-    const int BLUR_RADIUS = 2;
-
-    float best = 1000000.0f;
-    float value = 0.0f;
-    auto run = [=, &best, &value](int xmin, int ymin) {
-        float sum = 0.0f;
-        float count = 0.0f;
-        for (int i=0; i <= BLUR_RADIUS; ++i) {
-            for (int j=0; j <= BLUR_RADIUS; ++j) {
-                const int tx = x + xmin + i;
-                const int ty = y + ymin + j;
-                if (tx >= 0 && tx < image_size_px &&
-                    ty >= 0 && ty < image_size_px)
-                {
-                    if (image[tx + ty * image_size_px]) {
-                        sum += ssao[tx + ty * image_size_px];
-                        count++;
-                    }
-                }
-            }
-        }
-        const float mean = sum / count;
-        float stdev = 0.0f;
-        for (int i=0; i <= BLUR_RADIUS; ++i) {
-            for (int j=0; j <= BLUR_RADIUS; ++j) {
-                const int tx = xmin + i;
-                const int ty = ymin + j;
-                if (tx >= 0 && tx < image_size_px &&
-                    ty >= 0 && ty < image_size_px)
-                {
-                    if (image[tx + ty * image_size_px]) {
-                        const float d = (mean - ssao[tx + ty * image_size_px]);
-                        stdev += d * d;
-                    }
-                }
-            }
-        }
-        stdev /= count - 1.0f;
-        stdev = sqrtf(stdev);
-        if (stdev < best) {
-            best = stdev;
-            value = mean;
-        }
-    };
-
-    for (unsigned i=0; i < 4; ++i) {
-        run((i & 1) ? 0 : -BLUR_RADIUS,
-            (i & 2) ? 0 : -BLUR_RADIUS);
-    }
-    output[x + y * image_size_px] = value;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-__global__ void draw_shaded(const int32_t* const __restrict__ depth,
-                            const uint32_t* const __restrict__ norm,
-                            const int32_t* const __restrict__ ssao,
-
-                            const int image_size_px,
-
-                            int32_t* const __restrict__ output)
-{
-    unsigned x = threadIdx.x + blockIdx.x * blockDim.x;
-    unsigned y = threadIdx.y + blockIdx.y * blockDim.y;
-
-    if (x >= image_size_px && y >= image_size_px) {
-        return;
-    }
-
-    const auto h = depth[x + y * image_size_px];
-    if (!h) {
-        return;
-    }
-
-    const uint8_t s = ssao[x + y * image_size_px];
-
     // Get normal from image
-    const auto n = norm[x + y * image_size_px];
     float dx = (float)(n & 0xFF) - 128.0f;
     float dy = (float)((n >> 8) & 0xFF) - 128.0f;
     float dz = (float)((n >> 16) & 0xFF) - 128.0f;
@@ -200,7 +181,7 @@ __global__ void draw_shaded(const int32_t* const __restrict__ depth,
     float light = fmaxf(0.0f, light_dir.dot(normal)) * 0.8f;
 
     // SSAO dimming
-    light *= s / 255.0f;
+    light *= ssao / 255.0f;
 
     // Ambient
     light += 0.2f;
@@ -214,10 +195,164 @@ __global__ void draw_shaded(const int32_t* const __restrict__ depth,
 
     uint8_t color = light * 255.0f;
 
-    output[x + y * image_size_px] = (0xFF << 24) |
-                                    (color << 16) |
-                                    (color << 8) |
-                                    (color << 0);
+    return (0xFF << 24) | (color << 16) | (color << 8) | (color << 0);
+}
+
+/*
+ *  draw_shaded
+ *
+ *  Blurs the packed SSAO values from draw_ssao, upsamples them to the full
+ *  image resolution (if SCALE > 1), then either writes the occlusion value
+ *  (if SHADE is false) or a shaded color.  The blur is edge-preserving:
+ *  every output takes the mean of whichever of the four quadrants around it
+ *  has the lowest variance, ignoring empty texels.  Upsampling is bilateral,
+ *  weighting the four nearest texels by their distance and by how close
+ *  their height is to the pixel's own.
+ *
+ *  Blurred texels are computed once per block, in shared memory.  Every
+ *  pixel of `output` is written (with 0 for empty pixels).  If `surface`
+ *  isn't zero, then RGBA colors are written to it instead (with occlusion
+ *  as gray), and empty pixels are only cleared if `append` is false.
+ */
+template <int SCALE, bool SHADE>
+__global__
+void draw_shaded(const int32_t* const __restrict__ depth,
+                 const uint32_t* const __restrict__ norm,
+                 const int32_t* const __restrict__ ssao,
+
+                 const int image_size_px,
+
+                 int32_t* const __restrict__ output,
+                 const cudaSurfaceObject_t surface,
+                 const bool append)
+{
+    // Number of blurred texels used by this block, including a border of
+    // one texel for bilinear upsampling, and the raw texels they need
+    constexpr int BORDER = (SCALE > 1) ? 1 : 0;
+    constexpr int TEXELS = SSAO_TILE / SCALE + 2 * BORDER;
+    constexpr int RAW = TEXELS + 2 * SSAO_BLUR_RADIUS;
+    __shared__ int32_t raw[RAW][RAW];
+    __shared__ int32_t blurred[TEXELS][TEXELS];
+
+    const int ssao_size = image_size_px / SCALE;
+    const int t0x = blockIdx.x * SSAO_TILE / SCALE - BORDER;
+    const int t0y = blockIdx.y * SSAO_TILE / SCALE - BORDER;
+    const int thread = threadIdx.x + threadIdx.y * SSAO_TILE;
+    for (int i=thread; i < RAW * RAW; i += SSAO_TILE * SSAO_TILE) {
+        const int tx = t0x - SSAO_BLUR_RADIUS + i % RAW;
+        const int ty = t0y - SSAO_BLUR_RADIUS + i / RAW;
+        raw[i / RAW][i % RAW] =
+            (tx >= 0 && tx < ssao_size && ty >= 0 && ty < ssao_size)
+            ? ssao[tx + ty * ssao_size]
+            : 0;
+    }
+    __syncthreads();
+
+    for (int i=thread; i < TEXELS * TEXELS; i += SSAO_TILE * SSAO_TILE) {
+        const int cx = i % TEXELS + SSAO_BLUR_RADIUS;
+        const int cy = i / TEXELS + SSAO_BLUR_RADIUS;
+        const int32_t c = raw[cy][cx];
+        if (!(c >> 8)) {
+            blurred[i / TEXELS][i % TEXELS] = 0;
+            continue;
+        }
+
+        float best = 1000000.0f;
+        float value = 0.0f;
+        for (unsigned q=0; q < 4; ++q) {
+            const int xmin = cx + ((q & 1) ? 0 : -SSAO_BLUR_RADIUS);
+            const int ymin = cy + ((q & 2) ? 0 : -SSAO_BLUR_RADIUS);
+            float sum = 0.0f;
+            float count = 0.0f;
+            for (int j=0; j <= SSAO_BLUR_RADIUS; ++j) {
+                for (int k=0; k <= SSAO_BLUR_RADIUS; ++k) {
+                    const int32_t t = raw[ymin + j][xmin + k];
+                    if (t >> 8) {
+                        sum += t & 0xFF;
+                        count++;
+                    }
+                }
+            }
+            const float mean = sum / count;
+            float stdev = 0.0f;
+            for (int j=0; j <= SSAO_BLUR_RADIUS; ++j) {
+                for (int k=0; k <= SSAO_BLUR_RADIUS; ++k) {
+                    const int32_t t = raw[ymin + j][xmin + k];
+                    if (t >> 8) {
+                        const float d = mean - (t & 0xFF);
+                        stdev += d * d;
+                    }
+                }
+            }
+            stdev = (count > 1.0f) ? sqrtf(stdev / (count - 1.0f)) : 0.0f;
+            if (stdev < best) {
+                best = stdev;
+                value = mean;
+            }
+        }
+        blurred[i / TEXELS][i % TEXELS] = (c & ~0xFF) | (uint8_t)value;
+    }
+    __syncthreads();
+
+    const int x = threadIdx.x + blockIdx.x * SSAO_TILE;
+    const int y = threadIdx.y + blockIdx.y * SSAO_TILE;
+    if (x >= image_size_px || y >= image_size_px) {
+        return;
+    }
+    const int h = depth[x + y * image_size_px];
+    if (!h) {
+        if (!surface) {
+            output[x + y * image_size_px] = 0;
+        } else if (!append) {
+            surf2Dwrite(0, surface, x * 4, y);
+        }
+        return;
+    }
+
+    float s;
+    if (SCALE == 1) {
+        s = blurred[threadIdx.y][threadIdx.x] & 0xFF;
+    } else {
+        // Position of this pixel in texel coordinates, relative to the
+        // first texel in `blurred`
+        const float u = (x + 0.5f) / SCALE - 0.5f - t0x;
+        const float v = (y + 0.5f) / SCALE - 0.5f - t0y;
+        const int tu = floorf(u);
+        const int tv = floorf(v);
+        const float fu = u - tu;
+        const float fv = v - tv;
+        float sum = 0.0f;
+        float weight = 0.0f;
+        for (int j=0; j < 2; ++j) {
+            for (int i=0; i < 2; ++i) {
+                const int32_t t = blurred[tv + j][tu + i];
+                if (!(t >> 8)) {
+                    continue;
+                }
+                const float w = (i ? fu : 1.0f - fu) * (j ? fv : 1.0f - fv)
+                    * __expf(-fabsf((float)((t >> 8) - h)) / SCALE) + 1e-6f;
+                sum += w * (t & 0xFF);
+                weight += w;
+            }
+        }
+        s = (weight > 0.0f) ? (sum / weight) : 255.0f;
+    }
+
+    int32_t out;
+    if (SHADE) {
+        out = shade_pixel(x, y, h, norm[x + y * image_size_px], s,
+                          image_size_px);
+    } else if (surface) {
+        const uint8_t g = s;
+        out = 0xFF000000 | g | (g << 8) | (g << 16);
+    } else {
+        out = (uint8_t)s;
+    }
+    if (surface) {
+        surf2Dwrite(out, surface, x * 4, y);
+    } else {
+        output[x + y * image_size_px] = out;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -257,44 +392,42 @@ void Effects::resizeTo(const Context& ctx) {
     }
 }
 
-void Effects::drawSSAO(const Context& ctx)
+
+void Effects::draw(const Context& ctx, bool shade,
+                   cudaSurfaceObject_t surface, bool append)
 {
     resizeTo(ctx);
 
-    const auto bytes = sizeof(int32_t) * pow(image_size_px, 2);
-    CUDA_CHECK(cudaMemsetAsync(tmp.get(), 0, bytes));
-    CUDA_CHECK(cudaMemsetAsync(image.get(), 0, bytes));
-
-    const unsigned u = (image_size_px + 15) / 16;
-    draw_ssao<<<dim3(u, u), dim3(16, 16)>>>(
+    // Both passes write every value of their outputs, so neither tmp nor
+    // image needs to be cleared.
+    const int scale = half_res_ssao ? 2 : 1;
+    const unsigned s = (image_size_px / scale + SSAO_TILE - 1) / SSAO_TILE;
+    const auto draw_ssao_f = (scale == 2) ? draw_ssao<2> : draw_ssao<1>;
+    draw_ssao_f<<<dim3(s, s), dim3(SSAO_TILE, SSAO_TILE)>>>(
             ctx.stages[3].filled.get(), ctx.normals.get(),
             ssao_kernel, ssao_rvecs, image_size_px,
             tmp.get());
-    blur_ssao<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), tmp.get(), image_size_px, image.get());
+
+    const auto draw_shaded_f = (scale == 2)
+        ? (shade ? draw_shaded<2, true> : draw_shaded<2, false>)
+        : (shade ? draw_shaded<1, true> : draw_shaded<1, false>);
+    const unsigned u = (image_size_px + SSAO_TILE - 1) / SSAO_TILE;
+    draw_shaded_f<<<dim3(u, u), dim3(SSAO_TILE, SSAO_TILE)>>>(
+            ctx.stages[3].filled.get(), ctx.normals.get(),
+            tmp.get(), image_size_px, image.get(), surface, append);
     CUDA_CHECK(cudaDeviceSynchronize());
 }
 
-void Effects::drawShaded(const Context& ctx)
+void Effects::drawSSAO(const Context& ctx, cudaSurfaceObject_t surface,
+                       bool append)
 {
-    resizeTo(ctx);
-
-    const auto bytes = sizeof(int32_t) * pow(image_size_px, 2);
-    CUDA_CHECK(cudaMemsetAsync(tmp.get(), 0, bytes));
-    CUDA_CHECK(cudaMemsetAsync(image.get(), 0, bytes));
-
-    const unsigned u = (image_size_px + 15) / 16;
-    draw_ssao<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), ctx.normals.get(),
-            ssao_kernel, ssao_rvecs, image_size_px,
-            image.get());
-    blur_ssao<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), image.get(), image_size_px, tmp.get());
-    draw_shaded<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), ctx.normals.get(),
-            tmp.get(), image_size_px, image.get());
-    CUDA_CHECK(cudaDeviceSynchronize());
+    draw(ctx, false, surface, append);
 }
 
+void Effects::drawShaded(const Context& ctx, cudaSurfaceObject_t surface,
+                         bool append)
+{
+    draw(ctx, true, surface, append);
+}
 
 }   // namespace mpr
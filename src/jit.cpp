@@ -0,0 +1,460 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <vector>
+
+#ifdef MPR_JIT
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cuda.h>
+#include <nvrtc.h>
+#endif
+
+#include "clause.hpp"
+#include "gpu_opcode.hpp"
+#include "jit.hpp"
+#include "tape.hpp"
+
+namespace mpr {
+
+/*  Returns an expression for one clause, which is evaluated on floats
+ *  (matching eval_tape_f) or on Derivs (matching eval_tape_d).  Returns an
+ *  empty string for opcodes which can't be compiled. */
+static std::string clause_expr(const uint8_t op, const std::string& lhs,
+                               const std::string& rhs, const std::string& imm,
+                               const bool deriv)
+{
+    // Unary functions have the same name for both types, apart from the
+    // f suffix on the float versions
+    auto call = [&](const char* f, const std::string& a) {
+        return std::string(f) + (deriv ? "" : "f") + "(" + a + ")";
+    };
+    auto call2 = [&](const char* f, const std::string& a,
+                     const std::string& b) {
+        return std::string(f) + "(" + a + ", " + b + ")";
+    };
+    switch (op) {
+        case GPU_OP_SQUARE_LHS: return lhs + " * " + lhs;
+        case GPU_OP_SQRT_LHS: return call("sqrt", lhs);
+        case GPU_OP_NEG_LHS: return "-" + lhs;
+        case GPU_OP_SIN_LHS: return call("sin", lhs);
+        case GPU_OP_COS_LHS: return call("cos", lhs);
+        case GPU_OP_ASIN_LHS: return call("asin", lhs);
+        case GPU_OP_ACOS_LHS: return call("acos", lhs);
+        case GPU_OP_ATAN_LHS: return call("atan", lhs);
+        case GPU_OP_EXP_LHS: return call("exp", lhs);
+        case GPU_OP_ABS_LHS: return deriv ? call("abs", lhs)
+                                          : call("fabs", lhs);
+        case GPU_OP_LOG_LHS: return call("log", lhs);
+        case GPU_OP_TAN_LHS: return call("tan", lhs);
+        case GPU_OP_RECIP_LHS: return deriv ? call("recip", lhs)
+                                            : "1.0f / " + lhs;
+
+        // Commutative opcodes
+        case GPU_OP_ADD_LHS_IMM: return lhs + " + " + imm;
+        case GPU_OP_ADD_LHS_RHS: return lhs + " + " + rhs;
+        case GPU_OP_MUL_LHS_IMM: return lhs + " * " + imm;
+        case GPU_OP_MUL_LHS_RHS: return lhs + " * " + rhs;
+        case GPU_OP_MIN_LHS_IMM: return call2(deriv ? "min" : "fminf", lhs, imm);
+        case GPU_OP_MIN_LHS_RHS: return call2(deriv ? "min" : "fminf", lhs, rhs);
+        case GPU_OP_MAX_LHS_IMM: return call2(deriv ? "max" : "fmaxf", lhs, imm);
+        case GPU_OP_MAX_LHS_RHS: return call2(deriv ? "max" : "fmaxf", lhs, rhs);
+
+        // Non-commutative opcodes
+        case GPU_OP_SUB_LHS_IMM: return lhs + " - " + imm;
+        case GPU_OP_SUB_IMM_RHS: return imm + " - " + rhs;
+        case GPU_OP_SUB_LHS_RHS: return lhs + " - " + rhs;
+
+        case GPU_OP_DIV_LHS_IMM: return lhs + " / " + imm;
+        case GPU_OP_DIV_IMM_RHS: return imm + " / " + rhs;
+        case GPU_OP_DIV_LHS_RHS: return lhs + " / " + rhs;
+        case GPU_OP_ATAN2_LHS_IMM: return call2(deriv ? "atan2" : "atan2f", lhs, imm);
+        case GPU_OP_ATAN2_IMM_RHS: return call2(deriv ? "atan2" : "atan2f", imm, rhs);
+        case GPU_OP_ATAN2_LHS_RHS: return call2(deriv ? "atan2" : "atan2f", lhs, rhs);
+        case GPU_OP_MOD_LHS_IMM: return call2("mod", lhs, imm);
+        case GPU_OP_MOD_IMM_RHS: return call2("mod", imm, rhs);
+        case GPU_OP_MOD_LHS_RHS: return call2("mod", lhs, rhs);
+        case GPU_OP_POW_LHS_IMM: return call2(deriv ? "pow" : "powf", lhs, imm);
+        case GPU_OP_NTH_ROOT_LHS_IMM: return call2("nth_root", lhs, imm);
+
+        // Fused opcodes
+        case GPU_OP_FMA_LHS_IMM_RHS:
+            return deriv ? lhs + " * " + imm + " + " + rhs
+                         : "fmaf(" + lhs + ", " + imm + ", " + rhs + ")";
+        case GPU_OP_SQUARE_ADD_LHS_RHS:
+            return deriv ? "square(" + lhs + ") + " + rhs
+                         : "fmaf(" + lhs + ", " + lhs + ", " + rhs + ")";
+        case GPU_OP_DIFF_SQUARE_LHS_IMM:
+            return deriv ? "square(" + lhs + " - " + imm + ")"
+                         : "(" + lhs + " - " + imm + ") * (" +
+                                 lhs + " - " + imm + ")";
+        case GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS:
+            return deriv ? "square(" + lhs + " - " + imm + ") + " + rhs
+                         : "fmaf(" + lhs + " - " + imm + ", " +
+                                 lhs + " - " + imm + ", " + rhs + ")";
+
+        case GPU_OP_COPY_IMM: return deriv ? "Deriv(" + imm + ")" : imm;
+        case GPU_OP_COPY_LHS: return lhs;
+        case GPU_OP_COPY_RHS: return rhs;
+
+        default: return "";
+    }
+}
+
+// Everything in the generated source apart from the two evaluators.  The
+// kernels match calculate_voxels / eval_voxels_f and eval_pixel_list_d,
+// and TileNode and Eigen::Matrix4f (which is column-major) are redeclared
+// with the same layout.
+static const char* JIT_KERNELS = R"(
+struct JitTileNode {
+    int position;
+    int tape;
+    int next;
+    int batch;
+};
+
+struct JitMat4 {
+    float m[16];
+};
+
+extern "C" __global__
+void jit_voxels(const unsigned long long* const __restrict__ tape,
+                const JitTileNode* const __restrict__ tiles,
+                const int* __restrict__ tile_count,
+                float2* const __restrict__ values)
+{
+    const int voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int tile_index = voxel_index / 32;
+    if (tile_index >= *tile_count || tiles[tile_index].tape) {
+        return;
+    }
+    float2* const v = &values[voxel_index * 3];
+    const float2 x = v[0];
+    const float2 y = v[1];
+    const float2 z = v[2];
+    v[0] = make_float2(jit_eval_f(tape, x.x, y.x, z.x),
+                       jit_eval_f(tape, x.y, y.y, z.y));
+}
+
+extern "C" __global__
+void jit_normals(const JitMat4 mat,
+                 const unsigned long long* const __restrict__ tape,
+                 const int* const __restrict__ image,
+                 unsigned* const __restrict__ output,
+                 const unsigned image_size_px,
+                 const int2* const __restrict__ list,
+                 const int* const __restrict__ list_count)
+{
+    const int i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= *list_count) {
+        return;
+    }
+    const int2 entry = list[i];
+    if (entry.y) {
+        return;
+    }
+    const int px = entry.x % image_size_px;
+    const int py = entry.x / image_size_px;
+
+    // Move slightly in front of the surface, as in normal_height
+    int pz = image[entry.x];
+    if (pz == 0 || pz >= (int)image_size_px) {
+        pz = 0;
+    } else if (pz < (int)image_size_px - 1) {
+        pz += 1;
+    }
+
+    const float size_recip = 1.0f / image_size_px;
+    const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
+    const float fw = mat.m[3] * fx + mat.m[7] * fy + mat.m[11] * fz +
+                     mat.m[15];
+    float p[3];
+    for (unsigned j=0; j < 3; ++j) {
+        p[j] = (mat.m[j] * fx + mat.m[j + 4] * fy + mat.m[j + 8] * fz +
+                mat.m[j + 12]) / fw;
+    }
+    const Deriv result = jit_eval_d(tape,
+                                    Deriv(p[0], 1.0f, 0.0f, 0.0f),
+                                    Deriv(p[1], 0.0f, 1.0f, 0.0f),
+                                    Deriv(p[2], 0.0f, 0.0f, 1.0f));
+
+    const float norm = sqrtf(powf(result.dx(), 2) +
+                             powf(result.dy(), 2) +
+                             powf(result.dz(), 2));
+    const unsigned char dx = (result.dx() / norm) * 127 + 128;
+    const unsigned char dy = (result.dy() / norm) * 127 + 128;
+    const unsigned char dz = (result.dz() / norm) * 127 + 128;
+    output[entry.x] = (0xFF << 24) | (dz << 16) | (dy << 8) | dx;
+}
+)";
+
+std::string JitTape::source(const Tape& tape) {
+    // The tape lives in GPU memory, so read it back in one go
+    std::vector<uint64_t> clauses(tape.length);
+    CUDA_CHECK(cudaMemcpy(clauses.data(), tape.data.get(),
+                          sizeof(uint64_t) * tape.length,
+                          cudaMemcpyDeviceToHost));
+
+    // Each slot holds the name of the variable that was last written to it.
+    // Slots which are read before they're written get a name that doesn't
+    // exist, so that compilation fails.
+    std::vector<std::string> slots(256);
+    for (unsigned i=0; i < slots.size(); ++i) {
+        slots[i] = "unset_slot_" + std::to_string(i);
+    }
+    const uint8_t* const header = (const uint8_t*)&clauses[0];
+    slots[header[1]] = "x";
+    slots[header[2]] = "y";
+    slots[header[3]] = "z";
+
+    std::stringstream body_f;
+    std::stringstream body_d;
+    std::string result;
+    for (int32_t i=1; i < tape.length; ++i) {
+        const uint64_t* const d = &clauses[i];
+        if (!OP(d)) {
+            result = slots[I_OUT(d)];
+            break;
+        }
+        // Immediates are written by value, so they're bit-exact
+        char imm[32];
+        uint32_t bits;
+        memcpy(&bits, &IMM(d), sizeof(bits));
+        snprintf(imm, sizeof(imm), "__uint_as_float(0x%08" PRIx32 "u)", bits);
+
+        // Variables are read from the tape, where each render stores them
+        // (see Context::vars), rather than being compiled in
+        if (i <= TAPE_VARS(header)) {
+            snprintf(imm, sizeof(imm), "((const float*)&tape[%i])[1]", i);
+        }
+        const std::string f = clause_expr(OP(d), slots[I_LHS(d)],
+                                          slots[I_RHS(d)], imm, false);
+        const std::string g = clause_expr(OP(d), slots[I_LHS(d)],
+                                          slots[I_RHS(d)], imm, true);
+        if (f.empty() || g.empty()) {
+            fprintf(stderr, "Cannot compile opcode %i (at clause %i)\n",
+                    OP(d), i);
+            return "";
+        }
+        const std::string v = "v" + std::to_string(i);
+        body_f << "    const float " << v << " = " << f << ";\n";
+        body_d << "    const Deriv " << v << " = " << g << ";\n";
+        slots[I_OUT(d)] = v;
+    }
+    if (result.empty()) {
+        fprintf(stderr, "Tape has no final clause\n");
+        return "";
+    }
+
+    std::stringstream out;
+    out << "#include \"gpu_interval.hpp\"\n"
+        << "#include \"gpu_deriv.hpp\"\n"
+        << "using namespace mpr;\n\n"
+        << "__device__ inline\n"
+        << "float jit_eval_f(const unsigned long long* const __restrict__ tape,\n"
+        << "                 const float x, const float y, const float z)\n"
+        << "{\n" << body_f.str() << "    return " << result << ";\n}\n\n"
+        << "__device__ inline\n"
+        << "Deriv jit_eval_d(const unsigned long long* const __restrict__ tape,\n"
+        << "                 const Deriv x, const Deriv y, const Deriv z)\n"
+        << "{\n" << body_d.str() << "    return " << result << ";\n}\n"
+        << JIT_KERNELS;
+    return out.str();
+}
+
+#ifdef MPR_JIT
+static bool cuCheck(CUresult code, const char* what) {
+    if (code != CUDA_SUCCESS) {
+        const char* err = nullptr;
+        cuGetErrorString(code, &err);
+        fprintf(stderr, "Could not %s: %s\n", what, err ? err : "unknown");
+        return false;
+    }
+    return true;
+}
+
+/*  Compiles the generated source to PTX for the device with the given
+ *  compute capability, returning an empty string (after printing the
+ *  compiler's log) if it fails. */
+static std::string compile(const std::string& src, int major, int minor) {
+    nvrtcProgram prog;
+    if (nvrtcCreateProgram(&prog, src.c_str(), "jit_tape.cu",
+                           0, nullptr, nullptr) != NVRTC_SUCCESS)
+    {
+        fprintf(stderr, "Could not create NVRTC program\n");
+        return "";
+    }
+    const std::string arch = "--gpu-architecture=compute_" +
+                             std::to_string(major * 10 + minor);
+    const std::string inc = std::string("-I") + MPR_JIT_INCLUDE_DIR;
+    const std::string cuda_inc = std::string("-I") + MPR_JIT_CUDA_INCLUDE_DIR;
+    const char* opts[] = {arch.c_str(), inc.c_str(), cuda_inc.c_str(),
+                          "--std=c++11"};
+
+    std::string ptx;
+    if (nvrtcCompileProgram(prog, 4, opts) != NVRTC_SUCCESS) {
+        size_t log_size;
+        nvrtcGetProgramLogSize(prog, &log_size);
+        std::string log(log_size, '\0');
+        nvrtcGetProgramLog(prog, &log[0]);
+        fprintf(stderr, "Could not compile tape:\n%s\n", log.c_str());
+    } else {
+        size_t ptx_size;
+        nvrtcGetPTXSize(prog, &ptx_size);
+        ptx.resize(ptx_size);
+        nvrtcGetPTX(prog, &ptx[0]);
+        ptx.resize(strlen(ptx.c_str()));
+    }
+    nvrtcDestroyProgram(&prog);
+    return ptx;
+}
+#endif
+
+std::shared_ptr<const JitTape> JitTape::build(const Tape& tape,
+                                              const std::string& cache_dir)
+{
+#ifdef MPR_JIT
+    const std::string src = source(tape);
+    if (src.empty()) {
+        return nullptr;
+    }
+
+    int device;
+    cudaDeviceProp props;
+    CUDA_CHECK(cudaGetDevice(&device));
+    CUDA_CHECK(cudaGetDeviceProperties(&props, device));
+
+    // The generated source is hashed along with the tape, so that cached
+    // kernels from a build with a different code generator aren't used
+    char name[96];
+    snprintf(name, sizeof(name), "%016" PRIx64 "-%016zx-sm_%i%i.ptx",
+             tape.hash, std::hash<std::string>()(src),
+             props.major, props.minor);
+    const std::string path = cache_dir + "/" + name;
+
+    std::string ptx;
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (in.is_open()) {
+            std::stringstream ss;
+            ss << in.rdbuf();
+            ptx = ss.str();
+        }
+    }
+    if (ptx.empty()) {
+        ptx = compile(src, props.major, props.minor);
+        if (ptx.empty()) {
+            return nullptr;
+        }
+        // Failing to write the cache only means compiling again next time.
+        // Writing to a temporary file then renaming it means that other
+        // processes never see a partial file.
+        mkdir(cache_dir.c_str(), 0755);
+        const std::string tmp = path + "." + std::to_string(getpid());
+        std::ofstream out(tmp, std::ios::binary);
+        if (out.is_open()) {
+            out << ptx;
+            out.close();
+            if (!out.fail()) {
+                std::rename(tmp.c_str(), path.c_str());
+            }
+        }
+        std::remove(tmp.c_str());
+    }
+
+    // The driver API uses the current context, so make sure that the
+    // runtime has set up this device's primary context on this thread
+    CUDA_CHECK(cudaFree(nullptr));
+
+    std::shared_ptr<JitTape> out(new JitTape);
+    out->hash = tape.hash;
+    if (!cuCheck(cuModuleLoadData(&out->module, ptx.c_str()),
+                 "load compiled tape") ||
+        !cuCheck(cuModuleGetFunction(&out->voxels, out->module,
+                                     "jit_voxels"), "find jit_voxels") ||
+        !cuCheck(cuModuleGetFunction(&out->normals, out->module,
+                                     "jit_normals"), "find jit_normals"))
+    {
+        return nullptr;
+    }
+    return out;
+#else
+    (void)tape;
+    (void)cache_dir;
+    fprintf(stderr, "JIT compilation requires a build with MPR_JIT\n");
+    return nullptr;
+#endif
+}
+
+JitTape::~JitTape() {
+#ifdef MPR_JIT
+    if (module) {
+        cuModuleUnload(module);
+    }
+#endif
+}
+
+void JitTape::evalVoxels(const uint64_t* tape_data, const TileNode* tiles,
+                         const int32_t* tile_count, unsigned num_blocks,
+                         float2* values, cudaStream_t stream) const
+{
+#ifdef MPR_JIT
+    void* args[] = {(void*)&tape_data, (void*)&tiles, (void*)&tile_count,
+                    (void*)&values};
+    cuCheck(cuLaunchKernel(voxels, num_blocks, 1, 1, NUM_TILES * 32, 1, 1,
+                           0, stream, args, nullptr),
+            "launch jit_voxels");
+#else
+    (void)tape_data;
+    (void)tiles;
+    (void)tile_count;
+    (void)num_blocks;
+    (void)values;
+    (void)stream;
+#endif
+}
+
+void JitTape::evalNormals(const Eigen::Matrix4f& mat,
+                          const uint64_t* tape_data, const int32_t* image,
+                          uint32_t* normals_out, int32_t image_size_px,
+                          const int2* list, const int32_t* list_count,
+                          unsigned num_blocks, cudaStream_t stream) const
+{
+#ifdef MPR_JIT
+    // The kernel takes the matrix by value, as 16 column-major floats
+    void* args[] = {(void*)mat.data(), (void*)&tape_data, (void*)&image,
+                    (void*)&normals_out,
+                    (void*)&image_size_px, (void*)&list, (void*)&list_count};
+    cuCheck(cuLaunchKernel(normals, num_blocks, 1, 1, NUM_THREADS, 1, 1,
+                           0, stream, args, nullptr),
+            "launch jit_normals");
+#else
+    (void)mat;
+    (void)tape_data;
+    (void)image;
+    (void)normals_out;
+    (void)image_size_px;
+    (void)list;
+    (void)list_count;
+    (void)num_blocks;
+    (void)stream;
+#endif
+}
+
+}   // namespace mpr
@@ -0,0 +1,98 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <thread>
+
+#include "context.hpp"
+#include "multi_context.hpp"
+
+namespace mpr {
+
+MultiContext::MultiContext(int32_t image_size_px, std::vector<int> devs,
+                           int32_t num_subtapes)
+    : image_size_px(image_size_px), devices(devs)
+{
+    if (devices.empty()) {
+        int count;
+        CUDA_CHECK(cudaGetDeviceCount(&count));
+        for (int i=0; i < count; ++i) {
+            devices.push_back(i);
+        }
+    }
+
+    int prev;
+    CUDA_CHECK(cudaGetDevice(&prev));
+    for (auto& d : devices) {
+        CUDA_CHECK(cudaSetDevice(d));
+        contexts.emplace_back(new Context(image_size_px, nullptr,
+                                          num_subtapes));
+    }
+    CUDA_CHECK(cudaSetDevice(prev));
+
+    filled.reset(CUDA_MALLOC_HOST(int32_t, image_size_px * image_size_px));
+    normals.reset(CUDA_MALLOC_HOST(uint32_t, image_size_px * image_size_px));
+}
+
+MultiContext::~MultiContext() {
+    // Each Context must be destroyed on its own device, since it owns
+    // streams and memory pools which belong to that device.
+    int prev;
+    CUDA_CHECK(cudaGetDevice(&prev));
+    for (unsigned i=0; i < contexts.size(); ++i) {
+        CUDA_CHECK(cudaSetDevice(devices[i]));
+        contexts[i].reset();
+    }
+    CUDA_CHECK(cudaSetDevice(prev));
+}
+
+void MultiContext::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    const int32_t num_rows = image_size_px / 64;
+    const int32_t num_devices = contexts.size();
+    const int32_t rows_per_device =
+        (num_rows + num_devices - 1) / num_devices;
+
+    std::vector<std::thread> threads;
+    for (int32_t i=0; i < num_devices; ++i) {
+        const int32_t row_begin = i * rows_per_device;
+        const int32_t row_end = std::min(row_begin + rows_per_device,
+                                         num_rows);
+        if (row_begin >= row_end) {
+            break;
+        }
+        threads.emplace_back([&, i, row_begin, row_end]() {
+            // The current device is per-thread state
+            CUDA_CHECK(cudaSetDevice(devices[i]));
+            Context& ctx = *contexts[i];
+            ctx.tile_row_begin = row_begin;
+            ctx.tile_row_end = row_end;
+            ctx.render3D(tape, mat);
+
+            // Each strip is a contiguous block of rows in the images
+            const size_t offset = row_begin * 64 * image_size_px;
+            const size_t count = (row_end - row_begin) * 64 * image_size_px;
+            CUDA_CHECK(cudaMemcpyAsync(
+                    filled.get() + offset, ctx.stages[3].filled.get() + offset,
+                    sizeof(int32_t) * count, cudaMemcpyDefault,
+                    ctx.stream.get()));
+            CUDA_CHECK(cudaMemcpyAsync(
+                    normals.get() + offset, ctx.normals.get() + offset,
+                    sizeof(uint32_t) * count, cudaMemcpyDefault,
+                    ctx.stream.get()));
+            CUDA_CHECK(cudaStreamSynchronize(ctx.stream.get()));
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+}   // namespace mpr
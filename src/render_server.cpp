@@ -0,0 +1,178 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+
+#include "context.hpp"
+#include "render_server.hpp"
+#include "tape.hpp"
+
+namespace mpr {
+
+RenderServer::RenderServer(int32_t num_contexts, int32_t num_subtapes,
+                           int32_t max_batch, float max_wait_ms)
+    : num_subtapes(num_subtapes), max_batch(std::max(max_batch, 1)),
+      max_wait_ms(max_wait_ms), rendered(0), batches(0)
+{
+    CUDA_CHECK(cudaGetDevice(&device));
+    for (int32_t i=0; i < std::max(num_contexts, 1); ++i) {
+        workers.emplace_back([this]() { run(); });
+    }
+}
+
+RenderServer::~RenderServer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+std::future<RenderResult> RenderServer::submit(
+        std::shared_ptr<const Tape> tape, const Eigen::Matrix4f& mat,
+        int32_t image_size_px, int32_t priority)
+{
+    Request r;
+    r.tape = tape;
+    r.mat = mat;
+    r.image_size_px = image_size_px;
+    r.priority = priority;
+    r.submitted = Clock::now();
+    auto out = r.promise.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        r.seq = next_seq++;
+        queue.push_back(std::move(r));
+    }
+    cv.notify_one();
+    return out;
+}
+
+size_t RenderServer::pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+}
+
+std::vector<RenderServer::Request> RenderServer::takeBatch() {
+    // Requests which have waited too long are served oldest-first, ahead
+    // of everything else; otherwise, pick by priority then by age.
+    const auto now = Clock::now();
+    auto overdue = [&](const Request& r) {
+        return std::chrono::duration<float, std::milli>(
+                now - r.submitted).count() > max_wait_ms;
+    };
+    auto before = [&](const Request& a, const Request& b) {
+        const bool oa = overdue(a);
+        const bool ob = overdue(b);
+        if (oa != ob) {
+            return oa;
+        } else if (!oa && a.priority != b.priority) {
+            return a.priority > b.priority;
+        } else {
+            return a.seq < b.seq;
+        }
+    };
+    std::stable_sort(queue.begin(), queue.end(), before);
+
+    // Fill out the batch with other requests of the same size, in the same
+    // order, as long as their tapes leave most of the pool for pushing
+    // (since renderBatch3D stores every root tape in the pool).
+    const int32_t size = queue.front().image_size_px;
+    const int32_t max_clauses = num_subtapes * SUBTAPE_CHUNK_SIZE / 2;
+    int32_t clauses = 0;
+
+    std::vector<Request> batch;
+    std::vector<Request> rest;
+    for (auto& r : queue) {
+        if (batch.empty() ||
+            (r.image_size_px == size &&
+             (int32_t)batch.size() < max_batch &&
+             clauses + r.tape->length <= max_clauses))
+        {
+            clauses += r.tape->length;
+            batch.push_back(std::move(r));
+        } else {
+            rest.push_back(std::move(r));
+        }
+    }
+    queue.swap(rest);
+    return batch;
+}
+
+void RenderServer::render(std::unique_ptr<Context>& ctx,
+                          std::vector<Request>& batch)
+{
+    const int32_t size = batch.front().image_size_px;
+    if (!ctx || ctx->image_size_px != size) {
+        ctx.reset();    // Free the old Context's memory first
+        ctx.reset(new Context(size, nullptr, num_subtapes));
+    }
+    cudaStream_t stream = ctx->stream.get();
+
+    if (batch.size() == 1) {
+        ctx->render3D(*batch.front().tape, batch.front().mat, stream);
+    } else {
+        std::vector<const Tape*> tapes;
+        Context::MatrixList mats;
+        for (auto& r : batch) {
+            tapes.push_back(r.tape.get());
+            mats.push_back(r.mat);
+        }
+        ctx->renderBatch3D(tapes, mats, stream);
+    }
+
+    // Each item in the batch is one layer of the images
+    const size_t pixels = size * size;
+    std::vector<RenderResult> results(batch.size());
+    for (unsigned i=0; i < batch.size(); ++i) {
+        auto& out = results[i];
+        out.image_size_px = size;
+        out.depth.resize(pixels);
+        out.normals.resize(pixels);
+        CUDA_CHECK(cudaMemcpyAsync(
+                out.depth.data(), ctx->stages[3].filled.get() + i * pixels,
+                sizeof(int32_t) * pixels, cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaMemcpyAsync(
+                out.normals.data(), ctx->normals.get() + i * pixels,
+                sizeof(uint32_t) * pixels, cudaMemcpyDeviceToHost, stream));
+    }
+    CUDA_CHECK(cudaStreamSynchronize(stream));
+
+    for (unsigned i=0; i < batch.size(); ++i) {
+        batch[i].promise.set_value(std::move(results[i]));
+    }
+    rendered += batch.size();
+    batches++;
+}
+
+void RenderServer::run() {
+    // The current device is per-thread state
+    CUDA_CHECK(cudaSetDevice(device));
+    std::unique_ptr<Context> ctx;
+
+    while (true) {
+        std::vector<Request> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                break;  // stopping, with nothing left to do
+            }
+            batch = takeBatch();
+        }
+        render(ctx, batch);
+    }
+}
+
+}   // namespace mpr
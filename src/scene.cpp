@@ -0,0 +1,267 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include "scene.hpp"
+#include "tape.hpp"
+
+namespace mpr {
+
+int32_t Scene::addInstance(const libfive::Tree& shape,
+                           const Eigen::Matrix4f& transform,
+                           const Eigen::Vector3f& lower,
+                           const Eigen::Vector3f& upper)
+{
+    Instance i = {shape, transform, lower, upper};
+    instances.push_back(i);
+
+    // Find scene-space bounds from the corners of the shape's bounds
+    const float inf = std::numeric_limits<float>::infinity();
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(inf);
+    Eigen::Vector3f hi = Eigen::Vector3f::Constant(-inf);
+    for (unsigned c=0; c < 8; ++c) {
+        const Eigen::Vector4f p((c & 1) ? upper.x() : lower.x(),
+                                (c & 2) ? upper.y() : lower.y(),
+                                (c & 4) ? upper.z() : lower.z(), 1.0f);
+        const Eigen::Vector3f q = (transform * p).head<3>();
+        lo = lo.cwiseMin(q);
+        hi = hi.cwiseMax(q);
+    }
+    lowers.push_back(lo);
+    uppers.push_back(hi);
+
+    // The BVH is rebuilt by the next call to prepare
+    bvh.clear();
+    return instances.size() - 1;
+}
+
+void Scene::clear() {
+    instances.clear();
+    lowers.clear();
+    uppers.clear();
+    bvh.clear();
+    bvh_order.clear();
+    tapes.clear();
+}
+
+void Scene::buildBVH() {
+    const int32_t n = instances.size();
+    bvh_order.resize(n);
+    std::iota(bvh_order.begin(), bvh_order.end(), 0);
+
+    bvh.clear();
+    bvh.push_back(Node());
+    if (n == 0) {
+        bvh[0].lower = Eigen::Vector3f::Zero();
+        bvh[0].upper = Eigen::Vector3f::Zero();
+        bvh[0].start = 0;
+        bvh[0].count = 0;
+        return;
+    }
+
+    // Nodes which still need their bounds and children, with the range of
+    // bvh_order that they cover
+    struct Range {
+        int32_t node;
+        int32_t begin;
+        int32_t end;
+    };
+    std::vector<Range> todo = {{0, 0, n}};
+    const float inf = std::numeric_limits<float>::infinity();
+    while (!todo.empty()) {
+        const Range r = todo.back();
+        todo.pop_back();
+
+        Node node;
+        node.lower = Eigen::Vector3f::Constant(inf);
+        node.upper = Eigen::Vector3f::Constant(-inf);
+        for (int32_t i=r.begin; i < r.end; ++i) {
+            node.lower = node.lower.cwiseMin(lowers[bvh_order[i]]);
+            node.upper = node.upper.cwiseMax(uppers[bvh_order[i]]);
+        }
+
+        if (r.end - r.begin <= SCENE_BVH_LEAF_SIZE) {
+            node.start = r.begin;
+            node.count = r.end - r.begin;
+        } else {
+            // Split at the median of the instances' centers, on the
+            // longest axis of the node
+            int axis;
+            (node.upper - node.lower).maxCoeff(&axis);
+            const int32_t mid = (r.begin + r.end) / 2;
+            std::nth_element(bvh_order.begin() + r.begin,
+                             bvh_order.begin() + mid,
+                             bvh_order.begin() + r.end,
+                             [&](int32_t a, int32_t b) {
+                                 return lowers[a][axis] + uppers[a][axis] <
+                                        lowers[b][axis] + uppers[b][axis];
+                             });
+            node.start = bvh.size();
+            node.count = 0;
+            bvh.push_back(Node());
+            bvh.push_back(Node());
+            todo.push_back({node.start, r.begin, mid});
+            todo.push_back({node.start + 1, mid, r.end});
+        }
+        bvh[r.node] = node;
+    }
+}
+
+void Scene::query(const Eigen::Vector3f& lower, const Eigen::Vector3f& upper,
+                  std::vector<int32_t>& out) const
+{
+    auto overlaps = [&](const Eigen::Vector3f& lo, const Eigen::Vector3f& hi) {
+        return (lo.array() <= upper.array()).all() &&
+               (hi.array() >= lower.array()).all();
+    };
+
+    if (instances.empty()) {
+        return;
+    }
+
+    // The tree is balanced, so its depth is at most log2 of the instance
+    // count, and the stack never holds more than one node per level.
+    int32_t stack[64];
+    int32_t depth = 0;
+    stack[depth++] = 0;
+    while (depth) {
+        const Node& node = bvh[stack[--depth]];
+        if (!overlaps(node.lower, node.upper)) {
+            continue;
+        } else if (node.count) {
+            for (int32_t i=0; i < node.count; ++i) {
+                const int32_t j = bvh_order[node.start + i];
+                if (overlaps(lowers[j], uppers[j])) {
+                    out.push_back(j);
+                }
+            }
+        } else {
+            stack[depth++] = node.start;
+            stack[depth++] = node.start + 1;
+        }
+    }
+    std::sort(out.begin(), out.end());
+}
+
+libfive::Tree Scene::tree(const std::vector<int32_t>& is) const {
+    const libfive::Tree axes[3] = {
+        libfive::Tree::X(), libfive::Tree::Y(), libfive::Tree::Z()};
+
+    std::vector<libfive::Tree> shapes;
+    for (auto i : is) {
+        // Each shape is evaluated in its own coordinates, so we remap it by
+        // the inverse of its transform (skipping zero terms, since most
+        // transforms only scale and translate).
+        const Eigen::Matrix4f inv = instances[i].transform.inverse();
+        std::vector<libfive::Tree> local;
+        for (unsigned row=0; row < 3; ++row) {
+            libfive::Tree t = inv(row, 3);
+            for (unsigned col=0; col < 3; ++col) {
+                if (inv(row, col) != 0.0f) {
+                    t = t + inv(row, col) * axes[col];
+                }
+            }
+            local.push_back(t);
+        }
+        shapes.push_back(instances[i].shape.remap(local[0], local[1],
+                                                  local[2]));
+    }
+
+    // Take the union pairwise, so that the min() tree stays shallow
+    while (shapes.size() > 1) {
+        std::vector<libfive::Tree> next;
+        for (unsigned i=0; i + 1 < shapes.size(); i += 2) {
+            next.push_back(min(shapes[i], shapes[i + 1]));
+        }
+        if (shapes.size() % 2) {
+            next.push_back(shapes.back());
+        }
+        shapes.swap(next);
+    }
+    return shapes.front();
+}
+
+Scene::Frame Scene::prepare(const Eigen::Matrix4f& mat,
+                            int32_t image_size_px)
+{
+    if (bvh.empty()) {
+        buildBVH();
+    }
+
+    const int32_t n = image_size_px / 64;
+    Frame out;
+    out.tile_tapes.resize(n * n * n, -1);
+
+    // Index of each tape in out.tapes
+    std::map<const Tape*, int32_t> index;
+
+    const float inf = std::numeric_limits<float>::infinity();
+    std::vector<int32_t> found;
+    for (int32_t t=0; t < n * n * n; ++t) {
+        // Find the tile's bounds in scene coordinates from its corners, as
+        // in calculate_intervals_3d.  If any corner is behind the camera,
+        // then the tile's bounds are unlimited.
+        const int32_t pos[3] = {t % n, (t / n) % n, (t / n) / n};
+        Eigen::Vector3f lower = Eigen::Vector3f::Constant(inf);
+        Eigen::Vector3f upper = Eigen::Vector3f::Constant(-inf);
+        for (unsigned c=0; c < 8; ++c) {
+            Eigen::Vector4f p;
+            for (unsigned j=0; j < 3; ++j) {
+                const int32_t k = pos[j] + ((c & (1 << j)) ? 1 : 0);
+                p[j] = (k / (float)n - 0.5f) * 2.0f;
+            }
+            p[3] = 1.0f;
+            const Eigen::Vector4f q = mat * p;
+            if (q.w() <= 0.0f) {
+                lower = Eigen::Vector3f::Constant(-inf);
+                upper = Eigen::Vector3f::Constant(inf);
+                break;
+            }
+            const Eigen::Vector3f r = q.head<3>() / q.w();
+            lower = lower.cwiseMin(r);
+            upper = upper.cwiseMax(r);
+        }
+
+        found.clear();
+        query(lower, upper, found);
+        if (found.empty()) {
+            continue;
+        }
+
+        auto itr = tapes.find(found);
+        if (itr == tapes.end()) {
+            // Start over once the cache is full; tapes which are already
+            // in this frame are kept alive by `out`.
+            if (tapes.size() >= SCENE_TAPE_CACHE_CAPACITY) {
+                tapes.clear();
+            }
+            std::shared_ptr<const Tape> tape(new Tape(tree(found)));
+            itr = tapes.insert(std::make_pair(found, tape)).first;
+            misses++;
+        } else {
+            hits++;
+        }
+
+        const Tape* tape = itr->second.get();
+        auto j = index.find(tape);
+        if (j == index.end()) {
+            j = index.insert(std::make_pair(tape, out.tapes.size())).first;
+            out.tapes.push_back(itr->second);
+        }
+        out.tile_tapes[t] = j->second;
+    }
+    return out;
+}
+
+}   // namespace mpr
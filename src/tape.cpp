@@ -9,67 +9,611 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "libfive/tree/tree.hpp"
 #include "libfive/tree/cache.hpp"
 
 #include "clause.hpp"
+#include "parameters.hpp"
 #include "tape.hpp"
 #include "gpu_opcode.hpp"
 
 namespace mpr {
 
-Tape::Tape(const libfive::Tree& tree) {
-    // Hold a single cache lock to avoid needing mutex locks everywhere
-    auto lock = libfive::Cache::instance();
+namespace {
 
-    auto ordered = tree.orderedDfs();
-    std::vector<libfive::Tree::Id> ordered_fast;
-    ordered_fast.reserve(ordered.size());
+/*  Header of a file written by Tape::save, which is followed by `length`
+ *  clauses and then `metadata_size` bytes of metadata.  Axis slots are
+ *  also encoded in the first clause, but are stored here for tools which
+ *  inspect files without decoding clauses. */
+struct TapeFileHeader {
+    char magic[8];          // TAPE_FILE_MAGIC
+    uint32_t version;       // TAPE_FILE_VERSION
+    uint32_t num_opcodes;   // number of GPU opcodes in the saving build
+    int32_t length;
+    int32_t num_slots;
+    uint8_t axes[4];        // X, Y, Z slots (then padding)
+    uint32_t metadata_size;
+    uint64_t hash;
+};
+static_assert(sizeof(TapeFileHeader) % sizeof(uint64_t) == 0,
+              "Tape file header must keep clauses aligned");
+const char TAPE_FILE_MAGIC[8] = {'m', 'p', 'r', 't', 'a', 'p', 'e', 0};
 
-    std::map<libfive::Tree::Id, libfive::Tree::Id> last_used;
-    libfive::Tree::Id axes_used[3] = {nullptr};
-    for (auto& c : ordered) {
-        using namespace libfive::Opcode;
-        // Very simple tracking of active spans, without clause reordering
-        // or any other cleverness.
-        switch (c->op) {
-            case CONSTANT: continue;
-            case VAR_X: axes_used[0] = c.id(); break;
-            case VAR_Y: axes_used[1] = c.id(); break;
-            case VAR_Z: axes_used[2] = c.id(); break;
-
-            // Opcodes which take two arguments store their RHS
+/*  FNV-1a over every clause, which is stored as Tape::hash */
+uint64_t hash_clauses(const uint64_t* clauses, size_t count) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i=0; i < count; ++i) {
+        hash = (hash ^ clauses[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*  A flattened expression, used while building (and optimizing) a tape.
+ *  `lhs` and `rhs` are indices into the same list of nodes, which is kept
+ *  in topological order (arguments before the nodes that use them).
+ *
+ *  If `fused` is non-zero, then it's the GPU opcode of a fused clause which
+ *  replaces `op`, with `value` as its immediate (see `fuse`).  For free
+ *  variables, `value` is the variable's index in Tape::var_ids. */
+struct Node {
+    libfive::Opcode::Opcode op;
+    int32_t lhs;
+    int32_t rhs;
+    float value;
+    uint8_t fused;
+};
+
+/*  Key for structural hashing in `simplify` */
+struct NodeKey {
+    int op;
+    int32_t lhs;
+    int32_t rhs;
+    uint32_t bits;      // constant value, as raw bits
+    bool operator==(const NodeKey& other) const {
+        return op == other.op && lhs == other.lhs && rhs == other.rhs &&
+               bits == other.bits;
+    }
+};
+
+struct NodeKeyHash {
+    size_t operator()(const NodeKey& k) const {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (const uint32_t v : {(uint32_t)k.op, (uint32_t)k.lhs,
+                                 (uint32_t)k.rhs, k.bits})
+        {
+            h = (h ^ v) * 0x100000001b3ull;
+        }
+        return h;
+    }
+};
+
+/*  Calls f(begin, end) on chunks of [0, count), which are spread across
+ *  threads if there are at least TAPE_PARALLEL_MIN_CHUNK items per thread */
+template <typename F>
+void parallel_for(size_t count, F f) {
+    const size_t threads = std::min<size_t>(
+            std::max(1u, std::thread::hardware_concurrency()),
+            count / TAPE_PARALLEL_MIN_CHUNK);
+    if (threads <= 1) {
+        f(0, count);
+        return;
+    }
+    const size_t chunk = (count + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t i=0; i < threads; ++i) {
+        const size_t begin = i * chunk;
+        workers.emplace_back(f, begin, std::min(count, begin + chunk));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+/*  Returns the number of arguments for opcodes that we can put into a tape,
+ *  0 for constants, axes, and variables, and -1 for everything else. */
+int arity(libfive::Opcode::Opcode op) {
+    using namespace libfive::Opcode;
+    switch (op) {
+        case CONSTANT:
+        case VAR_X:
+        case VAR_Y:
+        case VAR_Z:
+        case VAR_FREE:  return 0;
+
+        case CONST_VAR:
+
+        case OP_SQUARE:
+        case OP_SQRT:
+        case OP_NEG:
+        case OP_SIN:
+        case OP_COS:
+        case OP_ASIN:
+        case OP_ACOS:
+        case OP_ATAN:
+        case OP_EXP:
+        case OP_ABS:
+        case OP_LOG:
+        case OP_TAN:
+        case OP_RECIP:  return 1;
+
+        case OP_ADD:
+        case OP_MUL:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_ATAN2:
+        case OP_POW:
+        case OP_NTH_ROOT:
+        case OP_MOD:    return 2;
+
+        default:        return -1;
+    }
+}
+
+bool isCommutative(libfive::Opcode::Opcode op) {
+    using namespace libfive::Opcode;
+    return op == OP_ADD || op == OP_MUL || op == OP_MIN || op == OP_MAX;
+}
+
+/*  Evaluates an opcode on constant arguments, returning false if the
+ *  opcode can't be folded. */
+bool fold(libfive::Opcode::Opcode op, float a, float b, float* out) {
+    using namespace libfive::Opcode;
+    switch (op) {
+        case OP_SQUARE: *out = a * a; break;
+        case OP_SQRT:   *out = sqrtf(a); break;
+        case OP_NEG:    *out = -a; break;
+        case OP_SIN:    *out = sinf(a); break;
+        case OP_COS:    *out = cosf(a); break;
+        case OP_ASIN:   *out = asinf(a); break;
+        case OP_ACOS:   *out = acosf(a); break;
+        case OP_ATAN:   *out = atanf(a); break;
+        case OP_EXP:    *out = expf(a); break;
+        case OP_ABS:    *out = fabsf(a); break;
+        case OP_LOG:    *out = logf(a); break;
+        case OP_TAN:    *out = tanf(a); break;
+        case OP_RECIP:  *out = 1.0f / a; break;
+
+        case OP_ADD:    *out = a + b; break;
+        case OP_MUL:    *out = a * b; break;
+        case OP_MIN:    *out = fminf(a, b); break;
+        case OP_MAX:    *out = fmaxf(a, b); break;
+        case OP_SUB:    *out = a - b; break;
+        case OP_DIV:    *out = a / b; break;
+        case OP_ATAN2:  *out = atan2f(a, b); break;
+        case OP_POW:    *out = powf(a, b); break;
+        case OP_NTH_ROOT: {
+            // Matches nth_root in gpu_interval.hpp
+            const int n = b;
+            *out = (a < 0.0f && n % 2) ? -powf(-a, 1.0f / n)
+                                       : powf(a, 1.0f / n);
+            break;
+        }
+        case OP_MOD:    *out = a - b * floorf(a / b); break;
+
+        default:        return false;
+    }
+    return true;
+}
+
+/*  Folds constant subexpressions, applies a handful of algebraic identities
+ *  (x + 0, x * 1, x * x, -(-x), min(x, x), ...) and merges identical
+ *  subexpressions.  Returns a new list of nodes, updating `root` to point
+ *  into it.  Unreachable nodes may be left in the list. */
+std::vector<Node> simplify(const std::vector<Node>& in, int32_t& root) {
+    using namespace libfive::Opcode;
+
+    std::vector<Node> out;
+    out.reserve(in.size());
+    std::vector<int32_t> remap(in.size());
+
+    // Structural hashing: (opcode, lhs, rhs, constant bits) => index
+    std::unordered_map<NodeKey, int32_t, NodeKeyHash> seen;
+    seen.reserve(in.size());
+    auto intern = [&](const Node& n) {
+        uint32_t bits = 0;
+        if (n.op == CONSTANT || n.op == VAR_FREE) {
+            memcpy(&bits, &n.value, sizeof(bits));
+        }
+        int32_t a = n.lhs;
+        int32_t b = n.rhs;
+        if (isCommutative(n.op) && a > b) {
+            std::swap(a, b);
+        }
+        const NodeKey key = {static_cast<int>(n.op), a, b, bits};
+        auto itr = seen.find(key);
+        if (itr != seen.end()) {
+            return itr->second;
+        }
+        const int32_t index = out.size();
+        out.push_back(n);
+        seen.insert(std::make_pair(key, index));
+        return index;
+    };
+    auto isConstant = [&](int32_t i, float v) {
+        return out[i].op == CONSTANT && out[i].value == v;
+    };
+
+    for (unsigned i=0; i < in.size(); ++i) {
+        Node n = in[i];
+        const int nargs = arity(n.op);
+        if (nargs >= 1) {
+            n.lhs = remap[n.lhs];
+        }
+        if (nargs >= 2) {
+            n.rhs = remap[n.rhs];
+        }
+
+        // Fold constant subexpressions
+        if (nargs >= 1 && out[n.lhs].op == CONSTANT &&
+            (nargs == 1 || out[n.rhs].op == CONSTANT))
+        {
+            float v;
+            if (fold(n.op, out[n.lhs].value,
+                     nargs == 2 ? out[n.rhs].value : 0.0f, &v))
+            {
+                remap[i] = intern({CONSTANT, -1, -1, v, 0});
+                continue;
+            }
+        }
+
+        // Algebraic simplification.  These rules are exact in floating-point
+        // (other than the sign of zero), so we avoid things like x * 0 => 0,
+        // which is wrong for infinite x.
+        int32_t same = -1;
+        switch (n.op) {
             case OP_ADD:
+                if (isConstant(n.rhs, 0.0f)) {
+                    same = n.lhs;
+                } else if (isConstant(n.lhs, 0.0f)) {
+                    same = n.rhs;
+                }
+                break;
+            case OP_SUB:
+                if (isConstant(n.rhs, 0.0f)) {
+                    same = n.lhs;
+                } else if (isConstant(n.lhs, 0.0f)) {
+                    n = {OP_NEG, n.rhs, -1, 0.0f, 0};
+                }
+                break;
             case OP_MUL:
+                if (isConstant(n.rhs, 1.0f)) {
+                    same = n.lhs;
+                } else if (isConstant(n.lhs, 1.0f)) {
+                    same = n.rhs;
+                } else if (isConstant(n.rhs, -1.0f)) {
+                    n = {OP_NEG, n.lhs, -1, 0.0f, 0};
+                } else if (isConstant(n.lhs, -1.0f)) {
+                    n = {OP_NEG, n.rhs, -1, 0.0f, 0};
+                } else if (n.lhs == n.rhs) {
+                    // square has a tighter interval result than x * x
+                    n = {OP_SQUARE, n.lhs, -1, 0.0f, 0};
+                }
+                break;
+            case OP_DIV:
+                if (isConstant(n.rhs, 1.0f)) {
+                    same = n.lhs;
+                } else if (isConstant(n.rhs, -1.0f)) {
+                    n = {OP_NEG, n.lhs, -1, 0.0f, 0};
+                }
+                break;
             case OP_MIN:
             case OP_MAX:
-            case OP_SUB:
-            case OP_DIV:    last_used[c.rhs().id()] = c.id();
-                            // FALLTHROUGH
-
-            // Unary opcodes (and fallthrough) store their LHS)
-            case OP_SQUARE:
-            case OP_SQRT:
+                if (n.lhs == n.rhs) {
+                    same = n.lhs;
+                }
+                break;
+            case OP_POW:
+            case OP_NTH_ROOT:
+                if (isConstant(n.rhs, 1.0f)) {
+                    same = n.lhs;
+                } else if (n.op == OP_POW && isConstant(n.rhs, 2.0f)) {
+                    n = {OP_SQUARE, n.lhs, -1, 0.0f, 0};
+                } else if (n.op == OP_NTH_ROOT && isConstant(n.rhs, 2.0f)) {
+                    n = {OP_SQRT, n.lhs, -1, 0.0f, 0};
+                }
+                break;
             case OP_NEG:
-            case OP_SIN:
-            case OP_COS:
-            case OP_ASIN:
-            case OP_ACOS:
-            case OP_ATAN:
-            case OP_EXP:
+                if (out[n.lhs].op == OP_NEG) {
+                    same = out[n.lhs].lhs;
+                }
+                break;
             case OP_ABS:
-            case OP_LOG:    last_used[c.lhs().id()] = c.id();
-                            ordered_fast.push_back(c.id());
-                            break;
-            default:    break;
+                if (out[n.lhs].op == OP_ABS || out[n.lhs].op == OP_SQUARE) {
+                    same = n.lhs;
+                }
+                break;
+            case CONST_VAR:
+                // This only matters to libfive's solver
+                same = n.lhs;
+                break;
+            default:
+                break;
+        }
+        remap[i] = (same != -1) ? same : intern(n);
+    }
+    root = remap[root];
+    return out;
+}
+
+/*  Orders the clauses that are reachable from `root`, dropping everything
+ *  else.  Within each binary clause, the argument which needs more live
+ *  slots (estimated with Sethi-Ullman numbering) is evaluated first, which
+ *  shortens live ranges and reduces the total number of slots. */
+std::vector<int32_t> schedule(const std::vector<Node>& nodes, int32_t root) {
+    std::vector<int32_t> need(nodes.size(), 0);
+    for (unsigned i=0; i < nodes.size(); ++i) {
+        const Node& n = nodes[i];
+        const int nargs = arity(n.op);
+        if (nargs == 1) {
+            need[i] = std::max(need[n.lhs], 1);
+        } else if (nargs == 2) {
+            const int32_t a = need[n.lhs];
+            const int32_t b = need[n.rhs];
+            need[i] = (a == b) ? (a + 1) : std::max(a, b);
+        }
+    }
+
+    // Iterative post-order traversal, since trees can be very deep
+    std::vector<int32_t> order;
+    std::vector<uint8_t> state(nodes.size(), 0); // 0: new, 1: open, 2: done
+    std::vector<int32_t> todo = {root};
+    while (todo.size()) {
+        const int32_t i = todo.back();
+        const Node& n = nodes[i];
+        const int nargs = arity(n.op);
+        if (state[i] == 2 || nargs <= 0) {
+            todo.pop_back();
+        } else if (state[i] == 1) {
+            todo.pop_back();
+            state[i] = 2;
+            order.push_back(i);
+        } else {
+            state[i] = 1;
+            // The last child to be pushed is the first to be evaluated
+            if (nargs == 2 && need[n.lhs] >= need[n.rhs]) {
+                todo.push_back(n.rhs);
+                todo.push_back(n.lhs);
+            } else {
+                todo.push_back(n.lhs);
+                if (nargs == 2) {
+                    todo.push_back(n.rhs);
+                }
+            }
+        }
+    }
+    return order;
+}
+
+/*  Replaces common chains of clauses with single fused clauses:
+ *      x * c + y       => FMA_LHS_IMM_RHS
+ *      x * x + y       => SQUARE_ADD_LHS_RHS
+ *      (x - c)^2       => DIFF_SQUARE_LHS_IMM
+ *      (x - c)^2 + y   => DIFF_SQUARE_ADD_LHS_IMM_RHS
+ *  (along with the equivalent forms using x + c, y - x * c, etc).  A clause
+ *  is only absorbed into its user if it has no other users, and fused
+ *  clauses never absorb min or max, so tape pushing isn't affected.
+ *
+ *  Absorbed clauses are removed from `order`. */
+void fuse(std::vector<Node>& nodes, std::vector<int32_t>& order,
+          int32_t root)
+{
+    using namespace libfive::Opcode;
+
+    std::vector<int32_t> uses(nodes.size(), 0);
+    for (auto& c : order) {
+        uses[nodes[c].lhs]++;
+        if (nodes[c].rhs != -1) {
+            uses[nodes[c].rhs]++;
+        }
+    }
+    uses[root]++;
+
+    auto isConstant = [&](int32_t i) {
+        return nodes[i].op == CONSTANT;
+    };
+    // Checks whether node i is an unfused, single-use binary opcode with
+    // one constant argument, storing the other argument and the constant.
+    // For SUB, this ignores the order of arguments, so it's only useful
+    // when the result is squared.
+    auto matchImm = [&](int32_t i, libfive::Opcode::Opcode op,
+                        int32_t* arg, float* imm) {
+        const Node& n = nodes[i];
+        if (uses[i] != 1 || n.fused || n.op != op) {
+            return false;
+        } else if (isConstant(n.rhs) && !isConstant(n.lhs)) {
+            *arg = n.lhs;
+            *imm = nodes[n.rhs].value;
+            return true;
+        } else if (isConstant(n.lhs) && !isConstant(n.rhs)) {
+            *arg = n.rhs;
+            *imm = nodes[n.lhs].value;
+            return true;
+        }
+        return false;
+    };
+
+    std::vector<bool> absorbed(nodes.size(), false);
+    for (auto& c : order) {
+        Node& n = nodes[c];
+        int32_t arg;
+        float imm;
+        if (n.op == OP_SQUARE) {
+            if (matchImm(n.lhs, OP_SUB, &arg, &imm)) {
+                absorbed[n.lhs] = true;
+                n = {OP_SQUARE, arg, -1, imm, GPU_OP_DIFF_SQUARE_LHS_IMM};
+            } else if (matchImm(n.lhs, OP_ADD, &arg, &imm)) {
+                absorbed[n.lhs] = true;
+                n = {OP_SQUARE, arg, -1, -imm, GPU_OP_DIFF_SQUARE_LHS_IMM};
+            }
+        } else if (n.op == OP_ADD) {
+            for (unsigned j=0; j < 2; ++j) {
+                const int32_t s = j ? n.rhs : n.lhs;
+                const int32_t y = j ? n.lhs : n.rhs;
+                if (isConstant(y) || uses[s] != 1) {
+                    continue;
+                }
+                const Node& a = nodes[s];
+                if (a.fused == GPU_OP_DIFF_SQUARE_LHS_IMM) {
+                    n = {OP_ADD, a.lhs, y, a.value,
+                         GPU_OP_DIFF_SQUARE_ADD_LHS_IMM_RHS};
+                } else if (!a.fused && a.op == OP_SQUARE) {
+                    n = {OP_ADD, a.lhs, y, 0.0f, GPU_OP_SQUARE_ADD_LHS_RHS};
+                } else if (matchImm(s, OP_MUL, &arg, &imm)) {
+                    n = {OP_ADD, arg, y, imm, GPU_OP_FMA_LHS_IMM_RHS};
+                } else {
+                    continue;
+                }
+                absorbed[s] = true;
+                break;
+            }
+        } else if (n.op == OP_SUB && !isConstant(n.lhs)) {
+            // y - x * c => x * -c + y
+            if (matchImm(n.rhs, OP_MUL, &arg, &imm)) {
+                absorbed[n.rhs] = true;
+                n = {OP_SUB, arg, n.lhs, -imm, GPU_OP_FMA_LHS_IMM_RHS};
+            }
+        }
+    }
+
+    std::vector<int32_t> out;
+    out.reserve(order.size());
+    for (auto& c : order) {
+        if (!absorbed[c]) {
+            out.push_back(c);
+        }
+    }
+    order.swap(out);
+}
+
+}   // anonymous namespace
+
+Tape::Tape(const libfive::Tree& tree, bool optimize) {
+    std::vector<Node> nodes;
+    int32_t root;
+    {   // Hold a single cache lock to avoid needing mutex locks everywhere
+        auto lock = libfive::Cache::instance();
+
+        auto ordered = tree.orderedDfs();
+        nodes.reserve(ordered.size());
+
+        std::unordered_map<libfive::Tree::Id, int32_t> index;
+        index.reserve(ordered.size());
+        for (auto& c : ordered) {
+            Node n = {c->op, -1, -1, c->value, 0};
+            if (c->op == libfive::Opcode::VAR_FREE) {
+                n.value = var_ids.size();
+                var_ids.push_back(c.id());
+            }
+            const int nargs = arity(c->op);
+            if (nargs < 0) {
+                fprintf(stderr, "Unimplemented opcode");
+            }
+            if (nargs >= 1) {
+                n.lhs = index.at(c->lhs.get());
+            }
+            if (nargs >= 2) {
+                n.rhs = index.at(c->rhs.get());
+            }
+            index[c.id()] = nodes.size();
+            nodes.push_back(n);
+        }
+        root = nodes.size() - 1;
+    }
+
+    // Without optimization, we keep the clauses from orderedDfs as-is
+    std::vector<int32_t> order;
+    if (optimize) {
+        nodes = simplify(nodes, root);
+        order = schedule(nodes, root);
+        fuse(nodes, order, root);
+    } else {
+        for (unsigned i=0; i < nodes.size(); ++i) {
+            if (arity(nodes[i].op) > 0) {
+                order.push_back(i);
+            }
+        }
+    }
+
+    // Every variable is loaded by its own clause at the start of the tape,
+    // in order of index, so that renders can find and replace its value
+    num_vars = var_ids.size();
+    if (num_vars > TAPE_MAX_VARS) {
+        fprintf(stderr, "Only the first %i of %i variables can be set\n",
+                TAPE_MAX_VARS, num_vars);
+    }
+    {
+        std::vector<int32_t> var_nodes(num_vars, -1);
+        for (unsigned i=0; i < nodes.size(); ++i) {
+            if (nodes[i].op == libfive::Opcode::VAR_FREE) {
+                var_nodes[(int32_t)nodes[i].value] = i;
+            }
+        }
+        order.insert(order.begin(), var_nodes.begin(), var_nodes.end());
+    }
+
+    // Find the last use of each node, as a position in `order` plus one
+    // (so that 0 means unused).  Large tapes are split across threads,
+    // which keep the latest use with an atomic max.
+    std::vector<std::atomic<int32_t>> last_used(nodes.size());
+    for (auto& u : last_used) {
+        u.store(0, std::memory_order_relaxed);
+    }
+    parallel_for(order.size(), [&](size_t begin, size_t end) {
+        for (size_t p=begin; p < end; ++p) {
+            const Node& n = nodes[order[p]];
+            for (auto& h : {n.lhs, n.rhs}) {
+                if (h == -1) {
+                    continue;
+                }
+                int32_t prev = last_used[h].load(std::memory_order_relaxed);
+                while (prev < (int32_t)p + 1 &&
+                       !last_used[h].compare_exchange_weak(
+                           prev, (int32_t)p + 1, std::memory_order_relaxed))
+                {
+                    // Keep trying until we store p + 1 or see a later use
+                }
+            }
+        }
+    });
+
+    int32_t axes_used[3] = {-1, -1, -1};
+    for (unsigned i=0; i < nodes.size(); ++i) {
+        using namespace libfive::Opcode;
+        if (!last_used[i].load(std::memory_order_relaxed) &&
+            (int32_t)i != root)
+        {
+            continue;
+        }
+        switch (nodes[i].op) {
+            case VAR_X: axes_used[0] = i; break;
+            case VAR_Y: axes_used[1] = i; break;
+            case VAR_Z: axes_used[2] = i; break;
+            default: break;
         }
     }
 
+    // Slots bound to each node (or -1), as a flat table indexed by node
+    std::vector<int16_t> bound_slots(nodes.size(), -1);
     std::vector<uint8_t> free_slots;
-    std::map<libfive::Tree::Id, uint8_t> bound_slots;
     uint8_t num_slots = 1;
 
-    auto getSlot = [&](libfive::Tree::Id id) {
+    auto getSlot = [&](int32_t id) {
         // Pick a slot for the output of this opcode
         uint8_t out = 0;
         if (free_slots.size()) {
@@ -85,138 +629,191 @@ Tape::Tape(const libfive::Tree& tree) {
         bound_slots[id] = out;
         return out;
     };
+    auto isConstant = [&](int32_t id) {
+        return nodes[id].op == libfive::Opcode::CONSTANT;
+    };
 
     // Bind the axes to known slots, so that we can store their values
     // before beginning an evaluation.
     uint64_t start = 0;
     for (unsigned i=0; i < 3; ++i) {
-        if (axes_used[i] != nullptr) {
+        if (axes_used[i] != -1) {
             ((uint8_t*)&start)[i + 1] = getSlot(axes_used[i]);
         }
     }
-    std::vector<uint64_t> flat;
-    flat.reserve(ordered.size());
-    flat.push_back(start);
+    TAPE_VARS(&start) = num_vars;
 
-    auto get_reg = [&](const std::shared_ptr<libfive::Tree::Tree_>& tree) {
-        auto itr = bound_slots.find(tree.get());
-        if (itr != bound_slots.end()) {
-            return itr->second;
+    // Assign output slots in order, which has to be done serially (since
+    // slots are recycled once their last use has been seen).  Arguments
+    // are released before picking the output, so that it can reuse one of
+    // their slots.  A clause like x + x uses the same argument twice, which
+    // must only be released once (otherwise two later values would share
+    // its slot).
+    for (size_t p=0; p < order.size(); ++p) {
+        const Node& n = nodes[order[p]];
+        const int32_t args[2] = {n.lhs, (n.rhs != n.lhs) ? n.rhs : -1};
+        for (auto& h : args) {
+            if (h != -1 && !isConstant(h) && bound_slots[h] != -1 &&
+                last_used[h].load(std::memory_order_relaxed) ==
+                    (int32_t)p + 1)
+            {
+                free_slots.push_back(bound_slots[h]);
+            }
+        }
+        const uint8_t out = getSlot(order[p]);
+
+        // Unused variables still have a clause, but their slot is free
+        if (!last_used[order[p]].load(std::memory_order_relaxed) &&
+            order[p] != root)
+        {
+            free_slots.push_back(out);
+        }
+    }
+
+    auto get_reg = [&](int32_t id) {
+        if (bound_slots[id] != -1) {
+            return static_cast<uint8_t>(bound_slots[id]);
         } else {
-            fprintf(stderr, "Could not find bound slots %i\n", tree->op);
+            fprintf(stderr, "Could not find bound slots %i\n", nodes[id].op);
             return static_cast<uint8_t>(0);
         }
     };
 
-    for (auto& c : ordered_fast) {
+    // With every slot known, clauses can be encoded independently
+    auto encode = [&](int32_t c) {
+        const Node& n = nodes[c];
         uint64_t clause = 0;
-        switch (c->op) {
-            using namespace libfive::Opcode;
-
-            case CONSTANT:
-            case VAR_X:
-            case VAR_Y:
-            case VAR_Z:
-                continue;
+        if (n.fused) {
+            OP(&clause) = n.fused;
+            I_LHS(&clause) = get_reg(n.lhs);
+            if (n.rhs != -1) {
+                I_RHS(&clause) = get_reg(n.rhs);
+            }
+            IMM(&clause) = n.value;
+        } else {
+            switch (n.op) {
+                using namespace libfive::Opcode;
 
 #define OP_UNARY(p) \
-            case OP_##p: { \
-                OP(&clause) = GPU_OP_##p##_LHS;      \
-                I_LHS(&clause) = get_reg(c->lhs);    \
-                break;                              \
-            }
-            OP_UNARY(SQUARE)
-            OP_UNARY(SQRT);
-            OP_UNARY(NEG);
-            OP_UNARY(SIN);
-            OP_UNARY(COS);
-            OP_UNARY(ASIN);
-            OP_UNARY(ACOS);
-            OP_UNARY(ATAN);
-            OP_UNARY(EXP);
-            OP_UNARY(ABS);
-            OP_UNARY(LOG);
+                case OP_##p: { \
+                    OP(&clause) = GPU_OP_##p##_LHS;      \
+                    I_LHS(&clause) = get_reg(n.lhs);     \
+                    break;                              \
+                }
+                OP_UNARY(SQUARE)
+                OP_UNARY(SQRT);
+                OP_UNARY(NEG);
+                OP_UNARY(SIN);
+                OP_UNARY(COS);
+                OP_UNARY(ASIN);
+                OP_UNARY(ACOS);
+                OP_UNARY(ATAN);
+                OP_UNARY(EXP);
+                OP_UNARY(ABS);
+                OP_UNARY(LOG);
+                OP_UNARY(TAN);
+                OP_UNARY(RECIP);
 
 #define OP_COMMUTATIVE(p) \
-            case OP_##p: { \
-                if (c->lhs->op == CONSTANT) {                   \
-                    OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->rhs);           \
-                    IMM(&clause) = c->lhs->value;               \
-                } else if (c->rhs->op == CONSTANT) {            \
-                    OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    IMM(&clause) = c->rhs->value;               \
-                } else {                                        \
-                    OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
-                }                                               \
-                break;                                          \
-            }
-            OP_COMMUTATIVE(ADD)
-            OP_COMMUTATIVE(MUL)
-            OP_COMMUTATIVE(MIN)
-            OP_COMMUTATIVE(MAX)
+                case OP_##p: { \
+                    if (isConstant(n.lhs)) {                        \
+                        OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
+                        I_LHS(&clause) = get_reg(n.rhs);            \
+                        IMM(&clause) = nodes[n.lhs].value;          \
+                    } else if (isConstant(n.rhs)) {                 \
+                        OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
+                        I_LHS(&clause) = get_reg(n.lhs);            \
+                        IMM(&clause) = nodes[n.rhs].value;          \
+                    } else {                                        \
+                        OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
+                        I_LHS(&clause) = get_reg(n.lhs);            \
+                        I_RHS(&clause) = get_reg(n.rhs);            \
+                    }                                               \
+                    break;                                          \
+                }
+                OP_COMMUTATIVE(ADD)
+                OP_COMMUTATIVE(MUL)
+                OP_COMMUTATIVE(MIN)
+                OP_COMMUTATIVE(MAX)
 
 #define OP_NONCOMMUTATIVE(p) \
-            case OP_##p: { \
-                if (c->lhs->op == CONSTANT) {                   \
-                    OP(&clause) = GPU_OP_##p##_IMM_RHS;         \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
-                    IMM(&clause) = c->lhs->value;               \
-                } else if (c->rhs->op == CONSTANT) {            \
-                    OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    IMM(&clause) = c->rhs->value;               \
-                } else {                                        \
-                    OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
-                }                                               \
-                break;                                          \
-            }
-            OP_NONCOMMUTATIVE(SUB)
-            OP_NONCOMMUTATIVE(DIV)
-
-            case INVALID:
-            case OP_TAN:
-            case OP_RECIP:
-            case OP_ATAN2:
-            case OP_POW:
-            case OP_NTH_ROOT:
-            case OP_MOD:
-            case OP_NANFILL:
-            case OP_COMPARE:
-            case VAR_FREE:
-            case CONST_VAR:
-            case ORACLE:
-            case LAST_OP:
-                fprintf(stderr, "Unimplemented opcode");
-                break;
-        }
+                case OP_##p: { \
+                    if (isConstant(n.lhs)) {                        \
+                        OP(&clause) = GPU_OP_##p##_IMM_RHS;         \
+                        I_RHS(&clause) = get_reg(n.rhs);            \
+                        IMM(&clause) = nodes[n.lhs].value;          \
+                    } else if (isConstant(n.rhs)) {                 \
+                        OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
+                        I_LHS(&clause) = get_reg(n.lhs);            \
+                        IMM(&clause) = nodes[n.rhs].value;          \
+                    } else {                                        \
+                        OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
+                        I_LHS(&clause) = get_reg(n.lhs);            \
+                        I_RHS(&clause) = get_reg(n.rhs);            \
+                    }                                               \
+                    break;                                          \
+                }
+                OP_NONCOMMUTATIVE(SUB)
+                OP_NONCOMMUTATIVE(DIV)
+                OP_NONCOMMUTATIVE(ATAN2)
+                OP_NONCOMMUTATIVE(MOD)
 
-        // Release slots if this was their last use.  We do this now so
-        // that one of them can be reused for the output slots below.
-        for (auto& h : {c->lhs.get(), c->rhs.get()}) {
-            if (h != nullptr &&
-                h->op != libfive::Opcode::CONSTANT &&
-                last_used[h] == c)
-            {
-                auto itr = bound_slots.find(h);
-                free_slots.push_back(itr->second);
-                bound_slots.erase(itr);
+                // As in libfive, the exponent (or root) must be a constant
+#define OP_CONSTANT_RHS(p) \
+                case OP_##p: { \
+                    if (isConstant(n.rhs)) {                        \
+                        OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
+                        I_LHS(&clause) = get_reg(n.lhs);            \
+                        IMM(&clause) = nodes[n.rhs].value;          \
+                    } else {                                        \
+                        fprintf(stderr, #p " requires a constant\n"); \
+                    }                                               \
+                    break;                                          \
+                }
+                OP_CONSTANT_RHS(POW)
+                OP_CONSTANT_RHS(NTH_ROOT)
+
+                // Variables start at zero, until a render replaces them
+                case VAR_FREE:
+                    OP(&clause) = GPU_OP_COPY_IMM;
+                    IMM(&clause) = 0.0f;
+                    break;
+                case CONST_VAR:
+                    OP(&clause) = GPU_OP_COPY_LHS;
+                    I_LHS(&clause) = get_reg(n.lhs);
+                    break;
+
+                default:
+                    fprintf(stderr, "Unimplemented opcode");
+                    break;
             }
         }
 
-        I_OUT(&clause) = getSlot(c);
+        I_OUT(&clause) = bound_slots[c];
+        return clause;
+    };
+    std::vector<uint64_t> flat(order.size() + 1);
+    flat[0] = start;
+    parallel_for(order.size(), [&](size_t begin, size_t end) {
+        for (size_t p=begin; p < end; ++p) {
+            flat[p + 1] = encode(order[p]);
+        }
+    });
+
+    // A constant tree (possibly after folding) has no clauses, so we copy
+    // its value into a slot to have something to read.
+    if (isConstant(root)) {
+        uint64_t clause = 0;
+        OP(&clause) = GPU_OP_COPY_IMM;
+        IMM(&clause) = nodes[root].value;
+        I_OUT(&clause) = getSlot(root);
         flat.push_back(clause);
     }
 
     {   // Push the end of the tape, which points to the final clauses's
         // output slot so that we know where to read the result.
         uint64_t end = 0;
-        I_OUT(&end) = get_reg(ordered.back().operator->());
+        I_OUT(&end) = get_reg(root);
         flat.push_back(end);
     }
 
@@ -225,7 +822,124 @@ Tape::Tape(const libfive::Tree& tree) {
                           sizeof(uint64_t) * flat.size(),
                           cudaMemcpyHostToDevice));
     length = flat.size();
+    this->num_slots = num_slots;
+
+    hash = hash_clauses(flat.data(), flat.size());
 }
 
-} // namespace mpr
+int32_t Tape::varIndex(const libfive::Tree& var) const {
+    const auto itr = std::find(var_ids.begin(), var_ids.end(),
+                               (const void*)var.id());
+    return (itr == var_ids.end()) ? -1 : (itr - var_ids.begin());
+}
 
+////////////////////////////////////////////////////////////////////////////////
+
+bool Tape::save(const std::string& path, const std::string& metadata) const
+{
+    std::vector<uint64_t> clauses(length);
+    CUDA_CHECK(cudaMemcpy(clauses.data(), data.get(),
+                          sizeof(uint64_t) * length,
+                          cudaMemcpyDeviceToHost));
+
+    TapeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TAPE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TAPE_FILE_VERSION;
+    header.num_opcodes = GPU_OP_COPY_RHS + 1;
+    header.length = length;
+    header.num_slots = num_slots;
+    for (unsigned i=0; i < 3; ++i) {
+        header.axes[i] = ((const uint8_t*)clauses.data())[i + 1];
+    }
+    header.metadata_size = metadata.size();
+    header.hash = hash;
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s for writing\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(clauses.data(), sizeof(uint64_t), length, f) ==
+                  (size_t)length &&
+              (metadata.empty() ||
+               fwrite(metadata.data(), metadata.size(), 1, f) == 1);
+    ok &= (fclose(f) == 0);
+    if (!ok) {
+        fprintf(stderr, "Failed to write tape to %s\n", path.c_str());
+    }
+    return ok;
+}
+
+std::unique_ptr<Tape> Tape::load(const std::string& path,
+                                 std::string* metadata)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path.c_str());
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TapeFileHeader)) {
+        fprintf(stderr, "%s is not a tape file\n", path.c_str());
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    void* const map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path.c_str());
+        return nullptr;
+    }
+
+    // The clauses directly follow the header, which keeps them 8-byte
+    // aligned in the mapping
+    const auto& header = *static_cast<const TapeFileHeader*>(map);
+    const uint64_t* const clauses = reinterpret_cast<const uint64_t*>(
+            static_cast<const char*>(map) + sizeof(TapeFileHeader));
+    const char* const meta = reinterpret_cast<const char*>(
+            clauses + std::max(header.length, 0));
+
+    const char* err = nullptr;
+    if (memcmp(header.magic, TAPE_FILE_MAGIC, sizeof(header.magic))) {
+        err = "is not a tape file";
+    } else if (header.version != TAPE_FILE_VERSION) {
+        err = "has an unsupported format version";
+    } else if (header.num_opcodes != GPU_OP_COPY_RHS + 1) {
+        err = "was saved with a different set of opcodes";
+    } else if (header.length <= 0 || header.num_slots <= 0 ||
+               header.num_slots > 256 ||
+               size < sizeof(TapeFileHeader) +
+                      sizeof(uint64_t) * header.length +
+                      header.metadata_size ||
+               TAPE_VARS(clauses) < 0 || TAPE_VARS(clauses) >= header.length)
+    {
+        err = "is truncated or corrupt";
+    } else if (hash_clauses(clauses, header.length) != header.hash) {
+        err = "failed its checksum";
+    }
+
+    std::unique_ptr<Tape> out;
+    if (err) {
+        fprintf(stderr, "%s %s\n", path.c_str(), err);
+    } else {
+        out.reset(new Tape);
+        out->data.reset(CUDA_MALLOC(uint64_t, header.length));
+        CUDA_CHECK(cudaMemcpy(out->data.get(), clauses,
+                              sizeof(uint64_t) * header.length,
+                              cudaMemcpyHostToDevice));
+        out->length = header.length;
+        out->num_slots = header.num_slots;
+        out->hash = header.hash;
+        out->num_vars = TAPE_VARS(clauses);
+        if (metadata) {
+            metadata->assign(meta, header.metadata_size);
+        }
+    }
+    munmap(map, size);
+    return out;
+}
+
+} // namespace mpr
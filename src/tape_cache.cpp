@@ -0,0 +1,148 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstring>
+#include <set>
+#include <unordered_map>
+
+#include "libfive/tree/tree.hpp"
+#include "libfive/tree/cache.hpp"
+
+#include "tape.hpp"
+#include "tape_cache.hpp"
+
+namespace mpr {
+
+TapeCache::TapeCache(size_t capacity)
+    : capacity(capacity)
+{
+    // Nothing to do here
+}
+
+uint64_t TapeCache::hash(const libfive::Tree& tree) {
+    // Hold a single cache lock, as in the Tape constructor
+    auto lock = libfive::Cache::instance();
+
+    auto ordered = tree.orderedDfs();
+    std::unordered_map<libfive::Tree::Id, uint64_t> hashes;
+    hashes.reserve(ordered.size());
+
+    auto mix = [](uint64_t h, uint64_t v) {
+        return (h ^ v) * 0x100000001b3ull;
+    };
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (auto& c : ordered) {
+        uint32_t bits;
+        memcpy(&bits, &c->value, sizeof(bits));
+
+        h = mix(0xcbf29ce484222325ull, c->op);
+        h = mix(h, bits);
+
+        // Free variables (and oracles) are only equal to themselves, and
+        // each tape records which ones it uses (see Tape::var_ids)
+        if (hasIdentity(c->op)) {
+            h = mix(h, (uint64_t)(uintptr_t)c.id());
+        }
+        if (c->lhs.get()) {
+            h = mix(h, hashes.at(c->lhs.get()));
+        }
+        if (c->rhs.get()) {
+            h = mix(h, hashes.at(c->rhs.get()));
+        }
+        hashes[c.id()] = h;
+    }
+    // orderedDfs puts the root last
+    return h;
+}
+
+bool TapeCache::hasIdentity(int op) {
+    return op == libfive::Opcode::VAR_FREE || op == libfive::Opcode::ORACLE;
+}
+
+bool TapeCache::equal(const libfive::Tree& a, const libfive::Tree& b) {
+    auto lock = libfive::Cache::instance();
+
+    // Walk both graphs in lockstep, visiting each pair of nodes once
+    typedef std::pair<libfive::Tree::Id, libfive::Tree::Id> Pair;
+    std::vector<Pair> todo = {{a.id(), b.id()}};
+    std::set<Pair> seen;
+    while (todo.size()) {
+        const Pair p = todo.back();
+        todo.pop_back();
+        if (p.first == p.second || !seen.insert(p).second) {
+            continue;
+        } else if (!p.first || !p.second) {
+            return false;
+        }
+        uint32_t bits_a, bits_b;
+        memcpy(&bits_a, &p.first->value, sizeof(bits_a));
+        memcpy(&bits_b, &p.second->value, sizeof(bits_b));
+        if (p.first->op != p.second->op || bits_a != bits_b ||
+            hasIdentity(p.first->op))
+        {
+            return false;
+        }
+        todo.push_back({p.first->lhs.get(), p.second->lhs.get()});
+        todo.push_back({p.first->rhs.get(), p.second->rhs.get()});
+    }
+    return true;
+}
+
+std::shared_ptr<const Tape> TapeCache::get(const libfive::Tree& tree,
+                                           bool optimize)
+{
+    const uint64_t key = hash(tree) ^ (optimize ? 0 : 0x9e3779b97f4a7c15ull);
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto itr = index.find(key);
+        if (itr != index.end() && equal(*itr->second->tree, tree)) {
+            hits++;
+            lru.splice(lru.begin(), lru, itr->second);
+            return itr->second->tape;
+        }
+        misses++;
+    }
+
+    // Build the tape without holding the lock, since this is slow
+    std::shared_ptr<const Tape> tape(new Tape(tree, optimize));
+
+    std::lock_guard<std::mutex> guard(mutex);
+    auto itr = index.find(key);
+    if (itr != index.end()) {
+        if (equal(*itr->second->tree, tree)) {
+            // Another thread built the same tape in the meantime
+            lru.splice(lru.begin(), lru, itr->second);
+            return itr->second->tape;
+        }
+        // A different tree with the same hash is replaced
+        lru.erase(itr->second);
+        index.erase(itr);
+    }
+    if (capacity == 0) {
+        return tape;
+    }
+    while (lru.size() >= capacity) {
+        index.erase(lru.back().key);
+        lru.pop_back();
+    }
+    lru.push_front(Entry{key, std::make_shared<const libfive::Tree>(tree),
+                         tape});
+    index[key] = lru.begin();
+    return tape;
+}
+
+void TapeCache::clear() {
+    std::lock_guard<std::mutex> guard(mutex);
+    lru.clear();
+    index.clear();
+}
+
+}   // namespace mpr